@@ -39,6 +39,7 @@
 #include "exec/replay-core.h"
 #include "system/tcg.h"
 #include "exec/helper-proto-common.h"
+#include "tb-async.h"
 #include "tb-jmp-cache.h"
 #include "tb-hash.h"
 #include "tb-context.h"
@@ -198,7 +199,7 @@ static bool tb_lookup_cmp(const void *p, const void *d)
         tb_page_addr0(tb) == desc->page_addr0 &&
         tb->cs_base == desc->cs_base &&
         tb->flags == desc->flags &&
-        tb_cflags(tb) == desc->cflags) {
+        tb_lookup_cflags(tb_cflags(tb)) == tb_lookup_cflags(desc->cflags)) {
         /* check next page if needed */
         tb_page_addr_t tb_phys_page1 = tb_page_addr1(tb);
         if (tb_phys_page1 == -1) {
@@ -282,7 +283,7 @@ static inline TranslationBlock *tb_lookup(CPUState *cpu, vaddr pc,
                jc->array[hash].pc == pc &&
                tb->cs_base == cs_base &&
                tb->flags == flags &&
-               tb_cflags(tb) == cflags)) {
+               tb_lookup_cflags(tb_cflags(tb)) == tb_lookup_cflags(cflags))) {
         goto hit;
     }
 
@@ -290,6 +291,7 @@ static inline TranslationBlock *tb_lookup(CPUState *cpu, vaddr pc,
     if (tb == NULL) {
         return NULL;
     }
+    tcg_tb_mark_referenced(tb);
 
     jc->array[hash].pc = pc;
     qatomic_set(&jc->array[hash].tb, tb);
@@ -692,6 +694,9 @@ static inline void tb_add_jump(TranslationBlock *tb, int n,
 
     qemu_spin_unlock(&tb_next->jmp_lock);
 
+    /* Executing through the jump does not look tb_next up any more */
+    tcg_tb_mark_referenced(tb_next);
+
     qemu_log_mask(CPU_LOG_EXEC, "Linking TBs %p index %d -> %p\n",
                   tb->tc.ptr, n, tb_next->tc.ptr);
     return;
@@ -933,6 +938,23 @@ static inline void cpu_loop_exec_tb(CPUState *cpu, TranslationBlock *tb,
 {
     trace_exec_tb(tb, pc);
     tb = cpu_tb_exec(cpu, tb, tb_exit);
+    if (*tb_exit == TB_EXIT_HOT) {
+        /*
+         * Replace the TB we were about to execute with a superblock.
+         * Invalidating it also unchains the jumps to it, which will be
+         * chained to the superblock as they are looked up again.
+         * Unchaining patches the code of the TBs that jump to it.
+         */
+        *last_tb = NULL;
+        mmap_lock();
+        qemu_thread_jit_write();
+        tb_phys_invalidate(tb, -1);
+        qemu_thread_jit_execute();
+        mmap_unlock();
+        cpu->cflags_next_tb = curr_cflags(cpu) | CF_SUPERBLOCK;
+        qatomic_inc(&tb_ctx.tb_superblock_count);
+        return;
+    }
     if (*tb_exit != TB_EXIT_REQUESTED) {
         *last_tb = tb;
         return;
@@ -1124,6 +1146,8 @@ bool tcg_exec_realizefn(CPUState *cpu, Error **errp)
 /* undo the initializations in reverse order */
 void tcg_exec_unrealizefn(CPUState *cpu)
 {
+    tb_async_cpu_unrealize(cpu);
+
 #ifndef CONFIG_USER_ONLY
     tcg_iommu_free_notifier_list(cpu);
 #endif /* !CONFIG_USER_ONLY */
@@ -40,6 +40,7 @@
 #include "tb-internal.h"
 #include "trace.h"
 #include "tb-hash.h"
+#include "tlb-mirror.h"
 #include "tb-internal.h"
 #include "internal-common.h"
 #include "internal-target.h"
@@ -291,6 +292,7 @@ static void tlb_flush_one_mmuidx_locked(CPUState *cpu, int mmu_idx,
 
     tlb_mmu_resize_locked(desc, fast, now);
     tlb_mmu_flush_locked(desc, fast);
+    tlb_mirror_flush_locked(cpu, mmu_idx);
 }
 
 static void tlb_mmu_init(CPUTLBDesc *desc, CPUTLBDescFast *fast, int64_t now)
@@ -328,12 +330,14 @@ void tlb_init(CPUState *cpu)
     for (i = 0; i < NB_MMU_MODES; i++) {
         tlb_mmu_init(&cpu->neg.tlb.d[i], &cpu->neg.tlb.f[i], now);
     }
+    tlb_mirror_init(cpu);
 }
 
 void tlb_destroy(CPUState *cpu)
 {
     int i;
 
+    tlb_mirror_destroy(cpu);
     qemu_spin_destroy(&cpu->neg.tlb.c.lock);
     for (i = 0; i < NB_MMU_MODES; i++) {
         CPUTLBDesc *desc = &cpu->neg.tlb.d[i];
@@ -512,6 +516,7 @@ static void tlb_flush_page_locked(CPUState *cpu, int midx, vaddr page)
             tlb_n_used_entries_dec(cpu, midx);
         }
         tlb_flush_vtlb_page_locked(cpu, midx, page);
+        tlb_mirror_flush_page_locked(cpu, midx, page);
     }
 }
 
@@ -696,6 +701,11 @@ static void tlb_flush_range_locked(CPUState *cpu, int midx,
         return;
     }
 
+    /* Other pages than these may match under @mask. */
+    if (bits < TARGET_LONG_BITS) {
+        tlb_mirror_flush_locked(cpu, midx);
+    }
+
     for (vaddr i = 0; i < len; i += TARGET_PAGE_SIZE) {
         vaddr page = addr + i;
         CPUTLBEntry *entry = tlb_entry(cpu, midx, page);
@@ -704,6 +714,7 @@ static void tlb_flush_range_locked(CPUState *cpu, int midx,
             tlb_n_used_entries_dec(cpu, midx);
         }
         tlb_flush_vtlb_page_mask_locked(cpu, midx, page, mask);
+        tlb_mirror_flush_page_locked(cpu, midx, page);
     }
 }
 
@@ -931,6 +942,7 @@ void tlb_reset_dirty(CPUState *cpu, ram_addr_t start1, ram_addr_t length)
                                          start1, length);
         }
     }
+    tlb_mirror_reset_dirty_locked(cpu, start1, length);
     qemu_spin_unlock(&cpu->neg.tlb.c.lock);
 }
 
@@ -954,7 +966,12 @@ static void tlb_set_dirty(CPUState *cpu, vaddr addr)
     addr &= TARGET_PAGE_MASK;
     qemu_spin_lock(&cpu->neg.tlb.c.lock);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-        tlb_set_dirty1_locked(tlb_entry(cpu, mmu_idx, addr), addr);
+        CPUTLBEntry *te = tlb_entry(cpu, mmu_idx, addr);
+
+        tlb_set_dirty1_locked(te, addr);
+        if (te->addr_write == addr) {
+            tlb_mirror_set_page_locked(cpu, mmu_idx, addr, te);
+        }
     }
 
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
@@ -1175,6 +1192,7 @@ void tlb_set_page_full(CPUState *cpu, int mmu_idx,
 
     copy_tlb_helper_locked(te, &tn);
     tlb_n_used_entries_inc(cpu, mmu_idx);
+    tlb_mirror_set_page_locked(cpu, mmu_idx, addr_page, te);
     qemu_spin_unlock(&tlb->c.lock);
 }
 
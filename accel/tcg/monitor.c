@@ -18,6 +18,8 @@
 #include "system/tcg.h"
 #include "tcg/tcg.h"
 #include "internal-common.h"
+#include "tb-async.h"
+#include "tb-cache.h"
 #include "tb-context.h"
 
 
@@ -126,6 +128,20 @@ static gboolean tb_tree_stats_iter(gpointer key, gpointer value, gpointer data)
     return false;
 }
 
+static void tb_lookup_counts(uint64_t *phits, uint64_t *pmisses)
+{
+    CPUState *cpu;
+    uint64_t hits = 0, misses = 0;
+
+    /* Updated by TCG code without atomics, so only approximate */
+    CPU_FOREACH(cpu) {
+        hits += cpu->tb_lookup_hits;
+        misses += cpu->tb_lookup_misses;
+    }
+    *phits = hits;
+    *pmisses = misses;
+}
+
 static void tlb_flush_counts(size_t *pfull, size_t *ppart, size_t *pelide)
 {
     CPUState *cpu;
@@ -151,6 +167,7 @@ static void dump_exec_info(GString *buf)
     struct tb_tree_stats tst = {};
     struct qht_stats hst;
     size_t nb_tbs, flush_full, flush_part, flush_elide;
+    uint64_t lookup_hits, lookup_misses;
 
     tcg_tb_foreach(tb_tree_stats_iter, &tst);
     nb_tbs = tst.nb_tbs;
@@ -191,6 +208,20 @@ static void dump_exec_info(GString *buf)
                            qatomic_read(&tb_ctx.tb_flush_count));
     g_string_append_printf(buf, "TB invalidate count %u\n",
                            qatomic_read(&tb_ctx.tb_phys_invalidate_count));
+    g_string_append_printf(buf, "TB evict count      %u\n",
+                           qatomic_read(&tb_ctx.tb_evict_count));
+    g_string_append_printf(buf, "TB evicted count    %u\n",
+                           qatomic_read(&tb_ctx.tb_evicted_count));
+    g_string_append_printf(buf, "TB retranslated     %u\n",
+                           qatomic_read(&tb_ctx.tb_retranslate_count));
+    g_string_append_printf(buf, "TB superblocks      %u\n",
+                           qatomic_read(&tb_ctx.tb_superblock_count));
+    tb_lookup_counts(&lookup_hits, &lookup_misses);
+    g_string_append_printf(buf, "TB inline lookups   %" PRIu64
+                           " hits, %" PRIu64 " misses\n",
+                           lookup_hits, lookup_misses);
+    tb_async_dump_info(buf);
+    tb_cache_dump_info(buf);
 
     tlb_flush_counts(&flush_full, &flush_part, &flush_elide);
     g_string_append_printf(buf, "TLB full flushes    %zu\n", flush_full);
@@ -221,6 +221,52 @@ static void gen_mem_cb(struct qemu_plugin_regular_cb *cb,
     tcg_temp_free_i32(cpu_index);
 }
 
+/*
+ * Append a record to the buffer of the vcpu, and only call out of the
+ * generated code when the buffer is full. The record is written first,
+ * so that no temp has to live across the label.
+ */
+static void gen_mem_buffered_cb(struct qemu_plugin_buffered_cb *cb,
+                                qemu_plugin_meminfo_t meminfo, TCGv_i64 addr)
+{
+    static TCGHelperInfo info = {
+        .flags = TCG_CALL_NO_RWG,
+        .typemask = dh_typemask(void, 0) |
+                    dh_typemask(i32, 1) |
+                    dh_typemask(ptr, 2),
+    };
+    qemu_plugin_u64 state = { .score = cb->buf->vcpus, .offset = 0 };
+    TCGv_ptr ptr = gen_plugin_u64_ptr(state);
+    TCGv_ptr next = tcg_temp_ebb_new_ptr();
+    TCGv_ptr end = tcg_temp_ebb_new_ptr();
+    TCGLabel *done = gen_new_label();
+
+    tcg_gen_ld_ptr(next, ptr, offsetof(struct qemu_plugin_mem_buffer_vcpu,
+                                       next));
+    tcg_gen_st_i64(addr, next, offsetof(qemu_plugin_mem_record, vaddr));
+    tcg_gen_st_i64(tcg_constant_i64(cb->udata), next,
+                   offsetof(qemu_plugin_mem_record, udata));
+    tcg_gen_st_i32(tcg_constant_i32(meminfo), next,
+                   offsetof(qemu_plugin_mem_record, info));
+    tcg_gen_addi_ptr(next, next, sizeof(qemu_plugin_mem_record));
+    tcg_gen_st_ptr(next, ptr, offsetof(struct qemu_plugin_mem_buffer_vcpu,
+                                       next));
+    tcg_gen_ld_ptr(end, ptr, offsetof(struct qemu_plugin_mem_buffer_vcpu,
+                                      end));
+    tcg_gen_brcond_ptr(TCG_COND_NE, next, end, done);
+
+    TCGv_i32 cpu_index = gen_cpu_index();
+    tcg_gen_call2(qemu_plugin_mem_buffer_full, &info, NULL,
+                  tcgv_i32_temp(cpu_index),
+                  tcgv_ptr_temp(tcg_constant_ptr(cb->buf)));
+    tcg_temp_free_i32(cpu_index);
+    gen_set_label(done);
+
+    tcg_temp_free_ptr(end);
+    tcg_temp_free_ptr(next);
+    tcg_temp_free_ptr(ptr);
+}
+
 static void inject_cb(struct qemu_plugin_dyn_cb *cb)
 
 {
@@ -258,6 +304,11 @@ static void inject_mem_cb(struct qemu_plugin_dyn_cb *cb,
             inject_cb(cb);
         }
         break;
+    case PLUGIN_CB_MEM_BUFFERED:
+        if (rw & cb->buffered.rw) {
+            gen_mem_buffered_cb(&cb->buffered, meminfo, addr);
+        }
+        break;
     default:
         g_assert_not_reached();
     }
@@ -0,0 +1,310 @@
+/*
+ * Background translation
+ *
+ * With MTTCG, a vCPU that misses in the TB hash table stalls until it has
+ * translated the code itself.  Background threads, each with their own
+ * TCGContext, translate ahead the direct successors of the TBs that the
+ * vCPUs generate, so that the vCPUs find them already in the hash table.
+ * A vCPU that gets there first still translates the TB itself, and
+ * tb_link_page() keeps only one of the two.
+ *
+ * The requests are translated from the TB lookup fields and the physical
+ * address of the code only, as the state of the vCPU has moved on by the
+ * time they are served.  Targets opt in with TCGCPUOps.translate_code_async.
+ *
+ * A vCPU store to code invalidates the TBs of the page before it lands,
+ * and the next stores do not trap.  A background translation that read the
+ * page in between would put the old code back, so each request records the
+ * write generation of the page, and tb_link_page() drops the TB if it
+ * changed.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/lockable.h"
+#include "qemu/plugin.h"
+#include "qemu/qht.h"
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
+#include "exec/exec-all.h"
+#include "exec/ram_addr.h"
+#include "hw/core/cpu.h"
+#include "hw/core/tcg-cpu-ops.h"
+#include "tcg/tcg.h"
+#include "tcg/startup.h"
+#include "tb-async.h"
+#include "tb-context.h"
+#include "tb-hash.h"
+#include "tb-internal.h"
+#include "internal-common.h"
+#include "trace.h"
+
+#define TB_ASYNC_QUEUE_SIZE 64
+
+typedef struct TBAsyncRequest {
+    CPUState *cpu;
+    vaddr pc;
+    uint64_t cs_base;
+    uint32_t flags;
+    uint32_t cflags;
+    tb_page_addr_t phys_pc;
+    /* Of the page, from the vCPU that requested the translation */
+    unsigned write_gen;
+} TBAsyncRequest;
+
+typedef struct TBAsyncThread {
+    QemuThread thread;
+    /* Held while translating */
+    QemuMutex lock;
+} TBAsyncThread;
+
+static struct {
+    unsigned nb_threads;
+    TBAsyncThread *threads;
+
+    /* Protects everything below */
+    QemuMutex lock;
+    QemuCond cond;
+    TBAsyncRequest queue[TB_ASYNC_QUEUE_SIZE];
+    unsigned head;
+    unsigned count;
+
+    unsigned queued;
+    unsigned dropped;
+    unsigned present;
+    unsigned translated;
+    unsigned failed;
+} tb_async;
+
+static bool tb_async_cmp(const void *p, const void *d)
+{
+    const TranslationBlock *tb = p;
+    const TBAsyncRequest *req = d;
+
+    /*
+     * Unlike tb_lookup_cmp(), accept any TB that spans two pages: checking
+     * the second one needs the TLB of the vCPU, and translating such a TB
+     * would stop there anyway.
+     */
+    return (tb_cflags(tb) & CF_PCREL || tb->pc == req->pc) &&
+           tb_page_addr0(tb) == req->phys_pc &&
+           tb->cs_base == req->cs_base &&
+           tb->flags == req->flags &&
+           tb_lookup_cflags(tb_cflags(tb)) == req->cflags;
+}
+
+static bool tb_async_present(const TBAsyncRequest *req)
+{
+    uint32_t h = tb_hash_func(req->phys_pc,
+                              req->cflags & CF_PCREL ? 0 : req->pc,
+                              req->flags, req->cs_base, req->cflags);
+
+    return qht_lookup_custom(&tb_ctx.htable, req, h, tb_async_cmp) != NULL;
+}
+
+/*
+ * The host address of the code cannot be queued: the RAM may have been
+ * unplugged by the time the request is served.  Look it up again, in the
+ * same RCU critical section as the translation.
+ */
+static void *tb_async_host_pc(tb_page_addr_t phys_pc)
+{
+    RAMBlock *block;
+
+    RAMBLOCK_FOREACH(block) {
+        if (block->host && phys_pc - block->offset < block->used_length) {
+            return ramblock_ptr(block, phys_pc - block->offset);
+        }
+    }
+    return NULL;
+}
+
+static void tb_async_translate(const TBAsyncRequest *req)
+{
+    TranslationBlock *tb;
+    void *host_pc;
+
+    if (tb_async_present(req)) {
+        qatomic_inc(&tb_async.present);
+        return;
+    }
+
+    host_pc = tb_async_host_pc(req->phys_pc);
+    if (!host_pc) {
+        qatomic_inc(&tb_async.failed);
+        return;
+    }
+    tb = tb_gen_code_async(req->cpu, req->pc, req->cs_base, req->flags,
+                           req->cflags, req->phys_pc, host_pc,
+                           req->write_gen);
+    if (tb) {
+        qatomic_inc(&tb_async.translated);
+    } else {
+        qatomic_inc(&tb_async.failed);
+    }
+    trace_tb_async_translate(req->pc, tb);
+}
+
+static void *tb_async_thread_fn(void *opaque)
+{
+    TBAsyncThread *t = opaque;
+    TBAsyncRequest req;
+
+    rcu_register_thread();
+    tcg_register_thread();
+    tcg_ctx->gen_async = true;
+
+    for (;;) {
+        qemu_mutex_lock(&tb_async.lock);
+        while (!tb_async.count) {
+            qemu_cond_wait(&tb_async.cond, &tb_async.lock);
+        }
+        req = tb_async.queue[tb_async.head];
+        tb_async.head = (tb_async.head + 1) % TB_ASYNC_QUEUE_SIZE;
+        tb_async.count--;
+
+        /* Before dropping tb_async.lock, for tb_async_cpu_unrealize() */
+        qemu_mutex_lock(&t->lock);
+        qemu_mutex_unlock(&tb_async.lock);
+
+        WITH_RCU_READ_LOCK_GUARD() {
+            tb_async_translate(&req);
+        }
+        qemu_mutex_unlock(&t->lock);
+    }
+
+    return NULL;
+}
+
+void tb_async_init(unsigned nb_threads)
+{
+    unsigned i;
+
+    qemu_mutex_init(&tb_async.lock);
+    qemu_cond_init(&tb_async.cond);
+
+    tb_async.threads = g_new0(TBAsyncThread, nb_threads);
+    tb_async.nb_threads = nb_threads;
+    for (i = 0; i < nb_threads; i++) {
+        TBAsyncThread *t = &tb_async.threads[i];
+        g_autofree char *name = g_strdup_printf("TCG translate %u", i);
+
+        qemu_mutex_init(&t->lock);
+        qemu_thread_create(&t->thread, name, tb_async_thread_fn, t,
+                           QEMU_THREAD_DETACHED);
+    }
+}
+
+static bool tb_async_plugin_enabled(CPUState *cpu)
+{
+#ifdef CONFIG_PLUGIN
+    /* Translation callbacks run in the vCPU thread. */
+    return test_bit(QEMU_PLUGIN_EV_VCPU_TB_TRANS,
+                    cpu->plugin_state->event_mask);
+#else
+    return false;
+#endif
+}
+
+void tb_async_prefetch(CPUState *cpu, const TranslationBlock *tb, vaddr pc)
+{
+    uint32_t cflags = tb_cflags(tb);
+    int i;
+
+    /* Only prefetch for TBs with the cflags of curr_cflags(). */
+    if (!tb_async.nb_threads || tb_page_addr0(tb) == -1 ||
+        !cpu->cc->tcg_ops->translate_code_async ||
+        (cflags & (CF_COUNT_MASK | CF_SINGLE_STEP | CF_MEMI_ONLY |
+                   CF_USE_ICOUNT | CF_NOIRQ | CF_BP_PAGE)) ||
+        tb_async_plugin_enabled(cpu)) {
+        return;
+    }
+
+    QEMU_LOCK_GUARD(&tb_async.lock);
+    for (i = 0; i < tcg_ctx->nb_goto_tb_dest; i++) {
+        vaddr dest = tcg_ctx->goto_tb_dest[i];
+        TBAsyncRequest *req;
+
+        /* The physical address is only known on the page of @tb. */
+        if ((dest ^ pc) & TARGET_PAGE_MASK) {
+            continue;
+        }
+        if (tb_async.count == TB_ASYNC_QUEUE_SIZE) {
+            tb_async.dropped++;
+            continue;
+        }
+
+        req = &tb_async.queue[(tb_async.head + tb_async.count) %
+                              TB_ASYNC_QUEUE_SIZE];
+        req->cpu = cpu;
+        req->pc = dest;
+        req->cs_base = tb->cs_base;
+        req->flags = tb->flags;
+        req->cflags = tb_lookup_cflags(cflags);
+        req->phys_pc = tb_page_addr0(tb) + (dest - pc);
+        req->write_gen = tb_page_write_gen(req->phys_pc);
+        tb_async.count++;
+        tb_async.queued++;
+        qemu_cond_signal(&tb_async.cond);
+    }
+}
+
+void tb_async_pause(void)
+{
+    unsigned i;
+
+    for (i = 0; i < tb_async.nb_threads; i++) {
+        qemu_mutex_lock(&tb_async.threads[i].lock);
+    }
+}
+
+void tb_async_resume(void)
+{
+    unsigned i;
+
+    for (i = 0; i < tb_async.nb_threads; i++) {
+        qemu_mutex_unlock(&tb_async.threads[i].lock);
+    }
+}
+
+void tb_async_cpu_unrealize(CPUState *cpu)
+{
+    unsigned i, n;
+
+    if (!tb_async.nb_threads) {
+        return;
+    }
+
+    QEMU_LOCK_GUARD(&tb_async.lock);
+    for (i = n = 0; i < tb_async.count; i++) {
+        TBAsyncRequest *req = &tb_async.queue[(tb_async.head + i) %
+                                              TB_ASYNC_QUEUE_SIZE];
+
+        if (req->cpu != cpu) {
+            tb_async.queue[(tb_async.head + n++) % TB_ASYNC_QUEUE_SIZE] =
+                *req;
+        }
+    }
+    tb_async.count = n;
+
+    tb_async_pause();
+    tb_async_resume();
+}
+
+void tb_async_dump_info(GString *buf)
+{
+    if (!tb_async.nb_threads) {
+        return;
+    }
+
+    QEMU_LOCK_GUARD(&tb_async.lock);
+    g_string_append_printf(buf, "TB async queued     %u\n", tb_async.queued);
+    g_string_append_printf(buf, "TB async dropped    %u\n", tb_async.dropped);
+    g_string_append_printf(buf, "TB async present    %u\n",
+                           qatomic_read(&tb_async.present));
+    g_string_append_printf(buf, "TB async translated %u\n",
+                           qatomic_read(&tb_async.translated));
+    g_string_append_printf(buf, "TB async failed     %u\n",
+                           qatomic_read(&tb_async.failed));
+}
@@ -0,0 +1,89 @@
+/*
+ * Background translation
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#ifndef ACCEL_TCG_TB_ASYNC_H
+#define ACCEL_TCG_TB_ASYNC_H
+
+#include "exec/cpu-common.h"
+#include "exec/translation-block.h"
+
+#ifdef CONFIG_USER_ONLY
+
+static inline void tb_async_prefetch(CPUState *cpu, const TranslationBlock *tb,
+                                     vaddr pc)
+{
+}
+
+static inline void tb_async_pause(void)
+{
+}
+
+static inline void tb_async_resume(void)
+{
+}
+
+static inline void tb_async_cpu_unrealize(CPUState *cpu)
+{
+}
+
+#else
+
+/**
+ * tb_async_init() - start the background translation threads
+ * @nb_threads: number of threads
+ *
+ * Must be called after tcg_init() was given room for @nb_threads more
+ * contexts, and after tcg_prologue_init().
+ */
+void tb_async_init(unsigned nb_threads);
+
+/**
+ * tb_async_prefetch() - queue the successors of @tb for translation
+ * @cpu: the CPU that generated @tb
+ * @tb: a TB that was just generated or found in the hash table
+ * @pc: guest PC of @tb
+ *
+ * The successors are the destinations of goto_tb recorded in tcg_ctx
+ * while translating @tb.  They are translated with the flags of @tb,
+ * which is what is usually needed by the time @cpu gets there, and
+ * only if the target sets TCGCPUOps.translate_code_async.
+ */
+void tb_async_prefetch(CPUState *cpu, const TranslationBlock *tb, vaddr pc);
+
+/**
+ * tb_async_pause() - wait for the translations in progress
+ *
+ * Until tb_async_resume(), no background thread touches the code buffer.
+ * Must be called from a safe-work context, so that no vCPU holds a page
+ * lock that the background threads may be waiting for.
+ */
+void tb_async_pause(void);
+void tb_async_resume(void);
+
+/**
+ * tb_async_cpu_unrealize() - forget the requests for @cpu
+ * @cpu: a CPU that is going away
+ *
+ * Also wait for the translation of any request for @cpu in progress.
+ */
+void tb_async_cpu_unrealize(CPUState *cpu);
+
+void tb_async_dump_info(GString *buf);
+
+/*
+ * Like tb_gen_code(), from a background thread: return NULL instead of
+ * making room in the code buffer or translating across pages, and if the
+ * page was written since tb_page_write_gen() returned @write_gen.
+ */
+TranslationBlock *tb_gen_code_async(CPUState *cpu,
+                                    vaddr pc, uint64_t cs_base,
+                                    uint32_t flags, uint32_t cflags,
+                                    tb_page_addr_t phys_pc, void *host_pc,
+                                    unsigned write_gen);
+
+#endif /* CONFIG_USER_ONLY */
+
+#endif /* ACCEL_TCG_TB_ASYNC_H */
@@ -0,0 +1,715 @@
+/*
+ * Persistent translation cache
+ *
+ * The host code generated for a TB depends only on its guest code, its
+ * lookup fields and the emulator itself, except for references to code
+ * outside of the TB: helpers and the epilogue.  Saving those references
+ * along with the code allows later runs of the same binary to reuse it,
+ * which pays off for short-lived processes that keep translating the
+ * same code, e.g. compilers run under linux-user.
+ *
+ * The cache is an append-only file: a header identifying the binary and
+ * the guest environment, followed by one record per TB.  Several
+ * processes may append to it at the same time.  Records are indexed when
+ * the file is mapped, and checksummed and validated against the current
+ * guest code only when they are looked up, so that startup stays cheap.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/cacheflush.h"
+#include "qemu/cacheinfo.h"
+#include "qemu/crc32c.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
+#include "qemu/lockable.h"
+#include "qemu/units.h"
+#include "qemu/xxhash.h"
+#include "exec/exec-all.h"
+#include "exec/tb-cache.h"
+#include "exec/translation-block.h"
+#include "hw/core/cpu.h"
+#include "qom/object.h"
+#include "tcg/tcg.h"
+#ifdef CONFIG_USER_ONLY
+#include "user/guest-base.h"
+#endif
+#if TCG_TARGET_EXT_RELOCS
+#include "host/cpuinfo.h"
+#endif
+#include "internal-common.h"
+#include "tb-cache.h"
+#include "trace.h"
+
+#define TB_CACHE_MAGIC          "QEMUTBC"
+#define TB_CACHE_VERSION        1
+#define TB_CACHE_RECORD_MAGIC   0x43425451
+
+/* Stop appending past this size; delete the file to start over */
+#define TB_CACHE_MAX_SIZE   (128 * MiB)
+
+/*
+ * Addresses in QEMU's own image, i.e. helpers, are saved relative to one
+ * of its functions; the fingerprint ensures that the binary is the same.
+ * The only references into the code buffer are to the prologue.
+ */
+#define TB_CACHE_IMAGE_BASE     ((uintptr_t)tb_cache_init)
+#define TB_CACHE_PROLOGUE_BASE  ((uintptr_t)tcg_qemu_tb_exec)
+
+typedef struct TBCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t fingerprint_len;   /* including NUL and padding */
+    /* followed by the fingerprint */
+} TBCacheHeader;
+
+typedef enum TBCacheRelocBase {
+    TB_CACHE_RELOC_IMAGE,
+    TB_CACHE_RELOC_PROLOGUE,
+} TBCacheRelocBase;
+
+typedef struct TBCacheReloc {
+    uint32_t offset;            /* of the field, from the start of the code */
+    uint8_t kind;               /* TCGExtRelocKind */
+    uint8_t base;               /* TBCacheRelocBase */
+    uint16_t pad;
+    int64_t target;             /* from the base */
+} TBCacheReloc;
+
+typedef struct TBCacheRecord {
+    uint32_t magic;
+    uint32_t len;               /* of the whole record, including padding */
+    uint32_t crc;               /* of everything that follows */
+    uint32_t cflags;
+    uint64_t pc;                /* for CF_PCREL, only the offset in the page */
+    uint64_t cs_base;
+    uint32_t flags;
+    uint16_t size;
+    uint16_t icount;
+    uint32_t code_size;
+    uint32_t search_size;
+    uint16_t jmp_reset_offset[2];
+    uint16_t jmp_insn_offset[2];
+    uint32_t nb_relocs;
+    uint32_t pad;
+    /* followed by relocations, guest code, host code and search data */
+} TBCacheRecord;
+
+QEMU_BUILD_BUG_ON(sizeof(TBCacheHeader) % 8);
+QEMU_BUILD_BUG_ON(sizeof(TBCacheReloc) % 8);
+QEMU_BUILD_BUG_ON(sizeof(TBCacheRecord) % 8);
+
+static struct {
+    QemuMutex lock;
+    char *path;
+    bool enabled;
+    bool opened;
+    int fd;                     /* for appending, or -1 */
+    size_t file_size;
+    GHashTable *index;          /* lookup fields -> GSList of records */
+
+    /* statistics */
+    unsigned hits;
+    unsigned misses;
+    unsigned stale;
+    unsigned saved;
+} tb_cache;
+
+static size_t record_len(size_t nb_relocs, size_t size, size_t code_size,
+                         size_t search_size)
+{
+    return ROUND_UP(sizeof(TBCacheRecord) + nb_relocs * sizeof(TBCacheReloc) +
+                    size + code_size + search_size, 8);
+}
+
+static const TBCacheReloc *record_relocs(const TBCacheRecord *rec)
+{
+    return (const void *)(rec + 1);
+}
+
+static const uint8_t *record_guest_code(const TBCacheRecord *rec)
+{
+    return (const void *)(record_relocs(rec) + rec->nb_relocs);
+}
+
+static const uint8_t *record_code(const TBCacheRecord *rec)
+{
+    return record_guest_code(rec) + rec->size;
+}
+
+static uint32_t record_crc(const TBCacheRecord *rec)
+{
+    size_t skip = offsetof(TBCacheRecord, cflags);
+
+    return crc32c(0xffffffff, (const uint8_t *)rec + skip, rec->len - skip);
+}
+
+static guint record_hash(gconstpointer p)
+{
+    const TBCacheRecord *rec = p;
+
+    return qemu_xxhash6(rec->pc, rec->cs_base, rec->flags, rec->cflags);
+}
+
+static gboolean record_equal(gconstpointer a, gconstpointer b)
+{
+    const TBCacheRecord *ra = a;
+    const TBCacheRecord *rb = b;
+
+    return ra->pc == rb->pc && ra->cs_base == rb->cs_base &&
+           ra->flags == rb->flags && ra->cflags == rb->cflags;
+}
+
+static void record_init_key(TBCacheRecord *rec, const TranslationBlock *tb,
+                            vaddr pc)
+{
+    /* CF_PCREL code only depends on the offset of the TB in its page */
+    rec->pc = tb_cflags(tb) & CF_PCREL ? pc & ~TARGET_PAGE_MASK : pc;
+    rec->cs_base = tb->cs_base;
+    rec->flags = tb->flags;
+    rec->cflags = tb_cflags(tb);
+}
+
+static void tb_cache_insert(const TBCacheRecord *rec)
+{
+    GSList *list = g_hash_table_lookup(tb_cache.index, rec);
+    GSList *l;
+
+    for (l = list; l; l = l->next) {
+        const TBCacheRecord *old = l->data;
+
+        /* Saved concurrently by another process; keep the first one */
+        if (old->size == rec->size &&
+            !memcmp(record_guest_code(old), record_guest_code(rec),
+                    rec->size)) {
+            return;
+        }
+    }
+    if (list) {
+        g_slist_append(list, (gpointer)rec);
+    } else {
+        g_hash_table_insert(tb_cache.index, (gpointer)rec,
+                            g_slist_append(NULL, (gpointer)rec));
+    }
+}
+
+/* Index the records in @buf; the checksum is verified on use. */
+static void tb_cache_index(const char *buf, size_t len)
+{
+    size_t off = 0;
+
+    while (len - off >= sizeof(TBCacheRecord)) {
+        const TBCacheRecord *rec = (const void *)(buf + off);
+
+        /*
+         * Skip torn writes, from processes that were killed or ran out
+         * of space, up to the next record.
+         */
+        if (rec->magic != TB_CACHE_RECORD_MAGIC ||
+            rec->len > len - off ||
+            rec->len != record_len(rec->nb_relocs, rec->size,
+                                   rec->code_size, rec->search_size)) {
+            off += 8;
+            continue;
+        }
+        tb_cache_insert(rec);
+        off += rec->len;
+    }
+}
+
+/*
+ * The file holds code that is executed as is, so only trust it if nobody
+ * else could have written it.
+ */
+static bool tb_cache_check_owner(int fd, struct stat *st)
+{
+    if (fstat(fd, st) < 0) {
+        return false;
+    }
+    if (!S_ISREG(st->st_mode) || st->st_uid != geteuid() ||
+        (st->st_mode & (S_IWGRP | S_IWOTH))) {
+        warn_report("tb-cache: %s is not a regular file owned by the user "
+                    "and only writable by them, disabling the cache",
+                    tb_cache.path);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Returns false if @path exists but must not be used; otherwise, the
+ * contents are returned in @contents, or NULL if the file is missing.
+ */
+static bool tb_cache_map(const char *path, const char **contents,
+                         size_t *len)
+{
+    struct stat st;
+    void *p;
+    int fd;
+
+    *contents = NULL;
+    fd = qemu_open_old(path, O_RDONLY | O_NOFOLLOW);
+    if (fd < 0) {
+        if (errno == ELOOP) {
+            warn_report("tb-cache: %s is a symbolic link, disabling the cache",
+                        path);
+            return false;
+        }
+        return true;
+    }
+    if (!tb_cache_check_owner(fd, &st)) {
+        close(fd);
+        return false;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return true;
+    }
+    /* Lookups only touch the records they use */
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p != MAP_FAILED) {
+        *contents = p;
+        *len = st.st_size;
+    }
+    return true;
+}
+
+static gint tb_cache_compare_names(gconstpointer a, gconstpointer b)
+{
+    return strcmp(*(const char * const *)a, *(const char * const *)b);
+}
+
+/* Properties that differ between the vCPUs of a machine */
+static bool tb_cache_prop_is_per_cpu(const char *name)
+{
+    return g_str_has_suffix(name, "-id") ||
+           !strcmp(name, "cpu-index") ||
+           !strcmp(name, "mp-affinity") ||
+           !strcmp(name, "start-powered-off");
+}
+
+/*
+ * Digest of the CPU model and features, i.e. of the value of every QOM
+ * property of @cpu: the same CPU type can be configured differently, and
+ * the generated code depends on the configured features.
+ */
+static char *tb_cache_cpu_digest(CPUState *cpu)
+{
+    Object *obj = OBJECT(cpu);
+    g_autoptr(GChecksum) sum = g_checksum_new(G_CHECKSUM_SHA256);
+    g_autoptr(GPtrArray) names = g_ptr_array_new();
+    ObjectPropertyIterator iter;
+    ObjectProperty *prop;
+    guint i;
+
+    object_property_iter_init(&iter, obj);
+    while ((prop = object_property_iter_next(&iter))) {
+        if (prop->get && !strstart(prop->type, "link<", NULL) &&
+            !strstart(prop->type, "child<", NULL) &&
+            !tb_cache_prop_is_per_cpu(prop->name)) {
+            g_ptr_array_add(names, (gpointer)prop->name);
+        }
+    }
+    g_ptr_array_sort(names, tb_cache_compare_names);
+
+    for (i = 0; i < names->len; i++) {
+        const char *name = g_ptr_array_index(names, i);
+        g_autofree char *value = object_property_print(obj, name, false,
+                                                       NULL);
+
+        g_checksum_update(sum, (const guchar *)name, strlen(name));
+        g_checksum_update(sum, (const guchar *)"=", 1);
+        if (value) {
+            g_checksum_update(sum, (const guchar *)value, strlen(value));
+        }
+        g_checksum_update(sum, (const guchar *)"\n", 1);
+    }
+    return g_strdup(g_checksum_get_string(sum));
+}
+
+/*
+ * Everything the generated code depends on besides the guest code and
+ * the TB lookup fields.  The binary is identified by its inode and
+ * modification time rather than hashed, which would be too slow for
+ * short-lived processes.
+ */
+static char *tb_cache_fingerprint(CPUState *cpu)
+{
+    g_autofree char *cpu_digest = tb_cache_cpu_digest(cpu);
+    uint64_t host = 0, base = 0;
+    struct stat st;
+
+    if (stat("/proc/self/exe", &st) < 0) {
+        return NULL;
+    }
+#if TCG_TARGET_EXT_RELOCS
+    host = cpuinfo;
+#endif
+#ifdef CONFIG_USER_ONLY
+    base = guest_base;
+#endif
+    return g_strdup_printf("%s %s cpu=%s exe=%" PRIu64 ":%" PRIu64 ":%" PRId64
+                           ":%" PRId64 " host=%" PRIx64 " icache=%d"
+                           " guest-base=%" PRIx64 " superblock=%u",
+                           TARGET_NAME, object_get_typename(OBJECT(cpu)),
+                           cpu_digest,
+                           (uint64_t)st.st_dev, (uint64_t)st.st_ino,
+                           (int64_t)st.st_size, (int64_t)st.st_mtime,
+                           host, qemu_icache_linesize, base,
+                           qatomic_read(&superblock_threshold));
+}
+
+/*
+ * Replace @path with a file containing @data.  Unlike g_file_set_contents(),
+ * the file is only made writable by the user regardless of the umask, so
+ * that tb_cache_check_owner() accepts it.
+ */
+static bool tb_cache_create(const char *path, const void *data, size_t len)
+{
+    g_autofree char *tmp = g_strdup_printf("%s.XXXXXX", path);
+    int fd = g_mkstemp_full(tmp, O_WRONLY, 0644);
+
+    if (fd < 0) {
+        warn_report("tb-cache: cannot create %s: %s", tmp, strerror(errno));
+        return false;
+    }
+    if (qemu_write_full(fd, data, len) != len) {
+        warn_report("tb-cache: cannot write %s: %s", tmp, strerror(errno));
+        close(fd);
+        unlink(tmp);
+        return false;
+    }
+    close(fd);
+    if (rename(tmp, path) < 0) {
+        warn_report("tb-cache: cannot rename %s: %s", tmp, strerror(errno));
+        unlink(tmp);
+        return false;
+    }
+    return true;
+}
+
+static GByteArray *tb_cache_header(const char *fingerprint)
+{
+    size_t len = ROUND_UP(strlen(fingerprint) + 1, 8);
+    TBCacheHeader hdr = {
+        .magic = TB_CACHE_MAGIC,
+        .version = TB_CACHE_VERSION,
+        .fingerprint_len = len,
+    };
+    GByteArray *buf = g_byte_array_sized_new(sizeof(hdr) + len);
+
+    g_byte_array_append(buf, (const void *)&hdr, sizeof(hdr));
+    g_byte_array_set_size(buf, sizeof(hdr) + len);
+    memset(buf->data + sizeof(hdr), 0, len);
+    memcpy(buf->data + sizeof(hdr), fingerprint, strlen(fingerprint));
+    return buf;
+}
+
+/* Call with tb_cache.lock held, before setting tb_cache.opened */
+static void tb_cache_open(CPUState *cpu)
+{
+    g_autofree char *fingerprint = tb_cache_fingerprint(cpu);
+    g_autoptr(GByteArray) header = NULL;
+    const char *contents;
+    struct stat st;
+    size_t len = 0;
+
+    if (!fingerprint) {
+        warn_report("tb-cache: cannot identify the emulator binary, "
+                    "disabling the cache");
+        tb_cache.enabled = false;
+        return;
+    }
+
+    tb_cache.index = g_hash_table_new_full(record_hash, record_equal, NULL,
+                                           (GDestroyNotify)g_slist_free);
+    header = tb_cache_header(fingerprint);
+
+    if (!tb_cache_map(tb_cache.path, &contents, &len)) {
+        tb_cache.enabled = false;
+        return;
+    }
+    if (contents && len >= header->len &&
+        !memcmp(contents, header->data, header->len)) {
+        tb_cache_index(contents + header->len, len - header->len);
+    } else {
+        /*
+         * Missing, or made by another binary or for another guest: start
+         * over.  The file is replaced atomically, so that processes still
+         * appending to the old one do not corrupt it.
+         */
+        if (contents) {
+            munmap((void *)contents, len);
+        }
+        trace_tb_cache_reset(tb_cache.path, len);
+        if (!tb_cache_create(tb_cache.path, header->data, header->len)) {
+            return;
+        }
+        len = header->len;
+    }
+
+    /* The file may have been replaced since it was checked */
+    tb_cache.fd = qemu_open_old(tb_cache.path,
+                                O_WRONLY | O_APPEND | O_NOFOLLOW);
+    if (tb_cache.fd < 0) {
+        warn_report("tb-cache: cannot open %s: %s", tb_cache.path,
+                    strerror(errno));
+    } else if (!tb_cache_check_owner(tb_cache.fd, &st)) {
+        close(tb_cache.fd);
+        tb_cache.fd = -1;
+        tb_cache.enabled = false;
+        return;
+    }
+    tb_cache.file_size = len;
+    trace_tb_cache_open(tb_cache.path, g_hash_table_size(tb_cache.index));
+}
+
+void tb_cache_init(const char *path)
+{
+    if (!TCG_TARGET_EXT_RELOCS) {
+        warn_report("tb-cache is not supported on this host, ignoring");
+        return;
+    }
+    qemu_mutex_init(&tb_cache.lock);
+    tb_cache.path = g_strdup(path);
+    tb_cache.fd = -1;
+    tb_cache.enabled = true;
+}
+
+bool tb_cache_active(CPUState *cpu, const TranslationBlock *tb,
+                     const void *host_pc)
+{
+    if (!qatomic_read(&tb_cache.enabled)) {
+        return false;
+    }
+    if (unlikely(!qatomic_load_acquire(&tb_cache.opened))) {
+        QEMU_LOCK_GUARD(&tb_cache.lock);
+        if (!tb_cache.opened) {
+            tb_cache_open(cpu);
+            qatomic_store_release(&tb_cache.opened, true);
+        }
+        if (!tb_cache.enabled) {
+            return false;
+        }
+    }
+
+    if (tb_page_addr0(tb) == -1 || !host_pc) {
+        return false;
+    }
+    /* Breakpoints are checked for at translation time */
+    if (tb_cflags(tb) & (CF_BP_PAGE | CF_SINGLE_STEP)) {
+        return false;
+    }
+#ifdef CONFIG_PLUGIN
+    /* So is instrumentation inserted */
+    if (cpu->plugin_state &&
+        test_bit(QEMU_PLUGIN_EV_VCPU_TB_TRANS,
+                 cpu->plugin_state->event_mask)) {
+        return false;
+    }
+#endif
+    return true;
+}
+
+static uintptr_t tb_cache_reloc_base(unsigned base)
+{
+    return base == TB_CACHE_RELOC_PROLOGUE ? TB_CACHE_PROLOGUE_BASE
+                                           : TB_CACHE_IMAGE_BASE;
+}
+
+static bool tb_cache_copy(TranslationBlock *tb, const TBCacheRecord *rec)
+{
+    const TBCacheReloc *r = record_relocs(rec);
+    void *buf = tcg_splitwx_to_rw(tb->tc.ptr);
+    uint32_t i;
+
+    if (buf + rec->code_size + rec->search_size > tcg_ctx->code_gen_highwater) {
+        return false;
+    }
+    memcpy(buf, record_code(rec), rec->code_size + rec->search_size);
+
+    for (i = 0; i < rec->nb_relocs; i++, r++) {
+        uintptr_t target = tb_cache_reloc_base(r->base) + r->target;
+        uintptr_t field = (uintptr_t)tb->tc.ptr + r->offset;
+        intptr_t disp;
+
+        switch (r->kind) {
+        case TCG_EXT_RELOC_PC32:
+            disp = target - (field + 4);
+            if (r->offset + 4 > rec->code_size || disp != (int32_t)disp) {
+                return false;
+            }
+            stl_he_p(buf + r->offset, disp);
+            break;
+        case TCG_EXT_RELOC_ABS64:
+            if (r->offset + 8 > rec->code_size) {
+                return false;
+            }
+            stq_he_p(buf + r->offset, target);
+            break;
+        default:
+            return false;
+        }
+    }
+
+    tb->size = rec->size;
+    tb->icount = rec->icount;
+    tb->tc.size = rec->code_size;
+    for (i = 0; i < 2; i++) {
+        tb->jmp_reset_offset[i] = rec->jmp_reset_offset[i];
+        tb->jmp_insn_offset[i] = rec->jmp_insn_offset[i];
+    }
+    flush_idcache_range((uintptr_t)tb->tc.ptr, (uintptr_t)buf, rec->code_size);
+    return true;
+}
+
+bool tb_cache_fill(TranslationBlock *tb, vaddr pc, const void *host_pc,
+                   int *code_size, int *search_size)
+{
+    TBCacheRecord key;
+    const TBCacheRecord *rec = NULL;
+    GSList *list, *l;
+
+    record_init_key(&key, tb, pc);
+
+    QEMU_LOCK_GUARD(&tb_cache.lock);
+    list = g_hash_table_lookup(tb_cache.index, &key);
+    for (l = list; l; l = l->next) {
+        const TBCacheRecord *r = l->data;
+
+        if ((pc & ~TARGET_PAGE_MASK) + r->size <= TARGET_PAGE_SIZE &&
+            !memcmp(host_pc, record_guest_code(r), r->size) &&
+            r->crc == record_crc(r)) {
+            rec = r;
+            break;
+        }
+    }
+
+    if (!rec) {
+        if (list) {
+            /* The guest code has changed since these were generated */
+            g_hash_table_remove(tb_cache.index, &key);
+            tb_cache.stale++;
+        }
+        tb_cache.misses++;
+        return false;
+    }
+    if (!tb_cache_copy(tb, rec)) {
+        tb_cache.misses++;
+        return false;
+    }
+
+    tb_cache.hits++;
+    *code_size = rec->code_size;
+    *search_size = rec->search_size;
+    return true;
+}
+
+void tb_cache_save(const TranslationBlock *tb, vaddr pc, const void *host_pc,
+                   int search_size)
+{
+    const void *code = tcg_splitwx_to_rw(tb->tc.ptr);
+    g_autoptr(GByteArray) buf = NULL;
+    TBCacheRecord rec = { };
+    TCGExtReloc *r;
+    size_t nb_relocs = 0, pad;
+
+    if (qatomic_read(&tb_cache.fd) < 0) {
+        return;
+    }
+    /* Only the first page is checked against the guest code on lookup */
+    if (tb_page_addr1(tb) != -1 ||
+        (pc & ~TARGET_PAGE_MASK) + tb->size > TARGET_PAGE_SIZE) {
+        return;
+    }
+
+    QSIMPLEQ_FOREACH(r, &tcg_ctx->ext_relocs, next) {
+        nb_relocs++;
+    }
+    record_init_key(&rec, tb, pc);
+    rec.magic = TB_CACHE_RECORD_MAGIC;
+    rec.len = record_len(nb_relocs, tb->size, tb->tc.size, search_size);
+    rec.size = tb->size;
+    rec.icount = tb->icount;
+    rec.code_size = tb->tc.size;
+    rec.search_size = search_size;
+    rec.jmp_reset_offset[0] = tb->jmp_reset_offset[0];
+    rec.jmp_reset_offset[1] = tb->jmp_reset_offset[1];
+    rec.jmp_insn_offset[0] = tb->jmp_insn_offset[0];
+    rec.jmp_insn_offset[1] = tb->jmp_insn_offset[1];
+    rec.nb_relocs = nb_relocs;
+
+    buf = g_byte_array_sized_new(rec.len);
+    g_byte_array_append(buf, (const void *)&rec, sizeof(rec));
+    QSIMPLEQ_FOREACH(r, &tcg_ctx->ext_relocs, next) {
+        TBCacheReloc cr = {
+            .offset = r->offset,
+            .kind = r->kind,
+        };
+
+        if (in_code_gen_buffer(tcg_splitwx_to_rw(r->target))) {
+            cr.base = TB_CACHE_RELOC_PROLOGUE;
+        } else {
+            cr.base = TB_CACHE_RELOC_IMAGE;
+        }
+        cr.target = (uintptr_t)r->target - tb_cache_reloc_base(cr.base);
+        g_byte_array_append(buf, (const void *)&cr, sizeof(cr));
+    }
+    g_byte_array_append(buf, host_pc, tb->size);
+    g_byte_array_append(buf, code, tb->tc.size + search_size);
+    pad = buf->len;
+    g_byte_array_set_size(buf, rec.len);
+    memset(buf->data + pad, 0, rec.len - pad);
+    ((TBCacheRecord *)buf->data)->crc = record_crc((void *)buf->data);
+
+    QEMU_LOCK_GUARD(&tb_cache.lock);
+    if (tb_cache.fd < 0) {
+        return;
+    }
+    /* O_APPEND keeps the records of concurrent processes apart */
+    if (write(tb_cache.fd, buf->data, buf->len) != (ssize_t)buf->len) {
+        warn_report("tb-cache: cannot write to %s, no longer saving",
+                    tb_cache.path);
+        goto stop;
+    }
+    tb_cache.saved++;
+    tb_cache.file_size += buf->len;
+    if (tb_cache.file_size < TB_CACHE_MAX_SIZE) {
+        return;
+    }
+    trace_tb_cache_full(tb_cache.path, tb_cache.file_size);
+
+stop:
+    close(tb_cache.fd);
+    qatomic_set(&tb_cache.fd, -1);
+}
+
+void tb_cache_dump_info(GString *buf)
+{
+    if (!tb_cache.path) {
+        return;
+    }
+
+    QEMU_LOCK_GUARD(&tb_cache.lock);
+    g_string_append_printf(buf, "TB cache hits       %u\n", tb_cache.hits);
+    g_string_append_printf(buf, "TB cache misses     %u\n", tb_cache.misses);
+    g_string_append_printf(buf, "TB cache stale      %u\n", tb_cache.stale);
+    g_string_append_printf(buf, "TB cache saved      %u\n", tb_cache.saved);
+}
+
+void tb_cache_exit(void)
+{
+    if (!tb_cache.path) {
+        return;
+    }
+
+    QEMU_LOCK_GUARD(&tb_cache.lock);
+    trace_tb_cache_stats(tb_cache.hits, tb_cache.misses, tb_cache.stale,
+                         tb_cache.saved);
+    if (tb_cache.fd >= 0) {
+        close(tb_cache.fd);
+        tb_cache.fd = -1;
+    }
+}
@@ -0,0 +1,62 @@
+/*
+ * Persistent translation cache
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#ifndef ACCEL_TCG_TB_CACHE_H
+#define ACCEL_TCG_TB_CACHE_H
+
+#include "exec/cpu-common.h"
+#include "exec/vaddr.h"
+
+/**
+ * tb_cache_init() - enable the persistent translation cache
+ * @path: the cache file, created if it does not exist
+ *
+ * The file is only opened when the first TB is generated, once the
+ * guest memory layout is known.
+ */
+void tb_cache_init(const char *path);
+
+/**
+ * tb_cache_active() - return whether @tb may be loaded from or saved to
+ * the cache
+ * @cpu: the CPU generating @tb
+ * @tb: the TB being generated, with its lookup fields set
+ * @host_pc: host address of the TB's guest code
+ *
+ * When this returns true, the code of @tb must be generated with
+ * TCGContext.ext_relocs_enabled set.
+ */
+bool tb_cache_active(CPUState *cpu, const TranslationBlock *tb,
+                     const void *host_pc);
+
+/**
+ * tb_cache_fill() - fill @tb from the cache
+ * @tb: the TB being generated, with its lookup fields set
+ * @pc: guest PC of @tb
+ * @host_pc: host address of the TB's guest code
+ * @code_size: set to the size of the generated code on success
+ * @search_size: set to the size of the search data on success
+ *
+ * Copy code previously generated for the same guest code, flags and
+ * cflags to tcg_ctx->code_gen_ptr and relocate it.  Return false, leaving
+ * @tb to be translated, if there is none or if it cannot be relocated.
+ */
+bool tb_cache_fill(TranslationBlock *tb, vaddr pc, const void *host_pc,
+                   int *code_size, int *search_size);
+
+/**
+ * tb_cache_save() - append a freshly generated @tb to the cache
+ * @tb: the TB, with its code and search data generated
+ * @pc: guest PC of @tb
+ * @host_pc: host address of the TB's guest code
+ * @search_size: size of the search data following the code
+ */
+void tb_cache_save(const TranslationBlock *tb, vaddr pc, const void *host_pc,
+                   int search_size);
+
+void tb_cache_dump_info(GString *buf);
+
+#endif /* ACCEL_TCG_TB_CACHE_H */
@@ -35,6 +35,10 @@ struct TBContext {
     /* statistics */
     unsigned tb_flush_count;
     unsigned tb_phys_invalidate_count;
+    unsigned tb_evict_count;
+    unsigned tb_evicted_count;
+    unsigned tb_retranslate_count;
+    unsigned tb_superblock_count;
 };
 
 extern TBContext tb_ctx;
@@ -38,6 +38,7 @@ void tb_lock_page0(tb_page_addr_t);
 void tb_lock_page1(tb_page_addr_t, tb_page_addr_t);
 void tb_unlock_page1(tb_page_addr_t, tb_page_addr_t);
 void tb_unlock_pages(TranslationBlock *);
+unsigned tb_page_write_gen(tb_page_addr_t);
 #endif
 
 #ifdef CONFIG_SOFTMMU
@@ -20,6 +20,7 @@
 #include "qemu/osdep.h"
 #include "qemu/interval-tree.h"
 #include "qemu/qtree.h"
+#include "qemu/bitops.h"
 #include "exec/cputlb.h"
 #include "exec/log.h"
 #include "exec/exec-all.h"
@@ -28,11 +29,13 @@
 #include "tb-internal.h"
 #include "system/tcg.h"
 #include "tcg/tcg.h"
+#include "tb-async.h"
 #include "tb-hash.h"
 #include "tb-context.h"
 #include "tb-internal.h"
 #include "internal-common.h"
 #include "internal-target.h"
+#include "trace.h"
 #ifdef CONFIG_USER_ONLY
 #include "user/page-protection.h"
 #endif
@@ -55,7 +58,8 @@ static bool tb_cmp(const void *ap, const void *bp)
     return ((tb_cflags(a) & CF_PCREL || a->pc == b->pc) &&
             a->cs_base == b->cs_base &&
             a->flags == b->flags &&
-            (tb_cflags(a) & ~CF_INVALID) == (tb_cflags(b) & ~CF_INVALID) &&
+            tb_lookup_cflags(tb_cflags(a) & ~CF_INVALID) ==
+            tb_lookup_cflags(tb_cflags(b) & ~CF_INVALID) &&
             tb_page_addr0(a) == tb_page_addr0(b) &&
             tb_page_addr1(a) == tb_page_addr1(b));
 }
@@ -187,6 +191,8 @@ struct PageDesc {
     QemuSpin lock;
     /* list of TBs intersecting this ram page */
     uintptr_t first_tb;
+    /* incremented whenever the TBs of the page are invalidated */
+    unsigned write_gen;
 };
 
 void page_table_config_init(void)
@@ -402,6 +408,13 @@ static void page_unlock(PageDesc *pd)
     page_unlock__debug(pd);
 }
 
+unsigned tb_page_write_gen(tb_page_addr_t paddr)
+{
+    PageDesc *pd = page_find(paddr >> TARGET_PAGE_BITS);
+
+    return pd ? qatomic_read(&pd->write_gen) : 0;
+}
+
 void tb_lock_page0(tb_page_addr_t paddr)
 {
     page_lock(page_find_alloc(paddr >> TARGET_PAGE_BITS, true));
@@ -759,17 +772,33 @@ static void tb_remove(TranslationBlock *tb)
 }
 #endif /* CONFIG_USER_ONLY */
 
-/* flush all the translation blocks */
-static void do_tb_flush(CPUState *cpu, run_on_cpu_data tb_flush_count)
+/*
+ * Hashes of recently evicted TBs, to count how many of them have to be
+ * translated again.  Collisions only make the count approximate.
+ */
+#define TB_EVICTED_HASH_BITS 16
+static unsigned long tb_evicted_hashes[BITS_TO_LONGS(1 << TB_EVICTED_HASH_BITS)];
+
+static void tb_evicted_hash_set(uint32_t h)
 {
-    bool did_flush = false;
+    h &= (1 << TB_EVICTED_HASH_BITS) - 1;
+    qatomic_or(&tb_evicted_hashes[BIT_WORD(h)], BIT_MASK(h));
+}
 
-    mmap_lock();
-    /* If it is already been done on request of another CPU, just retry. */
-    if (tb_ctx.tb_flush_count != tb_flush_count.host_int) {
-        goto done;
-    }
-    did_flush = true;
+static bool tb_evicted_hash_test_and_clear(uint32_t h)
+{
+    unsigned long *p;
+
+    h &= (1 << TB_EVICTED_HASH_BITS) - 1;
+    p = &tb_evicted_hashes[BIT_WORD(h)];
+    return (qatomic_read(p) & BIT_MASK(h)) &&
+           (qatomic_fetch_and(p, ~BIT_MASK(h)) & BIT_MASK(h));
+}
+
+/* Call with mmap_lock held, from a safe-work context */
+static void tb_flush__locked(void)
+{
+    CPUState *cpu;
 
     CPU_FOREACH(cpu) {
         tcg_flush_jmp_cache(cpu);
@@ -777,10 +806,29 @@ static void do_tb_flush(CPUState *cpu, run_on_cpu_data tb_flush_count)
 
     qht_reset_size(&tb_ctx.htable, CODE_GEN_HTABLE_SIZE);
     tb_remove_all();
+    memset(tb_evicted_hashes, 0, sizeof(tb_evicted_hashes));
 
     tcg_region_reset_all();
     /* XXX: flush processor icache at this point if cache flush is expensive */
     qatomic_inc(&tb_ctx.tb_flush_count);
+    trace_tb_flush(tb_ctx.tb_flush_count);
+}
+
+/* flush all the translation blocks */
+static void do_tb_flush(CPUState *cpu, run_on_cpu_data tb_flush_count)
+{
+    bool did_flush = false;
+
+    mmap_lock();
+    /* If it is already been done on request of another CPU, just retry. */
+    if (tb_ctx.tb_flush_count != tb_flush_count.host_int) {
+        goto done;
+    }
+    did_flush = true;
+
+    tb_async_pause();
+    tb_flush__locked();
+    tb_async_resume();
 
 done:
     mmap_unlock();
@@ -803,6 +851,90 @@ void tb_flush(CPUState *cpu)
     }
 }
 
+static void do_tb_phys_invalidate(TranslationBlock *tb, bool rm_from_page_list,
+                                  bool evict);
+
+static gboolean tb_evict_iter(gpointer key, gpointer value, gpointer data)
+{
+    TranslationBlock *tb = value;
+    size_t *nb_tbs = data;
+
+    if (tb_page_addr0(tb) != -1) {
+        tb_lock_pages(tb);
+        do_tb_phys_invalidate(tb, true, true);
+        tb_unlock_pages(tb);
+    }
+    (*nb_tbs)++;
+    return false;
+}
+
+static void tb_jmp_unlink(TranslationBlock *dest);
+
+/*
+ * Execution through a patched jump does not look the destination up, so
+ * unchain the TBs of a region that gets a second chance: tb_add_jump()
+ * marks them referenced again when they are chained the next time.
+ * The jump caches are flushed already.
+ */
+static gboolean tb_evict_spare_iter(gpointer key, gpointer value,
+                                    gpointer data)
+{
+    tb_jmp_unlink(value);
+    return false;
+}
+
+/* evict the oldest translation blocks to make room for new ones */
+static void do_tb_evict(CPUState *cpu, run_on_cpu_data unused)
+{
+    size_t nb_regions, nb_tbs = 0;
+    bool did_flush = false;
+
+    mmap_lock();
+    /* If another CPU already made room, just retry. */
+    if (tcg_region_has_free()) {
+        goto done;
+    }
+
+    /* Cheaper than looking for each evicted TB in every jump cache */
+    CPU_FOREACH(cpu) {
+        tcg_flush_jmp_cache(cpu);
+    }
+
+    tb_async_pause();
+    qemu_thread_jit_write();
+    nb_regions = tcg_region_evict(tb_evict_iter, tb_evict_spare_iter, &nb_tbs);
+    qemu_thread_jit_execute();
+
+    if (nb_regions) {
+        qatomic_inc(&tb_ctx.tb_evict_count);
+        qatomic_set(&tb_ctx.tb_evicted_count,
+                    tb_ctx.tb_evicted_count + nb_tbs);
+        trace_tb_evict(nb_regions, nb_tbs);
+    } else {
+        /* All regions are in use by a context; nothing can be kept */
+        tb_flush__locked();
+        did_flush = true;
+    }
+    tb_async_resume();
+
+done:
+    mmap_unlock();
+    if (did_flush) {
+        qemu_plugin_flush_cb();
+    }
+}
+
+void tb_evict(CPUState *cpu)
+{
+    if (!tcg_region_can_evict()) {
+        tb_flush(cpu);
+    } else if (cpu_in_serial_context(cpu)) {
+        do_tb_evict(cpu, RUN_ON_CPU_NULL);
+    } else {
+        async_safe_run_on_cpu(cpu, do_tb_evict, RUN_ON_CPU_NULL);
+    }
+}
+
 /* remove @orig from its @n_orig-th jump list */
 static inline void tb_remove_from_jmp_list(TranslationBlock *orig, int n_orig)
 {
@@ -862,7 +994,7 @@ void tb_reset_jump(TranslationBlock *tb, int n)
 }
 
 /* remove any jumps to the TB */
-static inline void tb_jmp_unlink(TranslationBlock *dest)
+static void tb_jmp_unlink(TranslationBlock *dest)
 {
     TranslationBlock *tb;
     int n;
@@ -905,8 +1037,11 @@ static void tb_jmp_cache_inval_tb(TranslationBlock *tb)
  * In user-mode, call with mmap_lock held.
  * In !user-mode, if @rm_from_page_list is set, call with the TB's pages'
  * locks held.
+ * If @evict is set, the TB's code is about to be reused: the caller has
+ * already flushed all jump caches and accounts for the TB itself.
  */
-static void do_tb_phys_invalidate(TranslationBlock *tb, bool rm_from_page_list)
+static void do_tb_phys_invalidate(TranslationBlock *tb, bool rm_from_page_list,
+                                  bool evict)
 {
     uint32_t h;
     tb_page_addr_t phys_pc;
@@ -933,7 +1068,9 @@ static void do_tb_phys_invalidate(TranslationBlock *tb, bool rm_from_page_list)
     }
 
     /* remove the TB from the hash list */
-    tb_jmp_cache_inval_tb(tb);
+    if (!evict) {
+        tb_jmp_cache_inval_tb(tb);
+    }
 
     /* suppress this TB from the two jump lists */
     tb_remove_from_jmp_list(tb, 0);
@@ -942,14 +1079,18 @@ static void do_tb_phys_invalidate(TranslationBlock *tb, bool rm_from_page_list)
     /* suppress any remaining jumps to this TB */
     tb_jmp_unlink(tb);
 
-    qatomic_set(&tb_ctx.tb_phys_invalidate_count,
-                tb_ctx.tb_phys_invalidate_count + 1);
+    if (evict) {
+        tb_evicted_hash_set(h);
+    } else {
+        qatomic_set(&tb_ctx.tb_phys_invalidate_count,
+                    tb_ctx.tb_phys_invalidate_count + 1);
+    }
 }
 
 static void tb_phys_invalidate__locked(TranslationBlock *tb)
 {
     qemu_thread_jit_write();
-    do_tb_phys_invalidate(tb, true);
+    do_tb_phys_invalidate(tb, true, false);
     qemu_thread_jit_execute();
 }
 
@@ -961,10 +1102,10 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
 {
     if (page_addr == -1 && tb_page_addr0(tb) != -1) {
         tb_lock_pages(tb);
-        do_tb_phys_invalidate(tb, true);
+        do_tb_phys_invalidate(tb, true, false);
         tb_unlock_pages(tb);
     } else {
-        do_tb_phys_invalidate(tb, false);
+        do_tb_phys_invalidate(tb, false, false);
     }
 }
 
@@ -976,6 +1117,9 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
  * Note that in !user-mode, another thread might have already added a TB
  * for the same block of guest code that @tb corresponds to. In that case,
  * the caller should discard the original @tb, and use instead the returned TB.
+ *
+ * Returns NULL, and the caller should discard @tb, if @tb was translated
+ * in the background and its page was written since it was requested.
  */
 TranslationBlock *tb_link_page(TranslationBlock *tb)
 {
@@ -985,6 +1129,21 @@ TranslationBlock *tb_link_page(TranslationBlock *tb)
     assert_memory_lock();
     tcg_debug_assert(!(tb->cflags & CF_INVALID));
 
+#ifndef CONFIG_USER_ONLY
+    /*
+     * A vCPU store invalidates the TBs of the page before it lands, and
+     * then no longer traps.  A background thread may have read the code
+     * in between; linking @tb would protect the page again, with the old
+     * code in the hash table.
+     */
+    if (tcg_ctx->gen_async &&
+        page_find(tb_page_addr0(tb) >> TARGET_PAGE_BITS)->write_gen !=
+        tcg_ctx->gen_async_write_gen) {
+        tb_unlock_pages(tb);
+        return NULL;
+    }
+#endif
+
     tb_record(tb);
 
     /* add in the hash table */
@@ -999,6 +1158,10 @@ TranslationBlock *tb_link_page(TranslationBlock *tb)
         return existing_tb;
     }
 
+    if (tb_evicted_hash_test_and_clear(h)) {
+        qatomic_inc(&tb_ctx.tb_retranslate_count);
+    }
+
     tb_unlock_pages(tb);
     return tb;
 }
@@ -1114,6 +1277,9 @@ tb_invalidate_phys_page_range__locked(struct page_collection *pages,
     /* Range may not cross a page. */
     tcg_debug_assert(((start ^ last) & TARGET_PAGE_MASK) == 0);
 
+    /* Before anything is written, see tb_link_page(). */
+    qatomic_set(&p->write_gen, p->write_gen + 1);
+
     /*
      * We remove all the TBs in the range [start, last].
      * XXX: see if in some cases it could be faster to invalidate all the code
@@ -40,6 +40,9 @@
 #include "hw/boards.h"
 #endif
 #include "internal-common.h"
+#include "tb-async.h"
+#include "tb-cache.h"
+#include "tlb-mirror.h"
 #include "cpu-param.h"
 
 
@@ -50,6 +53,10 @@ struct TCGState {
     bool one_insn_per_tb;
     int splitwx_enabled;
     unsigned long tb_size;
+    char *tb_cache;
+    uint32_t superblock_threshold;
+    uint32_t translate_threads;
+    bool mirror_ram;
 };
 typedef struct TCGState TCGState;
 
@@ -102,6 +109,7 @@ static void tcg_accel_instance_init(Object *obj)
 
 bool mttcg_enabled;
 bool one_insn_per_tb;
+unsigned superblock_threshold;
 
 static int tcg_init_machine(MachineState *ms)
 {
@@ -115,9 +123,21 @@ static int tcg_init_machine(MachineState *ms)
     tcg_allowed = true;
     mttcg_enabled = s->mttcg_enabled;
 
+#ifndef CONFIG_USER_ONLY
+    if (s->translate_threads && !mttcg_enabled) {
+        warn_report("translate-threads requires thread=multi, ignoring");
+        s->translate_threads = 0;
+    }
+#endif
+
     page_init();
     tb_htable_init();
-    tcg_init(s->tb_size * MiB, s->splitwx_enabled, max_cpus);
+    /* The translation threads need a TCGContext each */
+    tcg_init(s->tb_size * MiB, s->splitwx_enabled,
+             max_cpus + s->translate_threads);
+    if (s->tb_cache) {
+        tb_cache_init(s->tb_cache);
+    }
 
 #if defined(CONFIG_SOFTMMU)
     /*
@@ -125,6 +145,13 @@ static int tcg_init_machine(MachineState *ms)
      * initialize the prologue now.
      */
     tcg_prologue_init();
+
+    if (s->translate_threads) {
+        tb_async_init(s->translate_threads);
+    }
+    if (s->mirror_ram) {
+        tlb_mirror_setup();
+    }
 #endif
 
 #ifdef CONFIG_USER_ONLY
@@ -212,6 +239,106 @@ static void tcg_set_one_insn_per_tb(Object *obj, bool value, Error **errp)
     qatomic_set(&one_insn_per_tb, value);
 }
 
+static void tcg_get_superblock_threshold(Object *obj, Visitor *v,
+                                        const char *name, void *opaque,
+                                        Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    uint32_t value = s->superblock_threshold;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void tcg_set_superblock_threshold(Object *obj, Visitor *v,
+                                        const char *name, void *opaque,
+                                        Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    uint32_t value;
+
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+    /* The counters are 16 bits wide */
+    if (value > UINT16_MAX) {
+        error_setg(errp, "superblock-threshold must be at most %u",
+                   UINT16_MAX);
+        return;
+    }
+
+    s->superblock_threshold = value;
+    qatomic_set(&superblock_threshold, value);
+}
+
+static void tcg_get_translate_threads(Object *obj, Visitor *v,
+                                      const char *name, void *opaque,
+                                      Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    uint32_t value = s->translate_threads;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void tcg_set_translate_threads(Object *obj, Visitor *v,
+                                      const char *name, void *opaque,
+                                      Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    uint32_t value;
+
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+#ifdef CONFIG_USER_ONLY
+    if (value) {
+        error_setg(errp, "translate-threads is not supported in user mode");
+        return;
+    }
+#endif
+    if (value > 64) {
+        error_setg(errp, "translate-threads must be at most 64");
+        return;
+    }
+
+    s->translate_threads = value;
+}
+
+static char *tcg_get_tb_cache(Object *obj, Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+
+    return g_strdup(s->tb_cache);
+}
+
+static void tcg_set_tb_cache(Object *obj, const char *value, Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+
+    g_free(s->tb_cache);
+    s->tb_cache = g_strdup(value);
+}
+
+static bool tcg_get_mirror_ram(Object *obj, Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+
+    return s->mirror_ram;
+}
+
+static void tcg_set_mirror_ram(Object *obj, bool value, Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+
+#ifdef CONFIG_USER_ONLY
+    if (value) {
+        error_setg(errp, "mirror-ram is not supported in user mode");
+        return;
+    }
+#endif
+    s->mirror_ram = value;
+}
+
 static int tcg_gdbstub_supported_sstep_flags(void)
 {
     /*
@@ -257,6 +384,31 @@ static void tcg_accel_class_init(ObjectClass *oc, void *data)
                                    tcg_set_one_insn_per_tb);
     object_class_property_set_description(oc, "one-insn-per-tb",
         "Only put one guest insn in each translation block");
+
+    object_class_property_add(oc, "superblock-threshold", "uint32",
+        tcg_get_superblock_threshold, tcg_set_superblock_threshold,
+        NULL, NULL);
+    object_class_property_set_description(oc, "superblock-threshold",
+        "Executions after which a TB is retranslated across jumps "
+        "(0 to disable)");
+
+    object_class_property_add(oc, "translate-threads", "uint32",
+        tcg_get_translate_threads, tcg_set_translate_threads,
+        NULL, NULL);
+    object_class_property_set_description(oc, "translate-threads",
+        "Number of threads translating code ahead of the vCPUs");
+
+    object_class_property_add_str(oc, "tb-cache",
+                                  tcg_get_tb_cache,
+                                  tcg_set_tb_cache);
+    object_class_property_set_description(oc, "tb-cache",
+        "File to keep translated code in across runs");
+
+    object_class_property_add_bool(oc, "mirror-ram",
+                                   tcg_get_mirror_ram,
+                                   tcg_set_mirror_ram);
+    object_class_property_set_description(oc, "mirror-ram",
+        "Access shared guest RAM through host mappings instead of the TLB");
 }
 
 static const TypeInfo tcg_accel_type = {
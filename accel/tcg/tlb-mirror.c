@@ -0,0 +1,381 @@
+/*
+ * Host mirror of the guest address spaces
+ *
+ * With -accel tcg,mirror-ram=on, each vCPU reserves 4GiB of host address
+ * space per mmu_idx, and maps there the pages of guest RAM that its TLB
+ * allows to read or write directly, at their guest virtual address.
+ * Generated code then accesses guest memory at tlb.d[mmu_idx].mirror
+ * plus the guest address, without probing the TLB.
+ *
+ * Everything else is unmapped: I/O, watchpoints, pages that the TLB does
+ * not hold (yet), and the pages of RAMBlocks that are not shared file
+ * mappings.  Clean pages are mapped read-only, for dirty tracking.  When
+ * an access faults, the SIGSEGV handler maps the page if the TLB allows
+ * it, and otherwise executes the insn again through the softmmu TLB.
+ *
+ * Removing a mapping is always safe, so only the last TLB_MIRROR_PAGES
+ * pages that were mapped are kept, bounding the number of host VMAs.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/error-report.h"
+#include "qemu/units.h"
+#include "exec/exec-all.h"
+#include "exec/ramblock.h"
+#include "hw/boards.h"
+#include "hw/core/cpu.h"
+#include "tcg/tcg.h"
+#include "tlb-mirror.h"
+#include "internal-target.h"
+
+#if defined(__linux__) && (defined(__x86_64__) || defined(__aarch64__)) && \
+    TARGET_LONG_BITS == 32
+#define TLB_MIRROR_SUPPORTED 1
+#endif
+
+#ifdef TLB_MIRROR_SUPPORTED
+
+/* Room for the bytes of an access that wraps around the address space */
+#define TLB_MIRROR_GUARD    (64 * KiB)
+#define TLB_MIRROR_SIZE     (4 * GiB + TLB_MIRROR_GUARD)
+#define TLB_MIRROR_PAGES    8192
+
+typedef struct TLBMirrorPage {
+    uintptr_t host;
+    vaddr page;
+    int mmu_idx;                /* -1 if unused */
+    bool writable;
+} TLBMirrorPage;
+
+typedef struct TLBMirror {
+    uintptr_t base;
+    /* Bit N is set if the region of mmu_idx N may have mappings */
+    uint16_t mapped;
+    /* Address of the last fault that mapped a page */
+    uintptr_t last_fault;
+    /* Ring of the pages mapped, which may be stale */
+    unsigned next;
+    TLBMirrorPage pages[TLB_MIRROR_PAGES];
+} TLBMirror;
+
+static bool tlb_mirror_enabled;
+
+/*
+ * Without a shared file mapping for the machine's RAM, no guest access
+ * could use the mirror, and each one would fault first.
+ */
+static bool tlb_mirror_ram_ok(void)
+{
+    MemoryRegion *ram = current_machine ? current_machine->ram : NULL;
+    RAMBlock *rb = ram ? ram->ram_block : NULL;
+
+    return rb && rb->fd >= 0 && qemu_ram_is_shared(rb);
+}
+
+static void *tlb_mirror_addr(TLBMirror *m, int mmu_idx, vaddr page)
+{
+    return (void *)(m->base + mmu_idx * TLB_MIRROR_SIZE + page);
+}
+
+static void tlb_mirror_unmap(TLBMirror *m, int mmu_idx, vaddr page,
+                             size_t size)
+{
+    void *p = tlb_mirror_addr(m, mmu_idx, page);
+
+    /*
+     * Keep the reservation, so that nothing else is mapped there.  If
+     * the host is out of VMAs, at least remove the access.
+     */
+    if (mmap(p, size, PROT_NONE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED,
+             -1, 0) == MAP_FAILED && mprotect(p, size, PROT_NONE)) {
+        error_report("tlb mirror: cannot unmap %p: %s", p, strerror(errno));
+        abort();
+    }
+}
+
+bool tlb_mirror_set_page_locked(CPUState *cpu, int mmu_idx, vaddr page,
+                                const CPUTLBEntry *te)
+{
+    TLBMirror *m = cpu->neg.tlb.c.mirror;
+    TLBMirrorPage *e;
+    uintptr_t host;
+    ram_addr_t offset;
+    RAMBlock *rb;
+    bool writable;
+
+    if (!m) {
+        return false;
+    }
+
+    /* Only plain RAM: any TLB flag requires the slow path. */
+    host = te->addend + page;
+    rb = te->addr_read == page
+         ? qemu_ram_block_from_host((void *)host, false, &offset) : NULL;
+    if (!rb || rb->fd < 0 || !qemu_ram_is_shared(rb) ||
+        (host & (qemu_real_host_page_size() - 1))) {
+        if (m->mapped & (1 << mmu_idx)) {
+            tlb_mirror_unmap(m, mmu_idx, page, TARGET_PAGE_SIZE);
+        }
+        return false;
+    }
+
+    writable = te->addr_write == page;
+    if (mmap(tlb_mirror_addr(m, mmu_idx, page), TARGET_PAGE_SIZE,
+             PROT_READ | (writable ? PROT_WRITE : 0),
+             MAP_SHARED | MAP_FIXED, rb->fd,
+             rb->fd_offset + offset) == MAP_FAILED) {
+        /* Most likely out of VMAs: leave the page to the slow path. */
+        tlb_mirror_unmap(m, mmu_idx, page, TARGET_PAGE_SIZE);
+        return false;
+    }
+    m->mapped |= 1 << mmu_idx;
+
+    e = &m->pages[m->next];
+    m->next = (m->next + 1) % TLB_MIRROR_PAGES;
+    if (e->mmu_idx >= 0 && (m->mapped & (1 << e->mmu_idx)) &&
+        (e->mmu_idx != mmu_idx || e->page != page)) {
+        tlb_mirror_unmap(m, e->mmu_idx, e->page, TARGET_PAGE_SIZE);
+    }
+    e->host = host;
+    e->page = page;
+    e->mmu_idx = mmu_idx;
+    e->writable = writable;
+    return true;
+}
+
+void tlb_mirror_flush_page_locked(CPUState *cpu, int mmu_idx, vaddr page)
+{
+    TLBMirror *m = cpu->neg.tlb.c.mirror;
+
+    if (m && (m->mapped & (1 << mmu_idx))) {
+        tlb_mirror_unmap(m, mmu_idx, page, TARGET_PAGE_SIZE);
+    }
+}
+
+void tlb_mirror_flush_locked(CPUState *cpu, int mmu_idx)
+{
+    TLBMirror *m = cpu->neg.tlb.c.mirror;
+
+    if (m && (m->mapped & (1 << mmu_idx))) {
+        tlb_mirror_unmap(m, mmu_idx, 0, TLB_MIRROR_SIZE);
+        m->mapped &= ~(1 << mmu_idx);
+    }
+}
+
+void tlb_mirror_reset_dirty_locked(CPUState *cpu, uintptr_t start,
+                                   uintptr_t length)
+{
+    TLBMirror *m = cpu->neg.tlb.c.mirror;
+    unsigned i;
+
+    if (!m || !m->mapped) {
+        return;
+    }
+    for (i = 0; i < TLB_MIRROR_PAGES; i++) {
+        TLBMirrorPage *e = &m->pages[i];
+
+        if (e->mmu_idx >= 0 && e->writable &&
+            (m->mapped & (1 << e->mmu_idx)) &&
+            e->host - start < length) {
+            /* The next write faults, and notdirty_write() does the rest. */
+            tlb_mirror_unmap(m, e->mmu_idx, e->page, TARGET_PAGE_SIZE);
+            e->mmu_idx = -1;
+        }
+    }
+}
+
+static struct sigaction tlb_mirror_old_action;
+
+static uintptr_t tlb_mirror_host_pc(ucontext_t *uc)
+{
+#if defined(__x86_64__)
+    return uc->uc_mcontext.gregs[REG_RIP];
+#else
+    return uc->uc_mcontext.pc;
+#endif
+}
+
+/* As tlb_entry() in cputlb.c */
+static CPUTLBEntry *tlb_mirror_entry(CPUState *cpu, int mmu_idx, vaddr page)
+{
+    CPUTLBDescFast *fast = &cpu->neg.tlb.f[mmu_idx];
+    uintptr_t index = (page >> TARGET_PAGE_BITS) &
+                      (fast->mask >> CPU_TLB_ENTRY_BITS);
+
+    return &fast->table[index];
+}
+
+static bool tlb_mirror_refill(CPUState *cpu, int mmu_idx, vaddr page)
+{
+    bool ret;
+
+    qemu_spin_lock(&cpu->neg.tlb.c.lock);
+    ret = tlb_mirror_set_page_locked(cpu, mmu_idx, page,
+                                     tlb_mirror_entry(cpu, mmu_idx, page));
+    qemu_spin_unlock(&cpu->neg.tlb.c.lock);
+    return ret;
+}
+
+static void tlb_mirror_chain(int sig, siginfo_t *info, void *puc)
+{
+    struct sigaction *old = &tlb_mirror_old_action;
+
+    if (old->sa_flags & SA_SIGINFO) {
+        old->sa_sigaction(sig, info, puc);
+    } else if (old->sa_handler == SIG_DFL || old->sa_handler == SIG_IGN) {
+        /* Fault again with the default action. */
+        sigaction(sig, old, NULL);
+    } else {
+        old->sa_handler(sig);
+    }
+}
+
+static void tlb_mirror_sigsegv(int sig, siginfo_t *info, void *puc)
+{
+    ucontext_t *uc = puc;
+    CPUState *cpu = current_cpu;
+    TLBMirror *m = cpu ? cpu->neg.tlb.c.mirror : NULL;
+    uintptr_t addr = (uintptr_t)info->si_addr;
+    uintptr_t pc = tlb_mirror_host_pc(uc);
+    uintptr_t ofs;
+    vaddr page;
+    int mmu_idx;
+
+    if (!m || addr - m->base >= NB_MMU_MODES * TLB_MIRROR_SIZE ||
+        !in_code_gen_buffer((void *)(pc - tcg_splitwx_diff))) {
+        tlb_mirror_chain(sig, info, puc);
+        return;
+    }
+
+    ofs = addr - m->base;
+    mmu_idx = ofs / TLB_MIRROR_SIZE;
+    page = (ofs % TLB_MIRROR_SIZE) & TARGET_PAGE_MASK;
+
+    /*
+     * Map the page if the TLB allows it.  If that is what the previous
+     * fault did, the access is one that the mapping does not allow,
+     * e.g. a store to a clean page.
+     */
+    if (addr != m->last_fault && page < 4 * GiB &&
+        tlb_mirror_refill(cpu, mmu_idx, page)) {
+        m->last_fault = addr;
+        return;
+    }
+    m->last_fault = -1;
+
+    pthread_sigmask(SIG_SETMASK, &uc->uc_sigmask, NULL);
+    cpu_mirror_recompile(cpu, pc + GETPC_ADJ);
+}
+
+void tlb_mirror_setup(void)
+{
+    struct sigaction act = {
+        .sa_sigaction = tlb_mirror_sigsegv,
+        .sa_flags = SA_SIGINFO,
+    };
+
+    sigfillset(&act.sa_mask);
+    if (sigaction(SIGSEGV, &act, &tlb_mirror_old_action)) {
+        warn_report("mirror-ram: cannot install SIGSEGV handler, ignoring");
+        return;
+    }
+    tlb_mirror_enabled = true;
+}
+
+void tlb_mirror_init(CPUState *cpu)
+{
+    TLBMirror *m;
+    void *base;
+    int i;
+
+    if (!tlb_mirror_enabled) {
+        return;
+    }
+    if (TARGET_PAGE_SIZE < qemu_real_host_page_size()) {
+        warn_report_once("mirror-ram needs guest pages at least as large "
+                         "as host pages, ignoring");
+        return;
+    }
+    if (!tlb_mirror_ram_ok()) {
+        warn_report_once("mirror-ram needs the guest RAM to be a shared file "
+                         "mapping, e.g. -object memory-backend-memfd,"
+                         "share=on with -machine memory-backend, ignoring");
+        return;
+    }
+
+    base = mmap(NULL, NB_MMU_MODES * TLB_MIRROR_SIZE, PROT_NONE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+        warn_report("mirror-ram: cannot reserve address space for CPU %d: %s",
+                    cpu->cpu_index, strerror(errno));
+        return;
+    }
+
+    m = g_new0(TLBMirror, 1);
+    m->base = (uintptr_t)base;
+    m->last_fault = -1;
+    for (i = 0; i < TLB_MIRROR_PAGES; i++) {
+        m->pages[i].mmu_idx = -1;
+    }
+    for (i = 0; i < NB_MMU_MODES; i++) {
+        cpu->neg.tlb.d[i].mirror = m->base + i * TLB_MIRROR_SIZE;
+    }
+    cpu->neg.tlb.c.mirror = m;
+    tcg_cflags_set(cpu, CF_MIRROR_RAM);
+}
+
+void tlb_mirror_destroy(CPUState *cpu)
+{
+    TLBMirror *m = cpu->neg.tlb.c.mirror;
+    int i;
+
+    if (!m) {
+        return;
+    }
+    for (i = 0; i < NB_MMU_MODES; i++) {
+        cpu->neg.tlb.d[i].mirror = 0;
+    }
+    cpu->neg.tlb.c.mirror = NULL;
+    munmap((void *)m->base, NB_MMU_MODES * TLB_MIRROR_SIZE);
+    g_free(m);
+}
+
+#else
+
+void tlb_mirror_setup(void)
+{
+    warn_report("mirror-ram is only supported on 64-bit Linux hosts, "
+                "for guests with 32-bit addresses, ignoring");
+}
+
+void tlb_mirror_init(CPUState *cpu)
+{
+}
+
+void tlb_mirror_destroy(CPUState *cpu)
+{
+}
+
+bool tlb_mirror_set_page_locked(CPUState *cpu, int mmu_idx, vaddr page,
+                                const CPUTLBEntry *te)
+{
+    return false;
+}
+
+void tlb_mirror_flush_page_locked(CPUState *cpu, int mmu_idx, vaddr page)
+{
+}
+
+void tlb_mirror_flush_locked(CPUState *cpu, int mmu_idx)
+{
+}
+
+void tlb_mirror_reset_dirty_locked(CPUState *cpu, uintptr_t start,
+                                   uintptr_t length)
+{
+}
+
+#endif /* TLB_MIRROR_SUPPORTED */
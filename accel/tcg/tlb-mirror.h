@@ -0,0 +1,62 @@
+/*
+ * Host mirror of the guest address spaces
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#ifndef ACCEL_TCG_TLB_MIRROR_H
+#define ACCEL_TCG_TLB_MIRROR_H
+
+#include "exec/cpu-common.h"
+#include "exec/tlb-common.h"
+#include "exec/vaddr.h"
+
+/**
+ * tlb_mirror_setup() - enable the tlb mirror for the vCPUs to come
+ *
+ * Warn and leave it disabled if the host or the target does not support it.
+ */
+void tlb_mirror_setup(void);
+
+/**
+ * tlb_mirror_init() - reserve the mirror of @cpu
+ * @cpu: the CPU being realized
+ *
+ * If this succeeds, the TBs of @cpu are generated with CF_MIRROR_RAM.
+ */
+void tlb_mirror_init(CPUState *cpu);
+void tlb_mirror_destroy(CPUState *cpu);
+
+/*
+ * The following are called with tlb_c.lock held, after the corresponding
+ * change to the TLB.
+ */
+
+/**
+ * tlb_mirror_set_page_locked() - mirror a TLB entry
+ * @cpu: the CPU owning the TLB
+ * @mmu_idx: mmu index of @te
+ * @page: guest virtual address of the page
+ * @te: TLB entry for @page
+ *
+ * Map @page read-only or read-write if @te allows plain accesses to a
+ * RAMBlock that can be mapped twice, and unmap it otherwise.
+ * Return true if @page was mapped.
+ */
+bool tlb_mirror_set_page_locked(CPUState *cpu, int mmu_idx, vaddr page,
+                                const CPUTLBEntry *te);
+void tlb_mirror_flush_page_locked(CPUState *cpu, int mmu_idx, vaddr page);
+void tlb_mirror_flush_locked(CPUState *cpu, int mmu_idx);
+
+/**
+ * tlb_mirror_reset_dirty_locked() - unmap writable pages of a host range
+ * @cpu: the CPU owning the TLB
+ * @start: host address of the range
+ * @length: length of the range
+ *
+ * Like tlb_reset_dirty(), this may be called from another thread.
+ */
+void tlb_mirror_reset_dirty_locked(CPUState *cpu, uintptr_t start,
+                                   uintptr_t length);
+
+#endif /* ACCEL_TCG_TLB_MIRROR_H */
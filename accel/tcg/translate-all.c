@@ -61,6 +61,8 @@
 #include "hw/core/tcg-cpu-ops.h"
 #include "tb-jmp-cache.h"
 #include "tb-hash.h"
+#include "tb-async.h"
+#include "tb-cache.h"
 #include "tb-context.h"
 #include "tb-internal.h"
 #include "internal-common.h"
@@ -287,28 +289,32 @@ static int setjmp_gen_code(CPUArchState *env, TranslationBlock *tb,
     return tcg_gen_code(tcg_ctx, tb, pc);
 }
 
-/* Called with mmap_lock held for user mode emulation.  */
-TranslationBlock *tb_gen_code(CPUState *cpu,
-                              vaddr pc, uint64_t cs_base,
-                              uint32_t flags, int cflags)
+/* Give back the code buffer space of a TB that will not be used. */
+static void tb_discard(TranslationBlock *tb, tcg_insn_unit *gen_code_buf)
+{
+    uintptr_t orig_aligned = (uintptr_t)gen_code_buf;
+
+    orig_aligned -= ROUND_UP(sizeof(*tb), qemu_icache_linesize);
+    qatomic_set(&tcg_ctx->code_gen_ptr, (void *)orig_aligned);
+}
+
+/*
+ * Translate the code at @pc, which is at @phys_pc and @host_pc.
+ * Return NULL if the code buffer is full, or if a background translation
+ * needs a second page or finds its page written (see TCGContext.gen_async).
+ */
+static TranslationBlock *tb_gen_code_phys(CPUState *cpu,
+                                          vaddr pc, uint64_t cs_base,
+                                          uint32_t flags, int cflags,
+                                          tb_page_addr_t phys_pc,
+                                          void *host_pc)
 {
     CPUArchState *env = cpu_env(cpu);
     TranslationBlock *tb, *existing_tb;
-    tb_page_addr_t phys_pc, phys_p2;
+    tb_page_addr_t phys_p2;
     tcg_insn_unit *gen_code_buf;
     int gen_code_size, search_size, max_insns;
     int64_t ti;
-    void *host_pc;
-
-    assert_memory_lock();
-    qemu_thread_jit_write();
-
-    phys_pc = get_page_addr_code_hostp(env, pc, &host_pc);
-
-    if (phys_pc == -1) {
-        /* Generate a one-shot TB with 1 insn in it */
-        cflags = (cflags & ~CF_COUNT_MASK) | 1;
-    }
 
     max_insns = cflags & CF_COUNT_MASK;
     if (max_insns == 0) {
@@ -316,16 +322,13 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     }
     QEMU_BUILD_BUG_ON(CF_COUNT_MASK + 1 != TCG_MAX_INSNS);
 
+    tcg_ctx->nb_goto_tb_dest = 0;
+
  buffer_overflow:
     assert_no_pages_locked();
     tb = tcg_tb_alloc(tcg_ctx);
     if (unlikely(!tb)) {
-        /* flush must be done */
-        tb_flush(cpu);
-        mmap_unlock();
-        /* Make the execution loop process the flush as soon as possible.  */
-        cpu->exception_index = EXCP_INTERRUPT;
-        cpu_loop_exit(cpu);
+        return NULL;
     }
 
     gen_code_buf = tcg_ctx->code_gen_ptr;
@@ -348,6 +351,7 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     tcg_ctx->page_bits = TARGET_PAGE_BITS;
     tcg_ctx->page_mask = TARGET_PAGE_MASK;
     tcg_ctx->tlb_dyn_max_bits = CPU_TLB_DYN_MAX_BITS;
+    tcg_ctx->mirror_ram = cflags & CF_MIRROR_RAM;
 #endif
     tcg_ctx->insn_start_words = TARGET_INSN_START_WORDS;
 #ifdef TCG_GUEST_DEFAULT_MO
@@ -356,6 +360,14 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     tcg_ctx->guest_mo = TCG_MO_ALL;
 #endif
 
+    tcg_ctx->ext_relocs_enabled = !tcg_ctx->gen_async &&
+                                  tb_cache_active(cpu, tb, host_pc);
+    if (tcg_ctx->ext_relocs_enabled &&
+        tb_cache_fill(tb, pc, host_pc, &gen_code_size, &search_size)) {
+        tcg_ctx->gen_tb = NULL;
+        goto tb_ready;
+    }
+
  restart_translate:
     trace_translate_block(tb, pc, tb->tc.ptr);
 
@@ -419,6 +431,16 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
                           "Restarting code generation with re-locked pages");
             goto restart_translate;
 
+        case -4:
+            /*
+             * A background translation reached the second page.  Leave
+             * the TB to the vCPU, which can look up that page.
+             */
+            tb_unlock_pages(tb);
+            tcg_ctx->gen_tb = NULL;
+            tb_discard(tb, gen_code_buf);
+            return NULL;
+
         default:
             g_assert_not_reached();
         }
@@ -432,6 +454,10 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     }
     tb->tc.size = gen_code_size;
 
+    if (tcg_ctx->ext_relocs_enabled) {
+        tb_cache_save(tb, pc, host_pc, search_size);
+    }
+
     /*
      * For CF_PCREL, attribute all executions of the generated code
      * to its first mapping.
@@ -511,6 +537,7 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
         }
     }
 
+ tb_ready:
     qatomic_set(&tcg_ctx->code_gen_ptr, (void *)
         ROUND_UP((uintptr_t)gen_code_buf + gen_code_size + search_size,
                  CODE_GEN_ALIGN));
@@ -566,16 +593,64 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
 
     /* if the TB already exists, discard what we just translated */
     if (unlikely(existing_tb != tb)) {
-        uintptr_t orig_aligned = (uintptr_t)gen_code_buf;
-
-        orig_aligned -= ROUND_UP(sizeof(*tb), qemu_icache_linesize);
-        qatomic_set(&tcg_ctx->code_gen_ptr, (void *)orig_aligned);
+        tb_discard(tb, gen_code_buf);
         tcg_tb_remove(tb);
         return existing_tb;
     }
     return tb;
 }
 
+/* Called with mmap_lock held for user mode emulation.  */
+TranslationBlock *tb_gen_code(CPUState *cpu,
+                              vaddr pc, uint64_t cs_base,
+                              uint32_t flags, int cflags)
+{
+    TranslationBlock *tb;
+    tb_page_addr_t phys_pc;
+    void *host_pc;
+
+    assert_memory_lock();
+    qemu_thread_jit_write();
+
+    phys_pc = get_page_addr_code_hostp(cpu_env(cpu), pc, &host_pc);
+
+    if (phys_pc == -1) {
+        /* Generate a one-shot TB with 1 insn in it */
+        cflags = (cflags & ~CF_COUNT_MASK) | 1;
+    }
+
+    tb = tb_gen_code_phys(cpu, pc, cs_base, flags, cflags, phys_pc, host_pc);
+    if (unlikely(!tb)) {
+        /* make room by evicting the oldest code, or flush everything */
+        tb_evict(cpu);
+        mmap_unlock();
+        /* Make the execution loop process the flush as soon as possible.  */
+        cpu->exception_index = EXCP_INTERRUPT;
+        cpu_loop_exit(cpu);
+    }
+
+    if (tcg_ctx->nb_goto_tb_dest) {
+        tb_async_prefetch(cpu, tb, pc);
+    }
+    return tb;
+}
+
+#ifndef CONFIG_USER_ONLY
+TranslationBlock *tb_gen_code_async(CPUState *cpu,
+                                    vaddr pc, uint64_t cs_base,
+                                    uint32_t flags, uint32_t cflags,
+                                    tb_page_addr_t phys_pc, void *host_pc,
+                                    unsigned write_gen)
+{
+    assert(tcg_ctx->gen_async);
+    qemu_thread_jit_write();
+
+    tcg_ctx->gen_async_write_gen = write_gen;
+
+    return tb_gen_code_phys(cpu, pc, cs_base, flags, cflags, phys_pc, host_pc);
+}
+#endif
+
 /* user-mode: call with mmap_lock held */
 void tb_check_watchpoint(CPUState *cpu, uintptr_t retaddr)
 {
@@ -607,12 +682,12 @@ void tb_check_watchpoint(CPUState *cpu, uintptr_t retaddr)
 
 #ifndef CONFIG_USER_ONLY
 /*
- * In deterministic execution mode, instructions doing device I/Os
- * must be at the end of the TB.
- *
- * Called by softmmu_template.h, with iothread mutex not held.
+ * Rewind execution to the insn at @retaddr, and exit the loop to
+ * execute just that insn in a new TB, without @cflags_clear.
  */
-void cpu_io_recompile(CPUState *cpu, uintptr_t retaddr)
+static G_NORETURN
+void cpu_recompile_insn(CPUState *cpu, uintptr_t retaddr,
+                        uint32_t cflags_clear, const char *who)
 {
     TranslationBlock *tb;
     CPUClass *cc;
@@ -620,8 +695,8 @@ void cpu_io_recompile(CPUState *cpu, uintptr_t retaddr)
 
     tb = tcg_tb_lookup(retaddr);
     if (!tb) {
-        cpu_abort(cpu, "cpu_io_recompile: could not find TB for pc=%p",
-                  (void *)retaddr);
+        cpu_abort(cpu, "%s: could not find TB for pc=%p",
+                  who, (void *)retaddr);
     }
     cpu_restore_state_from_tb(cpu, tb, retaddr);
 
@@ -645,19 +720,40 @@ void cpu_io_recompile(CPUState *cpu, uintptr_t retaddr)
      * double instrument the instruction. Also don't let an IRQ sneak
      * in before we execute it.
      */
-    cpu->cflags_next_tb = curr_cflags(cpu) | CF_MEMI_ONLY | CF_NOIRQ | n;
+    cpu->cflags_next_tb = (curr_cflags(cpu) & ~cflags_clear) |
+                          CF_MEMI_ONLY | CF_NOIRQ | n;
 
     if (qemu_loglevel_mask(CPU_LOG_EXEC)) {
         vaddr pc = cpu->cc->get_pc(cpu);
         if (qemu_log_in_addr_range(pc)) {
-            qemu_log("cpu_io_recompile: rewound execution of TB to %016"
-                     VADDR_PRIx "\n", pc);
+            qemu_log("%s: rewound execution of TB to %016"
+                     VADDR_PRIx "\n", who, pc);
         }
     }
 
     cpu_loop_exit_noexc(cpu);
 }
 
+/*
+ * In deterministic execution mode, instructions doing device I/Os
+ * must be at the end of the TB.
+ *
+ * Called by softmmu_template.h, with iothread mutex not held.
+ */
+void cpu_io_recompile(CPUState *cpu, uintptr_t retaddr)
+{
+    cpu_recompile_insn(cpu, retaddr, 0, __func__);
+}
+
+/*
+ * The insn at @retaddr made an access that the tlb mirror does not
+ * allow; execute it again through the softmmu TLB.
+ */
+void cpu_mirror_recompile(CPUState *cpu, uintptr_t retaddr)
+{
+    cpu_recompile_insn(cpu, retaddr, CF_MIRROR_RAM, __func__);
+}
+
 #endif /* CONFIG_USER_ONLY */
 
 /*
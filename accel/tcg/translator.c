@@ -17,9 +17,12 @@
 #include "exec/cpu_ldst.h"
 #include "exec/tswap.h"
 #include "tcg/tcg-op-common.h"
+#include "tcg/tcg-temp-internal.h"
+#include "internal-common.h"
 #include "internal-target.h"
 #include "disas/disas.h"
 #include "tb-internal.h"
+#include "tb-hash.h"
 
 static void set_can_do_io(DisasContextBase *db, bool val)
 {
@@ -41,6 +44,44 @@ bool translator_io_start(DisasContextBase *db)
     return true;
 }
 
+static intptr_t tb_hot_count_offset(vaddr pc)
+{
+    unsigned idx = (pc ^ (pc >> 9)) % CPU_TB_HOT_COUNT_SIZE;
+
+    return offsetof(ArchCPU, parent_obj.tb_hot_count) - offsetof(ArchCPU, env)
+           + idx * sizeof(uint16_t);
+}
+
+static bool tb_wants_hot_count(const DisasContextBase *db,
+                               const TranslatorOps *ops, uint32_t cflags)
+{
+    return ops->superblocks && qatomic_read(&superblock_threshold) &&
+           tb_page_addr0(db->tb) != -1 &&
+           !(cflags & (CF_SUPERBLOCK | CF_COUNT_MASK | CF_USE_ICOUNT |
+                       CF_NO_GOTO_TB | CF_SINGLE_STEP));
+}
+
+/*
+ * Count executions of the TB, and exit with TB_EXIT_HOT before running
+ * it when the count reaches the threshold.  Counters are shared by TBs
+ * whose PC hashes the same, which at worst retranslates a cold TB as a
+ * superblock too early.
+ */
+static void gen_tb_hot_count(DisasContextBase *db)
+{
+    intptr_t ofs = tb_hot_count_offset(db->pc_first);
+    TCGv_i32 count = tcg_temp_new_i32();
+
+    tcg_gen_ld16u_i32(count, tcg_env, ofs);
+    tcg_gen_addi_i32(count, count, 1);
+    tcg_gen_st16_i32(count, tcg_env, ofs);
+
+    tcg_ctx->hot_label = gen_new_label();
+    tcg_gen_brcondi_i32(TCG_COND_GEU, count,
+                        qatomic_read(&superblock_threshold),
+                        tcg_ctx->hot_label);
+}
+
 static TCGOp *gen_tb_start(DisasContextBase *db, uint32_t cflags)
 {
     TCGv_i32 count = NULL;
@@ -86,9 +127,12 @@ static TCGOp *gen_tb_start(DisasContextBase *db, uint32_t cflags)
     return icount_start_insn;
 }
 
-static void gen_tb_end(const TranslationBlock *tb, uint32_t cflags,
-                       TCGOp *icount_start_insn, int num_insns)
+static void gen_tb_end(const DisasContextBase *db, uint32_t cflags,
+                       TCGOp *icount_start_insn)
 {
+    const TranslationBlock *tb = db->tb;
+    int num_insns = db->num_insns;
+
     if (cflags & CF_USE_ICOUNT) {
         /*
          * Update the num_insn immediate parameter now that we know
@@ -102,6 +146,14 @@ static void gen_tb_end(const TranslationBlock *tb, uint32_t cflags,
         gen_set_label(tcg_ctx->exitreq_label);
         tcg_gen_exit_tb(tb, TB_EXIT_REQUESTED);
     }
+
+    if (tcg_ctx->hot_label) {
+        /* Start counting again for the TBs sharing the counter */
+        gen_set_label(tcg_ctx->hot_label);
+        tcg_gen_st16_i32(tcg_constant_i32(0), tcg_env,
+                         tb_hot_count_offset(db->pc_first));
+        tcg_gen_exit_tb(tb, TB_EXIT_HOT);
+    }
 }
 
 bool translator_is_same_page(const DisasContextBase *db, vaddr addr)
@@ -117,7 +169,128 @@ bool translator_use_goto_tb(DisasContextBase *db, vaddr dest)
     }
 
     /* Check for the dest on the same page as the start of the TB.  */
-    return translator_is_same_page(db, dest);
+    if (!translator_is_same_page(db, dest)) {
+        return false;
+    }
+
+    /* Remember the destination, so that it can be translated ahead. */
+    if (tcg_ctx->nb_goto_tb_dest < ARRAY_SIZE(tcg_ctx->goto_tb_dest) &&
+        !(tcg_ctx->nb_goto_tb_dest && tcg_ctx->goto_tb_dest[0] == dest)) {
+        tcg_ctx->goto_tb_dest[tcg_ctx->nb_goto_tb_dest++] = dest;
+    }
+    return true;
+}
+
+bool translator_follow_jump(DisasContextBase *db, vaddr dest)
+{
+    /* Plugins expect the instructions of a TB to be contiguous. */
+    if (!(tb_cflags(db->tb) & CF_SUPERBLOCK) || db->plugin_enabled) {
+        return false;
+    }
+
+    /*
+     * Never from tb_stop.  The TB must also keep covering a single
+     * range of guest code, from pc_first, for invalidation.
+     */
+    return db->is_jmp == DISAS_NEXT &&
+           dest >= db->pc_first && translator_is_same_page(db, dest);
+}
+
+#define CPU_ENV_OFFSET(field) \
+    (offsetof(ArchCPU, parent_obj.field) - offsetof(ArchCPU, env))
+
+/* Must match tb_jmp_cache_hash_func(). */
+static void gen_tb_jmp_cache_hash(TCGv_i64 hash, TCGv_i64 pc)
+{
+#ifdef CONFIG_SOFTMMU
+    TCGv_i64 tmp = tcg_temp_ebb_new_i64();
+
+    tcg_gen_shri_i64(tmp, pc, TARGET_PAGE_BITS - TB_JMP_PAGE_BITS);
+    tcg_gen_xor_i64(tmp, tmp, pc);
+    tcg_gen_shri_i64(hash, tmp, TARGET_PAGE_BITS - TB_JMP_PAGE_BITS);
+    tcg_gen_andi_i64(hash, hash, TB_JMP_PAGE_MASK);
+    tcg_gen_andi_i64(tmp, tmp, TB_JMP_ADDR_MASK);
+    tcg_gen_or_i64(hash, hash, tmp);
+    tcg_temp_free_i64(tmp);
+#else
+    tcg_gen_shri_i64(hash, pc, TB_JMP_CACHE_BITS);
+    tcg_gen_xor_i64(hash, hash, pc);
+    tcg_gen_andi_i64(hash, hash, TB_JMP_CACHE_SIZE - 1);
+#endif
+}
+
+static void gen_cpu_count(intptr_t ofs)
+{
+    TCGv_i64 count = tcg_temp_ebb_new_i64();
+
+    tcg_gen_ld_i64(count, tcg_env, ofs);
+    tcg_gen_addi_i64(count, count, 1);
+    tcg_gen_st_i64(count, tcg_env, ofs);
+    tcg_temp_free_i64(count);
+}
+
+void translator_lookup_and_goto_ptr(DisasContextBase *db, TCGv_i64 pc)
+{
+    const TranslationBlock *tb = db->tb;
+    uint32_t cflags = tb_cflags(tb);
+    TCGLabel *miss;
+    TCGv_ptr jc, next;
+    TCGv_i64 t64;
+    TCGv_i32 t32;
+
+    /*
+     * Leave to the helper anything beyond the jump cache lookup: TBs
+     * whose cflags are not those of curr_cflags(), icount, and logging.
+     */
+    if ((cflags & (CF_COUNT_MASK | CF_NO_GOTO_PTR | CF_SINGLE_STEP |
+                   CF_USE_ICOUNT | CF_NOIRQ | CF_BP_PAGE)) ||
+        qemu_loglevel_mask(CPU_LOG_TB_CPU | CPU_LOG_EXEC)) {
+        tcg_gen_lookup_and_goto_ptr();
+        return;
+    }
+
+    miss = gen_new_label();
+    jc = tcg_temp_ebb_new_ptr();
+    next = tcg_temp_ebb_new_ptr();
+    t64 = tcg_temp_ebb_new_i64();
+    t32 = tcg_temp_ebb_new_i32();
+
+    /* Breakpoints are checked by the helper. */
+    tcg_gen_ld_ptr(jc, tcg_env, CPU_ENV_OFFSET(breakpoints.tqh_first));
+    tcg_gen_brcondi_ptr(TCG_COND_NE, jc, 0, miss);
+
+    gen_tb_jmp_cache_hash(t64, pc);
+    tcg_gen_shli_i64(t64, t64,
+                     ctz32(sizeof_field(CPUJumpCache, array[0])));
+    tcg_gen_trunc_i64_ptr(next, t64);
+    tcg_gen_ld_ptr(jc, tcg_env, CPU_ENV_OFFSET(tb_jmp_cache));
+    tcg_gen_add_ptr(jc, jc, next);
+
+    /* The same checks as the jump cache fast path of tb_lookup(). */
+    tcg_gen_ld_ptr(next, jc, offsetof(CPUJumpCache, array[0].tb));
+    tcg_gen_brcondi_ptr(TCG_COND_EQ, next, 0, miss);
+    tcg_gen_ld_i64(t64, jc, offsetof(CPUJumpCache, array[0].pc));
+    tcg_gen_brcond_i64(TCG_COND_NE, t64, pc, miss);
+    tcg_gen_ld_i64(t64, next, offsetof(TranslationBlock, cs_base));
+    tcg_gen_brcondi_i64(TCG_COND_NE, t64, tb->cs_base, miss);
+    tcg_gen_ld_i32(t32, next, offsetof(TranslationBlock, flags));
+    tcg_gen_brcondi_i32(TCG_COND_NE, t32, tb->flags, miss);
+    tcg_gen_ld_i32(t32, next, offsetof(TranslationBlock, cflags));
+    tcg_gen_andi_i32(t32, t32, ~CF_SUPERBLOCK);
+    tcg_gen_brcondi_i32(TCG_COND_NE, t32, tb_lookup_cflags(cflags), miss);
+
+    gen_cpu_count(CPU_ENV_OFFSET(tb_lookup_hits));
+    tcg_gen_ld_ptr(next, next, offsetof(TranslationBlock, tc.ptr));
+    tcg_gen_goto_ptr(next);
+
+    tcg_temp_free_ptr(jc);
+    tcg_temp_free_ptr(next);
+    tcg_temp_free_i64(t64);
+    tcg_temp_free_i32(t32);
+
+    gen_set_label(miss);
+    gen_cpu_count(CPU_ENV_OFFSET(tb_lookup_misses));
+    tcg_gen_lookup_and_goto_ptr();
 }
 
 void translator_loop(CPUState *cpu, TranslationBlock *tb, int *max_insns,
@@ -137,6 +310,7 @@ void translator_loop(CPUState *cpu, TranslationBlock *tb, int *max_insns,
     db->num_insns = 0;
     db->max_insns = *max_insns;
     db->insn_start = NULL;
+    db->pc_end = pc;
     db->fake_insn = false;
     db->host_addr[0] = host_pc;
     db->host_addr[1] = NULL;
@@ -148,6 +322,10 @@ void translator_loop(CPUState *cpu, TranslationBlock *tb, int *max_insns,
 
     /* Start translating.  */
     icount_start_insn = gen_tb_start(db, cflags);
+    tcg_ctx->hot_label = NULL;
+    if (tb_wants_hot_count(db, ops, cflags)) {
+        gen_tb_hot_count(db);
+    }
     ops->tb_start(db, cpu);
     tcg_debug_assert(db->is_jmp == DISAS_NEXT);  /* no early exit */
 
@@ -203,7 +381,7 @@ void translator_loop(CPUState *cpu, TranslationBlock *tb, int *max_insns,
 
     /* Emit code to exit the TB, as indicated by db->is_jmp.  */
     ops->tb_stop(db, cpu);
-    gen_tb_end(tb, cflags, icount_start_insn, db->num_insns);
+    gen_tb_end(db, cflags, icount_start_insn);
 
     /*
      * Manage can_do_io for the translation block: set to false before
@@ -221,7 +399,7 @@ void translator_loop(CPUState *cpu, TranslationBlock *tb, int *max_insns,
     tcg_ctx->emit_before_op = NULL;
 
     /* May be used by disas_log or plugin callbacks. */
-    tb->size = db->pc_next - db->pc_first;
+    tb->size = MAX(db->pc_next, db->pc_end) - db->pc_first;
     tb->icount = db->num_insns;
 
     if (plugin_enabled) {
@@ -253,6 +431,10 @@ static bool translator_ld(CPUArchState *env, DisasContextBase *db,
     void *host;
     vaddr base;
 
+    if (tb_cflags(tb) & CF_SUPERBLOCK) {
+        db->pc_end = MAX(db->pc_end, pc + len);
+    }
+
     /* Use slow path if first page is MMIO. */
     if (unlikely(tb_page_addr0(tb) == -1)) {
         /* We capped translation with first page MMIO in tb_gen_code. */
@@ -296,6 +478,11 @@ static bool translator_ld(CPUArchState *env, DisasContextBase *db,
     if (host == NULL) {
         tb_page_addr_t page0, old_page1, new_page1;
 
+        /* Only the vCPU can walk its page tables; let it translate. */
+        if (unlikely(tcg_ctx->gen_async)) {
+            siglongjmp(tcg_ctx->jmp_trans, -4);
+        }
+
         new_page1 = get_page_addr_code_hostp(env, base, &db->host_addr[1]);
 
         /*
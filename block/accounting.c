@@ -27,6 +27,7 @@
 #include "block/accounting.h"
 #include "block/block_int.h"
 #include "qemu/timer.h"
+#include "qemu/units.h"
 #include "system/qtest.h"
 
 static QEMUClockType clock_type = QEMU_CLOCK_REALTIME;
@@ -69,6 +70,7 @@ void block_acct_cleanup(BlockAcctStats *stats)
 {
     BlockAcctTimedStats *s, *next;
     QSLIST_FOREACH_SAFE(s, &stats->intervals, entries, next) {
+        g_free(s->latency_windows);
         g_free(s);
     }
     qemu_mutex_destroy(&stats->lock);
@@ -77,11 +79,20 @@ void block_acct_cleanup(BlockAcctStats *stats)
 void block_acct_add_interval(BlockAcctStats *stats, unsigned interval_length)
 {
     BlockAcctTimedStats *s;
+    int64_t now = qemu_clock_get_ns(clock_type);
     unsigned i;
 
     s = g_new0(BlockAcctTimedStats, 1);
     s->interval_length = interval_length;
     s->stats = stats;
+
+    /* Same window layout as TimedAverage, see util/timed-average.c */
+    s->latency_window_period =
+        (uint64_t) interval_length * NANOSECONDS_PER_SECOND * 4 / 3;
+    s->latency_windows = g_new0(BlockAcctLatencyWindow, 2);
+    s->latency_windows[0].expiration = now + s->latency_window_period / 2;
+    s->latency_windows[1].expiration = now + s->latency_window_period;
+
     qemu_mutex_lock(&stats->lock);
     QSLIST_INSERT_HEAD(&stats->intervals, s, entries);
 
@@ -112,6 +123,65 @@ void block_acct_start(BlockAcctStats *stats, BlockAcctCookie *cookie,
     cookie->type = type;
 }
 
+/* Map a request type to its index in BlockAcctLatencyWindow.hist, or return
+ * -1 if no percentiles are kept for it */
+static int block_acct_pct_index(enum BlockAcctType type)
+{
+    switch (type) {
+    case BLOCK_ACCT_READ:
+        return 0;
+    case BLOCK_ACCT_WRITE:
+        return 1;
+    case BLOCK_ACCT_FLUSH:
+        return 2;
+    default:
+        return -1;
+    }
+}
+
+/* Largest request size in @size_class, or 0 if the class is unbounded */
+uint64_t block_acct_size_class_max(int size_class)
+{
+    static const uint64_t max_bytes[BLOCK_ACCT_SIZE_CLASSES] = {
+        4 * KiB, 64 * KiB, 512 * KiB, 0,
+    };
+
+    assert(size_class >= 0 && size_class < BLOCK_ACCT_SIZE_CLASSES);
+    return max_bytes[size_class];
+}
+
+static int block_acct_size_class(int64_t bytes)
+{
+    int i;
+
+    for (i = 0; i < BLOCK_ACCT_SIZE_CLASSES - 1; i++) {
+        if (bytes <= block_acct_size_class_max(i)) {
+            break;
+        }
+    }
+    return i;
+}
+
+/* Reset the latency windows that have expired and return the oldest one.
+ * Called with stats->lock held. */
+static BlockAcctLatencyWindow *
+block_acct_latency_windows_check(BlockAcctTimedStats *s, int64_t now)
+{
+    BlockAcctLatencyWindow *w = s->latency_windows;
+    int64_t period = s->latency_window_period;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        if (w[i].expiration <= now) {
+            int64_t elapsed = (now - w[i].expiration) % period;
+            memset(w[i].hist, 0, sizeof(w[i].hist));
+            w[i].expiration = now + period - elapsed;
+        }
+    }
+
+    return w[0].expiration < w[1].expiration ? &w[0] : &w[1];
+}
+
 /* block_latency_histogram_compare_func:
  * Compare @key with interval [@it[0], @it[1]).
  * Return: -1 if @key < @it[0]
@@ -206,6 +276,7 @@ static void block_account_one_io(BlockAcctStats *stats, BlockAcctCookie *cookie,
     BlockAcctTimedStats *s;
     int64_t time_ns = qemu_clock_get_ns(clock_type);
     int64_t latency_ns = time_ns - cookie->start_time_ns;
+    int pct_index = block_acct_pct_index(cookie->type);
 
     if (qtest_enabled()) {
         latency_ns = qtest_latency_ns;
@@ -234,6 +305,17 @@ static void block_account_one_io(BlockAcctStats *stats, BlockAcctCookie *cookie,
 
             QSLIST_FOREACH(s, &stats->intervals, entries) {
                 timed_average_account(&s->latency[cookie->type], latency_ns);
+
+                if (pct_index >= 0) {
+                    BlockAcctLatencyWindow *w = s->latency_windows;
+                    int cls = block_acct_size_class(cookie->bytes);
+
+                    block_acct_latency_windows_check(s, time_ns);
+                    hdr_histogram_account(&w[0].hist[pct_index][cls],
+                                          latency_ns);
+                    hdr_histogram_account(&w[1].hist[pct_index][cls],
+                                          latency_ns);
+                }
             }
         }
     }
@@ -296,3 +378,27 @@ double block_acct_queue_depth(BlockAcctTimedStats *stats,
 
     return (double) sum / elapsed;
 }
+
+/* Merge the latencies of the @type requests in @size_class (or in all size
+ * classes if @size_class is -1) that completed in the current window of
+ * @stats into @hist.
+ */
+void block_acct_latency_histogram(BlockAcctTimedStats *stats,
+                                  enum BlockAcctType type, int size_class,
+                                  HdrHistogram *hist)
+{
+    BlockAcctLatencyWindow *w;
+    int pct_index = block_acct_pct_index(type);
+    int i;
+
+    assert(pct_index >= 0);
+    assert(size_class >= -1 && size_class < BLOCK_ACCT_SIZE_CLASSES);
+
+    QEMU_LOCK_GUARD(&stats->stats->lock);
+    w = block_acct_latency_windows_check(stats, qemu_clock_get_ns(clock_type));
+    for (i = 0; i < BLOCK_ACCT_SIZE_CLASSES; i++) {
+        if (size_class == -1 || size_class == i) {
+            hdr_histogram_merge(hist, &w->hist[pct_index][i]);
+        }
+    }
+}
@@ -46,6 +46,8 @@ typedef struct BackupBlockJob {
     BackupPerf perf;
 
     BlockCopyState *bcs;
+    /* Statistics of bcs, kept for query-block-jobs after backup_clean() */
+    BlockJobInfoBackup bcs_info;
 
     bool wait;
     BlockCopyCallState *bg_bcs_call;
@@ -98,9 +100,27 @@ static void backup_abort(Job *job)
     }
 }
 
+static void backup_get_bcs_info(BackupBlockJob *s, BlockJobInfoBackup *info)
+{
+    int workers, chunk_size;
+
+    block_copy_get_tuning(s->bcs, &workers, &chunk_size);
+    *info = (BlockJobInfoBackup) {
+        .offloaded_bytes = block_copy_offloaded_bytes(s->bcs),
+        .workers = MIN(workers, s->perf.max_workers),
+        .chunk_size = s->perf.max_chunk ? MIN(chunk_size, s->perf.max_chunk)
+                                        : chunk_size,
+    };
+}
+
 static void backup_clean(Job *job)
 {
     BackupBlockJob *s = container_of(job, BackupBlockJob, common.job);
+
+    /* bcs belongs to the filter */
+    backup_get_bcs_info(s, &s->bcs_info);
+    s->bcs = NULL;
+
     block_job_remove_all_bdrv(&s->common);
     bdrv_cbw_drop(s->cbw);
 }
@@ -328,6 +348,17 @@ static void backup_set_speed(BlockJob *job, int64_t speed)
     }
 }
 
+static void backup_query(BlockJob *job, BlockJobInfo *info)
+{
+    BackupBlockJob *s = container_of(job, BackupBlockJob, common);
+
+    if (s->bcs) {
+        backup_get_bcs_info(s, &info->u.backup);
+    } else {
+        info->u.backup = s->bcs_info;
+    }
+}
+
 static bool backup_cancel(Job *job, bool force)
 {
     BackupBlockJob *s = container_of(job, BackupBlockJob, common.job);
@@ -350,6 +381,7 @@ static const BlockJobDriver backup_job_driver = {
         .cancel                 = backup_cancel,
     },
     .set_speed = backup_set_speed,
+    .query = backup_query,
 };
 
 BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
@@ -492,7 +524,8 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
     job->len = len;
     job->perf = *perf;
 
-    block_copy_set_copy_opts(bcs, perf->use_copy_range, compress);
+    block_copy_set_copy_opts(bcs, perf->use_copy_range, perf->use_reflink,
+                             compress);
     block_copy_set_progress_meter(bcs, &job->common.job.progress);
     block_copy_set_speed(bcs, speed);
 
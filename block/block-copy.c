@@ -28,11 +28,17 @@
 #include "block/aio_task.h"
 #include "qemu/error-report.h"
 #include "qemu/memalign.h"
+#include "qemu/stats64.h"
 
 #define BLOCK_COPY_MAX_COPY_RANGE (16 * MiB)
 #define BLOCK_COPY_MAX_BUFFER (1 * MiB)
 #define BLOCK_COPY_MAX_MEM (128 * MiB)
 #define BLOCK_COPY_MAX_WORKERS 64
+#define BLOCK_COPY_TUNE_MAX_BUFFER (16 * MiB)
+#define BLOCK_COPY_TUNE_INIT_WORKERS 16
+#define BLOCK_COPY_TUNE_EPOCH_TIME 100000000ULL /* ns */
+#define BLOCK_COPY_TUNE_EPOCH_TASKS 8
+#define BLOCK_COPY_TUNE_RELEARN_EPOCHS 32
 #define BLOCK_COPY_SLICE_TIME 100000000ULL /* ns */
 #define BLOCK_COPY_CLUSTER_SIZE_DEFAULT (1 << 16)
 
@@ -54,6 +60,8 @@ typedef struct BlockCopyCallState {
     int max_workers;
     int64_t max_chunk;
     bool ignore_ratelimit;
+    /* Background copy, tuned by block_copy_tune() */
+    bool tune;
     BlockCopyAsyncCallbackFunc cb;
     void *cb_opaque;
     /* Coroutine where async block-copy is running */
@@ -98,6 +106,9 @@ typedef struct BlockCopyTask {
      */
     BlockCopyMethod method;
 
+    /* Set when the task starts copying, used for tuning */
+    int64_t start_ns;
+
     /*
      * Generally, req is protected by lock in BlockCopyState, Still req.offset
      * is only set on task creation, so may be read concurrently after creation.
@@ -129,6 +140,7 @@ typedef struct BlockCopyState {
     int64_t max_transfer;
     uint64_t len;
     BdrvRequestFlags write_flags;
+    BdrvRequestFlags copy_range_flags;
 
     /*
      * Fields whose state changes throughout the execution
@@ -158,17 +170,38 @@ typedef struct BlockCopyState {
     /* State fields that use a thread-safe API */
     BdrvDirtyBitmap *copy_bitmap;
     ProgressMeter *progress;
+    Stat64 offloaded_bytes;
     SharedResource *mem;
     RateLimit rate_limit;
+    bool rate_limited; /* atomic */
+
+    /*
+     * Feedback controller for the chunk size of buffered copies and for the
+     * number of parallel tasks of background copies, see block_copy_tune().
+     * Protected by lock, @tune.chunk and @tune.workers may also be read
+     * atomically.
+     */
+    BlockCopyTuneState tune;
+
+    /* Measurements of the current tuning epoch, protected by lock */
+    struct {
+        int64_t start_ns;
+        uint64_t bytes;
+        uint64_t latency_ns;
+        int tasks;
+    } epoch;
 } BlockCopyState;
 
 /* Called with lock held */
-static int64_t block_copy_chunk_size(BlockCopyState *s)
+static int64_t block_copy_chunk_size(BlockCopyState *s, bool tune)
 {
     switch (s->method) {
     case COPY_READ_WRITE_CLUSTER:
         return s->cluster_size;
     case COPY_READ_WRITE:
+        return MIN(MAX(s->cluster_size,
+                       tune ? s->tune.chunk : BLOCK_COPY_MAX_BUFFER),
+                   s->max_transfer);
     case COPY_RANGE_SMALL:
         return MIN(MAX(s->cluster_size, BLOCK_COPY_MAX_BUFFER),
                    s->max_transfer);
@@ -193,7 +226,8 @@ block_copy_task_create(BlockCopyState *s, BlockCopyCallState *call_state,
     int64_t max_chunk;
 
     QEMU_LOCK_GUARD(&s->lock);
-    max_chunk = MIN_NON_ZERO(block_copy_chunk_size(s), call_state->max_chunk);
+    max_chunk = MIN_NON_ZERO(block_copy_chunk_size(s, call_state->tune),
+                             call_state->max_chunk);
     if (!bdrv_dirty_bitmap_next_dirty_area(s->copy_bitmap,
                                            offset, offset + bytes,
                                            max_chunk, &offset, &bytes))
@@ -283,7 +317,7 @@ static uint32_t block_copy_max_transfer(BdrvChild *source, BdrvChild *target)
 }
 
 void block_copy_set_copy_opts(BlockCopyState *s, bool use_copy_range,
-                              bool compress)
+                              bool use_reflink, bool compress)
 {
     /* Keep BDRV_REQ_SERIALISING set (or not set) in block_copy_state_new() */
     s->write_flags = (s->write_flags & BDRV_REQ_SERIALISING) |
@@ -300,12 +334,18 @@ void block_copy_set_copy_opts(BlockCopyState *s, bool use_copy_range,
     } else if (compress) {
         /* Compression supports only cluster-size writes and no copy-range. */
         s->method = COPY_READ_WRITE_CLUSTER;
-    } else {
+    } else if (use_copy_range || use_reflink) {
         /*
-         * If copy range enabled, start with COPY_RANGE_SMALL, until first
-         * successful copy_range (look at block_copy_do_copy).
+         * Start with COPY_RANGE_SMALL, until first successful copy_range (look
+         * at block_copy_do_copy).  If copy range is not enabled, only accept
+         * copies that share the data with the source (reflink): they turn the
+         * copy into a metadata operation, while other kinds of offloading may
+         * well be slower than read+write.
          */
-        s->method = use_copy_range ? COPY_RANGE_SMALL : COPY_READ_WRITE;
+        s->method = COPY_RANGE_SMALL;
+        s->copy_range_flags = use_copy_range ? 0 : BDRV_REQ_NO_FALLBACK;
+    } else {
+        s->method = COPY_READ_WRITE;
     }
 }
 
@@ -437,7 +477,9 @@ BlockCopyState *block_copy_state_new(BdrvChild *source, BdrvChild *target,
     };
 
     s->discard_source = discard_source;
-    block_copy_set_copy_opts(s, false, false);
+    block_copy_set_copy_opts(s, false, true, false);
+
+    block_copy_tune_init(&s->tune);
 
     ratelimit_init(&s->rate_limit);
     qemu_co_mutex_init(&s->lock);
@@ -527,7 +569,7 @@ block_copy_do_copy(BlockCopyState *s, int64_t offset, int64_t bytes,
     case COPY_RANGE_SMALL:
     case COPY_RANGE_FULL:
         ret = bdrv_co_copy_range(s->source, offset, s->target, offset, nbytes,
-                                 0, s->write_flags);
+                                 0, s->write_flags | s->copy_range_flags);
         if (ret >= 0) {
             /* Successful copy-range, increase chunk size.  */
             *method = COPY_RANGE_FULL;
@@ -578,6 +620,125 @@ block_copy_do_copy(BlockCopyState *s, int64_t offset, int64_t bytes,
     return ret;
 }
 
+void block_copy_tune_init(BlockCopyTuneState *t)
+{
+    *t = (BlockCopyTuneState) {
+        .chunk = BLOCK_COPY_MAX_BUFFER,
+        .workers = BLOCK_COPY_TUNE_INIT_WORKERS,
+        .chunk_step = 1,
+        .tune_chunk = true,
+    };
+}
+
+/*
+ * Adjust the chunk size used for buffered copies or the number of parallel
+ * tasks at the end of an epoch, in which the copy reached @throughput bytes
+ * per second with an average latency of @ns_per_mib per MiB.
+ *
+ * The two knobs are changed in alternate epochs so that the effect of each
+ * change can be told apart:
+ *
+ * - The chunk size follows the throughput: it keeps moving in the same
+ *   direction (doubling or halving) as long as the throughput does not drop,
+ *   and turns around when it does. It is only tuned for @buffered copies, and
+ *   stays between @min_chunk and @max_chunk.
+ *
+ * - The number of workers is increased by one per epoch, like TCP Vegas
+ *   increases its window, until the latency per byte grows to more than twice
+ *   the lowest one seen. At that point requests are queueing up below us,
+ *   which also delays the guest's requests, so the number is halved.
+ */
+void block_copy_tune_step(BlockCopyTuneState *t, uint64_t throughput,
+                          uint64_t ns_per_mib, bool buffered,
+                          int64_t min_chunk, int64_t max_chunk)
+{
+    if (++t->epochs % BLOCK_COPY_TUNE_RELEARN_EPOCHS == 0 ||
+        !t->base_ns_per_mib || ns_per_mib < t->base_ns_per_mib)
+    {
+        t->base_ns_per_mib = ns_per_mib;
+    }
+
+    if (t->tune_chunk && buffered) {
+        int64_t chunk;
+
+        if (throughput * 20 < t->prev_throughput * 19) {
+            t->chunk_step = -t->chunk_step;
+        }
+
+        chunk = t->chunk_step > 0 ? t->chunk * 2 : t->chunk / 2;
+        chunk = MAX(chunk, min_chunk);
+        chunk = MIN(chunk, max_chunk);
+        if (chunk == t->chunk) {
+            /* Hit a limit, try the other direction next time */
+            t->chunk_step = -t->chunk_step;
+        } else {
+            /* Per-byte latency depends on the request size */
+            qatomic_set(&t->chunk, chunk);
+            t->base_ns_per_mib = 0;
+        }
+    } else if (ns_per_mib > 2 * t->base_ns_per_mib) {
+        qatomic_set(&t->workers, MAX(t->workers / 2, 1));
+    } else if (t->workers < BLOCK_COPY_MAX_WORKERS &&
+               throughput * 20 >= t->prev_throughput * 19)
+    {
+        qatomic_set(&t->workers, t->workers + 1);
+    }
+
+    t->prev_throughput = throughput;
+    t->tune_chunk = !t->tune_chunk;
+}
+
+/*
+ * Account a finished task of block_copy_async() and, at the end of each
+ * epoch, let block_copy_tune_step() adjust the settings.
+ *
+ * Called with lock held.
+ */
+static void block_copy_tune(BlockCopyState *s, int64_t bytes,
+                            int64_t latency_ns)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    uint64_t throughput, ns_per_mib;
+    int64_t elapsed;
+
+    if (qatomic_read(&s->rate_limited)) {
+        /* Throughput says nothing when the rate limit is the bottleneck */
+        s->epoch.start_ns = 0;
+        return;
+    }
+
+    if (!s->epoch.start_ns) {
+        s->epoch.start_ns = now - latency_ns;
+        s->epoch.bytes = 0;
+        s->epoch.latency_ns = 0;
+        s->epoch.tasks = 0;
+    }
+
+    s->epoch.bytes += bytes;
+    s->epoch.latency_ns += latency_ns;
+    s->epoch.tasks++;
+
+    elapsed = now - s->epoch.start_ns;
+    if (s->epoch.tasks < BLOCK_COPY_TUNE_EPOCH_TASKS ||
+        elapsed < BLOCK_COPY_TUNE_EPOCH_TIME)
+    {
+        return;
+    }
+
+    throughput = s->epoch.bytes * 1000 / (elapsed / SCALE_MS);
+    ns_per_mib = (s->epoch.latency_ns << 10) /
+                 DIV_ROUND_UP(s->epoch.bytes, KiB);
+
+    block_copy_tune_step(&s->tune, throughput, ns_per_mib,
+                         s->method == COPY_READ_WRITE, s->cluster_size,
+                         MIN(BLOCK_COPY_TUNE_MAX_BUFFER, s->max_transfer));
+
+    trace_block_copy_tune(s, s->tune.chunk, s->tune.workers, throughput,
+                          ns_per_mib);
+
+    s->epoch.start_ns = 0;
+}
+
 static coroutine_fn int block_copy_task_entry(AioTask *task)
 {
     BlockCopyTask *t = container_of(task, BlockCopyTask, task);
@@ -586,6 +747,8 @@ static coroutine_fn int block_copy_task_entry(AioTask *task)
     BlockCopyMethod method = t->method;
     int ret = -1;
 
+    t->start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
     WITH_GRAPH_RDLOCK_GUARD() {
         ret = block_copy_do_copy(s, t->req.offset, t->req.bytes, &method,
                                  &error_is_read);
@@ -601,8 +764,23 @@ static coroutine_fn int block_copy_task_entry(AioTask *task)
                 t->call_state->ret = ret;
                 t->call_state->error_is_read = error_is_read;
             }
-        } else if (s->progress) {
-            progress_work_done(s->progress, t->req.bytes);
+        } else {
+            if (method == COPY_RANGE_FULL) {
+                stat64_add(&s->offloaded_bytes, t->req.bytes);
+            }
+            /*
+             * Only background copies are tuned: copy-before-write requests
+             * are driven by guest writes, their throughput says nothing
+             * about the best settings.
+             */
+            if (t->call_state->tune && t->method != COPY_WRITE_ZEROES) {
+                block_copy_tune(s, t->req.bytes,
+                                qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                                t->start_ns);
+            }
+            if (s->progress) {
+                progress_work_done(s->progress, t->req.bytes);
+            }
         }
     }
     co_put_to_shres(s->mem, t->req.bytes);
@@ -824,6 +1002,10 @@ block_copy_dirty_clusters(BlockCopyCallState *call_state)
         if (!aio && bytes) {
             aio = aio_task_pool_new(call_state->max_workers);
         }
+        if (aio && call_state->tune) {
+            aio_task_pool_set_max_busy_tasks(aio,
+                MIN(qatomic_read(&s->tune.workers), call_state->max_workers));
+        }
 
         ret = block_copy_task_run(aio, task);
         if (ret < 0) {
@@ -983,6 +1165,7 @@ BlockCopyCallState *block_copy_async(BlockCopyState *s,
         .bytes = bytes,
         .max_workers = max_workers,
         .max_chunk = max_chunk,
+        .tune = true,
         .cb = cb,
         .cb_opaque = cb_opaque,
 
@@ -1057,6 +1240,19 @@ int64_t block_copy_cluster_size(BlockCopyState *s)
     return s->cluster_size;
 }
 
+/* Number of bytes that were copied with copy offloading */
+int64_t block_copy_offloaded_bytes(BlockCopyState *s)
+{
+    return stat64_get(&s->offloaded_bytes);
+}
+
+/* Current settings of block_copy_async() copies, see block_copy_tune() */
+void block_copy_get_tuning(BlockCopyState *s, int *workers, int *chunk_size)
+{
+    *workers = qatomic_read(&s->tune.workers);
+    *chunk_size = qatomic_read(&s->tune.chunk);
+}
+
 void block_copy_set_skip_unallocated(BlockCopyState *s, bool skip)
 {
     qatomic_set(&s->skip_unallocated, skip);
@@ -1065,6 +1261,7 @@ void block_copy_set_skip_unallocated(BlockCopyState *s, bool skip)
 void block_copy_set_speed(BlockCopyState *s, uint64_t speed)
 {
     ratelimit_set_speed(&s->rate_limit, speed, BLOCK_COPY_SLICE_TIME);
+    qatomic_set(&s->rate_limited, speed != 0);
 
     /*
      * Note: it's good to kick all call states from here, but it should be done
@@ -62,8 +62,8 @@ int coroutine_fn GRAPH_RDLOCK
 bdrv_co_writev_vmstate(BlockDriverState *bs, QEMUIOVector *qiov, int64_t pos);
 
 int coroutine_fn GRAPH_RDLOCK
-nbd_co_do_establish_connection(BlockDriverState *bs, bool blocking,
-                               Error **errp);
+nbd_co_do_establish_connection(BlockDriverState *bs, unsigned idx,
+                               bool blocking, Error **errp);
 
 
 /*
@@ -87,6 +87,7 @@ bdrv_common_block_status_above(BlockDriverState *bs,
                                int *depth);
 
 int co_wrapper_mixed_bdrv_rdlock
-nbd_do_establish_connection(BlockDriverState *bs, bool blocking, Error **errp);
+nbd_do_establish_connection(BlockDriverState *bs, unsigned idx, bool blocking,
+                            Error **errp);
 
 #endif /* BLOCK_COROUTINES_H */
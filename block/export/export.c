@@ -81,6 +81,8 @@ BlockExport *blk_exp_add(BlockExportOptions *export, Error **errp)
     BlockDriverState *bs;
     BlockBackend *blk = NULL;
     AioContext *ctx;
+    g_autofree AioContext **multithread_ctxs = NULL;
+    size_t multithread_count = 0;
     uint64_t perm;
     int ret;
 
@@ -121,14 +123,45 @@ BlockExport *blk_exp_add(BlockExportOptions *export, Error **errp)
         AioContext *new_ctx;
         Error **set_context_errp;
 
-        iothread = iothread_by_id(export->iothread);
-        if (!iothread) {
-            error_setg(errp, "iothread \"%s\" not found", export->iothread);
-            goto fail;
+        if (export->iothread->type == QTYPE_QLIST) {
+            strList *iothread_list = export->iothread->u.multi;
+            size_t i;
+
+            if (!drv->supports_multithread) {
+                error_setg(errp, "The export type does not support "
+                           "multi-threading");
+                goto fail;
+            }
+
+            multithread_count = QAPI_LIST_LENGTH(iothread_list);
+            if (multithread_count == 0) {
+                error_setg(errp, "The iothread list must not be empty");
+                goto fail;
+            }
+
+            multithread_ctxs = g_new(AioContext *, multithread_count);
+            for (i = 0; iothread_list; iothread_list = iothread_list->next) {
+                iothread = iothread_by_id(iothread_list->value);
+                if (!iothread) {
+                    error_setg(errp, "iothread \"%s\" not found",
+                               iothread_list->value);
+                    goto fail;
+                }
+                multithread_ctxs[i++] = iothread_get_aio_context(iothread);
+            }
+            new_ctx = multithread_ctxs[0];
+        } else {
+            assert(export->iothread->type == QTYPE_QSTRING);
+            iothread = iothread_by_id(export->iothread->u.single);
+            if (!iothread) {
+                error_setg(errp, "iothread \"%s\" not found",
+                           export->iothread->u.single);
+                goto fail;
+            }
+
+            new_ctx = iothread_get_aio_context(iothread);
         }
 
-        new_ctx = iothread_get_aio_context(iothread);
-
         /* Ignore errors with fixed-iothread=false */
         set_context_errp = fixed_iothread ? errp : NULL;
         ret = bdrv_try_change_aio_context(bs, new_ctx, NULL, set_context_errp);
@@ -139,6 +172,11 @@ BlockExport *blk_exp_add(BlockExportOptions *export, Error **errp)
         }
     }
 
+    if (multithread_ctxs && multithread_ctxs[0] != ctx) {
+        /* With fixed-iothread=false, the node may have stayed where it was */
+        multithread_ctxs[0] = ctx;
+    }
+
     bdrv_graph_rdlock_main_loop();
     if (allow_inactive) {
         if (!drv->supports_inactive) {
@@ -195,7 +233,7 @@ BlockExport *blk_exp_add(BlockExportOptions *export, Error **errp)
         .blk        = blk,
     };
 
-    ret = drv->create(exp, export, errp);
+    ret = drv->create(exp, export, multithread_ctxs, multithread_count, errp);
     if (ret < 0) {
         goto fail;
     }
@@ -365,6 +403,10 @@ BlockExportInfoList *qmp_query_block_exports(Error **errp)
             .shutting_down  = !exp->user_owned,
         };
 
+        if (exp->drv->query_info) {
+            exp->drv->query_info(exp, info);
+        }
+
         QAPI_LIST_APPEND(tail, info);
     }
 
@@ -16,6 +16,7 @@
 #include "qapi/error.h"
 #include "block/export.h"
 #include "qemu/error-report.h"
+#include "qemu/lockable.h"
 #include "util/block-helpers.h"
 #include "subprojects/libvduse/libvduse.h"
 #include "virtio-blk-handler.h"
@@ -25,19 +26,42 @@
 #define VDUSE_DEFAULT_NUM_QUEUE 1
 #define VDUSE_DEFAULT_QUEUE_SIZE 256
 
-typedef struct VduseBlkExport {
+typedef struct VduseBlkExport VduseBlkExport;
+
+typedef struct VduseBlkQueue {
+    VduseBlkExport *vblk_exp;
+    VduseVirtq *vq;
+
+    /* The AioContext to process the virtqueue in, NULL for export.ctx */
+    AioContext *ctx;
+
+    /* The AioContext that the kick fd handler is installed in */
+    AioContext *handler_ctx;
+
+    bool enabled; /* protected by VduseBlkExport->lock */
+    VirtioBlkQueueStats stats;
+} VduseBlkQueue;
+
+struct VduseBlkExport {
     BlockExport export;
     VirtioBlkHandler handler;
     VduseDev *dev;
     uint16_t num_queues;
+    VduseBlkQueue *queues; /* num_queues elements */
     char *recon_file;
     unsigned int inflight; /* atomic */
     bool vqs_started;
-} VduseBlkExport;
+
+    /*
+     * Serializes calls into libvduse when virtqueues are processed in
+     * several AioContexts
+     */
+    QemuRecMutex lock;
+};
 
 typedef struct VduseBlkReq {
     VduseVirtqElement elem;
-    VduseVirtq *vq;
+    VduseBlkQueue *queue;
 } VduseBlkReq;
 
 static void vduse_blk_inflight_inc(VduseBlkExport *vblk_exp)
@@ -61,8 +85,12 @@ static void vduse_blk_inflight_dec(VduseBlkExport *vblk_exp)
 
 static void vduse_blk_req_complete(VduseBlkReq *req, size_t in_len)
 {
-    vduse_queue_push(req->vq, &req->elem, in_len);
-    vduse_queue_notify(req->vq);
+    VduseBlkQueue *queue = req->queue;
+
+    WITH_QEMU_LOCK_GUARD(&queue->vblk_exp->lock) {
+        vduse_queue_push(queue->vq, &req->elem, in_len);
+        vduse_queue_notify(queue->vq);
+    }
 
     free(req);
 }
@@ -70,9 +98,7 @@ static void vduse_blk_req_complete(VduseBlkReq *req, size_t in_len)
 static void coroutine_fn vduse_blk_virtio_process_req(void *opaque)
 {
     VduseBlkReq *req = opaque;
-    VduseVirtq *vq = req->vq;
-    VduseDev *dev = vduse_queue_get_dev(vq);
-    VduseBlkExport *vblk_exp = vduse_dev_get_priv(dev);
+    VduseBlkExport *vblk_exp = req->queue->vblk_exp;
     VirtioBlkHandler *handler = &vblk_exp->handler;
     VduseVirtqElement *elem = &req->elem;
     struct iovec *in_iov = elem->in_sg;
@@ -81,7 +107,7 @@ static void coroutine_fn vduse_blk_virtio_process_req(void *opaque)
     unsigned out_num = elem->out_num;
     int in_len;
 
-    in_len = virtio_blk_process_req(handler, in_iov,
+    in_len = virtio_blk_process_req(handler, &req->queue->stats, in_iov,
                                     out_iov, in_num, out_num);
     if (in_len < 0) {
         free(req);
@@ -92,18 +118,28 @@ static void coroutine_fn vduse_blk_virtio_process_req(void *opaque)
     vduse_blk_inflight_dec(vblk_exp);
 }
 
-static void vduse_blk_vq_handler(VduseDev *dev, VduseVirtq *vq)
+static void vduse_blk_vq_handler(VduseBlkQueue *queue)
 {
-    VduseBlkExport *vblk_exp = vduse_dev_get_priv(dev);
+    VduseBlkExport *vblk_exp = queue->vblk_exp;
 
     while (1) {
-        VduseBlkReq *req;
-
-        req = vduse_queue_pop(vq, sizeof(VduseBlkReq));
+        VduseBlkReq *req = NULL;
+
+        /*
+         * If the virtqueue is processed in an iothread, it may have been
+         * disabled by another thread while the kick was being dispatched.
+         * Don't hold the lock while the request is processed so that other
+         * virtqueues can make progress in parallel.
+         */
+        WITH_QEMU_LOCK_GUARD(&vblk_exp->lock) {
+            if (queue->enabled) {
+                req = vduse_queue_pop(queue->vq, sizeof(VduseBlkReq));
+            }
+        }
         if (!req) {
             break;
         }
-        req->vq = vq;
+        req->queue = queue;
 
         Coroutine *co =
             qemu_coroutine_create(vduse_blk_virtio_process_req, req);
@@ -115,9 +151,8 @@ static void vduse_blk_vq_handler(VduseDev *dev, VduseVirtq *vq)
 
 static void on_vduse_vq_kick(void *opaque)
 {
-    VduseVirtq *vq = opaque;
-    VduseDev *dev = vduse_queue_get_dev(vq);
-    int fd = vduse_queue_get_fd(vq);
+    VduseBlkQueue *queue = opaque;
+    int fd = vduse_queue_get_fd(queue->vq);
     eventfd_t kick_data;
 
     if (eventfd_read(fd, &kick_data) == -1) {
@@ -125,19 +160,36 @@ static void on_vduse_vq_kick(void *opaque)
         return;
     }
 
-    vduse_blk_vq_handler(dev, vq);
+    vduse_blk_vq_handler(queue);
+}
+
+static VduseBlkQueue *vduse_blk_get_queue(VduseBlkExport *vblk_exp,
+                                          VduseVirtq *vq)
+{
+    for (uint16_t i = 0; i < vblk_exp->num_queues; i++) {
+        if (vblk_exp->queues[i].vq == vq) {
+            return &vblk_exp->queues[i];
+        }
+    }
+    g_assert_not_reached();
 }
 
 static void vduse_blk_enable_queue(VduseDev *dev, VduseVirtq *vq)
 {
     VduseBlkExport *vblk_exp = vduse_dev_get_priv(dev);
+    VduseBlkQueue *queue = vduse_blk_get_queue(vblk_exp, vq);
 
     if (!vblk_exp->vqs_started) {
         return; /* vduse_blk_drained_end() will start vqs later */
     }
 
-    aio_set_fd_handler(vblk_exp->export.ctx, vduse_queue_get_fd(vq),
-                       on_vduse_vq_kick, NULL, NULL, NULL, vq);
+    WITH_QEMU_LOCK_GUARD(&vblk_exp->lock) {
+        queue->handler_ctx = queue->ctx ?: vblk_exp->export.ctx;
+        queue->enabled = true;
+        aio_set_fd_handler(queue->handler_ctx, vduse_queue_get_fd(vq),
+                           on_vduse_vq_kick, NULL, NULL, NULL, queue);
+    }
+
     /* Make sure we don't miss any kick after reconnecting */
     eventfd_write(vduse_queue_get_fd(vq), 1);
 }
@@ -145,14 +197,19 @@ static void vduse_blk_enable_queue(VduseDev *dev, VduseVirtq *vq)
 static void vduse_blk_disable_queue(VduseDev *dev, VduseVirtq *vq)
 {
     VduseBlkExport *vblk_exp = vduse_dev_get_priv(dev);
+    VduseBlkQueue *queue = vduse_blk_get_queue(vblk_exp, vq);
     int fd = vduse_queue_get_fd(vq);
 
     if (fd < 0) {
         return;
     }
 
-    aio_set_fd_handler(vblk_exp->export.ctx, fd,
-                       NULL, NULL, NULL, NULL, NULL);
+    QEMU_LOCK_GUARD(&vblk_exp->lock);
+    if (queue->enabled) {
+        aio_set_fd_handler(queue->handler_ctx, fd,
+                           NULL, NULL, NULL, NULL, NULL);
+        queue->enabled = false;
+    }
 }
 
 static const VduseOps vduse_blk_ops = {
@@ -163,7 +220,9 @@ static const VduseOps vduse_blk_ops = {
 static void on_vduse_dev_kick(void *opaque)
 {
     VduseDev *dev = opaque;
+    VduseBlkExport *vblk_exp = vduse_dev_get_priv(dev);
 
+    QEMU_LOCK_GUARD(&vblk_exp->lock);
     vduse_dev_handler(dev);
 }
 
@@ -209,6 +268,8 @@ static void vduse_blk_resize(void *opaque)
 
     config.capacity =
             cpu_to_le64(blk_getlength(exp->blk) >> VIRTIO_BLK_SECTOR_BITS);
+
+    QEMU_LOCK_GUARD(&vblk_exp->lock);
     vduse_dev_update_config(vblk_exp->dev, sizeof(config.capacity),
                             offsetof(struct virtio_blk_config, capacity),
                             (char *)&config.capacity);
@@ -266,7 +327,8 @@ static const BlockDevOps vduse_block_ops = {
 };
 
 static int vduse_blk_exp_create(BlockExport *exp, BlockExportOptions *opts,
-                                Error **errp)
+                                AioContext *const *multithread,
+                                size_t mt_count, Error **errp)
 {
     VduseBlkExport *vblk_exp = container_of(exp, VduseBlkExport, export);
     BlockExportOptionsVduseBlk *vblk_opts = &opts->u.vduse_blk;
@@ -302,6 +364,8 @@ static int vduse_blk_exp_create(BlockExport *exp, BlockExportOptions *opts,
         }
     }
     vblk_exp->num_queues = num_queues;
+    vblk_exp->queues = g_new0(VduseBlkQueue, num_queues);
+    qemu_rec_mutex_init(&vblk_exp->lock);
     vblk_exp->handler.blk = exp->blk;
     vblk_exp->handler.serial = g_strdup(vblk_opts->serial ?: "");
     vblk_exp->handler.logical_block_size = logical_block_size;
@@ -358,6 +422,20 @@ static int vduse_blk_exp_create(BlockExport *exp, BlockExportOptions *opts,
     }
 
     for (i = 0; i < num_queues; i++) {
+        VduseBlkQueue *queue = &vblk_exp->queues[i];
+
+        queue->vblk_exp = vblk_exp;
+        queue->vq = vduse_dev_get_queue(vblk_exp->dev, i);
+
+        /*
+         * Spread the virtqueues over the iothreads. The first iothread is the
+         * export's AioContext; leave its queues' ctx NULL so that they follow
+         * the block node if it is moved.
+         */
+        if (multithread && i % mt_count) {
+            queue->ctx = multithread[i % mt_count];
+        }
+
         vduse_dev_setup_queue(vblk_exp->dev, i, queue_size);
     }
 
@@ -381,6 +459,8 @@ err:
     g_free(vblk_exp->recon_file);
 err_dev:
     g_free(vblk_exp->handler.serial);
+    g_free(vblk_exp->queues);
+    qemu_rec_mutex_destroy(&vblk_exp->lock);
     return ret;
 }
 
@@ -400,6 +480,8 @@ static void vduse_blk_exp_delete(BlockExport *exp)
     }
     g_free(vblk_exp->recon_file);
     g_free(vblk_exp->handler.serial);
+    g_free(vblk_exp->queues);
+    qemu_rec_mutex_destroy(&vblk_exp->lock);
 }
 
 /* Called with exp->ctx acquired */
@@ -410,10 +492,23 @@ static void vduse_blk_exp_request_shutdown(BlockExport *exp)
     vduse_blk_stop_virtqueues(vblk_exp);
 }
 
+static void vduse_blk_exp_query_info(BlockExport *exp, BlockExportInfo *info)
+{
+    VduseBlkExport *vblk_exp = container_of(exp, VduseBlkExport, export);
+    BlockExportQueueInfoList **tail = &info->queues;
+
+    for (uint16_t i = 0; i < vblk_exp->num_queues; i++) {
+        QAPI_LIST_APPEND(tail, virtio_blk_queue_stats_info(
+                                   &vblk_exp->queues[i].stats, i));
+    }
+}
+
 const BlockExportDriver blk_exp_vduse_blk = {
     .type               = BLOCK_EXPORT_TYPE_VDUSE_BLK,
     .instance_size      = sizeof(VduseBlkExport),
+    .supports_multithread = true,
     .create             = vduse_blk_exp_create,
     .delete             = vduse_blk_exp_delete,
     .request_shutdown   = vduse_blk_exp_request_shutdown,
+    .query_info         = vduse_blk_exp_query_info,
 };
@@ -11,6 +11,7 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/error-report.h"
+#include "qemu/lockable.h"
 #include "block/block.h"
 #include "subprojects/libvhost-user/libvhost-user.h" /* only for the type definitions */
 #include "standard-headers/linux/virtio_blk.h"
@@ -29,6 +30,7 @@ typedef struct VuBlkReq {
     VuVirtqElement elem;
     VuServer *server;
     struct VuVirtq *vq;
+    VirtioBlkQueueStats *stats;
 } VuBlkReq;
 
 /* vhost user block device */
@@ -38,14 +40,19 @@ typedef struct {
     VirtioBlkHandler handler;
     QIOChannelSocket *sioc;
     struct virtio_blk_config blkcfg;
+    uint16_t num_queues;
+    VirtioBlkQueueStats *queue_stats; /* num_queues elements */
 } VuBlkExport;
 
 static void vu_blk_req_complete(VuBlkReq *req, size_t in_len)
 {
-    VuDev *vu_dev = &req->server->vu_dev;
+    VuServer *server = req->server;
+    VuDev *vu_dev = &server->vu_dev;
 
-    vu_queue_push(vu_dev, req->vq, &req->elem, in_len);
-    vu_queue_notify(vu_dev, req->vq);
+    WITH_QEMU_LOCK_GUARD(&server->vq_lock) {
+        vu_queue_push(vu_dev, req->vq, &req->elem, in_len);
+        vu_queue_notify(vu_dev, req->vq);
+    }
 
     free(req);
 }
@@ -67,7 +74,7 @@ static void coroutine_fn vu_blk_virtio_process_req(void *opaque)
     unsigned out_num = elem->out_num;
     int in_len;
 
-    in_len = virtio_blk_process_req(handler, in_iov, out_iov,
+    in_len = virtio_blk_process_req(handler, req->stats, in_iov, out_iov,
                                     in_num, out_num);
     if (in_len < 0) {
         free(req);
@@ -82,9 +89,18 @@ static void coroutine_fn vu_blk_virtio_process_req(void *opaque)
 static void vu_blk_process_vq(VuDev *vu_dev, int idx)
 {
     VuServer *server = container_of(vu_dev, VuServer, vu_dev);
+    VuBlkExport *vexp = container_of(server, VuBlkExport, vu_server);
     VuVirtq *vq = vu_get_queue(vu_dev, idx);
 
-    while (1) {
+    /* Keeps vu_client_trip() from calling vu_deinit() while we run */
+    vhost_user_server_inc_in_flight(server);
+
+    /*
+     * kick_handler() holds vq_lock. It is dropped while a request is
+     * submitted so that virtqueues in other iothreads make progress, so the
+     * virtqueue may have been stopped when we get the lock back.
+     */
+    while (vu_queue_started(vu_dev, vq)) {
         VuBlkReq *req;
 
         req = vu_queue_pop(vu_dev, vq, sizeof(VuBlkReq));
@@ -94,13 +110,19 @@ static void vu_blk_process_vq(VuDev *vu_dev, int idx)
 
         req->server = server;
         req->vq = vq;
+        req->stats = &vexp->queue_stats[idx];
 
         Coroutine *co =
             qemu_coroutine_create(vu_blk_virtio_process_req, req);
 
         vhost_user_server_inc_in_flight(server);
+
+        qemu_rec_mutex_unlock(&server->vq_lock);
         qemu_coroutine_enter(co);
+        qemu_rec_mutex_lock(&server->vq_lock);
     }
+
+    vhost_user_server_dec_in_flight(server);
 }
 
 static void vu_blk_queue_set_started(VuDev *vu_dev, int idx, bool started)
@@ -315,10 +337,12 @@ static const BlockDevOps vu_blk_dev_ops = {
 };
 
 static int vu_blk_exp_create(BlockExport *exp, BlockExportOptions *opts,
-                             Error **errp)
+                             AioContext *const *multithread,
+                             size_t mt_count, Error **errp)
 {
     VuBlkExport *vexp = container_of(exp, VuBlkExport, export);
     BlockExportOptionsVhostUserBlk *vu_opts = &opts->u.vhost_user_blk;
+    g_autofree AioContext **queue_ctxs = NULL;
     uint64_t logical_block_size;
     uint16_t num_queues = VHOST_USER_BLK_NUM_QUEUES_DEFAULT;
 
@@ -344,6 +368,22 @@ static int vu_blk_exp_create(BlockExport *exp, BlockExportOptions *opts,
     vexp->handler.serial = g_strdup("vhost_user_blk");
     vexp->handler.logical_block_size = logical_block_size;
     vexp->handler.writable = opts->writable;
+    vexp->num_queues = num_queues;
+    vexp->queue_stats = g_new0(VirtioBlkQueueStats, num_queues);
+
+    if (multithread) {
+        /*
+         * Spread the virtqueues over the iothreads. The first iothread is the
+         * export's AioContext; leave its entries NULL so that they follow the
+         * block node if it is moved.
+         */
+        queue_ctxs = g_new0(AioContext *, num_queues);
+        for (uint16_t i = 0; i < num_queues; i++) {
+            if (i % mt_count) {
+                queue_ctxs[i] = multithread[i % mt_count];
+            }
+        }
+    }
 
     vu_blk_initialize_config(blk_bs(exp->blk), &vexp->blkcfg,
                              logical_block_size, num_queues);
@@ -354,9 +394,11 @@ static int vu_blk_exp_create(BlockExport *exp, BlockExportOptions *opts,
     blk_set_dev_ops(exp->blk, &vu_blk_dev_ops, vexp);
 
     if (!vhost_user_server_start(&vexp->vu_server, vu_opts->addr, exp->ctx,
-                                 num_queues, &vu_blk_iface, errp)) {
+                                 queue_ctxs, num_queues, &vu_blk_iface,
+                                 errp)) {
         blk_remove_aio_context_notifier(exp->blk, blk_aio_attached,
                                         blk_aio_detach, vexp);
+        g_free(vexp->queue_stats);
         g_free(vexp->handler.serial);
         return -EADDRNOTAVAIL;
     }
@@ -370,13 +412,27 @@ static void vu_blk_exp_delete(BlockExport *exp)
 
     blk_remove_aio_context_notifier(exp->blk, blk_aio_attached, blk_aio_detach,
                                     vexp);
+    g_free(vexp->queue_stats);
     g_free(vexp->handler.serial);
 }
 
+static void vu_blk_exp_query_info(BlockExport *exp, BlockExportInfo *info)
+{
+    VuBlkExport *vexp = container_of(exp, VuBlkExport, export);
+    BlockExportQueueInfoList **tail = &info->queues;
+
+    for (uint16_t i = 0; i < vexp->num_queues; i++) {
+        QAPI_LIST_APPEND(tail, virtio_blk_queue_stats_info(
+                                   &vexp->queue_stats[i], i));
+    }
+}
+
 const BlockExportDriver blk_exp_vhost_user_blk = {
     .type               = BLOCK_EXPORT_TYPE_VHOST_USER_BLK,
     .instance_size      = sizeof(VuBlkExport),
+    .supports_multithread = true,
     .create             = vu_blk_exp_create,
     .delete             = vu_blk_exp_delete,
     .request_shutdown   = vu_blk_exp_request_shutdown,
+    .query_info         = vu_blk_exp_query_info,
 };
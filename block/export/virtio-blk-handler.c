@@ -130,6 +130,7 @@ virtio_blk_discard_write_zeroes(VirtioBlkHandler *handler, struct iovec *iov,
 }
 
 int coroutine_fn virtio_blk_process_req(VirtioBlkHandler *handler,
+                                        VirtioBlkQueueStats *stats,
                                         struct iovec *in_iov,
                                         struct iovec *out_iov,
                                         unsigned int in_num,
@@ -203,6 +204,13 @@ int coroutine_fn virtio_blk_process_req(VirtioBlkHandler *handler,
         }
         if (ret >= 0) {
             in->status = VIRTIO_BLK_S_OK;
+            if (is_write) {
+                stat64_add(&stats->wr_ops, 1);
+                stat64_add(&stats->wr_bytes, qiov.size);
+            } else {
+                stat64_add(&stats->rd_ops, 1);
+                stat64_add(&stats->rd_bytes, qiov.size);
+            }
         } else {
             in->status = VIRTIO_BLK_S_IOERR;
         }
@@ -211,6 +219,7 @@ int coroutine_fn virtio_blk_process_req(VirtioBlkHandler *handler,
     case VIRTIO_BLK_T_FLUSH:
         if (blk_co_flush(blk) == 0) {
             in->status = VIRTIO_BLK_S_OK;
+            stat64_add(&stats->flush_ops, 1);
         } else {
             in->status = VIRTIO_BLK_S_IOERR;
         }
@@ -231,11 +240,40 @@ int coroutine_fn virtio_blk_process_req(VirtioBlkHandler *handler,
         }
         in->status = virtio_blk_discard_write_zeroes(handler, out_iov,
                                                      out_num, type);
+        if (in->status == VIRTIO_BLK_S_OK) {
+            stat64_add(type == VIRTIO_BLK_T_DISCARD ? &stats->discard_ops :
+                                                      &stats->write_zeroes_ops,
+                       1);
+        }
         break;
     default:
         in->status = VIRTIO_BLK_S_UNSUPP;
         break;
     }
 
+    if (in->status == VIRTIO_BLK_S_IOERR) {
+        stat64_add(&stats->failed_ops, 1);
+    }
+
     return in_len;
 }
+
+BlockExportQueueInfo *virtio_blk_queue_stats_info(VirtioBlkQueueStats *stats,
+                                                  uint16_t index)
+{
+    BlockExportQueueInfo *info = g_new(BlockExportQueueInfo, 1);
+
+    *info = (BlockExportQueueInfo) {
+        .index                      = index,
+        .rd_operations              = stat64_get(&stats->rd_ops),
+        .wr_operations              = stat64_get(&stats->wr_ops),
+        .flush_operations           = stat64_get(&stats->flush_ops),
+        .discard_operations         = stat64_get(&stats->discard_ops),
+        .write_zeroes_operations    = stat64_get(&stats->write_zeroes_ops),
+        .rd_bytes                   = stat64_get(&stats->rd_bytes),
+        .wr_bytes                   = stat64_get(&stats->wr_bytes),
+        .failed_operations          = stat64_get(&stats->failed_ops),
+    };
+
+    return info;
+}
@@ -14,6 +14,8 @@
 #define VIRTIO_BLK_HANDLER_H
 
 #include "system/block-backend.h"
+#include "qapi/qapi-types-block-export.h"
+#include "qemu/stats64.h"
 
 #define VIRTIO_BLK_SECTOR_BITS 9
 #define VIRTIO_BLK_SECTOR_SIZE (1ULL << VIRTIO_BLK_SECTOR_BITS)
@@ -28,10 +30,29 @@ typedef struct {
     bool writable;
 } VirtioBlkHandler;
 
+/*
+ * Request counters of one virtqueue. Updated by the thread that processes the
+ * virtqueue and read by query-block-exports.
+ */
+typedef struct {
+    Stat64 rd_ops;
+    Stat64 wr_ops;
+    Stat64 flush_ops;
+    Stat64 discard_ops;
+    Stat64 write_zeroes_ops;
+    Stat64 rd_bytes;
+    Stat64 wr_bytes;
+    Stat64 failed_ops;
+} VirtioBlkQueueStats;
+
 int coroutine_fn virtio_blk_process_req(VirtioBlkHandler *handler,
+                                        VirtioBlkQueueStats *stats,
                                         struct iovec *in_iov,
                                         struct iovec *out_iov,
                                         unsigned int in_num,
                                         unsigned int out_num);
 
+BlockExportQueueInfo *virtio_blk_queue_stats_info(VirtioBlkQueueStats *stats,
+                                                  uint16_t index);
+
 #endif /* VIRTIO_BLK_HANDLER_H */
@@ -36,6 +36,7 @@
 #include "block/thread-pool.h"
 #include "qemu/iov.h"
 #include "block/raw-aio.h"
+#include "exec/memory.h" /* for ram_block_discard_disable() */
 #include "qobject/qdict.h"
 #include "qobject/qstring.h"
 
@@ -161,8 +162,10 @@ typedef struct BDRVRawState {
     bool use_linux_aio:1;
     bool has_laio_fdsync:1;
     bool use_linux_io_uring:1;
+    bool use_fixed_buffers:1;
     int page_cache_inconsistent; /* errno from fdatasync failure */
     bool has_fallocate;
+    bool has_clone;
     bool needs_alignment;
     bool force_alignment;
     bool drop_cache;
@@ -215,6 +218,7 @@ typedef struct RawPosixAIOData {
         struct {
             int aio_fd2;
             off_t aio_offset2;
+            bool clone_only;
         } copy_range;
         struct {
             PreallocMode prealloc;
@@ -561,6 +565,14 @@ static QemuOptsList raw_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "AIO max batch size (0 = auto handled by AIO backend, default: 0)",
         },
+#ifdef CONFIG_LINUX_IO_URING
+        {
+            .name = "aio-fixed-buffers",
+            .type = QEMU_OPT_BOOL,
+            .help = "use io_uring fixed buffers and registered files "
+                    "(default: off)",
+        },
+#endif
         {
             .name = "locking",
             .type = QEMU_OPT_STRING,
@@ -638,6 +650,12 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     s->use_linux_aio = (aio == BLOCKDEV_AIO_OPTIONS_NATIVE);
 #ifdef CONFIG_LINUX_IO_URING
     s->use_linux_io_uring = (aio == BLOCKDEV_AIO_OPTIONS_IO_URING);
+    s->use_fixed_buffers = qemu_opt_get_bool(opts, "aio-fixed-buffers", false);
+    if (s->use_fixed_buffers && !s->use_linux_io_uring) {
+        error_setg(errp, "aio-fixed-buffers requires aio=io_uring");
+        ret = -EINVAL;
+        goto fail;
+    }
 #endif
 
     s->aio_max_batch = qemu_opt_get_number(opts, "aio-max-batch", 0);
@@ -757,6 +775,7 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
             goto fail;
         } else {
             s->has_fallocate = true;
+            s->has_clone = true;
         }
     } else {
         if (!(S_ISCHR(st.st_mode) || S_ISBLK(st.st_mode))) {
@@ -809,6 +828,18 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
         /* When extending regular files, we get zeros from the OS */
         bs->supported_truncate_flags = BDRV_REQ_ZERO_WRITE;
     }
+
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_fixed_buffers) {
+        /* Fixed buffers stay pinned, which conflicts with RAM discard */
+        ret = ram_block_discard_disable(true);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "ram_block_discard_disable() failed");
+            goto fail;
+        }
+        luring_register_file(s->fd);
+    }
+#endif
     ret = 0;
 fail:
     if (ret < 0 && s->fd != -1) {
@@ -2157,12 +2188,67 @@ static int handle_aiocb_zone_mgmt(void *opaque)
 }
 #endif
 
+/*
+ * Share the extents of the source range with the destination instead of
+ * copying the data, on file systems that support it (e.g. XFS and btrfs).
+ */
+static int do_clone_range(RawPosixAIOData *aiocb)
+{
+#ifdef FICLONERANGE
+    BDRVRawState *s = aiocb->bs->opaque;
+    struct file_clone_range range = {
+        .src_fd = aiocb->aio_fildes,
+        .src_offset = aiocb->aio_offset,
+        .src_length = aiocb->aio_nbytes,
+        .dest_offset = aiocb->copy_range.aio_offset2,
+    };
+    int ret;
+
+    if (!s->has_clone) {
+        return -ENOTSUP;
+    }
+
+    do {
+        ret = ioctl(aiocb->copy_range.aio_fd2, FICLONERANGE, &range);
+    } while (ret != 0 && errno == EINTR);
+    trace_file_clone_range(aiocb->bs, aiocb->aio_fildes, aiocb->aio_offset,
+                           aiocb->copy_range.aio_fd2,
+                           aiocb->copy_range.aio_offset2, aiocb->aio_nbytes,
+                           ret < 0 ? -errno : 0);
+    if (ret == 0) {
+        return 0;
+    }
+
+    switch (errno) {
+    case EOPNOTSUPP:
+    case ENOTTY:
+        /* The file system cannot share extents at all */
+        s->has_clone = false;
+        return -ENOTSUP;
+    case EXDEV:
+    case EINVAL:
+        /* Different file systems or a range not aligned to their blocks */
+        return -ENOTSUP;
+    default:
+        return -errno;
+    }
+#else
+    return -ENOTSUP;
+#endif
+}
+
 static int handle_aiocb_copy_range(void *opaque)
 {
     RawPosixAIOData *aiocb = opaque;
     uint64_t bytes = aiocb->aio_nbytes;
     off_t in_off = aiocb->aio_offset;
     off_t out_off = aiocb->copy_range.aio_offset2;
+    int ret;
+
+    ret = do_clone_range(aiocb);
+    if (ret != -ENOTSUP || aiocb->copy_range.clone_only) {
+        return ret;
+    }
 
     while (bytes) {
         ssize_t ret = copy_file_range(aiocb->aio_fildes, &in_off,
@@ -2477,7 +2563,8 @@ static inline bool raw_check_linux_aio(BDRVRawState *s)
 #endif
 
 static int coroutine_fn raw_co_prw(BlockDriverState *bs, int64_t *offset_ptr,
-                                   uint64_t bytes, QEMUIOVector *qiov, int type)
+                                   uint64_t bytes, QEMUIOVector *qiov, int type,
+                                   BdrvRequestFlags flags)
 {
     BDRVRawState *s = bs->opaque;
     RawPosixAIOData acb;
@@ -2508,7 +2595,7 @@ static int coroutine_fn raw_co_prw(BlockDriverState *bs, int64_t *offset_ptr,
 #ifdef CONFIG_LINUX_IO_URING
     } else if (raw_check_linux_io_uring(s)) {
         assert(qiov->size == bytes);
-        ret = luring_co_submit(bs, s->fd, offset, qiov, type);
+        ret = luring_co_submit(bs, s->fd, offset, qiov, type, flags);
         goto out;
 #endif
 #ifdef CONFIG_LINUX_AIO
@@ -2571,14 +2658,14 @@ static int coroutine_fn raw_co_preadv(BlockDriverState *bs, int64_t offset,
                                       int64_t bytes, QEMUIOVector *qiov,
                                       BdrvRequestFlags flags)
 {
-    return raw_co_prw(bs, &offset, bytes, qiov, QEMU_AIO_READ);
+    return raw_co_prw(bs, &offset, bytes, qiov, QEMU_AIO_READ, flags);
 }
 
 static int coroutine_fn raw_co_pwritev(BlockDriverState *bs, int64_t offset,
                                        int64_t bytes, QEMUIOVector *qiov,
                                        BdrvRequestFlags flags)
 {
-    return raw_co_prw(bs, &offset, bytes, qiov, QEMU_AIO_WRITE);
+    return raw_co_prw(bs, &offset, bytes, qiov, QEMU_AIO_WRITE, flags);
 }
 
 static int coroutine_fn raw_co_flush_to_disk(BlockDriverState *bs)
@@ -2600,7 +2687,7 @@ static int coroutine_fn raw_co_flush_to_disk(BlockDriverState *bs)
 
 #ifdef CONFIG_LINUX_IO_URING
     if (raw_check_linux_io_uring(s)) {
-        return luring_co_submit(bs, s->fd, 0, NULL, QEMU_AIO_FLUSH);
+        return luring_co_submit(bs, s->fd, 0, NULL, QEMU_AIO_FLUSH, 0);
     }
 #endif
 #ifdef CONFIG_LINUX_AIO
@@ -2611,6 +2698,29 @@ static int coroutine_fn raw_co_flush_to_disk(BlockDriverState *bs)
     return raw_thread_pool_submit(handle_aiocb_flush, &acb);
 }
 
+#ifdef CONFIG_LINUX_IO_URING
+static bool raw_register_buf(BlockDriverState *bs, void *host, size_t size,
+                             Error **errp)
+{
+    BDRVRawState *s = bs->opaque;
+
+    /* Fixed buffers are only an optimization, so this never fails */
+    if (s->use_fixed_buffers) {
+        luring_register_buf(host, size);
+    }
+    return true;
+}
+
+static void raw_unregister_buf(BlockDriverState *bs, void *host, size_t size)
+{
+    BDRVRawState *s = bs->opaque;
+
+    if (s->use_fixed_buffers) {
+        luring_unregister_buf(host, size);
+    }
+}
+#endif
+
 static void raw_close(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
@@ -2618,6 +2728,12 @@ static void raw_close(BlockDriverState *bs)
     if (s->fd >= 0) {
 #if defined(CONFIG_BLKZONED)
         g_free(bs->wps);
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+        if (s->use_fixed_buffers) {
+            luring_unregister_file(s->fd);
+            ram_block_discard_disable(false);
+        }
 #endif
         qemu_close(s->fd);
         s->fd = -1;
@@ -3540,7 +3656,7 @@ static int coroutine_fn raw_co_zone_append(BlockDriverState *bs,
     }
 
     trace_zbd_zone_append(bs, *offset >> BDRV_SECTOR_BITS);
-    return raw_co_prw(bs, offset, len, qiov, QEMU_AIO_ZONE_APPEND);
+    return raw_co_prw(bs, offset, len, qiov, QEMU_AIO_ZONE_APPEND, flags);
 }
 #endif
 
@@ -3809,6 +3925,12 @@ static void raw_set_perm(BlockDriverState *bs, uint64_t perm, uint64_t shared)
     /* For reopen, we have already switched to the new fd (.bdrv_set_perm is
      * called after .bdrv_reopen_commit) */
     if (s->perm_change_fd && s->fd != s->perm_change_fd) {
+#ifdef CONFIG_LINUX_IO_URING
+        if (s->use_fixed_buffers) {
+            luring_unregister_file(s->fd);
+            luring_register_file(s->perm_change_fd);
+        }
+#endif
         qemu_close(s->fd);
         s->fd = s->perm_change_fd;
         s->open_flags = s->perm_change_flags;
@@ -3873,6 +3995,7 @@ raw_co_copy_range_to(BlockDriverState *bs,
         .copy_range     = {
             .aio_fd2        = s->fd,
             .aio_offset2    = dst_offset,
+            .clone_only     = write_flags & BDRV_REQ_NO_FALLBACK,
         },
     };
 
@@ -3903,6 +4026,10 @@ BlockDriver bdrv_file = {
     .bdrv_co_pwritev        = raw_co_pwritev,
     .bdrv_co_flush_to_disk  = raw_co_flush_to_disk,
     .bdrv_co_pdiscard       = raw_co_pdiscard,
+#ifdef CONFIG_LINUX_IO_URING
+    .bdrv_register_buf      = raw_register_buf,
+    .bdrv_unregister_buf    = raw_unregister_buf,
+#endif
     .bdrv_co_copy_range_from = raw_co_copy_range_from,
     .bdrv_co_copy_range_to  = raw_co_copy_range_to,
     .bdrv_refresh_limits = raw_refresh_limits,
@@ -4267,6 +4394,10 @@ static BlockDriver bdrv_host_device = {
     .bdrv_co_pwritev        = raw_co_pwritev,
     .bdrv_co_flush_to_disk  = raw_co_flush_to_disk,
     .bdrv_co_pdiscard       = hdev_co_pdiscard,
+#ifdef CONFIG_LINUX_IO_URING
+    .bdrv_register_buf      = raw_register_buf,
+    .bdrv_unregister_buf    = raw_unregister_buf,
+#endif
     .bdrv_co_copy_range_from = raw_co_copy_range_from,
     .bdrv_co_copy_range_to  = raw_co_copy_range_to,
     .bdrv_refresh_limits = raw_refresh_limits,
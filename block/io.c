@@ -3397,9 +3397,7 @@ static int coroutine_fn GRAPH_RDLOCK bdrv_co_copy_range_internal(
     int ret;
     assert_bdrv_graph_readable();
 
-    /* TODO We can support BDRV_REQ_NO_FALLBACK here */
     assert(!(read_flags & BDRV_REQ_NO_FALLBACK));
-    assert(!(write_flags & BDRV_REQ_NO_FALLBACK));
     assert(!(read_flags & BDRV_REQ_NO_WAIT));
     assert(!(write_flags & BDRV_REQ_NO_WAIT));
 
@@ -15,7 +15,12 @@
 #include "block/block.h"
 #include "block/raw-aio.h"
 #include "qemu/coroutine.h"
+#include "qemu/bitmap.h"
 #include "qemu/defer-call.h"
+#include "qemu/error-report.h"
+#include "qemu/lockable.h"
+#include "qemu/rcu.h"
+#include "qemu/units.h"
 #include "qapi/error.h"
 #include "system/block-backend.h"
 #include "trace.h"
@@ -26,6 +31,44 @@
 /* io_uring ring size */
 #define MAX_ENTRIES 128
 
+/*
+ * Registered buffers and files
+ *
+ * Memory passed to luring_register_buf() and files passed to
+ * luring_register_file() are entered into the fixed buffer and file tables of
+ * every ring, at the same index in each ring.  The submission path looks them
+ * up in luring_fixed, an RCU-protected snapshot that is replaced as a whole on
+ * every (rare) change.  A request that was prepared with an index that has
+ * been unregistered in the meantime fails with -EFAULT or -EBADF and is
+ * resubmitted without fixed buffers and files.
+ */
+#define LURING_MAX_FIXED_BUFS   1024
+#define LURING_MAX_FIXED_FILES  64
+
+/* The kernel limits the size of a single fixed buffer */
+#define LURING_MAX_FIXED_BUF_SIZE (1 * GiB)
+
+typedef struct LuringFixedBuf {
+    uint8_t *host;
+    size_t size;
+    unsigned int index;
+} LuringFixedBuf;
+
+typedef struct LuringFixedTable {
+    struct rcu_head rcu;
+    unsigned int nb_bufs;
+    LuringFixedBuf bufs[LURING_MAX_FIXED_BUFS]; /* sorted by host address */
+    int files[LURING_MAX_FIXED_FILES];          /* -1 if the slot is unused */
+} LuringFixedTable;
+
+/* A buffer passed to luring_register_buf(), possibly more than once */
+typedef struct LuringFixedRegion {
+    void *host;
+    size_t size;
+    unsigned int refcnt;
+    QLIST_ENTRY(LuringFixedRegion) next;
+} LuringFixedRegion;
+
 typedef struct LuringAIOCB {
     Coroutine *co;
     struct io_uring_sqe sqeq;
@@ -34,6 +77,13 @@ typedef struct LuringAIOCB {
     bool is_read;
     QSIMPLEQ_ENTRY(LuringAIOCB) next;
 
+    /* Needed to prepare the request again without fixed buffers and files */
+    int fd;
+    uint64_t offset;
+    int type;
+    BdrvRequestFlags flags;
+    bool fixed;
+
     /*
      * Buffered reads may require resubmission, see
      * luring_resubmit_short_read().
@@ -58,8 +108,147 @@ struct LuringState {
     LuringQueue io_q;
 
     QEMUBH *completion_bh;
+
+    /* Are the fixed buffer and file tables of the ring in use? */
+    bool fixed_ok;
+
+    /* Protected by luring_fixed_lock */
+    QLIST_ENTRY(LuringState) next;
 };
 
+static QemuMutex luring_fixed_lock;
+
+/* Protected by luring_fixed_lock */
+static QLIST_HEAD(, LuringState) luring_states =
+    QLIST_HEAD_INITIALIZER(luring_states);
+#ifdef HAVE_IO_URING_REGISTER_BUFFERS_SPARSE
+static QLIST_HEAD(, LuringFixedRegion) luring_fixed_regions =
+    QLIST_HEAD_INITIALIZER(luring_fixed_regions);
+static bool luring_fixed_used;
+#endif
+
+/* Written with luring_fixed_lock held, read under RCU */
+static LuringFixedTable *luring_fixed;
+
+static void __attribute__((__constructor__)) luring_fixed_init(void)
+{
+    qemu_mutex_init(&luring_fixed_lock);
+}
+
+/* Returns the index of the fixed buffer that contains @buf, or -1 */
+static int luring_fixed_buf_index(LuringFixedTable *t, void *buf, size_t len)
+{
+    uint8_t *p = buf;
+    unsigned int lo = 0, hi = t->nb_bufs;
+
+    /* Find the last buffer that starts at or before @buf */
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+
+        if (t->bufs[mid].host <= p) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (lo == 0) {
+        return -1;
+    }
+    if (p + len > t->bufs[lo - 1].host + t->bufs[lo - 1].size) {
+        return -1;
+    }
+    return t->bufs[lo - 1].index;
+}
+
+/* Returns the fixed file index of @fd, or -1 */
+static int luring_fixed_file_index(LuringFixedTable *t, int fd)
+{
+    int i;
+
+    for (i = 0; i < LURING_MAX_FIXED_FILES; i++) {
+        if (t->files[i] == fd) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * luring_prep_sqe:
+ *
+ * Prepares the sqe of a request from the parameters saved in @luringcb, using
+ * fixed buffers and files if @use_fixed is true and they are registered.
+ */
+static void luring_prep_sqe(LuringState *s, LuringAIOCB *luringcb,
+                            bool use_fixed)
+{
+    struct io_uring_sqe *sqes = &luringcb->sqeq;
+    QEMUIOVector *qiov = luringcb->qiov;
+    int fd = luringcb->fd;
+    int file_index = -1;
+    int buf_index = -1;
+
+    if (use_fixed && qatomic_read(&s->fixed_ok)) {
+        LuringFixedTable *t;
+
+        RCU_READ_LOCK_GUARD();
+        t = qatomic_rcu_read(&luring_fixed);
+        if (t) {
+            file_index = luring_fixed_file_index(t, fd);
+
+            /* READ_FIXED/WRITE_FIXED take a single contiguous buffer */
+            if ((luringcb->flags & BDRV_REQ_REGISTERED_BUF) &&
+                qiov && qiov->niov == 1) {
+                buf_index = luring_fixed_buf_index(t, qiov->iov[0].iov_base,
+                                                   qiov->iov[0].iov_len);
+            }
+        }
+    }
+
+    if (file_index >= 0) {
+        fd = file_index;
+    }
+
+    switch (luringcb->type) {
+    case QEMU_AIO_WRITE:
+    case QEMU_AIO_ZONE_APPEND:
+        if (buf_index >= 0) {
+            io_uring_prep_write_fixed(sqes, fd, qiov->iov[0].iov_base,
+                                      qiov->iov[0].iov_len, luringcb->offset,
+                                      buf_index);
+        } else {
+            io_uring_prep_writev(sqes, fd, qiov->iov, qiov->niov,
+                                 luringcb->offset);
+        }
+        break;
+    case QEMU_AIO_READ:
+        if (buf_index >= 0) {
+            io_uring_prep_read_fixed(sqes, fd, qiov->iov[0].iov_base,
+                                     qiov->iov[0].iov_len, luringcb->offset,
+                                     buf_index);
+        } else {
+            io_uring_prep_readv(sqes, fd, qiov->iov, qiov->niov,
+                                luringcb->offset);
+        }
+        break;
+    case QEMU_AIO_FLUSH:
+        io_uring_prep_fsync(sqes, fd, IORING_FSYNC_DATASYNC);
+        break;
+    default:
+        fprintf(stderr, "%s: invalid AIO request type, aborting 0x%x.\n",
+                        __func__, luringcb->type);
+        abort();
+    }
+
+    if (file_index >= 0) {
+        io_uring_sqe_set_flags(sqes, IOSQE_FIXED_FILE);
+    }
+    io_uring_sqe_set_data(sqes, luringcb);
+
+    luringcb->fixed = file_index >= 0 || buf_index >= 0;
+}
+
 /**
  * luring_resubmit:
  *
@@ -90,6 +279,15 @@ static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
     luringcb->total_read += nread;
     remaining = luringcb->qiov->size - luringcb->total_read;
 
+    /* A fixed buffer read just continues in the same buffer */
+    if (luringcb->sqeq.opcode == IORING_OP_READ_FIXED) {
+        luringcb->sqeq.off += nread;
+        luringcb->sqeq.addr += nread;
+        luringcb->sqeq.len = remaining;
+        luring_resubmit(s, luringcb);
+        return;
+    }
+
     /* Shorten qiov */
     resubmit_qiov = &luringcb->resubmit_qiov;
     if (resubmit_qiov->iov == NULL) {
@@ -184,6 +382,18 @@ static void luring_process_completions(LuringState *s)
                 luring_resubmit(s, luringcb);
                 continue;
             }
+
+            /*
+             * The fixed buffer or file may have been unregistered after the
+             * request was prepared. Start over without them.
+             */
+            if ((ret == -EFAULT || ret == -EBADF) && luringcb->fixed) {
+                trace_luring_fixed_fallback(s, luringcb, ret);
+                luringcb->total_read = 0;
+                luring_prep_sqe(s, luringcb, false);
+                luring_resubmit(s, luringcb);
+                continue;
+            }
         } else if (!luringcb->qiov) {
             goto end;
         } else if (total_bytes == luringcb->qiov->size) {
@@ -325,43 +535,17 @@ static void luring_deferred_fn(void *opaque)
 
 /**
  * luring_do_submit:
- * @fd: file descriptor for I/O
  * @luringcb: AIO control block
  * @s: AIO state
- * @offset: offset for request
- * @type: type of request
  *
  * Fetches sqes from ring, adds to pending queue and preps them
  *
  */
-static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
-                            uint64_t offset, int type)
+static int luring_do_submit(LuringAIOCB *luringcb, LuringState *s)
 {
     int ret;
-    struct io_uring_sqe *sqes = &luringcb->sqeq;
 
-    switch (type) {
-    case QEMU_AIO_WRITE:
-        io_uring_prep_writev(sqes, fd, luringcb->qiov->iov,
-                             luringcb->qiov->niov, offset);
-        break;
-    case QEMU_AIO_ZONE_APPEND:
-        io_uring_prep_writev(sqes, fd, luringcb->qiov->iov,
-                             luringcb->qiov->niov, offset);
-        break;
-    case QEMU_AIO_READ:
-        io_uring_prep_readv(sqes, fd, luringcb->qiov->iov,
-                            luringcb->qiov->niov, offset);
-        break;
-    case QEMU_AIO_FLUSH:
-        io_uring_prep_fsync(sqes, fd, IORING_FSYNC_DATASYNC);
-        break;
-    default:
-        fprintf(stderr, "%s: invalid AIO request type, aborting 0x%x.\n",
-                        __func__, type);
-        abort();
-    }
-    io_uring_sqe_set_data(sqes, luringcb);
+    luring_prep_sqe(s, luringcb, true);
 
     QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
     s->io_q.in_queue++;
@@ -380,7 +564,8 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
 }
 
 int coroutine_fn luring_co_submit(BlockDriverState *bs, int fd, uint64_t offset,
-                                  QEMUIOVector *qiov, int type)
+                                  QEMUIOVector *qiov, int type,
+                                  BdrvRequestFlags flags)
 {
     int ret;
     AioContext *ctx = qemu_get_current_aio_context();
@@ -390,10 +575,14 @@ int coroutine_fn luring_co_submit(BlockDriverState *bs, int fd, uint64_t offset,
         .ret        = -EINPROGRESS,
         .qiov       = qiov,
         .is_read    = (type == QEMU_AIO_READ),
+        .fd         = fd,
+        .offset     = offset,
+        .type       = type,
+        .flags      = flags,
     };
     trace_luring_co_submit(bs, s, &luringcb, fd, offset, qiov ? qiov->size : 0,
                            type);
-    ret = luring_do_submit(fd, &luringcb, s, offset, type);
+    ret = luring_do_submit(&luringcb, s);
 
     if (ret < 0) {
         return ret;
@@ -422,7 +611,298 @@ void luring_attach_aio_context(LuringState *s, AioContext *new_context)
                        qemu_luring_poll_cb, qemu_luring_poll_ready, s);
 }
 
-LuringState *luring_init(Error **errp)
+#ifdef HAVE_IO_URING_REGISTER_BUFFERS_SPARSE
+/* Called with luring_fixed_lock held */
+static void luring_fixed_disable(LuringState *s, int ret)
+{
+    trace_luring_fixed_disable(s, ret);
+    qatomic_set(&s->fixed_ok, false);
+    io_uring_unregister_buffers(&s->ring);
+    io_uring_unregister_files(&s->ring);
+}
+
+/* Called with luring_fixed_lock held */
+static int luring_fixed_update_buf(LuringState *s, unsigned int index,
+                                   void *host, size_t size)
+{
+    struct iovec iov = { .iov_base = host, .iov_len = size };
+
+    return io_uring_register_buffers_update_tag(&s->ring, index, &iov,
+                                                NULL, 1);
+}
+
+/*
+ * Sets up the fixed buffer and file tables of @s with the current contents of
+ * luring_fixed. Called with luring_fixed_lock held.
+ */
+static void luring_fixed_enable(LuringState *s)
+{
+    LuringFixedTable *t = luring_fixed;
+    unsigned int i;
+    int ret;
+
+    ret = io_uring_register_buffers_sparse(&s->ring, LURING_MAX_FIXED_BUFS);
+    if (ret < 0) {
+        trace_luring_fixed_disable(s, ret);
+        return;
+    }
+
+    ret = io_uring_register_files_sparse(&s->ring, LURING_MAX_FIXED_FILES);
+    if (ret < 0) {
+        trace_luring_fixed_disable(s, ret);
+        io_uring_unregister_buffers(&s->ring);
+        return;
+    }
+
+    for (i = 0; t && i < t->nb_bufs; i++) {
+        ret = luring_fixed_update_buf(s, t->bufs[i].index, t->bufs[i].host,
+                                      t->bufs[i].size);
+        if (ret < 0) {
+            luring_fixed_disable(s, ret);
+            return;
+        }
+    }
+
+    for (i = 0; t && i < LURING_MAX_FIXED_FILES; i++) {
+        if (t->files[i] >= 0) {
+            ret = io_uring_register_files_update(&s->ring, i, &t->files[i], 1);
+            if (ret < 0) {
+                luring_fixed_disable(s, ret);
+                return;
+            }
+        }
+    }
+
+    qatomic_set(&s->fixed_ok, true);
+}
+
+/*
+ * Returns a copy of luring_fixed to be modified and published with
+ * luring_fixed_publish(). Called with luring_fixed_lock held.
+ */
+static LuringFixedTable *luring_fixed_copy(void)
+{
+    LuringFixedTable *t = g_new(LuringFixedTable, 1);
+    LuringState *s;
+
+    if (luring_fixed) {
+        *t = *luring_fixed;
+    } else {
+        t->nb_bufs = 0;
+        memset(t->files, -1, sizeof(t->files));
+    }
+
+    /* Rings only use fixed buffers and files once somebody asked for them */
+    if (!luring_fixed_used) {
+        luring_fixed_used = true;
+        QLIST_FOREACH(s, &luring_states, next) {
+            luring_fixed_enable(s);
+        }
+    }
+
+    return t;
+}
+
+/* Called with luring_fixed_lock held */
+static void luring_fixed_publish(LuringFixedTable *t)
+{
+    LuringFixedTable *old = luring_fixed;
+
+    qatomic_rcu_set(&luring_fixed, t);
+    if (old) {
+        g_free_rcu(old, rcu);
+    }
+}
+
+void luring_register_buf(void *host, size_t size)
+{
+    g_autofree unsigned long *used = bitmap_new(LURING_MAX_FIXED_BUFS);
+    LuringFixedRegion *region;
+    LuringFixedTable *t;
+    LuringState *s;
+    unsigned int nb_chunks, i, j;
+    size_t offset;
+
+    QEMU_LOCK_GUARD(&luring_fixed_lock);
+
+    QLIST_FOREACH(region, &luring_fixed_regions, next) {
+        if (region->host == host && region->size == size) {
+            region->refcnt++;
+            return;
+        }
+    }
+
+    region = g_new(LuringFixedRegion, 1);
+    *region = (LuringFixedRegion) {
+        .host   = host,
+        .size   = size,
+        .refcnt = 1,
+    };
+    QLIST_INSERT_HEAD(&luring_fixed_regions, region, next);
+
+    t = luring_fixed_copy();
+
+    nb_chunks = DIV_ROUND_UP(size, LURING_MAX_FIXED_BUF_SIZE);
+    if (t->nb_bufs + nb_chunks > LURING_MAX_FIXED_BUFS) {
+        trace_luring_register_buf_full(host, size);
+        g_free(t);
+        return;
+    }
+
+    for (i = 0; i < t->nb_bufs; i++) {
+        set_bit(t->bufs[i].index, used);
+    }
+
+    for (offset = 0; offset < size; offset += LURING_MAX_FIXED_BUF_SIZE) {
+        LuringFixedBuf buf = {
+            .host  = (uint8_t *)host + offset,
+            .size  = MIN(size - offset, LURING_MAX_FIXED_BUF_SIZE),
+            .index = find_first_zero_bit(used, LURING_MAX_FIXED_BUFS),
+        };
+
+        set_bit(buf.index, used);
+
+        QLIST_FOREACH(s, &luring_states, next) {
+            int ret;
+
+            if (!qatomic_read(&s->fixed_ok)) {
+                continue;
+            }
+            ret = luring_fixed_update_buf(s, buf.index, buf.host, buf.size);
+            if (ret < 0) {
+                luring_fixed_disable(s, ret);
+            }
+        }
+
+        /* Insert sorted by host address */
+        for (j = t->nb_bufs; j > 0 && t->bufs[j - 1].host > buf.host; j--) {
+            t->bufs[j] = t->bufs[j - 1];
+        }
+        t->bufs[j] = buf;
+        t->nb_bufs++;
+    }
+
+    trace_luring_register_buf(host, size, nb_chunks);
+    luring_fixed_publish(t);
+}
+
+void luring_unregister_buf(void *host, size_t size)
+{
+    LuringFixedRegion *region;
+    LuringFixedTable *t;
+    LuringState *s;
+    unsigned int i, j;
+
+    QEMU_LOCK_GUARD(&luring_fixed_lock);
+
+    QLIST_FOREACH(region, &luring_fixed_regions, next) {
+        if (region->host == host && region->size == size) {
+            break;
+        }
+    }
+    if (!region || --region->refcnt > 0) {
+        return;
+    }
+    QLIST_REMOVE(region, next);
+    g_free(region);
+
+    t = luring_fixed_copy();
+    for (i = 0, j = 0; i < t->nb_bufs; i++) {
+        LuringFixedBuf *buf = &t->bufs[i];
+
+        if (buf->host >= (uint8_t *)host &&
+            buf->host < (uint8_t *)host + size) {
+            QLIST_FOREACH(s, &luring_states, next) {
+                if (qatomic_read(&s->fixed_ok)) {
+                    luring_fixed_update_buf(s, buf->index, NULL, 0);
+                }
+            }
+        } else {
+            t->bufs[j++] = *buf;
+        }
+    }
+    t->nb_bufs = j;
+
+    trace_luring_unregister_buf(host, size);
+    luring_fixed_publish(t);
+}
+
+void luring_register_file(int fd)
+{
+    LuringFixedTable *t;
+    LuringState *s;
+    int i;
+
+    QEMU_LOCK_GUARD(&luring_fixed_lock);
+
+    t = luring_fixed_copy();
+    i = luring_fixed_file_index(t, -1);
+    if (i < 0) {
+        trace_luring_register_file(fd, -1);
+        g_free(t);
+        return;
+    }
+
+    QLIST_FOREACH(s, &luring_states, next) {
+        int ret;
+
+        if (!qatomic_read(&s->fixed_ok)) {
+            continue;
+        }
+        ret = io_uring_register_files_update(&s->ring, i, &fd, 1);
+        if (ret < 0) {
+            luring_fixed_disable(s, ret);
+        }
+    }
+
+    t->files[i] = fd;
+    trace_luring_register_file(fd, i);
+    luring_fixed_publish(t);
+}
+
+void luring_unregister_file(int fd)
+{
+    LuringFixedTable *t;
+    LuringState *s;
+    int i, unused = -1;
+
+    QEMU_LOCK_GUARD(&luring_fixed_lock);
+
+    if (!luring_fixed || luring_fixed_file_index(luring_fixed, fd) < 0) {
+        return;
+    }
+
+    t = luring_fixed_copy();
+    i = luring_fixed_file_index(t, fd);
+    t->files[i] = -1;
+    luring_fixed_publish(t);
+
+    QLIST_FOREACH(s, &luring_states, next) {
+        if (qatomic_read(&s->fixed_ok)) {
+            io_uring_register_files_update(&s->ring, i, &unused, 1);
+        }
+    }
+    trace_luring_unregister_file(fd, i);
+}
+#else
+void luring_register_buf(void *host, size_t size)
+{
+}
+
+void luring_unregister_buf(void *host, size_t size)
+{
+}
+
+void luring_register_file(int fd)
+{
+}
+
+void luring_unregister_file(int fd)
+{
+}
+#endif /* HAVE_IO_URING_REGISTER_BUFFERS_SPARSE */
+
+LuringState *luring_init(int64_t sqpoll_idle, Error **errp)
 {
     int rc;
     LuringState *s = g_new0(LuringState, 1);
@@ -430,7 +910,23 @@ LuringState *luring_init(Error **errp)
 
     trace_luring_init_state(s, sizeof(*s));
 
-    rc = io_uring_queue_init(MAX_ENTRIES, ring, 0);
+    if (sqpoll_idle > 0) {
+        struct io_uring_params params = {
+            .flags          = IORING_SETUP_SQPOLL,
+            .sq_thread_idle = MIN(sqpoll_idle, UINT32_MAX),
+        };
+
+        rc = io_uring_queue_init_params(MAX_ENTRIES, ring, &params);
+        if (rc < 0) {
+            warn_report("Could not set up io_uring submission queue "
+                        "polling, continuing without: %s", strerror(-rc));
+            sqpoll_idle = 0;
+        }
+    }
+
+    if (sqpoll_idle <= 0) {
+        rc = io_uring_queue_init(MAX_ENTRIES, ring, 0);
+    }
     if (rc < 0) {
         error_setg_errno(errp, -rc, "failed to init linux io_uring ring");
         g_free(s);
@@ -438,12 +934,24 @@ LuringState *luring_init(Error **errp)
     }
 
     ioq_init(&s->io_q);
+
+    WITH_QEMU_LOCK_GUARD(&luring_fixed_lock) {
+#ifdef HAVE_IO_URING_REGISTER_BUFFERS_SPARSE
+        if (luring_fixed_used) {
+            luring_fixed_enable(s);
+        }
+#endif
+        QLIST_INSERT_HEAD(&luring_states, s, next);
+    }
     return s;
 
 }
 
 void luring_cleanup(LuringState *s)
 {
+    WITH_QEMU_LOCK_GUARD(&luring_fixed_lock) {
+        QLIST_REMOVE(s, next);
+    }
     io_uring_queue_exit(&s->ring);
     trace_luring_cleanup_state(s);
     g_free(s);
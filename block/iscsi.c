@@ -2348,6 +2348,10 @@ iscsi_co_copy_range_to(BlockDriverState *bs,
     if (src->bs->drv->bdrv_co_copy_range_to != iscsi_co_copy_range_to) {
         return -ENOTSUP;
     }
+    if (write_flags & BDRV_REQ_NO_FALLBACK) {
+        /* XCOPY still moves the data within the storage */
+        return -ENOTSUP;
+    }
     src_lun = src->bs->opaque;
 
     if (!src_lun->dd || !dst_lun->dd) {
@@ -0,0 +1,1457 @@
+/*
+ * local-cache block driver
+ *
+ * Keeps the blocks of a slow image (typically on network storage) that are
+ * read or written on a fast local cache device, and writes dirty blocks back
+ * to the image in the background.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+
+#include "qapi/error.h"
+#include "qemu/bswap.h"
+#include "qemu/error-report.h"
+#include "qemu/memalign.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/units.h"
+#include "block/block-io.h"
+#include "block/block_int.h"
+#include "block/reqlist.h"
+#include "trace.h"
+
+/*
+ * Layout of the cache device:
+ *
+ *   0                  LocalCacheHeader, padded to LOCAL_CACHE_HEADER_SIZE
+ *   table_offset       one big-endian 64 bit entry per cache line
+ *   data_offset        nb_lines cache lines of block_size bytes each
+ *
+ * A table entry holds the guest offset of the block cached in the line
+ * together with the LOCAL_CACHE_ENTRY_* flags in its low bits.
+ *
+ * The entry of a line is only written once its data is stable, and before a
+ * line is reused for another block its old entry is invalidated and flushed.
+ * A clean line is marked dirty, and flushed, before it is written to.  So
+ * after a crash, valid entries always describe the data of their line, clean
+ * lines hold the data of the image, and dirty lines are recovered and written
+ * back after the next open.
+ */
+
+#define LOCAL_CACHE_MAGIC           0x514c434143484500ULL /* "QLCACHE\0" */
+#define LOCAL_CACHE_VERSION         1
+#define LOCAL_CACHE_HEADER_SIZE     4096
+
+#define LOCAL_CACHE_ENTRY_VALID     (1ULL << 0)
+#define LOCAL_CACHE_ENTRY_DIRTY     (1ULL << 1)
+#define LOCAL_CACHE_ENTRY_FLAGS \
+    (LOCAL_CACHE_ENTRY_VALID | LOCAL_CACHE_ENTRY_DIRTY)
+
+#define LOCAL_CACHE_DEFAULT_BLOCK_SIZE  (64 * KiB)
+#define LOCAL_CACHE_MIN_BLOCK_SIZE      (4 * KiB)
+#define LOCAL_CACHE_MAX_BLOCK_SIZE      (2 * MiB)
+#define LOCAL_CACHE_MAX_LINES           (4 * 1024 * 1024)
+
+/* Number of lines the clock hand looks at to find one to evict */
+#define LOCAL_CACHE_EVICT_SCAN          256
+/* Number of lines written back before the image is flushed */
+#define LOCAL_CACHE_WRITEBACK_BATCH     16
+/* Number of blocks that may wait to be added to the cache after reads */
+#define LOCAL_CACHE_MAX_FILLS           64
+
+typedef struct QEMU_PACKED LocalCacheHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t nb_lines;
+    uint64_t disk_size;
+    uint64_t table_offset;
+    uint64_t data_offset;
+} LocalCacheHeader;
+
+typedef struct LocalCacheLine {
+    uint64_t block;     /* cached guest block, key in BDRVLocalCacheState.map */
+    bool valid;
+    bool dirty;
+    bool referenced;    /* accessed since the clock hand passed last time */
+    bool stale;         /* invalid, but the entry on disk may not be yet */
+    int busy;           /* number of users, busy lines are never evicted */
+} LocalCacheLine;
+
+/* A block of a request, requests own their blocks in BDRVLocalCacheState.reqs */
+typedef struct LocalCacheBlock {
+    BlockReq req;
+    LocalCacheLine *line;   /* NULL if the block is not cached */
+    bool fill;              /* add the block to the cache after the read */
+} LocalCacheBlock;
+
+typedef struct BDRVLocalCacheState {
+    BdrvChild *cache_file;
+    bool writable;
+
+    /* Layout of the cache device */
+    uint32_t block_size;
+    uint64_t disk_size;
+    uint64_t nb_lines;
+    uint64_t table_offset;
+    uint64_t data_offset;
+
+    /* Limits in percent of the cache lines, and in cache lines */
+    uint64_t max_dirty_pct;
+    uint64_t writeback_threshold_pct;
+    uint64_t max_dirty;
+    uint64_t writeback_threshold;
+
+    /* Protected by lock */
+    CoMutex lock;
+    LocalCacheLine *lines;
+    GHashTable *map;
+    BlockReqList reqs;
+    uint64_t clock_hand;
+    uint64_t writeback_hand;
+    uint64_t nb_valid;
+    uint64_t nb_dirty;
+    int nb_fills;
+    bool writeback_in_flight;
+    BlockStatsSpecificLocalCache stats;
+} BDRVLocalCacheState;
+
+typedef struct LocalCacheFill {
+    BlockDriverState *bs;
+    uint64_t first;
+    int nb_blocks;
+    LocalCacheBlock *blocks;
+    uint8_t *buf;
+} LocalCacheFill;
+
+typedef struct LocalCacheWritebackCo {
+    BlockDriverState *bs;
+    int ret;
+} LocalCacheWritebackCo;
+
+#define LOCAL_CACHE_OPT_BLOCK_SIZE "block-size"
+#define LOCAL_CACHE_OPT_MAX_DIRTY "max-dirty"
+#define LOCAL_CACHE_OPT_WRITEBACK_THRESHOLD "writeback-threshold"
+static QemuOptsList runtime_opts = {
+    .name = "local-cache",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = LOCAL_CACHE_OPT_BLOCK_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "size of the cached blocks, default 64k for new caches",
+        },
+        {
+            .name = LOCAL_CACHE_OPT_MAX_DIRTY,
+            .type = QEMU_OPT_NUMBER,
+            .help = "percentage of the cache that may be dirty, default 50",
+        },
+        {
+            .name = LOCAL_CACHE_OPT_WRITEBACK_THRESHOLD,
+            .type = QEMU_OPT_NUMBER,
+            .help = "percentage of dirty blocks that starts writeback, "
+                "default 25",
+        },
+        { /* end of list */ }
+    },
+};
+
+static int64_t local_cache_line_offset(BDRVLocalCacheState *s,
+                                       LocalCacheLine *line)
+{
+    return s->data_offset + (int64_t)(line - s->lines) * s->block_size;
+}
+
+/* Number of bytes of @block that are within the image */
+static int64_t local_cache_block_bytes(BDRVLocalCacheState *s, uint64_t block)
+{
+    return MIN(s->block_size, s->disk_size - block * s->block_size);
+}
+
+static uint64_t local_cache_entry(BDRVLocalCacheState *s, LocalCacheLine *line)
+{
+    return line->block * s->block_size | LOCAL_CACHE_ENTRY_VALID |
+           (line->dirty ? LOCAL_CACHE_ENTRY_DIRTY : 0);
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+local_cache_co_write_entry(BlockDriverState *bs, LocalCacheLine *line,
+                           uint64_t entry)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    uint64_t be_entry = cpu_to_be64(entry);
+
+    return bdrv_co_pwrite(s->cache_file,
+                          s->table_offset + (line - s->lines) * sizeof(entry),
+                          sizeof(be_entry), &be_entry, 0);
+}
+
+/*
+ * Registers @blocks for the @nb blocks starting with @first, waiting for
+ * conflicting requests first, and looks up their cache lines.
+ *
+ * Called with lock held, which is dropped while waiting.
+ */
+static void coroutine_fn
+local_cache_co_get_blocks(BDRVLocalCacheState *s, uint64_t first, int nb,
+                          LocalCacheBlock *blocks)
+{
+    int64_t offset = first * s->block_size;
+    int i;
+
+    reqlist_wait_all(&s->reqs, offset, (int64_t)nb * s->block_size, &s->lock);
+
+    for (i = 0; i < nb; i++) {
+        uint64_t block = first + i;
+        LocalCacheLine *line = g_hash_table_lookup(s->map, &block);
+
+        reqlist_init_req(&s->reqs, &blocks[i].req, block * s->block_size,
+                         s->block_size);
+        if (line) {
+            line->busy++;
+            line->referenced = true;
+        }
+        blocks[i].line = line;
+        blocks[i].fill = false;
+    }
+}
+
+/* Called with lock held */
+static void coroutine_fn
+local_cache_co_put_block(LocalCacheBlock *block)
+{
+    if (block->line) {
+        block->line->busy--;
+    }
+    reqlist_remove_req(&block->req);
+}
+
+/*
+ * Takes a clean line away from the block it caches, so that it can be used
+ * for another one. Lines that were accessed recently get a second chance.
+ * Returns NULL if no line could be found quickly.
+ *
+ * Called with lock held.
+ */
+static LocalCacheLine *local_cache_evict(BDRVLocalCacheState *s)
+{
+    int i;
+
+    if (!s->writable) {
+        return NULL;
+    }
+
+    for (i = 0; i < MIN(s->nb_lines, LOCAL_CACHE_EVICT_SCAN); i++) {
+        LocalCacheLine *line = &s->lines[s->clock_hand];
+
+        s->clock_hand = (s->clock_hand + 1) % s->nb_lines;
+        if (line->busy || line->dirty) {
+            continue;
+        }
+        if (line->valid && line->referenced) {
+            line->referenced = false;
+            continue;
+        }
+
+        if (line->valid) {
+            g_hash_table_remove(s->map, &line->block);
+            line->valid = false;
+            line->stale = true;
+            s->nb_valid--;
+        }
+        line->busy++;
+        return line;
+    }
+
+    return NULL;
+}
+
+/*
+ * Stores @buf as the data of @block in @line, which must have been returned by
+ * local_cache_evict(). The caller owns @block. Dirty lines are reserved in
+ * s->nb_dirty by the caller.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+local_cache_co_fill_line(BlockDriverState *bs, LocalCacheLine *line,
+                         uint64_t block, const void *buf, bool dirty)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    int ret = 0;
+
+    if (line->stale) {
+        /* Never let a crash associate the new data with the old block */
+        ret = local_cache_co_write_entry(bs, line, 0);
+        if (ret == 0) {
+            ret = bdrv_co_flush(s->cache_file->bs);
+        }
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
+    ret = bdrv_co_pwrite(s->cache_file, local_cache_line_offset(s, line),
+                         s->block_size, buf, 0);
+    if (ret < 0) {
+        goto out;
+    }
+    ret = bdrv_co_flush(s->cache_file->bs);
+    if (ret < 0) {
+        goto out;
+    }
+
+    ret = local_cache_co_write_entry(bs, line, block * s->block_size |
+                                     LOCAL_CACHE_ENTRY_VALID |
+                                     (dirty ? LOCAL_CACHE_ENTRY_DIRTY : 0));
+
+out:
+    trace_local_cache_fill(bs, block, line - s->lines, dirty, ret);
+
+    WITH_QEMU_LOCK_GUARD(&s->lock) {
+        if (ret < 0) {
+            line->stale = true;
+        } else {
+            line->block = block;
+            line->valid = true;
+            line->dirty = dirty;
+            line->referenced = true;
+            line->stale = false;
+            g_hash_table_insert(s->map, &line->block, line);
+            s->nb_valid++;
+        }
+        line->busy--;
+    }
+
+    return ret;
+}
+
+/*
+ * Writes dirty lines back to the image until at most @target of them are
+ * left. Lines that are in use by requests are skipped.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+local_cache_co_writeback(BlockDriverState *bs, uint64_t target)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    LocalCacheBlock batch[LOCAL_CACHE_WRITEBACK_BATCH];
+    uint8_t *buf = qemu_blockalign(bs, s->block_size);
+    int i, n, ret = 0;
+
+    do {
+        n = 0;
+        WITH_QEMU_LOCK_GUARD(&s->lock) {
+            uint64_t scanned;
+
+            for (scanned = 0; scanned < s->nb_lines &&
+                 n < LOCAL_CACHE_WRITEBACK_BATCH && s->nb_dirty - n > target;
+                 scanned++)
+            {
+                LocalCacheLine *line = &s->lines[s->writeback_hand];
+                int64_t offset = line->block * s->block_size;
+
+                s->writeback_hand = (s->writeback_hand + 1) % s->nb_lines;
+                if (!line->dirty || line->busy ||
+                    reqlist_find_conflict(&s->reqs, offset, s->block_size))
+                {
+                    continue;
+                }
+
+                reqlist_init_req(&s->reqs, &batch[n].req, offset,
+                                 s->block_size);
+                batch[n].line = line;
+                line->busy++;
+                n++;
+            }
+        }
+
+        for (i = 0; i < n && ret == 0; i++) {
+            LocalCacheLine *line = batch[i].line;
+            int64_t bytes = local_cache_block_bytes(s, line->block);
+
+            ret = bdrv_co_pread(s->cache_file,
+                                local_cache_line_offset(s, line), bytes,
+                                buf, 0);
+            if (ret == 0) {
+                ret = bdrv_co_pwrite(bs->file, line->block * s->block_size,
+                                     bytes, buf, 0);
+            }
+            trace_local_cache_writeback(bs, line->block, line - s->lines, ret);
+        }
+        if (n && ret == 0) {
+            ret = bdrv_co_flush(bs->file->bs);
+        }
+
+        /*
+         * The entries are updated lazily. If a crash loses the update, the
+         * block is just written back once more.
+         */
+        for (i = 0; i < n && ret == 0; i++) {
+            LocalCacheLine *line = batch[i].line;
+
+            WITH_QEMU_LOCK_GUARD(&s->lock) {
+                line->dirty = false;
+                s->nb_dirty--;
+                s->stats.writeback++;
+            }
+            local_cache_co_write_entry(bs, line, local_cache_entry(s, line));
+        }
+
+        WITH_QEMU_LOCK_GUARD(&s->lock) {
+            for (i = 0; i < n; i++) {
+                local_cache_co_put_block(&batch[i]);
+            }
+        }
+    } while (n && ret == 0);
+
+    qemu_vfree(buf);
+    return ret;
+}
+
+static void coroutine_fn local_cache_co_writeback_entry(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVLocalCacheState *s = bs->opaque;
+
+    bdrv_graph_co_rdlock();
+    local_cache_co_writeback(bs, s->writeback_threshold / 2);
+    bdrv_graph_co_rdunlock();
+
+    WITH_QEMU_LOCK_GUARD(&s->lock) {
+        s->writeback_in_flight = false;
+    }
+    bdrv_dec_in_flight(bs);
+}
+
+/*
+ * Starts writing dirty lines back in the background if there are more than
+ * the configured threshold. At most one writeback coroutine runs at a time.
+ *
+ * Called with lock held.
+ */
+static void local_cache_kick_writeback(BlockDriverState *bs)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    Coroutine *co;
+
+    if (s->writeback_in_flight || s->nb_dirty <= s->writeback_threshold) {
+        return;
+    }
+
+    s->writeback_in_flight = true;
+
+    /* Keeps drain (and therefore close and reopen) waiting for us */
+    bdrv_inc_in_flight(bs);
+    co = qemu_coroutine_create(local_cache_co_writeback_entry, bs);
+    aio_co_enter(bdrv_get_aio_context(bs), co);
+}
+
+static void coroutine_fn local_cache_writeback_all_entry(void *opaque)
+{
+    LocalCacheWritebackCo *wb = opaque;
+    BDRVLocalCacheState *s = wb->bs->opaque;
+    int ret;
+
+    bdrv_graph_co_rdlock();
+    ret = local_cache_co_writeback(wb->bs, 0);
+    if (ret == 0) {
+        ret = bdrv_co_flush(s->cache_file->bs);
+    }
+    bdrv_graph_co_rdunlock();
+
+    wb->ret = ret;
+    aio_wait_kick();
+}
+
+/* Writes all dirty lines back, the node must be drained */
+static int GRAPH_RDLOCK local_cache_writeback_all(BlockDriverState *bs)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    LocalCacheWritebackCo wb = {
+        .bs = bs,
+        .ret = -EINPROGRESS,
+    };
+
+    if (!s->writable || !s->nb_dirty) {
+        return 0;
+    }
+
+    aio_co_enter(bdrv_get_aio_context(bs),
+                 qemu_coroutine_create(local_cache_writeback_all_entry, &wb));
+    BDRV_POLL_WHILE(bs, wb.ret == -EINPROGRESS);
+
+    return wb.ret;
+}
+
+static void local_cache_init_lines(BDRVLocalCacheState *s)
+{
+    s->lines = g_new0(LocalCacheLine, s->nb_lines);
+    s->map = g_hash_table_new(g_int64_hash, g_int64_equal);
+    s->clock_hand = s->writeback_hand = 0;
+    s->nb_valid = s->nb_dirty = 0;
+}
+
+static void local_cache_set_limits(BDRVLocalCacheState *s)
+{
+    s->max_dirty = s->nb_lines * s->max_dirty_pct / 100;
+    s->writeback_threshold = MIN(s->nb_lines * s->writeback_threshold_pct / 100,
+                                 s->max_dirty);
+}
+
+static int coroutine_mixed_fn GRAPH_RDLOCK
+local_cache_format(BlockDriverState *bs, uint32_t block_size, Error **errp)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    LocalCacheHeader header;
+    int64_t len;
+    uint64_t nb_lines, data_offset = 0;
+    int ret;
+
+    len = bdrv_getlength(s->cache_file->bs);
+    if (len < 0) {
+        error_setg_errno(errp, -len, "Failed to get cache device length");
+        return len;
+    }
+
+    nb_lines = MAX(len - LOCAL_CACHE_HEADER_SIZE, 0) /
+               (block_size + sizeof(uint64_t));
+    nb_lines = MIN(nb_lines, LOCAL_CACHE_MAX_LINES);
+    for (; nb_lines > 0; nb_lines--) {
+        data_offset = ROUND_UP(LOCAL_CACHE_HEADER_SIZE +
+                               nb_lines * sizeof(uint64_t), block_size);
+        if (data_offset + nb_lines * block_size <= len) {
+            break;
+        }
+    }
+    if (!nb_lines) {
+        error_setg(errp, "Cache device is too small for block size %" PRIu32,
+                   block_size);
+        return -EINVAL;
+    }
+
+    /* The table must be empty before the header makes it valid */
+    ret = bdrv_pwrite_zeroes(s->cache_file, LOCAL_CACHE_HEADER_SIZE,
+                             data_offset - LOCAL_CACHE_HEADER_SIZE, 0);
+    if (ret == 0) {
+        ret = bdrv_flush(s->cache_file->bs);
+    }
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to clear the cache table");
+        return ret;
+    }
+
+    header = (LocalCacheHeader) {
+        .magic          = cpu_to_be64(LOCAL_CACHE_MAGIC),
+        .version        = cpu_to_be32(LOCAL_CACHE_VERSION),
+        .block_size     = cpu_to_be32(block_size),
+        .nb_lines       = cpu_to_be64(nb_lines),
+        .disk_size      = cpu_to_be64(s->disk_size),
+        .table_offset   = cpu_to_be64(LOCAL_CACHE_HEADER_SIZE),
+        .data_offset    = cpu_to_be64(data_offset),
+    };
+    ret = bdrv_pwrite_sync(s->cache_file, 0, sizeof(header), &header, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to write the cache header");
+        return ret;
+    }
+
+    s->block_size = block_size;
+    s->nb_lines = nb_lines;
+    s->table_offset = LOCAL_CACHE_HEADER_SIZE;
+    s->data_offset = data_offset;
+    local_cache_init_lines(s);
+    local_cache_set_limits(s);
+
+    return 0;
+}
+
+/*
+ * Opens the cache on the cache device, or formats the device if it doesn't
+ * contain one yet. @block_size is 0 if the user didn't choose one.
+ *
+ * Inactive nodes must not write, so they leave an unformatted device alone
+ * and run without cache lines until they are activated.
+ */
+static int coroutine_mixed_fn GRAPH_RDLOCK
+local_cache_load(BlockDriverState *bs, uint32_t block_size, Error **errp)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    LocalCacheHeader header;
+    g_autofree uint64_t *table = NULL;
+    int64_t len;
+    uint64_t i;
+    int ret;
+
+    ret = bdrv_pread(s->cache_file, 0, sizeof(header), &header, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to read the cache header");
+        return ret;
+    }
+
+    if (be64_to_cpu(header.magic) != LOCAL_CACHE_MAGIC) {
+        if (bs->open_flags & BDRV_O_INACTIVE) {
+            s->block_size = block_size ?: LOCAL_CACHE_DEFAULT_BLOCK_SIZE;
+            s->nb_lines = 0;
+            local_cache_init_lines(s);
+            return 0;
+        }
+        if (!s->writable) {
+            error_setg(errp, "Cache device does not contain a cache and "
+                       "cannot be formatted read-only");
+            return -EINVAL;
+        }
+        return local_cache_format(bs, block_size ?:
+                                  LOCAL_CACHE_DEFAULT_BLOCK_SIZE, errp);
+    }
+
+    header.version = be32_to_cpu(header.version);
+    header.block_size = be32_to_cpu(header.block_size);
+    header.nb_lines = be64_to_cpu(header.nb_lines);
+    header.disk_size = be64_to_cpu(header.disk_size);
+    header.table_offset = be64_to_cpu(header.table_offset);
+    header.data_offset = be64_to_cpu(header.data_offset);
+
+    if (header.version != LOCAL_CACHE_VERSION) {
+        error_setg(errp, "Unsupported cache version %" PRIu32,
+                   header.version);
+        return -ENOTSUP;
+    }
+    if (block_size && block_size != header.block_size) {
+        error_setg(errp, "Cache device uses block size %" PRIu32,
+                   header.block_size);
+        return -EINVAL;
+    }
+    if (header.disk_size != s->disk_size) {
+        error_setg(errp, "Cache device belongs to an image of %" PRIu64
+                   " bytes, but the image has %" PRIu64 " bytes",
+                   header.disk_size, s->disk_size);
+        return -EINVAL;
+    }
+
+    len = bdrv_getlength(s->cache_file->bs);
+    if (len < 0) {
+        error_setg_errno(errp, -len, "Failed to get cache device length");
+        return len;
+    }
+
+    if (!is_power_of_2(header.block_size) ||
+        header.block_size < LOCAL_CACHE_MIN_BLOCK_SIZE ||
+        header.block_size > LOCAL_CACHE_MAX_BLOCK_SIZE ||
+        !header.nb_lines || header.nb_lines > LOCAL_CACHE_MAX_LINES ||
+        header.table_offset < sizeof(header) ||
+        header.table_offset + header.nb_lines * sizeof(uint64_t) >
+            header.data_offset ||
+        header.data_offset + header.nb_lines * header.block_size > len)
+    {
+        error_setg(errp, "Cache header is corrupt");
+        return -EINVAL;
+    }
+
+    s->block_size = header.block_size;
+    s->nb_lines = header.nb_lines;
+    s->table_offset = header.table_offset;
+    s->data_offset = header.data_offset;
+
+    table = g_try_new(uint64_t, s->nb_lines);
+    if (!table) {
+        error_setg(errp, "Could not allocate the cache table");
+        return -ENOMEM;
+    }
+    ret = bdrv_pread(s->cache_file, s->table_offset,
+                     s->nb_lines * sizeof(uint64_t), table, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to read the cache table");
+        return ret;
+    }
+
+    local_cache_init_lines(s);
+    for (i = 0; i < s->nb_lines; i++) {
+        uint64_t entry = be64_to_cpu(table[i]);
+        uint64_t offset = entry & ~(uint64_t)(s->block_size - 1);
+        LocalCacheLine *line = &s->lines[i];
+
+        if (!(entry & LOCAL_CACHE_ENTRY_VALID)) {
+            continue;
+        }
+
+        line->block = offset / s->block_size;
+        if ((entry & (s->block_size - 1) & ~LOCAL_CACHE_ENTRY_FLAGS) ||
+            offset >= s->disk_size ||
+            g_hash_table_contains(s->map, &line->block))
+        {
+            error_setg(errp, "Cache table entry %" PRIu64 " is corrupt", i);
+            return -EINVAL;
+        }
+
+        line->valid = true;
+        line->dirty = entry & LOCAL_CACHE_ENTRY_DIRTY;
+        g_hash_table_insert(s->map, &line->block, line);
+        s->nb_valid++;
+        if (line->dirty) {
+            s->nb_dirty++;
+        }
+    }
+
+    local_cache_set_limits(s);
+
+    if (s->nb_dirty) {
+        trace_local_cache_recover(bs, s->nb_valid, s->nb_dirty);
+    }
+
+    return 0;
+}
+
+static void local_cache_free_lines(BDRVLocalCacheState *s)
+{
+    if (s->map) {
+        g_hash_table_destroy(s->map);
+        s->map = NULL;
+    }
+    g_free(s->lines);
+    s->lines = NULL;
+}
+
+static int local_cache_open(BlockDriverState *bs, QDict *options, int flags,
+                            Error **errp)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    QemuOpts *opts;
+    uint64_t block_size;
+    int64_t len;
+    int ret;
+
+    GLOBAL_STATE_CODE();
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    if (!qemu_opts_absorb_qdict(opts, options, errp)) {
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    block_size = qemu_opt_get_size(opts, LOCAL_CACHE_OPT_BLOCK_SIZE, 0);
+    s->max_dirty_pct = qemu_opt_get_number(opts, LOCAL_CACHE_OPT_MAX_DIRTY, 50);
+    s->writeback_threshold_pct =
+        qemu_opt_get_number(opts, LOCAL_CACHE_OPT_WRITEBACK_THRESHOLD, 25);
+
+    if (block_size && (!is_power_of_2(block_size) ||
+                       block_size < LOCAL_CACHE_MIN_BLOCK_SIZE ||
+                       block_size > LOCAL_CACHE_MAX_BLOCK_SIZE))
+    {
+        error_setg(errp, "block-size must be a power of two between %" PRId64
+                   " and %" PRId64, LOCAL_CACHE_MIN_BLOCK_SIZE,
+                   LOCAL_CACHE_MAX_BLOCK_SIZE);
+        ret = -EINVAL;
+        goto fail;
+    }
+    if (s->max_dirty_pct > 100 || s->writeback_threshold_pct > 100) {
+        error_setg(errp, "max-dirty and writeback-threshold are percentages "
+                   "and must not exceed 100");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    ret = bdrv_open_file_child(NULL, options, "file", bs, errp);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    s->cache_file = bdrv_open_child(NULL, options, "cache-file", bs,
+                                    &child_of_bds, BDRV_CHILD_METADATA,
+                                    false, errp);
+    if (!s->cache_file) {
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    qemu_co_mutex_init(&s->lock);
+    QLIST_INIT(&s->reqs);
+
+    /* Nodes are only written to once they are activated */
+    s->writable = (flags & BDRV_O_RDWR) && !(flags & BDRV_O_INACTIVE);
+
+    GRAPH_RDLOCK_GUARD_MAINLOOP();
+
+    len = bdrv_getlength(bs->file->bs);
+    if (len < 0) {
+        ret = len;
+        error_setg_errno(errp, -ret, "Failed to get image length");
+        goto fail;
+    }
+    s->disk_size = len;
+
+    /* Remembered for formatting the cache device on activation */
+    s->block_size = block_size;
+
+    ret = local_cache_load(bs, block_size, errp);
+    if (ret < 0) {
+        local_cache_free_lines(s);
+        goto fail;
+    }
+
+    if (s->block_size % bs->file->bs->bl.request_alignment ||
+        s->block_size % s->cache_file->bs->bl.request_alignment)
+    {
+        error_setg(errp, "block-size must be a multiple of the request "
+                   "alignment of the image and the cache device");
+        local_cache_free_lines(s);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    bs->supported_write_flags = 0;
+    bs->supported_zero_flags = 0;
+
+    ret = 0;
+fail:
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static int GRAPH_RDLOCK local_cache_inactivate(BlockDriverState *bs)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    int ret;
+
+    ret = local_cache_writeback_all(bs);
+    if (ret < 0) {
+        error_report("Failed to write back the cache of node '%s': %s",
+                     bdrv_get_device_or_node_name(bs), strerror(-ret));
+        return ret;
+    }
+
+    s->writable = false;
+    return 0;
+}
+
+static void GRAPH_UNLOCKED local_cache_close(BlockDriverState *bs)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+
+    GLOBAL_STATE_CODE();
+
+    bdrv_graph_rdlock_main_loop();
+    if (!(bs->open_flags & BDRV_O_INACTIVE)) {
+        local_cache_inactivate(bs);
+    }
+    bdrv_graph_rdunlock_main_loop();
+
+    local_cache_free_lines(s);
+
+    bdrv_graph_wrlock();
+    bdrv_unref_child(bs, s->cache_file);
+    s->cache_file = NULL;
+    bdrv_graph_wrunlock();
+}
+
+/*
+ * Another instance may have written to the image while the node was
+ * inactive, so the clean lines can't be trusted any more.
+ */
+static void coroutine_fn GRAPH_RDLOCK
+local_cache_co_invalidate_cache(BlockDriverState *bs, Error **errp)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    uint64_t i;
+    int ret;
+
+    s->writable = bs->open_flags & BDRV_O_RDWR;
+    if (!s->writable) {
+        return;
+    }
+
+    if (!s->nb_lines) {
+        local_cache_free_lines(s);
+        local_cache_load(bs, s->block_size, errp);
+        return;
+    }
+
+    for (i = 0; i < s->nb_lines; i++) {
+        LocalCacheLine *line = &s->lines[i];
+
+        if (!line->valid || line->dirty) {
+            continue;
+        }
+
+        ret = local_cache_co_write_entry(bs, line, 0);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Failed to invalidate the cache");
+            return;
+        }
+        g_hash_table_remove(s->map, &line->block);
+        line->valid = false;
+        s->nb_valid--;
+    }
+
+    ret = bdrv_co_flush(s->cache_file->bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to invalidate the cache");
+    }
+}
+
+static int local_cache_reopen_prepare(BDRVReopenState *reopen_state,
+                                      BlockReopenQueue *queue, Error **errp)
+{
+    BlockDriverState *bs = reopen_state->bs;
+    int ret;
+
+    GLOBAL_STATE_CODE();
+    GRAPH_RDLOCK_GUARD_MAINLOOP();
+
+    /* The cache device may be reopened read-only as well */
+    if (!(reopen_state->flags & BDRV_O_RDWR)) {
+        ret = local_cache_writeback_all(bs);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Failed to write back the cache");
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+static void local_cache_reopen_commit(BDRVReopenState *state)
+{
+    BDRVLocalCacheState *s = state->bs->opaque;
+
+    s->writable = (state->flags & BDRV_O_RDWR) &&
+                  !(state->bs->open_flags & BDRV_O_INACTIVE);
+}
+
+static int64_t coroutine_fn GRAPH_RDLOCK
+local_cache_co_getlength(BlockDriverState *bs)
+{
+    return bdrv_co_getlength(bs->file->bs);
+}
+
+/* Add the blocks of a read that missed the cache in the background */
+static void coroutine_fn local_cache_co_fill_entry(void *opaque)
+{
+    LocalCacheFill *fill = opaque;
+    BlockDriverState *bs = fill->bs;
+    BDRVLocalCacheState *s = bs->opaque;
+    int i;
+
+    bdrv_graph_co_rdlock();
+
+    for (i = 0; i < fill->nb_blocks; i++) {
+        LocalCacheBlock *block = &fill->blocks[i];
+        LocalCacheLine *line = NULL;
+
+        if (!block->fill) {
+            continue;
+        }
+
+        WITH_QEMU_LOCK_GUARD(&s->lock) {
+            line = local_cache_evict(s);
+        }
+        if (line) {
+            local_cache_co_fill_line(bs, line, fill->first + i,
+                                     fill->buf + i * s->block_size, false);
+        }
+
+        WITH_QEMU_LOCK_GUARD(&s->lock) {
+            local_cache_co_put_block(block);
+            s->nb_fills--;
+        }
+    }
+
+    bdrv_graph_co_rdunlock();
+
+    qemu_vfree(fill->buf);
+    g_free(fill->blocks);
+    g_free(fill);
+    bdrv_dec_in_flight(bs);
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+local_cache_co_preadv_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                           QEMUIOVector *qiov, size_t qiov_offset,
+                           BdrvRequestFlags flags)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    uint64_t first = offset / s->block_size;
+    int nb = DIV_ROUND_UP(offset + bytes, s->block_size) - first;
+    LocalCacheBlock *blocks = g_new(LocalCacheBlock, nb);
+    int64_t end = offset + bytes;
+    int i, j, nb_fill = 0;
+    int ret = 0;
+
+    WITH_QEMU_LOCK_GUARD(&s->lock) {
+        local_cache_co_get_blocks(s, first, nb, blocks);
+    }
+
+    /* Read cached blocks from the cache, runs of other blocks from the image */
+    for (i = 0; i < nb && ret == 0; i = j) {
+        int64_t start = MAX(offset, (first + i) * s->block_size);
+        int64_t run_end;
+
+        if (blocks[i].line) {
+            j = i + 1;
+            run_end = MIN(end, (first + j) * s->block_size);
+            ret = bdrv_co_preadv_part(s->cache_file,
+                                      local_cache_line_offset(s,
+                                                              blocks[i].line) +
+                                      start % s->block_size,
+                                      run_end - start, qiov,
+                                      qiov_offset + start - offset, 0);
+        } else {
+            for (j = i + 1; j < nb && !blocks[j].line; j++) {
+                /* Extend the run */
+            }
+            run_end = MIN(end, (first + j) * s->block_size);
+            ret = bdrv_co_preadv_part(bs->file, start, run_end - start, qiov,
+                                      qiov_offset + start - offset, 0);
+        }
+    }
+
+    WITH_QEMU_LOCK_GUARD(&s->lock) {
+        for (i = 0; i < nb; i++) {
+            uint64_t block = first + i;
+            int64_t block_start = block * s->block_size;
+
+            if (blocks[i].line) {
+                s->stats.read_hits++;
+                continue;
+            }
+            s->stats.read_misses++;
+
+            /* Only blocks that were read completely can be added */
+            blocks[i].fill = ret == 0 && s->writable &&
+                s->nb_fills < LOCAL_CACHE_MAX_FILLS &&
+                block_start >= offset &&
+                block_start + local_cache_block_bytes(s, block) <= end;
+            if (blocks[i].fill) {
+                s->nb_fills++;
+                nb_fill++;
+            }
+        }
+
+        for (i = 0; i < nb; i++) {
+            if (!blocks[i].fill) {
+                local_cache_co_put_block(&blocks[i]);
+            }
+        }
+    }
+
+    if (nb_fill) {
+        LocalCacheFill *fill = g_new(LocalCacheFill, 1);
+
+        *fill = (LocalCacheFill) {
+            .bs = bs,
+            .first = first,
+            .nb_blocks = nb,
+            .blocks = blocks,
+            .buf = qemu_blockalign0(bs, (size_t)nb * s->block_size),
+        };
+        for (i = 0; i < nb; i++) {
+            int64_t block_start = (first + i) * s->block_size;
+
+            if (blocks[i].fill) {
+                qemu_iovec_to_buf(qiov, qiov_offset + block_start - offset,
+                                  fill->buf + i * s->block_size,
+                                  local_cache_block_bytes(s, first + i));
+            }
+        }
+
+        /* The blocks stay registered until they are in the cache */
+        bdrv_inc_in_flight(bs);
+        aio_co_enter(bdrv_get_aio_context(bs),
+                     qemu_coroutine_create(local_cache_co_fill_entry, fill));
+    } else {
+        g_free(blocks);
+    }
+
+    return ret;
+}
+
+/*
+ * Marks @line dirty on the cache device before it is written to, so that a
+ * crash never leaves data in a clean line that the image does not have. If
+ * the line can't be dirty, drops it from the cache instead and returns 1:
+ * the data must then be written to the image.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+local_cache_co_mark_dirty(BlockDriverState *bs, LocalCacheLine *line)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    bool drop = false;
+    int ret;
+
+    WITH_QEMU_LOCK_GUARD(&s->lock) {
+        s->stats.write_hits++;
+        if (line->dirty) {
+            return 0;
+        }
+        if (s->nb_dirty < s->max_dirty) {
+            line->dirty = true;
+            s->nb_dirty++;
+        } else {
+            drop = true;
+        }
+    }
+
+    if (!drop) {
+        ret = local_cache_co_write_entry(bs, line, local_cache_entry(s, line));
+        if (ret == 0) {
+            ret = bdrv_co_flush(s->cache_file->bs);
+        }
+        if (ret == 0) {
+            return 0;
+        }
+        WITH_QEMU_LOCK_GUARD(&s->lock) {
+            line->dirty = false;
+            s->nb_dirty--;
+        }
+    }
+
+    WITH_QEMU_LOCK_GUARD(&s->lock) {
+        g_hash_table_remove(s->map, &line->block);
+        line->valid = false;
+        /* Until the invalid entry is flushed, see local_cache_co_fill_line() */
+        line->stale = true;
+        s->nb_valid--;
+    }
+
+    ret = local_cache_co_write_entry(bs, line, 0);
+    if (ret == 0) {
+        ret = bdrv_co_flush(s->cache_file->bs);
+    }
+    if (ret < 0) {
+        return ret;
+    }
+
+    WITH_QEMU_LOCK_GUARD(&s->lock) {
+        line->stale = false;
+    }
+    return 1;
+}
+
+/*
+ * Adds @block to the cache as a dirty line, reading the parts that are not
+ * written from the image. Returns 1 if the data must be written to the image
+ * instead because there is no room in the cache.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+local_cache_co_write_miss(BlockDriverState *bs, uint64_t block,
+                          int64_t start, int64_t end, QEMUIOVector *qiov,
+                          size_t qiov_offset, uint8_t *buf)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    int64_t block_start = block * s->block_size;
+    int64_t block_bytes = local_cache_block_bytes(s, block);
+    LocalCacheLine *line = NULL;
+    int ret;
+
+    WITH_QEMU_LOCK_GUARD(&s->lock) {
+        if (s->nb_dirty < s->max_dirty) {
+            line = local_cache_evict(s);
+        }
+        if (!line) {
+            return 1;
+        }
+        /* Reserve the dirty line so that parallel writes respect the limit */
+        s->nb_dirty++;
+    }
+
+    memset(buf + block_bytes, 0, s->block_size - block_bytes);
+    if (start > block_start || end < block_start + block_bytes) {
+        ret = bdrv_co_pread(bs->file, block_start, block_bytes, buf, 0);
+        if (ret < 0) {
+            WITH_QEMU_LOCK_GUARD(&s->lock) {
+                line->busy--;
+                s->nb_dirty--;
+            }
+            return ret;
+        }
+    }
+    qemu_iovec_to_buf(qiov, qiov_offset, buf + start - block_start,
+                      end - start);
+
+    ret = local_cache_co_fill_line(bs, line, block, buf, true);
+
+    WITH_QEMU_LOCK_GUARD(&s->lock) {
+        if (ret < 0) {
+            s->nb_dirty--;
+        } else {
+            s->stats.write_misses++;
+        }
+    }
+
+    return ret < 0 ? 1 : 0;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+local_cache_co_pwritev_part(BlockDriverState *bs, int64_t offset,
+                            int64_t bytes, QEMUIOVector *qiov,
+                            size_t qiov_offset, BdrvRequestFlags flags)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    uint64_t first = offset / s->block_size;
+    int nb = DIV_ROUND_UP(offset + bytes, s->block_size) - first;
+    g_autofree LocalCacheBlock *blocks = g_new(LocalCacheBlock, nb);
+    int64_t end = offset + bytes;
+    int64_t through_start = 0, through_end = 0;
+    uint8_t *buf = NULL;
+    int i, ret = 0;
+
+    WITH_QEMU_LOCK_GUARD(&s->lock) {
+        local_cache_co_get_blocks(s, first, nb, blocks);
+    }
+
+    for (i = 0; i < nb && ret == 0; i++) {
+        uint64_t block = first + i;
+        int64_t start = MAX(offset, block * s->block_size);
+        int64_t block_end = MIN(end, (block + 1) * s->block_size);
+        LocalCacheLine *line = blocks[i].line;
+        bool through;
+
+        if (line) {
+            ret = local_cache_co_mark_dirty(bs, line);
+            if (ret < 0) {
+                break;
+            }
+            through = ret;
+            ret = 0;
+            if (!through) {
+                ret = bdrv_co_pwritev_part(s->cache_file,
+                                           local_cache_line_offset(s, line) +
+                                           start % s->block_size,
+                                           block_end - start, qiov,
+                                           qiov_offset + start - offset, 0);
+                if (ret < 0) {
+                    break;
+                }
+            }
+        } else {
+            if (!buf) {
+                buf = qemu_blockalign(bs, s->block_size);
+            }
+            ret = local_cache_co_write_miss(bs, block, start, block_end, qiov,
+                                            qiov_offset + start - offset,
+                                            buf);
+            if (ret < 0) {
+                break;
+            }
+            through = ret;
+            ret = 0;
+        }
+
+        if (!through) {
+            continue;
+        }
+
+        /* Coalesce blocks that are written to the image */
+        if (through_end != start) {
+            if (through_end > through_start) {
+                trace_local_cache_write_through(bs, through_start,
+                                                through_end - through_start);
+                ret = bdrv_co_pwritev_part(bs->file, through_start,
+                                           through_end - through_start, qiov,
+                                           qiov_offset + through_start -
+                                           offset, 0);
+            }
+            through_start = start;
+        }
+        through_end = block_end;
+
+        WITH_QEMU_LOCK_GUARD(&s->lock) {
+            s->stats.write_through++;
+        }
+    }
+
+    if (ret == 0 && through_end > through_start) {
+        trace_local_cache_write_through(bs, through_start,
+                                        through_end - through_start);
+        ret = bdrv_co_pwritev_part(bs->file, through_start,
+                                   through_end - through_start, qiov,
+                                   qiov_offset + through_start - offset, 0);
+    }
+
+    qemu_vfree(buf);
+
+    WITH_QEMU_LOCK_GUARD(&s->lock) {
+        for (i = 0; i < nb; i++) {
+            local_cache_co_put_block(&blocks[i]);
+        }
+        local_cache_kick_writeback(bs);
+    }
+
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+local_cache_co_pdiscard(BlockDriverState *bs, int64_t offset, int64_t bytes)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    uint64_t first = offset / s->block_size;
+    int nb = DIV_ROUND_UP(offset + bytes, s->block_size) - first;
+    g_autofree LocalCacheBlock *blocks = g_new(LocalCacheBlock, nb);
+    g_autofree bool *dropped = g_new0(bool, nb);
+    bool any_dropped = false;
+    int i, ret;
+
+    WITH_QEMU_LOCK_GUARD(&s->lock) {
+        local_cache_co_get_blocks(s, first, nb, blocks);
+    }
+
+    /* Drop the blocks that are discarded completely */
+    for (i = 0; i < nb; i++) {
+        LocalCacheLine *line = blocks[i].line;
+        int64_t block_start = (first + i) * s->block_size;
+
+        if (!line || block_start < offset ||
+            block_start + local_cache_block_bytes(s, first + i) >
+                offset + bytes)
+        {
+            continue;
+        }
+
+        ret = local_cache_co_write_entry(bs, line, 0);
+        dropped[i] = ret == 0;
+        any_dropped = true;
+
+        WITH_QEMU_LOCK_GUARD(&s->lock) {
+            g_hash_table_remove(s->map, &line->block);
+            line->valid = false;
+            /* Until the invalid entry is flushed, see local_cache_co_fill_line() */
+            line->stale = true;
+            s->nb_valid--;
+            if (line->dirty) {
+                line->dirty = false;
+                s->nb_dirty--;
+            }
+        }
+    }
+
+    ret = any_dropped ? bdrv_co_flush(s->cache_file->bs) : 0;
+
+    WITH_QEMU_LOCK_GUARD(&s->lock) {
+        for (i = 0; i < nb; i++) {
+            if (dropped[i] && ret == 0) {
+                blocks[i].line->stale = false;
+            }
+            local_cache_co_put_block(&blocks[i]);
+        }
+    }
+    if (ret < 0) {
+        return ret;
+    }
+
+    return bdrv_co_pdiscard(bs->file, offset, bytes);
+}
+
+/* Called with lock held */
+static bool local_cache_is_dirty(BDRVLocalCacheState *s, uint64_t block)
+{
+    LocalCacheLine *line = g_hash_table_lookup(s->map, &block);
+
+    return line && line->dirty;
+}
+
+/*
+ * Dirty blocks are only in the cache, everything else can be looked up in
+ * the image.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+local_cache_co_block_status(BlockDriverState *bs, bool want_zero,
+                            int64_t offset, int64_t bytes, int64_t *pnum,
+                            int64_t *map, BlockDriverState **file)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    int64_t end = offset + bytes;
+    int64_t pos;
+    bool dirty;
+
+    QEMU_LOCK_GUARD(&s->lock);
+
+    if (!s->nb_dirty) {
+        *pnum = bytes;
+        dirty = false;
+    } else {
+        dirty = local_cache_is_dirty(s, offset / s->block_size);
+        pos = QEMU_ALIGN_DOWN(offset, s->block_size) + s->block_size;
+        while (pos < end &&
+               local_cache_is_dirty(s, pos / s->block_size) == dirty) {
+            pos += s->block_size;
+        }
+        *pnum = MIN(pos, end) - offset;
+    }
+
+    if (dirty) {
+        return BDRV_BLOCK_DATA;
+    }
+
+    *map = offset;
+    *file = bs->file->bs;
+    return BDRV_BLOCK_RAW | BDRV_BLOCK_OFFSET_VALID;
+}
+
+static void GRAPH_RDLOCK
+local_cache_refresh_limits(BlockDriverState *bs, Error **errp)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+
+    if (!s->cache_file) {
+        return;
+    }
+
+    bs->bl.request_alignment = MAX(bs->file->bs->bl.request_alignment,
+                                   s->cache_file->bs->bl.request_alignment);
+    bs->bl.opt_transfer = MAX(bs->bl.opt_transfer, s->block_size);
+}
+
+static BlockStatsSpecific *local_cache_get_specific_stats(BlockDriverState *bs)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    BlockStatsSpecific *stats = g_new(BlockStatsSpecific, 1);
+
+    stats->driver = BLOCKDEV_DRIVER_LOCAL_CACHE;
+    stats->u.local_cache = s->stats;
+    stats->u.local_cache.cached_blocks = s->nb_valid;
+    stats->u.local_cache.dirty_blocks = s->nb_dirty;
+    stats->u.local_cache.total_blocks = s->nb_lines;
+
+    return stats;
+}
+
+static BlockDriver bdrv_local_cache = {
+    .format_name                = "local-cache",
+    .instance_size              = sizeof(BDRVLocalCacheState),
+
+    .bdrv_open                  = local_cache_open,
+    .bdrv_close                 = local_cache_close,
+    .bdrv_inactivate            = local_cache_inactivate,
+    .bdrv_co_invalidate_cache   = local_cache_co_invalidate_cache,
+    .bdrv_reopen_prepare        = local_cache_reopen_prepare,
+    .bdrv_reopen_commit         = local_cache_reopen_commit,
+    .bdrv_child_perm            = bdrv_default_perms,
+    .bdrv_refresh_limits        = local_cache_refresh_limits,
+
+    .bdrv_co_getlength          = local_cache_co_getlength,
+    .bdrv_co_preadv_part        = local_cache_co_preadv_part,
+    .bdrv_co_pwritev_part       = local_cache_co_pwritev_part,
+    .bdrv_co_pdiscard           = local_cache_co_pdiscard,
+    .bdrv_co_block_status       = local_cache_co_block_status,
+
+    .bdrv_get_specific_stats    = local_cache_get_specific_stats,
+};
+
+static void bdrv_local_cache_init(void)
+{
+    bdrv_register(&bdrv_local_cache);
+}
+
+block_init(bdrv_local_cache_init);
@@ -36,6 +36,7 @@
 #define NVME_CQ_ENTRY_BYTES 16
 #define NVME_QUEUE_SIZE 128
 #define NVME_DOORBELL_SIZE 4096
+#define NVME_MAX_IO_QUEUES 64
 
 /*
  * We have to leave one slot empty as that is the full queue case where
@@ -49,7 +50,11 @@ typedef struct BDRVNVMeState BDRVNVMeState;
 #define INDEX_ADMIN     0
 #define INDEX_IO(n)     (1 + n)
 
-/* This driver shares a single MSIX IRQ for the admin and I/O queues */
+/*
+ * The admin queue uses MSIX vector 0.  If the device has enough vectors, each
+ * I/O queue gets its own, with the same index as the queue; otherwise the
+ * single I/O queue shares vector 0 with the admin queue.
+ */
 enum {
     MSIX_SHARED_IRQ_IDX = 0,
     MSIX_IRQ_COUNT = 1
@@ -69,6 +74,7 @@ typedef struct {
     int cid;
     void *prp_list_page;
     uint64_t prp_list_iova;
+    uint32_t *result; /* if not NULL, receives Dword 0 of the completion */
     int free_req_next; /* q->reqs[] index of next free req */
 } NVMeRequest;
 
@@ -78,9 +84,18 @@ typedef struct {
     /* Read from I/O code path, initialized under BQL */
     BDRVNVMeState   *s;
     int             index;
+    unsigned        vector;
+
+    /*
+     * The event loop that processes completions of this queue pair, or NULL
+     * if no AioContext uses it.  Only changed in drained sections or, for
+     * a queue pair that is not in use, under s->queue_bind_lock.
+     */
+    AioContext      *ctx;
 
     /* Fields protected by BQL */
     uint8_t     *prp_list_pages;
+    EventNotifier irq_notifier; /* unless vector == MSIX_SHARED_IRQ_IDX */
 
     /* Fields protected by @lock */
     CoQueue     free_req_queue;
@@ -90,13 +105,18 @@ typedef struct {
     NVMeRequest reqs[NVME_NUM_REQS];
     int         need_kick;
     int         inflight;
+    struct {
+        uint64_t submitted;
+        uint64_t completed;
+        uint64_t completion_errors;
+        uint64_t free_req_waits;
+    } stats;
 
     /* Thread-safe, no lock necessary */
     QEMUBH      *completion_bh;
 } NVMeQueuePair;
 
 struct BDRVNVMeState {
-    AioContext *aio_context;
     QEMUVFIOState *vfio;
     void *bar0_wo_map;
     /* Memory mapped registers */
@@ -107,9 +127,25 @@ struct BDRVNVMeState {
     /* The submission/completion queue pairs.
      * [0]: admin queue.
      * [1..]: io queues.
+     *
+     * The array is allocated for max_io_queues I/O queues when the device
+     * is opened.  I/O queues are created on demand, one per AioContext that
+     * submits requests, and published by incrementing queue_count.
      */
     NVMeQueuePair **queues;
     unsigned queue_count;
+    unsigned max_io_queues;
+    unsigned nr_vectors;
+
+    /* Serializes binding and creation of I/O queues */
+    CoMutex queue_bind_lock;
+
+    /*
+     * Set when there are more AioContexts than I/O queues.  The remaining
+     * AioContexts share the existing queues.
+     */
+    bool io_queues_exhausted;
+    unsigned next_shared_queue;
     size_t page_size;
     /* How many uint32_t elements does each doorbell entry take. */
     size_t doorbell_scale;
@@ -135,7 +171,6 @@ struct BDRVNVMeState {
     char *device;
 
     struct {
-        uint64_t completion_errors;
         uint64_t aligned_accesses;
         uint64_t unaligned_accesses;
     } stats;
@@ -143,8 +178,10 @@ struct BDRVNVMeState {
 
 #define NVME_BLOCK_OPT_DEVICE "device"
 #define NVME_BLOCK_OPT_NAMESPACE "namespace"
+#define NVME_BLOCK_OPT_MAX_IO_QUEUES "max-io-queues"
 
 static void nvme_process_completion_bh(void *opaque);
+static void nvme_poll_queue(NVMeQueuePair *q);
 
 static QemuOptsList runtime_opts = {
     .name = "nvme",
@@ -160,6 +197,11 @@ static QemuOptsList runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "NVMe namespace",
         },
+        {
+            .name = NVME_BLOCK_OPT_MAX_IO_QUEUES,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Maximum number of I/O queue pairs",
+        },
         { /* end of list */ }
     },
 };
@@ -192,11 +234,67 @@ static void nvme_free_queue(NVMeQueue *q)
     qemu_vfree(q->queue);
 }
 
+static void nvme_handle_queue_event(EventNotifier *n)
+{
+    NVMeQueuePair *q = container_of(n, NVMeQueuePair, irq_notifier);
+
+    trace_nvme_handle_queue_event(q->s, q->index);
+    event_notifier_test_and_clear(n);
+    nvme_poll_queue(q);
+}
+
+static bool nvme_queue_poll_cb(void *opaque)
+{
+    EventNotifier *e = opaque;
+    NVMeQueuePair *q = container_of(e, NVMeQueuePair, irq_notifier);
+    const size_t cqe_offset = q->cq.head * NVME_CQ_ENTRY_BYTES;
+    NvmeCqe *cqe = (NvmeCqe *)&q->cq.queue[cqe_offset];
+
+    return (le16_to_cpu(cqe->status) & 0x1) != q->cq_phase;
+}
+
+static void nvme_queue_poll_ready(EventNotifier *e)
+{
+    nvme_poll_queue(container_of(e, NVMeQueuePair, irq_notifier));
+}
+
+/* Process completions of @q in @ctx from now on */
+static void nvme_attach_queue(NVMeQueuePair *q, AioContext *ctx)
+{
+    assert(!q->ctx);
+    trace_nvme_attach_queue(q->s, q->index, ctx);
+    q->completion_bh = aio_bh_new(ctx, nvme_process_completion_bh, q);
+    if (q->vector != MSIX_SHARED_IRQ_IDX) {
+        aio_set_event_notifier(ctx, &q->irq_notifier,
+                               nvme_handle_queue_event, nvme_queue_poll_cb,
+                               nvme_queue_poll_ready);
+    }
+    qatomic_store_release(&q->ctx, ctx);
+}
+
+/* Called with no requests in flight on @q */
+static void nvme_detach_queue(NVMeQueuePair *q)
+{
+    if (!q->ctx) {
+        return;
+    }
+    trace_nvme_detach_queue(q->s, q->index, q->ctx);
+    if (q->vector != MSIX_SHARED_IRQ_IDX) {
+        aio_set_event_notifier(q->ctx, &q->irq_notifier, NULL, NULL, NULL);
+    }
+    qemu_bh_delete(q->completion_bh);
+    q->completion_bh = NULL;
+    qatomic_set(&q->ctx, NULL);
+}
+
 static void nvme_free_queue_pair(NVMeQueuePair *q)
 {
     trace_nvme_free_queue_pair(q->index, q, &q->cq, &q->sq);
-    if (q->completion_bh) {
-        qemu_bh_delete(q->completion_bh);
+    nvme_detach_queue(q);
+    if (q->vector != MSIX_SHARED_IRQ_IDX) {
+        qemu_vfio_pci_set_irq(q->s->vfio, VFIO_PCI_MSIX_IRQ_INDEX, q->vector,
+                              NULL, NULL);
+        event_notifier_cleanup(&q->irq_notifier);
     }
     nvme_free_queue(&q->sq);
     nvme_free_queue(&q->cq);
@@ -218,9 +316,8 @@ static void nvme_free_req_queue_cb(void *opaque)
 }
 
 static NVMeQueuePair *nvme_create_queue_pair(BDRVNVMeState *s,
-                                             AioContext *aio_context,
-                                             unsigned idx, size_t size,
-                                             Error **errp)
+                                             unsigned idx, unsigned vector,
+                                             size_t size, Error **errp)
 {
     ERRP_GUARD();
     int i, r;
@@ -233,8 +330,7 @@ static NVMeQueuePair *nvme_create_queue_pair(BDRVNVMeState *s,
         error_setg(errp, "Cannot allocate queue pair");
         return NULL;
     }
-    trace_nvme_create_queue_pair(idx, q, size, aio_context,
-                                 event_notifier_get_fd(s->irq_notifier));
+    trace_nvme_create_queue_pair(idx, q, size, vector);
     bytes = QEMU_ALIGN_UP(s->page_size * NVME_NUM_REQS,
                           qemu_real_host_page_size());
     q->prp_list_pages = qemu_try_memalign(qemu_real_host_page_size(), bytes);
@@ -247,7 +343,20 @@ static NVMeQueuePair *nvme_create_queue_pair(BDRVNVMeState *s,
     q->s = s;
     q->index = idx;
     qemu_co_queue_init(&q->free_req_queue);
-    q->completion_bh = aio_bh_new(aio_context, nvme_process_completion_bh, q);
+    if (vector != MSIX_SHARED_IRQ_IDX) {
+        r = event_notifier_init(&q->irq_notifier, 0);
+        if (r) {
+            error_setg(errp, "Failed to init event notifier");
+            goto fail;
+        }
+        r = qemu_vfio_pci_set_irq(s->vfio, VFIO_PCI_MSIX_IRQ_INDEX, vector,
+                                  &q->irq_notifier, errp);
+        if (r) {
+            event_notifier_cleanup(&q->irq_notifier);
+            goto fail;
+        }
+        q->vector = vector;
+    }
     r = qemu_vfio_dma_map(s->vfio, q->prp_list_pages, bytes,
                           false, &prp_list_iova, errp);
     if (r) {
@@ -327,6 +436,7 @@ static coroutine_fn NVMeRequest *nvme_get_free_req(NVMeQueuePair *q)
 
     while (q->free_req_head == -1) {
         trace_nvme_free_req_queue_wait(q->s, q->index);
+        q->stats.free_req_waits++;
         qemu_co_queue_wait(&q->free_req_queue, &q->lock);
     }
 
@@ -344,8 +454,7 @@ static void nvme_put_free_req_locked(NVMeQueuePair *q, NVMeRequest *req)
 static void nvme_wake_free_req_locked(NVMeQueuePair *q)
 {
     if (!qemu_co_queue_empty(&q->free_req_queue)) {
-        replay_bh_schedule_oneshot_event(q->s->aio_context,
-                nvme_free_req_queue_cb, q);
+        replay_bh_schedule_oneshot_event(q->ctx, nvme_free_req_queue_cb, q);
     }
 }
 
@@ -411,8 +520,9 @@ static bool nvme_process_completion(NVMeQueuePair *q)
             break;
         }
         ret = nvme_translate_error(c);
+        q->stats.completed++;
         if (ret) {
-            s->stats.completion_errors++;
+            q->stats.completion_errors++;
         }
         q->cq.head = (q->cq.head + 1) % NVME_QUEUE_SIZE;
         if (!q->cq.head) {
@@ -430,8 +540,12 @@ static bool nvme_process_completion(NVMeQueuePair *q)
         req = *preq;
         assert(req.cid == cid);
         assert(req.cb);
+        if (req.result) {
+            *req.result = le32_to_cpu(c->result);
+        }
         nvme_put_free_req_locked(q, preq);
         preq->cb = preq->opaque = NULL;
+        preq->result = NULL;
         q->inflight--;
         qemu_mutex_unlock(&q->lock);
         req.cb(req.opaque, ret);
@@ -505,11 +619,35 @@ static void nvme_submit_command(NVMeQueuePair *q, NVMeRequest *req,
            q->sq.tail * NVME_SQ_ENTRY_BYTES, cmd, sizeof(*cmd));
     q->sq.tail = (q->sq.tail + 1) % NVME_QUEUE_SIZE;
     q->need_kick++;
+    q->stats.submitted++;
     qemu_mutex_unlock(&q->lock);
 
     defer_call(nvme_deferred_fn, q);
 }
 
+typedef struct {
+    Coroutine *co;
+    int ret;
+    AioContext *ctx;
+} NVMeCoData;
+
+static void nvme_rw_cb_bh(void *opaque)
+{
+    NVMeCoData *data = opaque;
+    qemu_coroutine_enter(data->co);
+}
+
+static void nvme_rw_cb(void *opaque, int ret)
+{
+    NVMeCoData *data = opaque;
+    data->ret = ret;
+    if (!data->co) {
+        /* The rw coroutine hasn't yielded, don't try to enter. */
+        return;
+    }
+    replay_bh_schedule_oneshot_event(data->ctx, nvme_rw_cb_bh, data);
+}
+
 static void nvme_admin_cmd_sync_cb(void *opaque, int ret)
 {
     int *pret = opaque;
@@ -517,7 +655,12 @@ static void nvme_admin_cmd_sync_cb(void *opaque, int ret)
     aio_wait_kick();
 }
 
-static int nvme_admin_cmd_sync(BlockDriverState *bs, NvmeCmd *cmd)
+/*
+ * Submit an admin command and wait for its completion.  If @result is not
+ * NULL, it receives Dword 0 of the completion queue entry.
+ */
+static int nvme_admin_cmd_sync_result(BlockDriverState *bs, NvmeCmd *cmd,
+                                      uint32_t *result)
 {
     BDRVNVMeState *s = bs->opaque;
     NVMeQueuePair *q = s->queues[INDEX_ADMIN];
@@ -528,12 +671,67 @@ static int nvme_admin_cmd_sync(BlockDriverState *bs, NvmeCmd *cmd)
     if (!req) {
         return -EBUSY;
     }
+    req->result = result;
     nvme_submit_command(q, req, cmd, nvme_admin_cmd_sync_cb, &ret);
 
     AIO_WAIT_WHILE(aio_context, ret == -EINPROGRESS);
     return ret;
 }
 
+static int nvme_admin_cmd_sync(BlockDriverState *bs, NvmeCmd *cmd)
+{
+    return nvme_admin_cmd_sync_result(bs, cmd, NULL);
+}
+
+/*
+ * Runs in the node's AioContext, which may be another thread than the one of
+ * the waiting coroutine: publish the result and let a BH in the coroutine's
+ * own AioContext enter it, once it has certainly yielded.
+ */
+static void nvme_admin_cmd_co_cb(void *opaque, int ret)
+{
+    NVMeCoData *data = opaque;
+
+    qatomic_store_release(&data->ret, ret);
+    aio_bh_schedule_oneshot(data->ctx, nvme_rw_cb_bh, data);
+}
+
+/*
+ * Like nvme_admin_cmd_sync(), but usable from a coroutine in any AioContext.
+ * Completions of the admin queue are processed in the node's AioContext.
+ */
+static int coroutine_fn nvme_admin_cmd_co(BlockDriverState *bs, NvmeCmd *cmd)
+{
+    BDRVNVMeState *s = bs->opaque;
+    NVMeQueuePair *q = s->queues[INDEX_ADMIN];
+    NVMeRequest *req;
+    NVMeCoData data = {
+        .co = qemu_coroutine_self(),
+        .ctx = qemu_get_current_aio_context(),
+        .ret = -EINPROGRESS,
+    };
+
+    req = nvme_get_free_req(q);
+    assert(req);
+    nvme_submit_command(q, req, cmd, nvme_admin_cmd_co_cb, &data);
+
+    /* Always yield, the BH is scheduled even if the command completed */
+    do {
+        qemu_coroutine_yield();
+    } while (qatomic_load_acquire(&data.ret) == -EINPROGRESS);
+
+    return data.ret;
+}
+
+static int coroutine_mixed_fn nvme_admin_cmd(BlockDriverState *bs,
+                                             NvmeCmd *cmd)
+{
+    if (qemu_in_coroutine()) {
+        return nvme_admin_cmd_co(bs, cmd);
+    }
+    return nvme_admin_cmd_sync(bs, cmd);
+}
+
 /* Returns true on success, false on failure. */
 static bool nvme_identify(BlockDriverState *bs, int namespace, Error **errp)
 {
@@ -647,12 +845,15 @@ static void nvme_poll_queue(NVMeQueuePair *q)
     qemu_mutex_unlock(&q->lock);
 }
 
+/* Poll the queues that signal completions through the shared vector */
 static void nvme_poll_queues(BDRVNVMeState *s)
 {
-    int i;
+    unsigned i, n = qatomic_load_acquire(&s->queue_count);
 
-    for (i = 0; i < s->queue_count; i++) {
-        nvme_poll_queue(s->queues[i]);
+    for (i = 0; i < n; i++) {
+        if (s->queues[i]->vector == MSIX_SHARED_IRQ_IDX) {
+            nvme_poll_queue(s->queues[i]);
+        }
     }
 }
 
@@ -666,27 +867,34 @@ static void nvme_handle_event(EventNotifier *n)
     nvme_poll_queues(s);
 }
 
-static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
+/*
+ * Create a new I/O queue pair whose completions are processed in @ctx.
+ * Called from the main loop during initialization, and later with
+ * s->queue_bind_lock held.
+ */
+static NVMeQueuePair * coroutine_mixed_fn
+nvme_add_io_queue(BlockDriverState *bs, AioContext *ctx, Error **errp)
 {
     BDRVNVMeState *s = bs->opaque;
     unsigned n = s->queue_count;
+    unsigned vector = s->nr_vectors > 1 ? n : MSIX_SHARED_IRQ_IDX;
     NVMeQueuePair *q;
     NvmeCmd cmd;
     unsigned queue_size = NVME_QUEUE_SIZE;
 
     assert(n <= UINT16_MAX);
-    q = nvme_create_queue_pair(s, bdrv_get_aio_context(bs),
-                               n, queue_size, errp);
+    assert(n < INDEX_IO(s->max_io_queues));
+    q = nvme_create_queue_pair(s, n, vector, queue_size, errp);
     if (!q) {
-        return false;
+        return NULL;
     }
     cmd = (NvmeCmd) {
         .opcode = NVME_ADM_CMD_CREATE_CQ,
         .dptr.prp1 = cpu_to_le64(q->cq.iova),
         .cdw10 = cpu_to_le32(((queue_size - 1) << 16) | n),
-        .cdw11 = cpu_to_le32(NVME_CQ_IEN | NVME_CQ_PC),
+        .cdw11 = cpu_to_le32(NVME_CQ_IEN | NVME_CQ_PC | (vector << 16)),
     };
-    if (nvme_admin_cmd_sync(bs, &cmd)) {
+    if (nvme_admin_cmd(bs, &cmd)) {
         error_setg(errp, "Failed to create CQ io queue [%u]", n);
         goto out_error;
     }
@@ -696,17 +904,114 @@ static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
         .cdw10 = cpu_to_le32(((queue_size - 1) << 16) | n),
         .cdw11 = cpu_to_le32(NVME_SQ_PC | (n << 16)),
     };
-    if (nvme_admin_cmd_sync(bs, &cmd)) {
+    if (nvme_admin_cmd(bs, &cmd)) {
         error_setg(errp, "Failed to create SQ io queue [%u]", n);
+        cmd = (NvmeCmd) {
+            .opcode = NVME_ADM_CMD_DELETE_CQ,
+            .cdw10 = cpu_to_le32(n),
+        };
+        nvme_admin_cmd(bs, &cmd);
         goto out_error;
     }
-    s->queues = g_renew(NVMeQueuePair *, s->queues, n + 1);
+    nvme_attach_queue(q, ctx);
     s->queues[n] = q;
-    s->queue_count++;
-    return true;
+    qatomic_store_release(&s->queue_count, n + 1);
+    return q;
 out_error:
     nvme_free_queue_pair(q);
-    return false;
+    return NULL;
+}
+
+/*
+ * Find an I/O queue pair for requests submitted from @ctx: a queue pair that
+ * is not used by any AioContext yet, or a new one if the limit allows it.
+ * Returns NULL if all queue pairs are already used by other AioContexts.
+ */
+static NVMeQueuePair * coroutine_fn
+nvme_bind_io_queue(BlockDriverState *bs, AioContext *ctx)
+{
+    BDRVNVMeState *s = bs->opaque;
+    Error *local_err = NULL;
+    NVMeQueuePair *q;
+    unsigned i;
+
+    QEMU_LOCK_GUARD(&s->queue_bind_lock);
+
+    /* Another coroutine in @ctx may have been faster */
+    for (i = INDEX_IO(0); i < s->queue_count; i++) {
+        if (s->queues[i]->ctx == ctx) {
+            return s->queues[i];
+        }
+    }
+
+    for (i = INDEX_IO(0); i < s->queue_count; i++) {
+        if (!s->queues[i]->ctx) {
+            nvme_attach_queue(s->queues[i], ctx);
+            return s->queues[i];
+        }
+    }
+
+    if (s->queue_count < INDEX_IO(s->max_io_queues)) {
+        q = nvme_add_io_queue(bs, ctx, &local_err);
+        if (q) {
+            return q;
+        }
+        warn_reportf_err(local_err, "nvme: Cannot add I/O queue, "
+                         "AioContexts will share the existing ones: ");
+        s->max_io_queues = s->queue_count - INDEX_IO(0);
+    }
+
+    qatomic_set(&s->io_queues_exhausted, true);
+    return NULL;
+}
+
+/* Returns the I/O queue pair to use for requests from the current thread */
+static NVMeQueuePair * coroutine_fn nvme_get_io_queue(BlockDriverState *bs)
+{
+    BDRVNVMeState *s = bs->opaque;
+    AioContext *ctx = qemu_get_current_aio_context();
+    unsigned i, n = qatomic_load_acquire(&s->queue_count);
+    NVMeQueuePair *q;
+
+    assert(n > INDEX_IO(0));
+    for (i = INDEX_IO(0); i < n; i++) {
+        if (qatomic_read(&s->queues[i]->ctx) == ctx) {
+            return s->queues[i];
+        }
+    }
+
+    if (!qatomic_read(&s->io_queues_exhausted)) {
+        q = nvme_bind_io_queue(bs, ctx);
+        if (q) {
+            return q;
+        }
+        n = qatomic_load_acquire(&s->queue_count);
+    }
+
+    /* Spread requests from AioContexts without a queue pair over all of them */
+    i = qatomic_fetch_inc(&s->next_shared_queue) % (n - INDEX_IO(0));
+    return s->queues[INDEX_IO(i)];
+}
+
+/*
+ * Returns the number of I/O queues that the controller granted, out of
+ * @nr_queues.  This must be called before creating any I/O queue.
+ */
+static unsigned nvme_set_num_queues(BlockDriverState *bs, unsigned nr_queues)
+{
+    uint32_t result;
+    NvmeCmd cmd = {
+        .opcode = NVME_ADM_CMD_SET_FEATURES,
+        .cdw10 = cpu_to_le32(NVME_NUMBER_OF_QUEUES),
+        .cdw11 = cpu_to_le32(((nr_queues - 1) << 16) | (nr_queues - 1)),
+    };
+
+    if (nvme_admin_cmd_sync_result(bs, &cmd, &result)) {
+        /* Every controller supports at least one I/O queue pair */
+        return 1;
+    }
+    return MIN(nr_queues, MIN(extract32(result, 0, 16),
+                              extract32(result, 16, 16)) + 1);
 }
 
 static bool nvme_poll_cb(void *opaque)
@@ -714,13 +1019,17 @@ static bool nvme_poll_cb(void *opaque)
     EventNotifier *e = opaque;
     BDRVNVMeState *s = container_of(e, BDRVNVMeState,
                                     irq_notifier[MSIX_SHARED_IRQ_IDX]);
-    int i;
+    unsigned i, n = qatomic_load_acquire(&s->queue_count);
 
-    for (i = 0; i < s->queue_count; i++) {
+    for (i = 0; i < n; i++) {
         NVMeQueuePair *q = s->queues[i];
         const size_t cqe_offset = q->cq.head * NVME_CQ_ENTRY_BYTES;
         NvmeCqe *cqe = (NvmeCqe *)&q->cq.queue[cqe_offset];
 
+        if (q->vector != MSIX_SHARED_IRQ_IDX) {
+            continue;
+        }
+
         /*
          * q->lock isn't needed because nvme_process_completion() only runs in
          * the event loop thread and cannot race with itself.
@@ -741,7 +1050,7 @@ static void nvme_poll_ready(EventNotifier *e)
 }
 
 static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
-                     Error **errp)
+                     unsigned max_io_queues, Error **errp)
 {
     BDRVNVMeState *s = bs->opaque;
     NVMeQueuePair *q;
@@ -754,10 +1063,10 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
     volatile NvmeBar *regs = NULL;
 
     qemu_co_mutex_init(&s->dma_map_lock);
+    qemu_co_mutex_init(&s->queue_bind_lock);
     qemu_co_queue_init(&s->dma_flush_queue);
     s->device = g_strdup(device);
     s->nsid = namespace;
-    s->aio_context = bdrv_get_aio_context(bs);
     ret = event_notifier_init(&s->irq_notifier[MSIX_SHARED_IRQ_IDX], 0);
     if (ret) {
         error_setg(errp, "Failed to init event notifier");
@@ -835,11 +1144,13 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
 
     /* Set up admin queue. */
     s->queues = g_new(NVMeQueuePair *, 1);
-    q = nvme_create_queue_pair(s, aio_context, 0, NVME_QUEUE_SIZE, errp);
+    q = nvme_create_queue_pair(s, INDEX_ADMIN, MSIX_SHARED_IRQ_IDX,
+                               NVME_QUEUE_SIZE, errp);
     if (!q) {
         ret = -EINVAL;
         goto out;
     }
+    nvme_attach_queue(q, aio_context);
     s->queues[INDEX_ADMIN] = q;
     s->queue_count = 1;
     QEMU_BUILD_BUG_ON((NVME_QUEUE_SIZE - 1) & 0xF000);
@@ -865,11 +1176,22 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
         }
     }
 
-    ret = qemu_vfio_pci_init_irq(s->vfio, s->irq_notifier,
-                                 VFIO_PCI_MSIX_IRQ_INDEX, errp);
+    /* All doorbells must fit in the mapped area */
+    max_io_queues = MIN(max_io_queues,
+                        NVME_DOORBELL_SIZE /
+                        (sizeof(*s->doorbells) * s->doorbell_scale) - 1);
+    s->nr_vectors = 1 + max_io_queues;
+    ret = qemu_vfio_pci_init_irqs(s->vfio, s->irq_notifier,
+                                  VFIO_PCI_MSIX_IRQ_INDEX, &s->nr_vectors,
+                                  errp);
     if (ret) {
         goto out;
     }
+    if (s->nr_vectors == 1) {
+        max_io_queues = 1;
+    } else {
+        max_io_queues = MIN(max_io_queues, s->nr_vectors - 1);
+    }
     aio_set_event_notifier(bdrv_get_aio_context(bs),
                            &s->irq_notifier[MSIX_SHARED_IRQ_IDX],
                            nvme_handle_event, nvme_poll_cb,
@@ -881,7 +1203,11 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
     }
 
     /* Set up command queues. */
-    if (!nvme_add_io_queue(bs, errp)) {
+    s->max_io_queues = nvme_set_num_queues(bs, max_io_queues);
+    trace_nvme_io_queues(s, max_io_queues, s->max_io_queues, s->nr_vectors);
+    s->queues = g_renew(NVMeQueuePair *, s->queues,
+                        INDEX_IO(s->max_io_queues));
+    if (!nvme_add_io_queue(bs, aio_context, errp)) {
         ret = -EIO;
     }
 out:
@@ -973,6 +1299,7 @@ static int nvme_open(BlockDriverState *bs, QDict *options, int flags,
     const char *device;
     QemuOpts *opts;
     int namespace;
+    uint64_t max_io_queues;
     int ret;
     BDRVNVMeState *s = bs->opaque;
 
@@ -988,7 +1315,15 @@ static int nvme_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     namespace = qemu_opt_get_number(opts, NVME_BLOCK_OPT_NAMESPACE, 1);
-    ret = nvme_init(bs, device, namespace, errp);
+    max_io_queues = qemu_opt_get_number(opts, NVME_BLOCK_OPT_MAX_IO_QUEUES,
+                                        NVME_MAX_IO_QUEUES);
+    if (max_io_queues < 1 || max_io_queues > UINT16_MAX) {
+        error_setg(errp, "'" NVME_BLOCK_OPT_MAX_IO_QUEUES "' must be between "
+                   "1 and %d", UINT16_MAX);
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+    ret = nvme_init(bs, device, namespace, max_io_queues, errp);
     qemu_opts_del(opts);
     if (ret) {
         goto fail;
@@ -1157,29 +1492,6 @@ fail:
     return r;
 }
 
-typedef struct {
-    Coroutine *co;
-    int ret;
-    AioContext *ctx;
-} NVMeCoData;
-
-static void nvme_rw_cb_bh(void *opaque)
-{
-    NVMeCoData *data = opaque;
-    qemu_coroutine_enter(data->co);
-}
-
-static void nvme_rw_cb(void *opaque, int ret)
-{
-    NVMeCoData *data = opaque;
-    data->ret = ret;
-    if (!data->co) {
-        /* The rw coroutine hasn't yielded, don't try to enter. */
-        return;
-    }
-    replay_bh_schedule_oneshot_event(data->ctx, nvme_rw_cb_bh, data);
-}
-
 static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
                                             uint64_t offset, uint64_t bytes,
                                             QEMUIOVector *qiov,
@@ -1188,7 +1500,7 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
 {
     int r;
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq;
     NVMeRequest *req;
 
     uint32_t cdw12 = (((bytes >> s->blkshift) - 1) & 0xFFFF) |
@@ -1201,12 +1513,12 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
         .cdw12 = cpu_to_le32(cdw12),
     };
     NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
+        .ctx = qemu_get_current_aio_context(),
         .ret = -EINPROGRESS,
     };
 
     trace_nvme_prw_aligned(s, is_write, offset, bytes, flags, qiov->niov);
-    assert(s->queue_count > 1);
+    ioq = nvme_get_io_queue(bs);
     req = nvme_get_free_req(ioq);
     assert(req);
 
@@ -1309,18 +1621,18 @@ static coroutine_fn int nvme_co_pwritev(BlockDriverState *bs,
 static coroutine_fn int nvme_co_flush(BlockDriverState *bs)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq;
     NVMeRequest *req;
     NvmeCmd cmd = {
         .opcode = NVME_CMD_FLUSH,
         .nsid = cpu_to_le32(s->nsid),
     };
     NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
+        .ctx = qemu_get_current_aio_context(),
         .ret = -EINPROGRESS,
     };
 
-    assert(s->queue_count > 1);
+    ioq = nvme_get_io_queue(bs);
     req = nvme_get_free_req(ioq);
     assert(req);
     nvme_submit_command(ioq, req, &cmd, nvme_rw_cb, &data);
@@ -1340,7 +1652,7 @@ static coroutine_fn int nvme_co_pwrite_zeroes(BlockDriverState *bs,
                                               BdrvRequestFlags flags)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq;
     NVMeRequest *req;
     uint32_t cdw12;
 
@@ -1367,7 +1679,7 @@ static coroutine_fn int nvme_co_pwrite_zeroes(BlockDriverState *bs,
     };
 
     NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
+        .ctx = qemu_get_current_aio_context(),
         .ret = -EINPROGRESS,
     };
 
@@ -1382,7 +1694,7 @@ static coroutine_fn int nvme_co_pwrite_zeroes(BlockDriverState *bs,
     cmd.cdw12 = cpu_to_le32(cdw12);
 
     trace_nvme_write_zeroes(s, offset, bytes, flags);
-    assert(s->queue_count > 1);
+    ioq = nvme_get_io_queue(bs);
     req = nvme_get_free_req(ioq);
     assert(req);
 
@@ -1403,7 +1715,7 @@ static int coroutine_fn nvme_co_pdiscard(BlockDriverState *bs,
                                          int64_t bytes)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq;
     NVMeRequest *req;
     QEMU_AUTO_VFREE NvmeDsmRange *buf = NULL;
     QEMUIOVector local_qiov;
@@ -1417,7 +1729,7 @@ static int coroutine_fn nvme_co_pdiscard(BlockDriverState *bs,
     };
 
     NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
+        .ctx = qemu_get_current_aio_context(),
         .ret = -EINPROGRESS,
     };
 
@@ -1425,8 +1737,6 @@ static int coroutine_fn nvme_co_pdiscard(BlockDriverState *bs,
         return -ENOTSUP;
     }
 
-    assert(s->queue_count > 1);
-
     /*
      * Filling the @buf requires @offset and @bytes to satisfy restrictions
      * defined in nvme_refresh_limits().
@@ -1447,6 +1757,7 @@ static int coroutine_fn nvme_co_pdiscard(BlockDriverState *bs,
     qemu_iovec_init(&local_qiov, 1);
     qemu_iovec_add(&local_qiov, buf, 4096);
 
+    ioq = nvme_get_io_queue(bs);
     req = nvme_get_free_req(ioq);
     assert(req);
 
@@ -1548,10 +1859,7 @@ static void nvme_detach_aio_context(BlockDriverState *bs)
     BDRVNVMeState *s = bs->opaque;
 
     for (unsigned i = 0; i < s->queue_count; i++) {
-        NVMeQueuePair *q = s->queues[i];
-
-        qemu_bh_delete(q->completion_bh);
-        q->completion_bh = NULL;
+        nvme_detach_queue(s->queues[i]);
     }
 
     aio_set_event_notifier(bdrv_get_aio_context(bs),
@@ -1564,17 +1872,35 @@ static void nvme_attach_aio_context(BlockDriverState *bs,
 {
     BDRVNVMeState *s = bs->opaque;
 
-    s->aio_context = new_context;
     aio_set_event_notifier(new_context, &s->irq_notifier[MSIX_SHARED_IRQ_IDX],
                            nvme_handle_event, nvme_poll_cb,
                            nvme_poll_ready);
 
-    for (unsigned i = 0; i < s->queue_count; i++) {
+    /* The other I/O queues are bound again when they are needed */
+    nvme_attach_queue(s->queues[INDEX_ADMIN], new_context);
+    nvme_attach_queue(s->queues[INDEX_IO(0)], new_context);
+    s->io_queues_exhausted = false;
+}
+
+/*
+ * AioContexts other than the node's may go away once the node is no longer
+ * used from them, and they would be left with handlers for our queues.  A
+ * drained section is the only hint that this is happening, so release their
+ * I/O queues here; they are bound again on the next request.
+ */
+static void nvme_drain_end(BlockDriverState *bs)
+{
+    BDRVNVMeState *s = bs->opaque;
+    AioContext *ctx = bdrv_get_aio_context(bs);
+
+    for (unsigned i = INDEX_IO(0); i < s->queue_count; i++) {
         NVMeQueuePair *q = s->queues[i];
 
-        q->completion_bh =
-            aio_bh_new(new_context, nvme_process_completion_bh, q);
+        if (q->ctx && q->ctx != ctx) {
+            nvme_detach_queue(q);
+        }
     }
+    s->io_queues_exhausted = false;
 }
 
 static bool nvme_register_buf(BlockDriverState *bs, void *host, size_t size,
@@ -1603,14 +1929,39 @@ static BlockStatsSpecific *nvme_get_specific_stats(BlockDriverState *bs)
 {
     BlockStatsSpecific *stats = g_new(BlockStatsSpecific, 1);
     BDRVNVMeState *s = bs->opaque;
+    BlockStatsSpecificNvmeQueueList **tail;
+    uint64_t completion_errors = 0;
 
     stats->driver = BLOCKDEV_DRIVER_NVME;
     stats->u.nvme = (BlockStatsSpecificNvme) {
-        .completion_errors = s->stats.completion_errors,
         .aligned_accesses = s->stats.aligned_accesses,
         .unaligned_accesses = s->stats.unaligned_accesses,
     };
 
+    tail = &stats->u.nvme.queues;
+    for (unsigned i = 0; i < qatomic_load_acquire(&s->queue_count); i++) {
+        NVMeQueuePair *q = s->queues[i];
+        BlockStatsSpecificNvmeQueue *qs;
+
+        QEMU_LOCK_GUARD(&q->lock);
+        completion_errors += q->stats.completion_errors;
+        if (i == INDEX_ADMIN) {
+            continue;
+        }
+
+        qs = g_new(BlockStatsSpecificNvmeQueue, 1);
+        *qs = (BlockStatsSpecificNvmeQueue) {
+            .qid = q->index,
+            .in_use = q->ctx != NULL,
+            .submitted = q->stats.submitted,
+            .completed = q->stats.completed,
+            .completion_errors = q->stats.completion_errors,
+            .free_request_waits = q->stats.free_req_waits,
+        };
+        QAPI_LIST_APPEND(tail, qs);
+    }
+    stats->u.nvme.completion_errors = completion_errors;
+
     return stats;
 }
 
@@ -1652,6 +2003,7 @@ static BlockDriver bdrv_nvme = {
 
     .bdrv_detach_aio_context  = nvme_detach_aio_context,
     .bdrv_attach_aio_context  = nvme_attach_aio_context,
+    .bdrv_drain_end           = nvme_drain_end,
 
     .bdrv_register_buf        = nvme_register_buf,
     .bdrv_unregister_buf      = nvme_unregister_buf,
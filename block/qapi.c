@@ -492,6 +492,56 @@ bdrv_latency_histogram_stats(BlockLatencyHistogram *hist)
     return info;
 }
 
+static void bdrv_latency_percentiles_fill(BlockLatencyPercentiles *info,
+                                          const HdrHistogram *hist)
+{
+    info->operations = hist->count;
+    info->p50_ns = hdr_histogram_percentile(hist, 50);
+    info->p99_ns = hdr_histogram_percentile(hist, 99);
+    info->p999_ns = hdr_histogram_percentile(hist, 99.9);
+}
+
+static BlockLatencyPercentiles *
+bdrv_latency_percentiles(BlockAcctTimedStats *ts, enum BlockAcctType type)
+{
+    g_autofree HdrHistogram *hist = g_new0(HdrHistogram, 1);
+    BlockLatencyPercentiles *info = g_new0(BlockLatencyPercentiles, 1);
+
+    block_acct_latency_histogram(ts, type, -1, hist);
+    bdrv_latency_percentiles_fill(info, hist);
+    return info;
+}
+
+static BlockSizeLatencyPercentilesList *
+bdrv_size_latency_percentiles(BlockAcctTimedStats *ts, enum BlockAcctType type)
+{
+    g_autofree HdrHistogram *hist = g_new(HdrHistogram, 1);
+    BlockSizeLatencyPercentilesList *list = NULL;
+    BlockSizeLatencyPercentilesList **tail = &list;
+    uint64_t min_bytes = 0;
+    int i;
+
+    for (i = 0; i < BLOCK_ACCT_SIZE_CLASSES; i++) {
+        BlockSizeLatencyPercentiles *info;
+        uint64_t max_bytes = block_acct_size_class_max(i);
+
+        hdr_histogram_reset(hist);
+        block_acct_latency_histogram(ts, type, i, hist);
+
+        info = g_new0(BlockSizeLatencyPercentiles, 1);
+        bdrv_latency_percentiles_fill(
+            qapi_BlockSizeLatencyPercentiles_base(info), hist);
+        info->min_bytes = min_bytes;
+        info->has_max_bytes = max_bytes != 0;
+        info->max_bytes = max_bytes;
+        QAPI_LIST_APPEND(tail, info);
+
+        min_bytes = max_bytes + 1;
+    }
+
+    return list;
+}
+
 static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
 {
     BlockAcctStats *stats = blk_get_stats(blk);
@@ -575,6 +625,17 @@ static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
         dev_stats->avg_zone_append_queue_depth =
             block_acct_queue_depth(ts, BLOCK_ACCT_ZONE_APPEND);
 
+        dev_stats->rd_latency_percentiles =
+            bdrv_latency_percentiles(ts, BLOCK_ACCT_READ);
+        dev_stats->rd_size_latency_percentiles =
+            bdrv_size_latency_percentiles(ts, BLOCK_ACCT_READ);
+        dev_stats->wr_latency_percentiles =
+            bdrv_latency_percentiles(ts, BLOCK_ACCT_WRITE);
+        dev_stats->wr_size_latency_percentiles =
+            bdrv_size_latency_percentiles(ts, BLOCK_ACCT_WRITE);
+        dev_stats->flush_latency_percentiles =
+            bdrv_latency_percentiles(ts, BLOCK_ACCT_FLUSH);
+
         QAPI_LIST_PREPEND(ds->timed_stats, dev_stats);
     }
 
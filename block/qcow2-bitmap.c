@@ -32,6 +32,7 @@
 #include "qemu/cutils.h"
 
 #include "qcow2.h"
+#include "trace.h"
 
 /* NOTICE: BME here means Bitmaps Extension and used as a namespace for
  * _internal_ constants. Please do not use this _internal_ abbreviation for
@@ -91,6 +92,7 @@ typedef struct Qcow2Bitmap {
     char *name;
 
     BdrvDirtyBitmap *dirty_bitmap;
+    bool reuse_table; /* store by updating the existing table in place */
 
     QSIMPLEQ_ENTRY(Qcow2Bitmap) entry;
 } Qcow2Bitmap;
@@ -100,6 +102,19 @@ typedef enum BitmapType {
     BT_DIRTY_TRACKING_BITMAP = 1
 } BitmapType;
 
+/*
+ * SHA-256 digests of the data clusters of a bitmap table as they are on disk,
+ * indexed like the table. Digests of entries without a data cluster are
+ * meaningless. They are kept in s->bitmap_digests from the time the table is
+ * loaded or stored until it is freed, so that storing the bitmap again only
+ * needs to write the clusters that changed.
+ */
+typedef struct Qcow2BitmapDigests {
+    uint64_t table_offset;
+    uint32_t table_size;
+    uint8_t digest[][QCOW2_DEDUP_DIGEST_SIZE];
+} Qcow2BitmapDigests;
+
 static inline bool can_write(BlockDriverState *bs)
 {
     return !bdrv_is_read_only(bs) && !(bdrv_get_flags(bs) & BDRV_O_INACTIVE);
@@ -117,6 +132,48 @@ static int GRAPH_RDLOCK update_header_sync(BlockDriverState *bs)
     return bdrv_flush(bs->file->bs);
 }
 
+static Qcow2BitmapDigests *bitmap_digests_new(uint32_t table_size)
+{
+    Qcow2BitmapDigests *digests =
+        g_malloc0(sizeof(*digests) + table_size * sizeof(digests->digest[0]));
+
+    digests->table_size = table_size;
+    return digests;
+}
+
+static void bitmap_digests_insert(BDRVQcow2State *s,
+                                  Qcow2BitmapDigests *digests,
+                                  uint64_t table_offset)
+{
+    if (!s->bitmap_digests) {
+        s->bitmap_digests = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                                  NULL, g_free);
+    }
+
+    digests->table_offset = table_offset;
+    g_hash_table_replace(s->bitmap_digests, &digests->table_offset, digests);
+}
+
+static Qcow2BitmapDigests *bitmap_digests_lookup(BDRVQcow2State *s,
+                                                 const Qcow2BitmapTable *tb)
+{
+    Qcow2BitmapDigests *digests;
+
+    if (!s->bitmap_digests) {
+        return NULL;
+    }
+
+    digests = g_hash_table_lookup(s->bitmap_digests, &tb->offset);
+    return digests && digests->table_size == tb->size ? digests : NULL;
+}
+
+static void bitmap_digests_remove(BDRVQcow2State *s, uint64_t table_offset)
+{
+    if (s->bitmap_digests) {
+        g_hash_table_remove(s->bitmap_digests, &table_offset);
+    }
+}
+
 static inline void bitmap_table_bswap_be(uint64_t *bitmap_table, size_t size)
 {
     size_t i;
@@ -263,9 +320,12 @@ fail:
 static int GRAPH_RDLOCK
 free_bitmap_clusters(BlockDriverState *bs, Qcow2BitmapTable *tb)
 {
+    BDRVQcow2State *s = bs->opaque;
     int ret;
     uint64_t *bitmap_table;
 
+    bitmap_digests_remove(s, tb->offset);
+
     ret = bitmap_table_load(bs, tb, &bitmap_table);
     if (ret < 0) {
         return ret;
@@ -284,10 +344,13 @@ free_bitmap_clusters(BlockDriverState *bs, Qcow2BitmapTable *tb)
 
 /* load_bitmap_data
  * @bitmap_table entries must satisfy specification constraints.
- * @bitmap must be cleared */
+ * @bitmap must be cleared
+ * @digests, if not NULL, is filled with the digests of the data clusters; it
+ * is freed and set to NULL if they cannot be computed. */
 static int coroutine_fn GRAPH_RDLOCK
 load_bitmap_data(BlockDriverState *bs, const uint64_t *bitmap_table,
-                 uint32_t bitmap_table_size, BdrvDirtyBitmap *bitmap)
+                 uint32_t bitmap_table_size, BdrvDirtyBitmap *bitmap,
+                 Qcow2BitmapDigests **digests)
 {
     int ret = 0;
     BDRVQcow2State *s = bs->opaque;
@@ -324,6 +387,12 @@ load_bitmap_data(BlockDriverState *bs, const uint64_t *bitmap_table,
             if (ret < 0) {
                 goto finish;
             }
+            if (digests && *digests &&
+                qcow2_dedup_digest(buf, s->cluster_size, (*digests)->digest[i],
+                                   NULL) < 0) {
+                g_free(*digests);
+                *digests = NULL;
+            }
             bdrv_dirty_bitmap_deserialize_part(bitmap, buf, offset, count,
                                                false);
         }
@@ -342,10 +411,12 @@ static coroutine_fn GRAPH_RDLOCK
 BdrvDirtyBitmap *load_bitmap(BlockDriverState *bs,
                              Qcow2Bitmap *bm, Error **errp)
 {
+    BDRVQcow2State *s = bs->opaque;
     int ret;
     uint64_t *bitmap_table = NULL;
     uint32_t granularity;
     BdrvDirtyBitmap *bitmap = NULL;
+    Qcow2BitmapDigests *digests = NULL;
 
     granularity = 1U << bm->granularity_bits;
     bitmap = bdrv_create_dirty_bitmap(bs, granularity, bm->name, errp);
@@ -366,17 +437,22 @@ BdrvDirtyBitmap *load_bitmap(BlockDriverState *bs,
         goto fail;
     }
 
-    ret = load_bitmap_data(bs, bitmap_table, bm->table.size, bitmap);
+    digests = bitmap_digests_new(bm->table.size);
+    ret = load_bitmap_data(bs, bitmap_table, bm->table.size, bitmap, &digests);
     if (ret < 0) {
         error_setg_errno(errp, -ret, "Could not read bitmap '%s' from image",
                          bm->name);
         goto fail;
     }
 
+    if (digests) {
+        bitmap_digests_insert(s, digests, bm->table.offset);
+    }
     g_free(bitmap_table);
     return bitmap;
 
 fail:
+    g_free(digests);
     g_free(bitmap_table);
     if (bitmap != NULL) {
         bdrv_release_dirty_bitmap(bitmap);
@@ -1275,10 +1351,13 @@ out:
 
 /* store_bitmap_data()
  * Store bitmap to image, filling bitmap table accordingly.
+ * The digests of the written clusters are returned in @digests, or NULL if
+ * they cannot be computed.
  */
 static uint64_t * GRAPH_RDLOCK
 store_bitmap_data(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
-                  uint32_t *bitmap_table_size, Error **errp)
+                  uint32_t *bitmap_table_size, Qcow2BitmapDigests **digests,
+                  Error **errp)
 {
     int ret;
     BDRVQcow2State *s = bs->opaque;
@@ -1305,6 +1384,7 @@ store_bitmap_data(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
         return NULL;
     }
 
+    *digests = bitmap_digests_new(tb_size);
     buf = g_malloc(s->cluster_size);
     limit = bdrv_dirty_bitmap_serialization_coverage(s->cluster_size, bitmap);
     assert(DIV_ROUND_UP(bm_size, limit) == tb_size);
@@ -1342,6 +1422,13 @@ store_bitmap_data(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
             memset(buf + write_size, 0, s->cluster_size - write_size);
         }
 
+        if (*digests &&
+            qcow2_dedup_digest(buf, s->cluster_size,
+                               (*digests)->digest[cluster], NULL) < 0) {
+            g_free(*digests);
+            *digests = NULL;
+        }
+
         ret = qcow2_pre_write_overlap_check(bs, 0, off, s->cluster_size, false);
         if (ret < 0) {
             error_setg_errno(errp, -ret, "Qcow2 overlap check failed");
@@ -1367,6 +1454,8 @@ fail:
     clear_bitmap_table(bs, tb, tb_size);
     g_free(buf);
     g_free(tb);
+    g_free(*digests);
+    *digests = NULL;
 
     return NULL;
 }
@@ -1378,18 +1467,20 @@ fail:
 static int GRAPH_RDLOCK
 store_bitmap(BlockDriverState *bs, Qcow2Bitmap *bm, Error **errp)
 {
+    BDRVQcow2State *s = bs->opaque;
     int ret;
     uint64_t *tb;
     int64_t tb_offset;
     uint32_t tb_size;
     BdrvDirtyBitmap *bitmap = bm->dirty_bitmap;
+    Qcow2BitmapDigests *digests;
     const char *bm_name;
 
     assert(bitmap != NULL);
 
     bm_name = bdrv_dirty_bitmap_name(bitmap);
 
-    tb = store_bitmap_data(bs, bitmap, &tb_size, errp);
+    tb = store_bitmap_data(bs, bitmap, &tb_size, &digests, errp);
     if (tb == NULL) {
         return -EINVAL;
     }
@@ -1424,6 +1515,9 @@ store_bitmap(BlockDriverState *bs, Qcow2Bitmap *bm, Error **errp)
 
     bm->table.offset = tb_offset;
     bm->table.size = tb_size;
+    if (digests) {
+        bitmap_digests_insert(s, digests, tb_offset);
+    }
 
     return 0;
 
@@ -1435,6 +1529,208 @@ fail:
                             QCOW2_DISCARD_OTHER);
     }
 
+    g_free(tb);
+    g_free(digests);
+
+    return ret;
+}
+
+/* bitmap_table_reusable()
+ * Check whether bm->dirty_bitmap can be stored by update_bitmap(), i.e.
+ * whether the digests of bm's table are known and its size still fits.
+ */
+static bool GRAPH_RDLOCK
+bitmap_table_reusable(BlockDriverState *bs, Qcow2Bitmap *bm)
+{
+    BDRVQcow2State *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap = bm->dirty_bitmap;
+    uint64_t bm_size = bdrv_dirty_bitmap_size(bitmap);
+    uint64_t tb_size =
+            size_to_clusters(s,
+                bdrv_dirty_bitmap_serialization_size(bitmap, 0, bm_size));
+
+    return bm->table.offset && tb_size == bm->table.size &&
+           bitmap_digests_lookup(s, &bm->table);
+}
+
+/* free_dropped_bitmap_clusters()
+ * Free the data clusters that are referenced by @old_tb but not by @new_tb,
+ * after making sure that @new_tb has reached the disk.
+ */
+static int GRAPH_RDLOCK
+free_dropped_bitmap_clusters(BlockDriverState *bs, const uint64_t *old_tb,
+                             const uint64_t *new_tb, uint32_t size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    bool flushed = false;
+    uint32_t i;
+    int ret;
+
+    for (i = 0; i < size; i++) {
+        uint64_t addr = old_tb[i] & BME_TABLE_ENTRY_OFFSET_MASK;
+
+        if (!addr || (new_tb[i] & BME_TABLE_ENTRY_OFFSET_MASK)) {
+            continue;
+        }
+
+        if (!flushed) {
+            ret = bdrv_flush(bs->file->bs);
+            if (ret < 0) {
+                return ret;
+            }
+            flushed = true;
+        }
+        qcow2_free_clusters(bs, addr, s->cluster_size, QCOW2_DISCARD_ALWAYS);
+    }
+
+    return 0;
+}
+
+/* update_bitmap()
+ * Store bm->dirty_bitmap to qcow2 by updating its existing bitmap table in
+ * place. Only the clusters whose digest differs from the one recorded when
+ * the table was loaded or last stored are written, and the table itself is
+ * only written if an entry changed.
+ *
+ * This is safe because the bitmap is marked in use in the image until the
+ * directory is updated, so the contents of its table do not matter if we
+ * crash in between. Clusters that are no longer needed are only freed once
+ * the table that referenced them has been overwritten and flushed.
+ */
+static int GRAPH_RDLOCK
+update_bitmap(BlockDriverState *bs, Qcow2Bitmap *bm, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap = bm->dirty_bitmap;
+    const char *bm_name = bdrv_dirty_bitmap_name(bitmap);
+    uint64_t bm_size = bdrv_dirty_bitmap_size(bitmap);
+    Qcow2BitmapDigests *digests = bitmap_digests_lookup(s, &bm->table);
+    uint8_t digest[QCOW2_DEDUP_DIGEST_SIZE];
+    uint64_t *tb, *old_tb = NULL;
+    uint8_t *buf = NULL;
+    uint64_t limit, offset;
+    uint32_t i, written = 0;
+    bool digests_valid = true;
+    int ret;
+
+    assert(digests);
+
+    ret = bitmap_table_load(bs, &bm->table, &tb);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret,
+                         "Could not read bitmap_table table from image for "
+                         "bitmap '%s'", bm_name);
+        bitmap_digests_remove(s, bm->table.offset);
+        return ret;
+    }
+    old_tb = g_memdup2(tb, bm->table.size * sizeof(tb[0]));
+
+    buf = g_malloc(s->cluster_size);
+    limit = bdrv_dirty_bitmap_serialization_coverage(s->cluster_size, bitmap);
+    assert(DIV_ROUND_UP(bm_size, limit) == bm->table.size);
+
+    for (i = 0, offset = 0; i < bm->table.size; i++, offset += limit) {
+        uint64_t end = MIN(bm_size, offset + limit);
+        uint64_t data_offset = tb[i] & BME_TABLE_ENTRY_OFFSET_MASK;
+        uint64_t write_size;
+        bool have_digest;
+
+        if (bdrv_dirty_bitmap_next_dirty(bitmap, offset, end - offset) < 0) {
+            /* Clean clusters need no data, drop it (and any flags) */
+            tb[i] = 0;
+            continue;
+        }
+
+        write_size = bdrv_dirty_bitmap_serialization_size(bitmap, offset,
+                                                          end - offset);
+        assert(write_size <= s->cluster_size);
+        bdrv_dirty_bitmap_serialize_part(bitmap, buf, offset, end - offset);
+        if (write_size < s->cluster_size) {
+            memset(buf + write_size, 0, s->cluster_size - write_size);
+        }
+
+        have_digest = qcow2_dedup_digest(buf, s->cluster_size, digest,
+                                         NULL) == 0;
+        if (data_offset && have_digest &&
+            !memcmp(digest, digests->digest[i], sizeof(digest))) {
+            continue;
+        }
+
+        if (!data_offset) {
+            int64_t off = qcow2_alloc_clusters(bs, s->cluster_size);
+            if (off < 0) {
+                error_setg_errno(errp, -off,
+                                 "Failed to allocate clusters for bitmap '%s'",
+                                 bm_name);
+                ret = off;
+                goto fail;
+            }
+            tb[i] = data_offset = off;
+        }
+
+        ret = qcow2_pre_write_overlap_check(bs, 0, data_offset,
+                                            s->cluster_size, false);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Qcow2 overlap check failed");
+            goto fail;
+        }
+
+        ret = bdrv_pwrite(bs->file, data_offset, s->cluster_size, buf, 0);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Failed to write bitmap '%s' to file",
+                             bm_name);
+            goto fail;
+        }
+
+        if (have_digest) {
+            memcpy(digests->digest[i], digest, sizeof(digest));
+        } else {
+            digests_valid = false;
+        }
+        written++;
+    }
+
+    trace_qcow2_bitmap_update(bs, bm_name, written, bm->table.size);
+
+    if (memcmp(tb, old_tb, bm->table.size * sizeof(tb[0]))) {
+        bitmap_table_bswap_be(tb, bm->table.size);
+        ret = bdrv_pwrite(bs->file, bm->table.offset,
+                          bm->table.size * sizeof(tb[0]), tb, 0);
+        bitmap_table_bswap_be(tb, bm->table.size);
+        if (ret < 0) {
+            /*
+             * The table may now refer to the new clusters or not, so leak
+             * them rather than risk freeing clusters that are in use.
+             */
+            error_setg_errno(errp, -ret, "Failed to write bitmap '%s' to file",
+                             bm_name);
+            bitmap_digests_remove(s, bm->table.offset);
+            goto out;
+        }
+
+        ret = free_dropped_bitmap_clusters(bs, old_tb, tb, bm->table.size);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Failed to flush bitmap '%s'",
+                             bm_name);
+            bitmap_digests_remove(s, bm->table.offset);
+            goto out;
+        }
+    }
+
+    if (!digests_valid) {
+        bitmap_digests_remove(s, bm->table.offset);
+    }
+    ret = 0;
+    goto out;
+
+fail:
+    /* Free the clusters that were allocated but are not in the table yet */
+    free_dropped_bitmap_clusters(bs, tb, old_tb, bm->table.size);
+    bitmap_digests_remove(s, bm->table.offset);
+
+out:
+    g_free(buf);
+    g_free(old_tb);
     g_free(tb);
 
     return ret;
@@ -1609,10 +1905,14 @@ bool qcow2_store_persistent_dirty_bitmaps(BlockDriverState *bs,
                            name);
                 goto fail;
             }
-            tb = g_memdup2(&bm->table, sizeof(bm->table));
-            bm->table.offset = 0;
-            bm->table.size = 0;
-            QSIMPLEQ_INSERT_TAIL(&drop_tables, tb, entry);
+            bm->dirty_bitmap = bitmap;
+            bm->reuse_table = bitmap_table_reusable(bs, bm);
+            if (!bm->reuse_table) {
+                tb = g_memdup2(&bm->table, sizeof(bm->table));
+                bm->table.offset = 0;
+                bm->table.size = 0;
+                QSIMPLEQ_INSERT_TAIL(&drop_tables, tb, entry);
+            }
         }
         bm->flags = bdrv_dirty_bitmap_enabled(bitmap) ? BME_FLAG_AUTO : 0;
         bm->granularity_bits = ctz32(bdrv_dirty_bitmap_granularity(bitmap));
@@ -1636,7 +1936,11 @@ bool qcow2_store_persistent_dirty_bitmaps(BlockDriverState *bs,
             continue;
         }
 
-        ret = store_bitmap(bs, bm, errp);
+        if (bm->reuse_table) {
+            ret = update_bitmap(bs, bm, errp);
+        } else {
+            ret = store_bitmap(bs, bm, errp);
+        }
         if (ret < 0) {
             goto fail;
         }
@@ -1649,7 +1953,7 @@ bool qcow2_store_persistent_dirty_bitmaps(BlockDriverState *bs,
     }
 
     /* Bitmap directory was successfully updated, so, old data can be dropped.
-     * TODO it is better to reuse these clusters */
+     * Tables whose digests were known have been updated in place instead. */
     QSIMPLEQ_FOREACH_SAFE(tb, &drop_tables, entry, tb_next) {
         free_bitmap_clusters(bs, tb);
         g_free(tb);
@@ -1672,7 +1976,7 @@ success:
 fail:
     QSIMPLEQ_FOREACH(bm, bm_list, entry) {
         if (bm->dirty_bitmap == NULL || bm->table.offset == 0 ||
-            bdrv_dirty_bitmap_readonly(bm->dirty_bitmap))
+            bm->reuse_table || bdrv_dirty_bitmap_readonly(bm->dirty_bitmap))
         {
             continue;
         }
@@ -1048,6 +1048,28 @@ int coroutine_fn qcow2_alloc_cluster_link_l2(BlockDriverState *bs,
         goto err;
     }
 
+    /*
+     * Add the cluster to the deduplication index, which takes a reference of
+     * its own, so the new L2 entry must not have QCOW_OFLAG_COPIED set.
+     */
+    if (m->dedup) {
+        assert(m->nb_clusters == 1);
+        if (qcow2_dedup_index_insert(s->dedup_index, m->dedup_digest,
+                                     cluster_offset)) {
+            int64_t cluster_index = cluster_offset >> s->cluster_bits;
+
+            ret = qcow2_update_cluster_refcount(bs, cluster_index, 1, false,
+                                                QCOW2_DISCARD_NEVER);
+            if (ret < 0) {
+                qcow2_dedup_index_remove(s->dedup_index, cluster_offset);
+                goto err;
+            }
+            trace_qcow2_dedup_insert(bs, m->offset, cluster_offset);
+        } else {
+            m->dedup = false;
+        }
+    }
+
     /* Update L2 table. */
     if (s->use_lazy_refcounts) {
         qcow2_mark_dirty(bs);
@@ -1081,7 +1103,8 @@ int coroutine_fn qcow2_alloc_cluster_link_l2(BlockDriverState *bs,
         /* The offset must fit in the offset field of the L2 table entry */
         assert((offset & L2E_OFFSET_MASK) == offset);
 
-        set_l2_entry(s, l2_slice, l2_index + i, offset | QCOW_OFLAG_COPIED);
+        set_l2_entry(s, l2_slice, l2_index + i,
+                     offset | (m->dedup ? 0 : QCOW_OFLAG_COPIED));
 
         /* Update bitmap with the subclusters that were just written */
         if (has_subclusters(s) && !m->prealloc) {
@@ -1122,6 +1145,80 @@ err:
     return ret;
  }
 
+/*
+ * Maps the guest cluster at @offset to the indexed host cluster at
+ * @host_offset, whose contents the caller has verified to be the data that
+ * is to be written there, and drops the reference to the cluster that was
+ * mapped before.
+ *
+ * Returns 1 on success, 0 if the cluster cannot be shared right now (the
+ * caller must then write the data normally), -errno on error.
+ *
+ * Called with s->lock held.
+ */
+int coroutine_fn qcow2_dedup_link_cluster(BlockDriverState *bs,
+                                          uint64_t offset,
+                                          uint64_t host_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    QCowL2Meta *old_alloc;
+    uint64_t *l2_slice, old_entry, refcount;
+    int l2_index, ret;
+
+    assert(offset_into_cluster(s, offset) == 0);
+
+    /* Leave overlapping allocations to the normal write path */
+    QLIST_FOREACH(old_alloc, &s->cluster_allocs, next_in_flight) {
+        uint64_t start = old_alloc->offset;
+        uint64_t end = start +
+            ((uint64_t)old_alloc->nb_clusters << s->cluster_bits);
+
+        if (offset < end && start < offset + s->cluster_size) {
+            return 0;
+        }
+    }
+
+    ret = qcow2_get_refcount(bs, host_offset >> s->cluster_bits, &refcount);
+    if (ret < 0) {
+        return ret;
+    }
+    if (refcount >= s->refcount_max) {
+        return 0;
+    }
+
+    ret = get_cluster_table(bs, offset, &l2_slice, &l2_index);
+    if (ret < 0) {
+        return ret;
+    }
+
+    old_entry = get_l2_entry(s, l2_slice, l2_index);
+    if (qcow2_get_cluster_type(bs, old_entry) == QCOW2_CLUSTER_NORMAL &&
+        (old_entry & L2E_OFFSET_MASK) == host_offset) {
+        qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+        return 1;
+    }
+
+    ret = qcow2_update_cluster_refcount(bs, host_offset >> s->cluster_bits,
+                                        1, false, QCOW2_DISCARD_NEVER);
+    if (ret < 0) {
+        qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+        return ret;
+    }
+
+    if (qcow2_need_accurate_refcounts(s)) {
+        qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                                   s->refcount_block_cache);
+    }
+    qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
+    set_l2_entry(s, l2_slice, l2_index, host_offset);
+    qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+
+    trace_qcow2_dedup_hit(bs, offset, host_offset);
+
+    qcow2_free_any_cluster(bs, old_entry, QCOW2_DISCARD_NEVER);
+    return 1;
+}
+
 /**
  * Frees the allocated clusters because the request failed and they won't
  * actually be linked.
@@ -1619,6 +1716,21 @@ do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
 
     /* Allocate new clusters */
     trace_qcow2_cluster_alloc_phys(qemu_coroutine_self());
+    if (s->alloc_extent_size || s->alloc_extent_bytes) {
+        uint64_t nb_reserved = *nb_clusters;
+        int64_t cluster_offset =
+            qcow2_alloc_reserved_clusters(bs, *host_offset, &nb_reserved);
+        if (cluster_offset < 0) {
+            return cluster_offset;
+        }
+        if (nb_reserved > 0) {
+            *host_offset = cluster_offset;
+            *nb_clusters = nb_reserved;
+            return 0;
+        }
+        /* Not contiguous with the current extent, try to extend in place */
+    }
+
     if (*host_offset == INV_OFFSET) {
         int64_t cluster_offset =
             qcow2_alloc_clusters(bs, *nb_clusters * s->cluster_size);
@@ -0,0 +1,216 @@
+/*
+ * Decompressed cluster cache for the QCOW2 format
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Compressed clusters are never modified in place, so their decompressed
+ * contents can be cached for as long as the host range they occupy stays
+ * allocated. Entries are keyed by the host offset of the compressed data and
+ * are dropped by update_refcount() as soon as a cluster they overlap is
+ * freed.
+ *
+ * Data reads run outside of s->lock and possibly in several threads, so the
+ * cache has its own mutex. A reader that decompresses a cluster samples the
+ * invalidation generation before looking up its L2 entry; if anything was
+ * invalidated in the meantime the result is not inserted, because the host
+ * range may already have been reused.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/iov.h"
+#include "qemu/memalign.h"
+#include "qemu/thread.h"
+#include "qcow2.h"
+#include "trace.h"
+
+typedef struct Qcow2DecompressedCluster {
+    uint64_t coffset;   /* 0 if the entry is unused */
+    int      csize;
+    uint64_t lru_counter;
+} Qcow2DecompressedCluster;
+
+struct Qcow2DecompressCache {
+    QemuMutex                   lock;
+    Qcow2DecompressedCluster   *entries;
+    int                         size;
+    int                         cluster_size;
+    void                       *data;
+    uint64_t                    lru_counter;
+    uint64_t                    generation;
+};
+
+static inline void *qcow2_decompress_cache_data(Qcow2DecompressCache *c,
+                                                int i)
+{
+    return (uint8_t *) c->data + (size_t) i * c->cluster_size;
+}
+
+/* Called with c->lock held */
+static int qcow2_decompress_cache_find(Qcow2DecompressCache *c,
+                                       uint64_t coffset, int csize)
+{
+    int i;
+
+    for (i = 0; i < c->size; i++) {
+        if (c->entries[i].coffset == coffset && c->entries[i].csize == csize) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+Qcow2DecompressCache *qcow2_decompress_cache_create(int nb_clusters,
+                                                    int cluster_size)
+{
+    Qcow2DecompressCache *c;
+
+    assert(nb_clusters > 0);
+
+    c = g_new0(Qcow2DecompressCache, 1);
+    c->size = nb_clusters;
+    c->cluster_size = cluster_size;
+    c->entries = g_try_new0(Qcow2DecompressedCluster, nb_clusters);
+    c->data = qemu_try_memalign(qemu_real_host_page_size(),
+                                (size_t) nb_clusters * cluster_size);
+    if (!c->entries || !c->data) {
+        qemu_vfree(c->data);
+        g_free(c->entries);
+        g_free(c);
+        return NULL;
+    }
+
+    qemu_mutex_init(&c->lock);
+    return c;
+}
+
+void qcow2_decompress_cache_destroy(Qcow2DecompressCache *c)
+{
+    if (!c) {
+        return;
+    }
+
+    qemu_mutex_destroy(&c->lock);
+    qemu_vfree(c->data);
+    g_free(c->entries);
+    g_free(c);
+}
+
+/*
+ * Copies @bytes bytes starting at @offset_in_cluster of the cached cluster
+ * whose compressed data is at @coffset into @qiov. Returns false if the
+ * cluster is not cached.
+ */
+bool qcow2_decompress_cache_read(Qcow2DecompressCache *c, uint64_t coffset,
+                                 int csize, int offset_in_cluster,
+                                 uint64_t bytes, QEMUIOVector *qiov,
+                                 size_t qiov_offset)
+{
+    int i;
+
+    assert(offset_in_cluster + bytes <= c->cluster_size);
+
+    QEMU_LOCK_GUARD(&c->lock);
+    i = qcow2_decompress_cache_find(c, coffset, csize);
+    if (i < 0) {
+        trace_qcow2_decompress_cache_miss(c, coffset);
+        return false;
+    }
+
+    trace_qcow2_decompress_cache_hit(c, coffset);
+    c->entries[i].lru_counter = ++c->lru_counter;
+    qemu_iovec_from_buf(qiov, qiov_offset,
+                        qcow2_decompress_cache_data(c, i) + offset_in_cluster,
+                        bytes);
+    return true;
+}
+
+bool qcow2_decompress_cache_contains(Qcow2DecompressCache *c,
+                                     uint64_t coffset, int csize)
+{
+    QEMU_LOCK_GUARD(&c->lock);
+    return qcow2_decompress_cache_find(c, coffset, csize) >= 0;
+}
+
+/*
+ * Returns the current invalidation generation, to be passed to
+ * qcow2_decompress_cache_insert() for data read after this call.
+ */
+uint64_t qcow2_decompress_cache_generation(Qcow2DecompressCache *c)
+{
+    QEMU_LOCK_GUARD(&c->lock);
+    return c->generation;
+}
+
+void qcow2_decompress_cache_insert(Qcow2DecompressCache *c, uint64_t coffset,
+                                   int csize, const void *buf,
+                                   uint64_t generation)
+{
+    uint64_t min_lru_counter = UINT64_MAX;
+    int i, min_lru_index = 0;
+
+    QEMU_LOCK_GUARD(&c->lock);
+    if (generation != c->generation) {
+        /* Something was freed in the meantime, @buf may be stale */
+        return;
+    }
+
+    if (qcow2_decompress_cache_find(c, coffset, csize) >= 0) {
+        return;
+    }
+
+    for (i = 0; i < c->size; i++) {
+        if (c->entries[i].lru_counter < min_lru_counter) {
+            min_lru_counter = c->entries[i].lru_counter;
+            min_lru_index = i;
+        }
+    }
+
+    c->entries[min_lru_index].coffset = coffset;
+    c->entries[min_lru_index].csize = csize;
+    c->entries[min_lru_index].lru_counter = ++c->lru_counter;
+    memcpy(qcow2_decompress_cache_data(c, min_lru_index), buf,
+           c->cluster_size);
+}
+
+/*
+ * Drops all entries whose compressed data overlaps the host range
+ * [@offset, @offset + @bytes).
+ */
+void qcow2_decompress_cache_invalidate(Qcow2DecompressCache *c,
+                                       uint64_t offset, uint64_t bytes)
+{
+    int i;
+
+    QEMU_LOCK_GUARD(&c->lock);
+    c->generation++;
+
+    for (i = 0; i < c->size; i++) {
+        Qcow2DecompressedCluster *e = &c->entries[i];
+
+        if (e->coffset && e->coffset < offset + bytes &&
+            offset < e->coffset + e->csize) {
+            e->coffset = 0;
+            e->csize = 0;
+            e->lru_counter = 0;
+        }
+    }
+}
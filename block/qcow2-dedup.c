@@ -0,0 +1,384 @@
+/*
+ * Deduplication index for the QCOW2 format
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * The deduplication index maps the SHA-256 digest of full data clusters to
+ * the host offset of a cluster with that content. Each indexed cluster holds
+ * one reference for the index, so it is always shared and never overwritten
+ * in place; when update_refcount() finds that only the index still refers to
+ * a cluster, the entry is dropped and the cluster freed.
+ *
+ * The index is kept in memory while the image is open and written to a new
+ * table on close. While it is being modified, QCOW2_AUTOCLEAR_DEDUP_INDEX is
+ * cleared and the image is marked dirty, so that after a crash the stale
+ * table is ignored and the references it held are repaired as leaks.
+ *
+ * All functions are called with s->lock held or while no requests are in
+ * flight.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "crypto/hash.h"
+#include "qcow2.h"
+#include "trace.h"
+
+typedef struct Qcow2DedupEntry {
+    uint8_t digest[QCOW2_DEDUP_DIGEST_SIZE];
+    uint64_t offset;
+} Qcow2DedupEntry;
+
+/* On-disk format of an index entry, offset in big endian */
+typedef struct Qcow2DedupTableEntry {
+    uint8_t digest[QCOW2_DEDUP_DIGEST_SIZE];
+    uint64_t offset;
+} QEMU_PACKED Qcow2DedupTableEntry;
+
+struct Qcow2DedupIndex {
+    GHashTable *by_digest;  /* owns the entries */
+    GHashTable *by_offset;
+};
+
+static guint qcow2_dedup_digest_hash(gconstpointer key)
+{
+    guint hash;
+
+    /* Any part of a SHA-256 digest is uniformly distributed */
+    memcpy(&hash, key, sizeof(hash));
+    return hash;
+}
+
+static gboolean qcow2_dedup_digest_equal(gconstpointer a, gconstpointer b)
+{
+    return !memcmp(a, b, QCOW2_DEDUP_DIGEST_SIZE);
+}
+
+Qcow2DedupIndex *qcow2_dedup_index_new(void)
+{
+    Qcow2DedupIndex *idx = g_new0(Qcow2DedupIndex, 1);
+
+    idx->by_digest = g_hash_table_new_full(qcow2_dedup_digest_hash,
+                                           qcow2_dedup_digest_equal,
+                                           NULL, g_free);
+    idx->by_offset = g_hash_table_new(g_int64_hash, g_int64_equal);
+    return idx;
+}
+
+void qcow2_dedup_index_free(Qcow2DedupIndex *idx)
+{
+    if (!idx) {
+        return;
+    }
+
+    g_hash_table_destroy(idx->by_offset);
+    g_hash_table_destroy(idx->by_digest);
+    g_free(idx);
+}
+
+uint64_t qcow2_dedup_index_size(Qcow2DedupIndex *idx)
+{
+    return g_hash_table_size(idx->by_digest);
+}
+
+/*
+ * Returns the host offset of the indexed cluster with the given digest, or 0
+ * if there is none.
+ */
+uint64_t qcow2_dedup_index_lookup(Qcow2DedupIndex *idx, const uint8_t *digest)
+{
+    Qcow2DedupEntry *e = g_hash_table_lookup(idx->by_digest, digest);
+
+    return e ? e->offset : 0;
+}
+
+/*
+ * Adds the cluster at @offset to the index. The caller is responsible for
+ * taking the reference that the index holds. Returns false if the digest or
+ * the cluster are already indexed.
+ */
+bool qcow2_dedup_index_insert(Qcow2DedupIndex *idx, const uint8_t *digest,
+                              uint64_t offset)
+{
+    Qcow2DedupEntry *e;
+
+    if (g_hash_table_contains(idx->by_digest, digest) ||
+        g_hash_table_contains(idx->by_offset, &offset)) {
+        return false;
+    }
+
+    e = g_new(Qcow2DedupEntry, 1);
+    memcpy(e->digest, digest, QCOW2_DEDUP_DIGEST_SIZE);
+    e->offset = offset;
+    g_hash_table_insert(idx->by_offset, &e->offset, e);
+    g_hash_table_insert(idx->by_digest, e->digest, e);
+    return true;
+}
+
+/*
+ * Removes the cluster at @offset from the index. The caller is responsible for
+ * dropping the reference that the index held. Returns false if the cluster is
+ * not indexed.
+ */
+bool qcow2_dedup_index_remove(Qcow2DedupIndex *idx, uint64_t offset)
+{
+    Qcow2DedupEntry *e = g_hash_table_lookup(idx->by_offset, &offset);
+
+    if (!e) {
+        return false;
+    }
+
+    g_hash_table_remove(idx->by_offset, &offset);
+    g_hash_table_remove(idx->by_digest, e->digest);
+    return true;
+}
+
+int qcow2_dedup_digest(const void *buf, size_t len, uint8_t *digest,
+                       Error **errp)
+{
+    size_t digest_len = QCOW2_DEDUP_DIGEST_SIZE;
+
+    if (qcrypto_hash_bytes(QCRYPTO_HASH_ALGO_SHA256, buf, len, &digest,
+                           &digest_len, errp) < 0) {
+        return -EIO;
+    }
+    return 0;
+}
+
+/*
+ * Reads the stored index (if any) into memory. The caller has made sure that
+ * the stored index is valid.
+ */
+int coroutine_fn GRAPH_RDLOCK
+qcow2_dedup_load(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    g_autofree Qcow2DedupTableEntry *table = NULL;
+    uint64_t size = (uint64_t)s->dedup_table_entries * sizeof(*table);
+    Qcow2DedupIndex *idx;
+    uint32_t i;
+    int ret;
+
+    assert(!s->dedup_index);
+    idx = qcow2_dedup_index_new();
+
+    if (s->dedup_table_entries) {
+        table = g_try_malloc(size);
+        if (!table) {
+            error_setg(errp, "Could not allocate deduplication index");
+            ret = -ENOMEM;
+            goto fail;
+        }
+
+        ret = bdrv_co_pread(bs->file, s->dedup_table_offset, size, table, 0);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not read deduplication index");
+            goto fail;
+        }
+
+        for (i = 0; i < s->dedup_table_entries; i++) {
+            uint64_t offset = be64_to_cpu(table[i].offset);
+
+            if (offset == 0 || offset_into_cluster(s, offset) ||
+                !qcow2_dedup_index_insert(idx, table[i].digest, offset))
+            {
+                error_setg(errp, "Invalid deduplication index entry %" PRIu32,
+                           i);
+                ret = -EINVAL;
+                goto fail;
+            }
+        }
+    }
+
+    s->dedup_index = idx;
+    return 0;
+
+fail:
+    qcow2_dedup_index_free(idx);
+    return ret;
+}
+
+/*
+ * Marks the stored index as invalid and the image as dirty. Must be called
+ * before the in-memory index can diverge from the stored one.
+ */
+int qcow2_dedup_invalidate(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+
+    if (!s->dedup_index) {
+        return 0;
+    }
+
+    ret = qcow2_mark_dirty(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (s->autoclear_features & QCOW2_AUTOCLEAR_DEDUP_INDEX) {
+        s->autoclear_features &= ~QCOW2_AUTOCLEAR_DEDUP_INDEX;
+        ret = qcow2_update_header(bs);
+        if (ret < 0) {
+            s->autoclear_features |= QCOW2_AUTOCLEAR_DEDUP_INDEX;
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Writes the in-memory index to a new table and marks it valid. The old table
+ * is freed afterwards. Nothing is done if the stored index is still valid or
+ * the image is read-only.
+ */
+int qcow2_dedup_store(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t old_offset = s->dedup_table_offset;
+    uint32_t old_entries = s->dedup_table_entries;
+    g_autofree Qcow2DedupTableEntry *table = NULL;
+    GHashTableIter iter;
+    Qcow2DedupEntry *e;
+    uint64_t nb_entries, size;
+    int64_t offset = 0;
+    uint32_t i = 0;
+    int ret;
+
+    if (!s->dedup_index || bdrv_is_read_only(bs) ||
+        (s->autoclear_features & QCOW2_AUTOCLEAR_DEDUP_INDEX)) {
+        return 0;
+    }
+
+    nb_entries = qcow2_dedup_index_size(s->dedup_index);
+    size = nb_entries * sizeof(*table);
+    if (size > QCOW2_MAX_DEDUP_INDEX_SIZE) {
+        error_setg(errp, "Deduplication index is too large");
+        return -EFBIG;
+    }
+
+    if (nb_entries) {
+        table = g_try_malloc(size);
+        if (!table) {
+            error_setg(errp, "Could not allocate deduplication index");
+            return -ENOMEM;
+        }
+
+        g_hash_table_iter_init(&iter, s->dedup_index->by_digest);
+        while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&e)) {
+            memcpy(table[i].digest, e->digest, QCOW2_DEDUP_DIGEST_SIZE);
+            table[i].offset = cpu_to_be64(e->offset);
+            i++;
+        }
+
+        offset = qcow2_alloc_clusters(bs, size);
+        if (offset < 0) {
+            ret = offset;
+            offset = 0;
+            goto fail;
+        }
+
+        ret = qcow2_pre_write_overlap_check(bs, 0, offset, size, false);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        ret = bdrv_pwrite(bs->file, offset, size, table, 0);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    /* The references held by the index must be stable before it is valid */
+    ret = qcow2_flush_caches(bs);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    s->dedup_table_offset = offset;
+    s->dedup_table_entries = nb_entries;
+    if (nb_entries) {
+        s->autoclear_features |= QCOW2_AUTOCLEAR_DEDUP_INDEX;
+    }
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        s->dedup_table_offset = old_offset;
+        s->dedup_table_entries = old_entries;
+        s->autoclear_features &= ~QCOW2_AUTOCLEAR_DEDUP_INDEX;
+        goto fail;
+    }
+
+    trace_qcow2_dedup_store(bs, offset, nb_entries);
+
+    if (old_offset) {
+        qcow2_free_clusters(bs, old_offset,
+                            (uint64_t)old_entries * sizeof(*table),
+                            QCOW2_DISCARD_OTHER);
+    }
+    return 0;
+
+fail:
+    if (offset) {
+        qcow2_free_clusters(bs, offset, size, QCOW2_DISCARD_OTHER);
+    }
+    error_setg_errno(errp, -ret, "Could not store deduplication index");
+    return ret;
+}
+
+int coroutine_fn GRAPH_RDLOCK
+qcow2_check_dedup_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
+                            void **refcount_table,
+                            int64_t *refcount_table_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    GHashTableIter iter;
+    Qcow2DedupEntry *e;
+    int ret;
+
+    if (s->dedup_table_offset) {
+        ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                       refcount_table_size,
+                                       s->dedup_table_offset,
+                                       (uint64_t)s->dedup_table_entries *
+                                       sizeof(Qcow2DedupTableEntry));
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    if (!s->dedup_index) {
+        return 0;
+    }
+
+    g_hash_table_iter_init(&iter, s->dedup_index->by_digest);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&e)) {
+        ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                       refcount_table_size, e->offset,
+                                       s->cluster_size);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
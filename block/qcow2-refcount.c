@@ -880,6 +880,13 @@ update_refcount(BlockDriverState *bs, int64_t offset, int64_t length,
         } else {
             refcount += addend;
         }
+        if (decrease && refcount == 1 && s->dedup_index &&
+            qcow2_dedup_index_remove(s->dedup_index, cluster_offset))
+        {
+            /* Only the deduplication index still referenced the cluster */
+            trace_qcow2_dedup_drop(bs, cluster_offset);
+            refcount = 0;
+        }
         if (refcount == 0 && cluster_index < s->free_cluster_index) {
             s->free_cluster_index = cluster_index;
         }
@@ -901,6 +908,12 @@ update_refcount(BlockDriverState *bs, int64_t offset, int64_t length,
                 qcow2_cache_discard(s->l2_table_cache, table);
             }
 
+            if (s->decompress_cache) {
+                qcow2_decompress_cache_invalidate(s->decompress_cache,
+                                                  cluster_offset,
+                                                  s->cluster_size);
+            }
+
             if (s->discard_passthrough[type]) {
                 update_refcount_discard(bs, cluster_offset, s->cluster_size);
             }
@@ -1065,6 +1078,80 @@ int64_t coroutine_fn qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offs
     return i;
 }
 
+/*
+ * Allocates up to *nb_clusters data clusters from the current allocation
+ * extent, reserving a new extent of alloc_extent_size bytes if the current
+ * one is used up. The refcount of a whole extent is updated at once, so
+ * consecutive allocating writes only dirty the refcount blocks once per
+ * extent instead of once per request.
+ *
+ * If @offset is not INV_OFFSET, clusters are only returned if the current
+ * extent starts at @offset; *nb_clusters is set to 0 otherwise.
+ *
+ * On success, *nb_clusters is updated to the number of contiguous clusters
+ * that were handed out and their host offset is returned.
+ */
+int64_t coroutine_fn GRAPH_RDLOCK
+qcow2_alloc_reserved_clusters(BlockDriverState *bs, uint64_t offset,
+                              uint64_t *nb_clusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t bytes = *nb_clusters << s->cluster_bits;
+    int64_t extent_offset;
+
+    if (offset != INV_OFFSET) {
+        if (s->alloc_extent_bytes == 0 || offset != s->alloc_extent_offset) {
+            *nb_clusters = 0;
+            return offset;
+        }
+    } else if (s->alloc_extent_bytes == 0) {
+        uint64_t extent_bytes = MAX(s->alloc_extent_size, bytes);
+
+        extent_offset = qcow2_alloc_clusters(bs, extent_bytes);
+        if (extent_offset < 0 && extent_bytes > bytes) {
+            /* Don't fail a request only because the reservation is large */
+            extent_bytes = bytes;
+            extent_offset = qcow2_alloc_clusters(bs, extent_bytes);
+        }
+        if (extent_offset < 0) {
+            return extent_offset;
+        }
+
+        trace_qcow2_reserve_clusters(bs, extent_offset, extent_bytes);
+        s->alloc_extent_offset = extent_offset;
+        s->alloc_extent_bytes = extent_bytes;
+    }
+
+    bytes = MIN(bytes, s->alloc_extent_bytes);
+    extent_offset = s->alloc_extent_offset;
+    s->alloc_extent_offset += bytes;
+    s->alloc_extent_bytes -= bytes;
+
+    *nb_clusters = bytes >> s->cluster_bits;
+    return extent_offset;
+}
+
+/*
+ * Drops the unused part of the current allocation extent. This must be called
+ * before anything that checks or rebuilds the refcount structures, and before
+ * the image is closed, or the reserved clusters would be leaked.
+ */
+void qcow2_release_reserved_clusters(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->alloc_extent_bytes == 0) {
+        return;
+    }
+
+    trace_qcow2_release_reserved_clusters(bs, s->alloc_extent_offset,
+                                          s->alloc_extent_bytes);
+    qcow2_free_clusters(bs, s->alloc_extent_offset, s->alloc_extent_bytes,
+                        QCOW2_DISCARD_NEVER);
+    s->alloc_extent_offset = 0;
+    s->alloc_extent_bytes = 0;
+}
+
 /* only used to allocate compressed sectors. We try to allocate
    contiguous sectors. size must be <= cluster_size */
 int64_t coroutine_fn GRAPH_RDLOCK qcow2_alloc_bytes(BlockDriverState *bs, int size)
@@ -2287,6 +2374,22 @@ calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         }
     }
 
+    /* compression dictionary */
+    if (s->compression_dict_offset) {
+        ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table, nb_clusters,
+                                       s->compression_dict_offset,
+                                       s->compression_dict_size);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    /* deduplication index */
+    ret = qcow2_check_dedup_refcounts(bs, res, refcount_table, nb_clusters);
+    if (ret < 0) {
+        return ret;
+    }
+
     /* bitmaps */
     ret = qcow2_check_bitmaps_refcounts(bs, res, refcount_table, nb_clusters);
     if (ret < 0) {
@@ -33,6 +33,7 @@
 #include <zstd_errors.h>
 #endif
 
+#include "qapi/error.h"
 #include "qcow2.h"
 #include "block/block-io.h"
 #include "block/thread-pool.h"
@@ -66,18 +67,77 @@ qcow2_co_process(BlockDriverState *bs, ThreadPoolFunc *func, void *arg)
  * Compression
  */
 
+struct Qcow2CompressionDict {
+#ifdef CONFIG_ZSTD
+    ZSTD_CDict *cdict;
+    ZSTD_DDict *ddict;
+#endif
+};
+
 typedef ssize_t (*Qcow2CompressFunc)(void *dest, size_t dest_size,
-                                     const void *src, size_t src_size);
+                                     const void *src, size_t src_size,
+                                     const Qcow2CompressionDict *dict);
 typedef struct Qcow2CompressData {
     void *dest;
     size_t dest_size;
     const void *src;
     size_t src_size;
+    const Qcow2CompressionDict *dict;
     ssize_t ret;
 
     Qcow2CompressFunc func;
 } Qcow2CompressData;
 
+/*
+ * qcow2_compression_dict_new()
+ *
+ * Prepare the dictionary in @buf for use with the compression method @type.
+ * The digested dictionary is shared read-only by all compression threads.
+ *
+ * Returns: the dictionary on success, NULL with @errp set on error
+ */
+Qcow2CompressionDict *
+qcow2_compression_dict_new(Qcow2CompressionType type, const void *buf,
+                           size_t size, Error **errp)
+{
+#ifdef CONFIG_ZSTD
+    Qcow2CompressionDict *dict;
+
+    if (type != QCOW2_COMPRESSION_TYPE_ZSTD) {
+        error_setg(errp, "Compression dictionaries require the zstd "
+                   "compression type");
+        return NULL;
+    }
+
+    dict = g_new0(Qcow2CompressionDict, 1);
+    dict->cdict = ZSTD_createCDict(buf, size, ZSTD_CLEVEL_DEFAULT);
+    dict->ddict = ZSTD_createDDict(buf, size);
+    if (!dict->cdict || !dict->ddict) {
+        error_setg(errp, "Invalid zstd compression dictionary");
+        qcow2_compression_dict_free(dict);
+        return NULL;
+    }
+
+    return dict;
+#else
+    error_setg(errp, "Compression dictionaries require zstd support");
+    return NULL;
+#endif
+}
+
+void qcow2_compression_dict_free(Qcow2CompressionDict *dict)
+{
+    if (!dict) {
+        return;
+    }
+
+#ifdef CONFIG_ZSTD
+    ZSTD_freeCDict(dict->cdict);
+    ZSTD_freeDDict(dict->ddict);
+#endif
+    g_free(dict);
+}
+
 /*
  * qcow2_zlib_compress()
  *
@@ -91,7 +151,8 @@ typedef struct Qcow2CompressData {
  *          -EIO    on any other error
  */
 static ssize_t qcow2_zlib_compress(void *dest, size_t dest_size,
-                                   const void *src, size_t src_size)
+                                   const void *src, size_t src_size,
+                                   const Qcow2CompressionDict *dict)
 {
     ssize_t ret;
     z_stream strm;
@@ -138,7 +199,8 @@ static ssize_t qcow2_zlib_compress(void *dest, size_t dest_size,
  *          -EIO on fail
  */
 static ssize_t qcow2_zlib_decompress(void *dest, size_t dest_size,
-                                     const void *src, size_t src_size)
+                                     const void *src, size_t src_size,
+                                     const Qcow2CompressionDict *dict)
 {
     int ret;
     z_stream strm;
@@ -180,13 +242,15 @@ static ssize_t qcow2_zlib_decompress(void *dest, size_t dest_size,
  *
  * @dest - destination buffer, @dest_size bytes
  * @src - source buffer, @src_size bytes
+ * @dict - dictionary to compress with, or NULL
  *
  * Returns: compressed size on success
  *          -ENOMEM destination buffer is not enough to store compressed data
  *          -EIO    on any other error
  */
 static ssize_t qcow2_zstd_compress(void *dest, size_t dest_size,
-                                   const void *src, size_t src_size)
+                                   const void *src, size_t src_size,
+                                   const Qcow2CompressionDict *dict)
 {
     ssize_t ret;
     size_t zstd_ret;
@@ -205,6 +269,10 @@ static ssize_t qcow2_zstd_compress(void *dest, size_t dest_size,
     if (!cctx) {
         return -EIO;
     }
+    if (dict && ZSTD_isError(ZSTD_CCtx_refCDict(cctx, dict->cdict))) {
+        ret = -EIO;
+        goto out;
+    }
     /*
      * Use the zstd streamed interface for symmetry with decompression,
      * where streaming is essential since we don't record the exact
@@ -249,12 +317,14 @@ out:
  *
  * @dest - destination buffer, @dest_size bytes
  * @src - source buffer, @src_size bytes
+ * @dict - dictionary the data was compressed with, or NULL
  *
  * Returns: 0 on success
  *          -EIO on any error
  */
 static ssize_t qcow2_zstd_decompress(void *dest, size_t dest_size,
-                                     const void *src, size_t src_size)
+                                     const void *src, size_t src_size,
+                                     const Qcow2CompressionDict *dict)
 {
     size_t zstd_ret = 0;
     ssize_t ret = 0;
@@ -273,6 +343,10 @@ static ssize_t qcow2_zstd_decompress(void *dest, size_t dest_size,
     if (!dctx) {
         return -EIO;
     }
+    if (dict && ZSTD_isError(ZSTD_DCtx_refDDict(dctx, dict->ddict))) {
+        ZSTD_freeDCtx(dctx);
+        return -EIO;
+    }
 
     /*
      * The compressed stream from the input buffer may consist of more
@@ -330,7 +404,7 @@ static int qcow2_compress_pool_func(void *opaque)
     Qcow2CompressData *data = opaque;
 
     data->ret = data->func(data->dest, data->dest_size,
-                           data->src, data->src_size);
+                           data->src, data->src_size, data->dict);
 
     return 0;
 }
@@ -339,11 +413,13 @@ static ssize_t coroutine_fn
 qcow2_co_do_compress(BlockDriverState *bs, void *dest, size_t dest_size,
                      const void *src, size_t src_size, Qcow2CompressFunc func)
 {
+    BDRVQcow2State *s = bs->opaque;
     Qcow2CompressData arg = {
         .dest = dest,
         .dest_size = dest_size,
         .src = src,
         .src_size = src_size,
+        .dict = s->compression_dict,
         .func = func,
     };
 
@@ -42,6 +42,7 @@
 #include "qapi/qobject-input-visitor.h"
 #include "qapi/qapi-visit-block-core.h"
 #include "crypto.h"
+#include "crypto/hash.h"
 #include "block/aio_task.h"
 #include "block/dirty-bitmap.h"
 
@@ -73,6 +74,8 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_CRYPTO_HEADER 0x0537be77
 #define  QCOW2_EXT_MAGIC_BITMAPS 0x23852875
 #define  QCOW2_EXT_MAGIC_DATA_FILE 0x44415441
+#define  QCOW2_EXT_MAGIC_COMPRESSION_DICT 0x7a444943
+#define  QCOW2_EXT_MAGIC_DEDUP_INDEX 0x64656475
 
 static int coroutine_fn
 qcow2_co_preadv_compressed(BlockDriverState *bs,
@@ -80,7 +83,8 @@ qcow2_co_preadv_compressed(BlockDriverState *bs,
                            uint64_t offset,
                            uint64_t bytes,
                            QEMUIOVector *qiov,
-                           size_t qiov_offset);
+                           size_t qiov_offset,
+                           uint64_t generation);
 
 static int qcow2_probe(const uint8_t *buf, int buf_size, const char *filename)
 {
@@ -432,6 +436,122 @@ qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             break;
         }
 
+        case QCOW2_EXT_MAGIC_COMPRESSION_DICT:
+        {
+            Qcow2CompressionDictHeaderExtension dict_ext;
+
+            if (ext.len != sizeof(dict_ext)) {
+                error_setg(errp, "Compression dictionary header extension "
+                           "size %u, but expected size %zu", ext.len,
+                           sizeof(dict_ext));
+                return -EINVAL;
+            }
+
+            ret = bdrv_co_pread(bs->file, offset, ext.len, &dict_ext, 0);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "Unable to read compression "
+                                 "dictionary header extension");
+                return ret;
+            }
+
+            s->compression_dict_offset = be64_to_cpu(dict_ext.offset);
+            s->compression_dict_size = be32_to_cpu(dict_ext.length);
+
+            if (offset_into_cluster(s, s->compression_dict_offset) ||
+                s->compression_dict_offset == 0) {
+                error_setg(errp, "Invalid compression dictionary offset");
+                return -EINVAL;
+            }
+
+            if (s->compression_dict_size == 0 ||
+                s->compression_dict_size > QCOW2_MAX_COMPRESSION_DICT_SIZE ||
+                dict_ext.reserved != 0) {
+                error_setg(errp, "Invalid compression dictionary size");
+                return -EINVAL;
+            }
+#ifdef DEBUG_EXT
+            printf("Qcow2: Got compression dictionary extension: "
+                   "offset=%" PRIu64 " size=%" PRIu32 "\n",
+                   s->compression_dict_offset, s->compression_dict_size);
+#endif
+            break;
+        }
+
+        case QCOW2_EXT_MAGIC_DEDUP_INDEX:
+        {
+            Qcow2DedupHeaderExtension dedup_ext;
+            uint64_t table_size;
+
+            if (ext.len != sizeof(dedup_ext)) {
+                error_setg(errp, "dedup_ext: Expected header extension "
+                           "size %zu, got %" PRIu32, sizeof(dedup_ext),
+                           ext.len);
+                return -EINVAL;
+            }
+
+            if (!(s->autoclear_features & QCOW2_AUTOCLEAR_DEDUP_INDEX)) {
+                warn_report("The deduplication index of this image was not "
+                            "stored cleanly or was modified by a program "
+                            "lacking deduplication support, so it is now "
+                            "considered stale");
+                error_printf("Some clusters may be leaked, "
+                             "run 'qemu-img check -r' on the image "
+                             "file to fix.");
+                if (need_update_header != NULL) {
+                    /* Updating is needed to drop the stale extension */
+                    *need_update_header = true;
+                }
+                break;
+            }
+
+            ret = bdrv_co_pread(bs->file, offset, ext.len, &dedup_ext, 0);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "dedup_ext: "
+                                 "Could not read ext header");
+                return ret;
+            }
+
+            dedup_ext.table_offset = be64_to_cpu(dedup_ext.table_offset);
+            dedup_ext.nb_entries = be32_to_cpu(dedup_ext.nb_entries);
+            dedup_ext.reserved = be32_to_cpu(dedup_ext.reserved);
+            table_size = (uint64_t)dedup_ext.nb_entries *
+                         (QCOW2_DEDUP_DIGEST_SIZE + sizeof(uint64_t));
+
+            if (dedup_ext.reserved != 0) {
+                error_setg(errp, "dedup_ext: Reserved field is not zero");
+                return -EINVAL;
+            }
+
+            if (dedup_ext.nb_entries == 0) {
+                error_setg(errp, "dedup_ext: Index has no entries");
+                return -EINVAL;
+            }
+
+            if (dedup_ext.table_offset == 0 ||
+                offset_into_cluster(s, dedup_ext.table_offset)) {
+                error_setg(errp, "dedup_ext: Invalid table offset");
+                return -EINVAL;
+            }
+
+            if (table_size > QCOW2_MAX_DEDUP_INDEX_SIZE) {
+                error_setg(errp, "dedup_ext: Index size (%" PRIu64 ") "
+                           "exceeds the maximum supported size (%" PRIu64
+                           ")", table_size,
+                           (uint64_t)QCOW2_MAX_DEDUP_INDEX_SIZE);
+                return -EINVAL;
+            }
+
+            s->dedup_table_offset = dedup_ext.table_offset;
+            s->dedup_table_entries = dedup_ext.nb_entries;
+
+#ifdef DEBUG_EXT
+            printf("Qcow2: Got deduplication index extension: "
+                   "offset=%" PRIu64 " nb_entries=%" PRIu32 "\n",
+                   s->dedup_table_offset, s->dedup_table_entries);
+#endif
+            break;
+        }
+
         default:
             /* unknown magic - save it in case we need to rewrite the header */
             /* If you add a new feature, make sure to also update the fast
@@ -614,6 +734,9 @@ qcow2_co_check_locked(BlockDriverState *bs, BdrvCheckResult *result,
 
     memset(result, 0, sizeof(*result));
 
+    /* Reserved but unused clusters would be reported as leaks */
+    qcow2_release_reserved_clusters(bs);
+
     ret = qcow2_check_read_snapshot_table(bs, &snapshot_res, fix);
     if (ret < 0) {
         qcow2_add_check_result(result, &snapshot_res, false);
@@ -701,6 +824,9 @@ static const char *const mutable_opts[] = {
     QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
     QCOW2_OPT_REFCOUNT_CACHE_SIZE,
     QCOW2_OPT_CACHE_CLEAN_INTERVAL,
+    QCOW2_OPT_ALLOC_EXTENT_SIZE,
+    QCOW2_OPT_DECOMPRESS_CACHE_SIZE,
+    QCOW2_OPT_DECOMPRESS_READAHEAD,
     NULL
 };
 
@@ -817,6 +943,30 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "Clean unused cache entries after this time (in seconds)",
         },
+        {
+            .name = QCOW2_OPT_ALLOC_EXTENT_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Reserve data clusters in extents of this size to batch "
+                    "refcount updates (0 = disabled)",
+        },
+        {
+            .name = QCOW2_OPT_DECOMPRESS_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum size of the cache for decompressed clusters "
+                    "(0 = disabled)",
+        },
+        {
+            .name = QCOW2_OPT_DECOMPRESS_READAHEAD,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of compressed clusters to decompress ahead of "
+                    "sequential reads",
+        },
+        {
+            .name = QCOW2_OPT_DEDUP_INDEX_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum size of the deduplication index "
+                    "(0 = deduplication disabled)",
+        },
         BLOCK_CRYPTO_OPT_DEF_KEY_SECRET("encrypt.",
             "ID of secret providing qcow2 AES key or LUKS passphrase"),
         { /* end of list */ }
@@ -979,6 +1129,10 @@ typedef struct Qcow2ReopenState {
     bool discard_passthrough[QCOW2_DISCARD_MAX];
     bool discard_no_unref;
     uint64_t cache_clean_interval;
+    uint64_t alloc_extent_size;
+    Qcow2DecompressCache *decompress_cache;
+    int decompress_readahead;
+    uint64_t dedup_max_entries;
     QCryptoBlockOpenOptions *crypto_opts; /* Disk encryption runtime options */
 } Qcow2ReopenState;
 
@@ -991,6 +1145,8 @@ qcow2_update_options_prepare(BlockDriverState *bs, Qcow2ReopenState *r,
     const char *opt_overlap_check, *opt_overlap_check_template;
     int overlap_check_template = 0;
     uint64_t l2_cache_size, l2_cache_entry_size, refcount_cache_size;
+    uint64_t decompress_cache_size, decompress_readahead;
+    uint64_t dedup_index_size;
     int i;
     const char *encryptfmt;
     QDict *encryptopts = NULL;
@@ -1079,6 +1235,88 @@ qcow2_update_options_prepare(BlockDriverState *bs, Qcow2ReopenState *r,
         goto fail;
     }
 
+    /* Size of the extents in which data clusters are reserved */
+    r->alloc_extent_size =
+        qemu_opt_get_size(opts, QCOW2_OPT_ALLOC_EXTENT_SIZE, 0);
+    if (r->alloc_extent_size > QCOW_MAX_ALLOC_EXTENT_SIZE ||
+        !QEMU_IS_ALIGNED(r->alloc_extent_size, s->cluster_size)) {
+        error_setg(errp, QCOW2_OPT_ALLOC_EXTENT_SIZE " must be a multiple of "
+                   "the cluster size (%d) and may not exceed %" PRId64,
+                   s->cluster_size, QCOW_MAX_ALLOC_EXTENT_SIZE);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    /* Decompressed cluster cache and read-ahead */
+    decompress_cache_size =
+        qemu_opt_get_size(opts, QCOW2_OPT_DECOMPRESS_CACHE_SIZE, 0);
+    decompress_cache_size /= s->cluster_size;
+    if (decompress_cache_size > INT_MAX) {
+        error_setg(errp, "Decompressed cluster cache size too big");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    decompress_readahead =
+        qemu_opt_get_number(opts, QCOW2_OPT_DECOMPRESS_READAHEAD, 0);
+    if (decompress_readahead > QCOW_MAX_DECOMPRESS_READAHEAD) {
+        error_setg(errp, QCOW2_OPT_DECOMPRESS_READAHEAD " may not exceed %d",
+                   QCOW_MAX_DECOMPRESS_READAHEAD);
+        ret = -EINVAL;
+        goto fail;
+    }
+    if (decompress_readahead > 0 &&
+        decompress_cache_size < decompress_readahead + 1) {
+        error_setg(errp, QCOW2_OPT_DECOMPRESS_CACHE_SIZE " must hold more "
+                   "clusters than " QCOW2_OPT_DECOMPRESS_READAHEAD);
+        ret = -EINVAL;
+        goto fail;
+    }
+    r->decompress_readahead = decompress_readahead;
+
+    if (decompress_cache_size > 0) {
+        r->decompress_cache =
+            qcow2_decompress_cache_create(decompress_cache_size,
+                                          s->cluster_size);
+        if (!r->decompress_cache) {
+            error_setg(errp, "Could not allocate decompressed cluster cache");
+            ret = -ENOMEM;
+            goto fail;
+        }
+    }
+
+    /* Deduplication of full cluster writes */
+    dedup_index_size = qemu_opt_get_size(opts, QCOW2_OPT_DEDUP_INDEX_SIZE, 0);
+    if (dedup_index_size > QCOW2_MAX_DEDUP_INDEX_SIZE) {
+        error_setg(errp, QCOW2_OPT_DEDUP_INDEX_SIZE " may not exceed %" PRId64,
+                   QCOW2_MAX_DEDUP_INDEX_SIZE);
+        ret = -EINVAL;
+        goto fail;
+    }
+    r->dedup_max_entries = dedup_index_size /
+                           (QCOW2_DEDUP_DIGEST_SIZE + sizeof(uint64_t));
+    if (r->dedup_max_entries) {
+        if (s->qcow_version < 3 || s->refcount_order == 0) {
+            error_setg(errp, "Deduplication requires a qcow2 image with at "
+                       "least qemu 1.1 compatibility level and refcount_bits "
+                       "> 1");
+            ret = -EINVAL;
+            goto fail;
+        }
+        if (s->crypt_method_header || has_subclusters(s) ||
+            (s->incompatible_features & QCOW2_INCOMPAT_DATA_FILE)) {
+            error_setg(errp, "Deduplication is not supported with encryption, "
+                       "extended L2 entries or external data files");
+            ret = -ENOTSUP;
+            goto fail;
+        }
+        if (!qcrypto_hash_supports(QCRYPTO_HASH_ALGO_SHA256)) {
+            error_setg(errp, "Deduplication requires SHA-256 support");
+            ret = -ENOTSUP;
+            goto fail;
+        }
+    }
+
     /* lazy-refcounts; flush if going from enabled to disabled */
     r->use_lazy_refcounts = qemu_opt_get_bool(opts, QCOW2_OPT_LAZY_REFCOUNTS,
         (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS));
@@ -1238,6 +1476,12 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
     }
 
     s->discard_no_unref = r->discard_no_unref;
+    s->alloc_extent_size = r->alloc_extent_size;
+
+    qcow2_decompress_cache_destroy(s->decompress_cache);
+    s->decompress_cache = r->decompress_cache;
+    s->decompress_readahead = r->decompress_readahead;
+    s->dedup_max_entries = r->dedup_max_entries;
 
     if (s->cache_clean_interval != r->cache_clean_interval) {
         cache_clean_timer_del(bs);
@@ -1258,6 +1502,7 @@ static void qcow2_update_options_abort(BlockDriverState *bs,
     if (r->refcount_block_cache) {
         qcow2_cache_destroy(r->refcount_block_cache);
     }
+    qcow2_decompress_cache_destroy(r->decompress_cache);
     qapi_free_QCryptoBlockOpenOptions(r->crypto_opts);
 }
 
@@ -1293,6 +1538,13 @@ static int validate_compression_type(BDRVQcow2State *s, Error **errp)
         return -ENOTSUP;
     }
 
+    if ((s->incompatible_features & QCOW2_INCOMPAT_COMPRESSION_DICT) &&
+        s->compression_type != QCOW2_COMPRESSION_TYPE_ZSTD) {
+        error_setg(errp, "qcow2: Compression dictionaries are only supported "
+                   "with the zstd compression type");
+        return -EINVAL;
+    }
+
     /*
      * if the compression type differs from QCOW2_COMPRESSION_TYPE_ZLIB
      * the incompatible feature flag must be set
@@ -1315,6 +1567,36 @@ static int validate_compression_type(BDRVQcow2State *s, Error **errp)
 }
 
 /* Called with s->lock held.  */
+static int coroutine_fn GRAPH_RDLOCK
+qcow2_load_compression_dict(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    g_autofree uint8_t *buf = g_try_malloc(s->compression_dict_size);
+    int ret;
+
+    if (!buf) {
+        error_setg(errp, "Could not allocate memory for the compression "
+                   "dictionary");
+        return -ENOMEM;
+    }
+
+    ret = bdrv_co_pread(bs->file, s->compression_dict_offset,
+                        s->compression_dict_size, buf, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read compression dictionary");
+        return ret;
+    }
+
+    s->compression_dict = qcow2_compression_dict_new(s->compression_type, buf,
+                                                     s->compression_dict_size,
+                                                     errp);
+    if (!s->compression_dict) {
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
 static int coroutine_fn GRAPH_RDLOCK
 qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
               bool open_data_file, Error **errp)
@@ -1636,6 +1918,28 @@ qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
+    if (!!(s->incompatible_features & QCOW2_INCOMPAT_COMPRESSION_DICT) !=
+        !!s->compression_dict_offset) {
+        error_setg(errp, "Compression dictionary incompatible feature bit "
+                   "and header extension do not match");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    if (s->compression_dict_offset && !(flags & BDRV_O_NO_IO)) {
+        ret = qcow2_load_compression_dict(bs, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    if (s->dedup_table_offset && !(flags & BDRV_O_NO_IO)) {
+        ret = qcow2_dedup_load(bs, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
     if (open_data_file && (flags & BDRV_O_NO_IO)) {
         /*
          * Don't open the data file for 'qemu-img info' so that it can be used
@@ -1880,6 +2184,21 @@ qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
         }
     }
 
+    if (s->dedup_max_entries && !s->dedup_index && !(flags & BDRV_O_NO_IO)) {
+        s->dedup_index = qcow2_dedup_index_new();
+    }
+
+    /* The stored index goes stale with the first write, so drop it now */
+    if (s->dedup_index && bdrv_is_writable(bs) &&
+        !(flags & BDRV_O_INACTIVE)) {
+        ret = qcow2_dedup_invalidate(bs);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not mark the deduplication "
+                             "index as in use");
+            goto fail;
+        }
+    }
+
 #ifdef DEBUG_ALLOC
     {
         BdrvCheckResult result = {0};
@@ -1913,6 +2232,13 @@ qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
     if (s->refcount_block_cache) {
         qcow2_cache_destroy(s->refcount_block_cache);
     }
+    qcow2_decompress_cache_destroy(s->decompress_cache);
+    s->decompress_cache = NULL;
+    qcow2_compression_dict_free(s->compression_dict);
+    s->compression_dict = NULL;
+    qcow2_dedup_index_free(s->dedup_index);
+    s->dedup_index = NULL;
+    g_clear_pointer(&s->bitmap_digests, g_hash_table_destroy);
     qcrypto_block_free(s->crypto);
     qapi_free_QCryptoBlockOpenOptions(s->crypto_opts);
     return ret;
@@ -2011,6 +2337,13 @@ qcow2_reopen_prepare(BDRVReopenState *state,BlockReopenQueue *queue,
             goto fail;
         }
 
+        qcow2_release_reserved_clusters(state->bs);
+
+        ret = qcow2_dedup_store(state->bs, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+
         ret = bdrv_flush(state->bs);
         if (ret < 0) {
             goto fail;
@@ -2059,10 +2392,13 @@ static void qcow2_reopen_commit(BDRVReopenState *state)
 
 static void qcow2_reopen_commit_post(BDRVReopenState *state)
 {
+    BDRVQcow2State *s = state->bs->opaque;
+
     GRAPH_RDLOCK_GUARD_MAINLOOP();
 
     if (state->flags & BDRV_O_RDWR) {
         Error *local_err = NULL;
+        int ret;
 
         if (qcow2_reopen_bitmaps_rw(state->bs, &local_err) < 0) {
             /*
@@ -2074,6 +2410,19 @@ static void qcow2_reopen_commit_post(BDRVReopenState *state)
                               "%s: Failed to make dirty bitmaps writable: ",
                               bdrv_get_node_name(state->bs));
         }
+
+        ret = qcow2_dedup_invalidate(state->bs);
+        if (ret < 0) {
+            /*
+             * The stored index stays valid as long as the in-memory copy is
+             * not modified, so just stop deduplicating.
+             */
+            error_report("%s: Failed to mark the deduplication index as in "
+                         "use: %s", bdrv_get_node_name(state->bs),
+                         strerror(-ret));
+            qcow2_dedup_index_free(s->dedup_index);
+            s->dedup_index = NULL;
+        }
     }
 }
 
@@ -2283,6 +2632,7 @@ typedef struct Qcow2AioTask {
     QEMUIOVector *qiov;
     uint64_t qiov_offset;
     QCowL2Meta *l2meta; /* only for write */
+    uint64_t generation; /* only for compressed read */
 } Qcow2AioTask;
 
 static coroutine_fn int qcow2_co_preadv_task_entry(AioTask *task);
@@ -2295,7 +2645,8 @@ static coroutine_fn int qcow2_add_task(BlockDriverState *bs,
                                        uint64_t bytes,
                                        QEMUIOVector *qiov,
                                        size_t qiov_offset,
-                                       QCowL2Meta *l2meta)
+                                       QCowL2Meta *l2meta,
+                                       uint64_t generation)
 {
     Qcow2AioTask local_task;
     Qcow2AioTask *task = pool ? g_new(Qcow2AioTask, 1) : &local_task;
@@ -2310,6 +2661,7 @@ static coroutine_fn int qcow2_add_task(BlockDriverState *bs,
         .bytes = bytes,
         .qiov_offset = qiov_offset,
         .l2meta = l2meta,
+        .generation = generation,
     };
 
     trace_qcow2_add_task(qemu_coroutine_self(), bs, pool,
@@ -2329,7 +2681,8 @@ static coroutine_fn int qcow2_add_task(BlockDriverState *bs,
 static int coroutine_fn GRAPH_RDLOCK
 qcow2_co_preadv_task(BlockDriverState *bs, QCow2SubclusterType subc_type,
                      uint64_t host_offset, uint64_t offset, uint64_t bytes,
-                     QEMUIOVector *qiov, size_t qiov_offset)
+                     QEMUIOVector *qiov, size_t qiov_offset,
+                     uint64_t generation)
 {
     BDRVQcow2State *s = bs->opaque;
 
@@ -2349,7 +2702,8 @@ qcow2_co_preadv_task(BlockDriverState *bs, QCow2SubclusterType subc_type,
 
     case QCOW2_SUBCLUSTER_COMPRESSED:
         return qcow2_co_preadv_compressed(bs, host_offset,
-                                          offset, bytes, qiov, qiov_offset);
+                                          offset, bytes, qiov, qiov_offset,
+                                          generation);
 
     case QCOW2_SUBCLUSTER_NORMAL:
         if (bs->encrypted) {
@@ -2380,7 +2734,7 @@ static int coroutine_fn GRAPH_RDLOCK qcow2_co_preadv_task_entry(AioTask *task)
 
     return qcow2_co_preadv_task(t->bs, t->subcluster_type,
                                 t->host_offset, t->offset, t->bytes,
-                                t->qiov, t->qiov_offset);
+                                t->qiov, t->qiov_offset, t->generation);
 }
 
 static int coroutine_fn GRAPH_RDLOCK
@@ -2392,6 +2746,7 @@ qcow2_co_preadv_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
     int ret = 0;
     unsigned int cur_bytes; /* number of bytes in current iteration */
     uint64_t host_offset = 0;
+    uint64_t generation = 0;
     QCow2SubclusterType type;
     AioTaskPool *aio = NULL;
 
@@ -2403,6 +2758,16 @@ qcow2_co_preadv_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
                             QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
         }
 
+        /*
+         * Sampled before the L2 lookup: a compressed cluster freed after
+         * it must not be cached, even if we read it before the cache was
+         * invalidated.
+         */
+        if (s->decompress_cache) {
+            generation =
+                qcow2_decompress_cache_generation(s->decompress_cache);
+        }
+
         qemu_co_mutex_lock(&s->lock);
         ret = qcow2_get_host_offset(bs, offset, &cur_bytes,
                                     &host_offset, &type);
@@ -2423,7 +2788,7 @@ qcow2_co_preadv_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
             }
             ret = qcow2_add_task(bs, aio, qcow2_co_preadv_task_entry, type,
                                  host_offset, offset, cur_bytes,
-                                 qiov, qiov_offset, NULL);
+                                 qiov, qiov_offset, NULL, generation);
             if (ret < 0) {
                 goto out;
             }
@@ -2673,6 +3038,66 @@ static coroutine_fn GRAPH_RDLOCK int qcow2_co_pwritev_task_entry(AioTask *task)
                                  t->l2meta);
 }
 
+/*
+ * Like qcow2_co_pwritev_task_entry(), for a full cluster whose data was copied
+ * to a bounce buffer by qcow2_co_pwritev_part(). Frees the buffer.
+ */
+static coroutine_fn GRAPH_RDLOCK int
+qcow2_co_dedup_pwritev_task_entry(AioTask *task)
+{
+    Qcow2AioTask *t = container_of(task, Qcow2AioTask, task);
+    int ret;
+
+    ret = qcow2_co_pwritev_task_entry(task);
+
+    qemu_vfree(t->qiov->local_iov.iov_base);
+    g_free(t->qiov);
+    return ret;
+}
+
+/*
+ * Tries to map the guest cluster at @offset to an indexed host cluster whose
+ * contents are @buf. @cmp_buf is scratch space of one cluster.
+ *
+ * The lock is dropped while the indexed cluster is read for comparison. An
+ * indexed cluster is never written in place, so it can only have changed if
+ * it was dropped from the index (and maybe reused) meanwhile; the lookup is
+ * repeated before the cluster is linked to catch that.
+ *
+ * Returns 1 if the cluster was mapped, 0 if the data must be written
+ * normally, -errno on error.
+ *
+ * Called with s->lock held.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+qcow2_co_dedup_pwrite(BlockDriverState *bs, uint64_t offset, const void *buf,
+                      void *cmp_buf, const uint8_t *digest)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t host_offset;
+    int ret;
+
+    host_offset = qcow2_dedup_index_lookup(s->dedup_index, digest);
+    if (!host_offset) {
+        return 0;
+    }
+
+    /* Never trust the digest alone */
+    qemu_co_mutex_unlock(&s->lock);
+    BLKDBG_CO_EVENT(bs->file, BLKDBG_READ_AIO);
+    ret = bdrv_co_pread(bs->file, host_offset, s->cluster_size, cmp_buf, 0);
+    qemu_co_mutex_lock(&s->lock);
+    if (ret < 0) {
+        return ret;
+    }
+    if (memcmp(buf, cmp_buf, s->cluster_size) ||
+        qcow2_dedup_index_lookup(s->dedup_index, digest) != host_offset) {
+        return 0;
+    }
+
+    return qcow2_dedup_link_cluster(bs, offset, host_offset);
+}
+
 static int coroutine_fn GRAPH_RDLOCK
 qcow2_co_pwritev_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
                       QEMUIOVector *qiov, size_t qiov_offset,
@@ -2685,10 +3110,15 @@ qcow2_co_pwritev_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
     uint64_t host_offset;
     QCowL2Meta *l2meta = NULL;
     AioTaskPool *aio = NULL;
+    uint8_t *dedup_buf = NULL;
+    uint8_t *cmp_buf = NULL;
+    uint8_t dedup_digest[QCOW2_DEDUP_DIGEST_SIZE];
+    QEMUIOVector *dedup_qiov;
 
     trace_qcow2_writev_start_req(qemu_coroutine_self(), offset, bytes);
 
     while (bytes != 0 && aio_task_pool_status(aio) == 0) {
+        bool dedup = false;
 
         l2meta = NULL;
 
@@ -2701,14 +3131,69 @@ qcow2_co_pwritev_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
                             - offset_in_cluster);
         }
 
+        /*
+         * Full clusters are deduplicated one at a time. The data is copied
+         * first so that what is hashed, compared and written is the same;
+         * each cluster gets its own copy, which the write task frees.
+         */
+        if (s->dedup_index && s->dedup_max_entries &&
+            offset_in_cluster == 0 && bytes >= s->cluster_size)
+        {
+            if (!cmp_buf) {
+                cmp_buf = qemu_try_blockalign(bs->file->bs, s->cluster_size);
+                if (!cmp_buf) {
+                    ret = -ENOMEM;
+                    goto fail_nometa;
+                }
+            }
+            if (!dedup_buf) {
+                dedup_buf = qemu_try_blockalign(bs->file->bs, s->cluster_size);
+                if (!dedup_buf) {
+                    ret = -ENOMEM;
+                    goto fail_nometa;
+                }
+            }
+
+            qemu_iovec_to_buf(qiov, qiov_offset, dedup_buf, s->cluster_size);
+            if (qcow2_dedup_digest(dedup_buf, s->cluster_size, dedup_digest,
+                                   NULL) == 0) {
+                dedup = true;
+                cur_bytes = s->cluster_size;
+            }
+        }
+
         qemu_co_mutex_lock(&s->lock);
 
+        if (dedup) {
+            ret = qcow2_co_dedup_pwrite(bs, offset, dedup_buf, cmp_buf,
+                                        dedup_digest);
+            if (ret < 0) {
+                goto out_locked;
+            } else if (ret > 0) {
+                /* dedup_buf is left for the next cluster */
+                qemu_co_mutex_unlock(&s->lock);
+                bytes -= cur_bytes;
+                offset += cur_bytes;
+                qiov_offset += cur_bytes;
+                trace_qcow2_writev_done_part(qemu_coroutine_self(), cur_bytes);
+                continue;
+            }
+        }
+
         ret = qcow2_alloc_host_offset(bs, offset, &cur_bytes,
                                       &host_offset, &l2meta);
         if (ret < 0) {
             goto out_locked;
         }
 
+        if (dedup && l2meta && !l2meta->next &&
+            cur_bytes == s->cluster_size &&
+            qcow2_dedup_index_size(s->dedup_index) < s->dedup_max_entries)
+        {
+            l2meta->dedup = true;
+            memcpy(l2meta->dedup_digest, dedup_digest, sizeof(dedup_digest));
+        }
+
         ret = qcow2_pre_write_overlap_check(bs, 0, host_offset,
                                             cur_bytes, true);
         if (ret < 0) {
@@ -2720,9 +3205,19 @@ qcow2_co_pwritev_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
         if (!aio && cur_bytes != bytes) {
             aio = aio_task_pool_new(QCOW2_MAX_WORKERS);
         }
-        ret = qcow2_add_task(bs, aio, qcow2_co_pwritev_task_entry, 0,
-                             host_offset, offset,
-                             cur_bytes, qiov, qiov_offset, l2meta);
+        if (dedup) {
+            /* The task owns dedup_buf from here on */
+            dedup_qiov = g_new(QEMUIOVector, 1);
+            qemu_iovec_init_buf(dedup_qiov, dedup_buf, cur_bytes);
+            dedup_buf = NULL;
+            ret = qcow2_add_task(bs, aio, qcow2_co_dedup_pwritev_task_entry, 0,
+                                 host_offset, offset,
+                                 cur_bytes, dedup_qiov, 0, l2meta, 0);
+        } else {
+            ret = qcow2_add_task(bs, aio, qcow2_co_pwritev_task_entry, 0,
+                                 host_offset, offset,
+                                 cur_bytes, qiov, qiov_offset, l2meta, 0);
+        }
         l2meta = NULL; /* l2meta is consumed by qcow2_co_pwritev_task() */
         if (ret < 0) {
             goto fail_nometa;
@@ -2751,6 +3246,9 @@ fail_nometa:
         g_free(aio);
     }
 
+    qemu_vfree(dedup_buf);
+    qemu_vfree(cmp_buf);
+
     trace_qcow2_writev_done_req(qemu_coroutine_self(), ret);
 
     return ret;
@@ -2770,6 +3268,16 @@ static int GRAPH_RDLOCK qcow2_inactivate(BlockDriverState *bs)
                           bdrv_get_device_or_node_name(bs));
     }
 
+    qcow2_release_reserved_clusters(bs);
+
+    qcow2_dedup_store(bs, &local_err);
+    if (local_err != NULL) {
+        result = -EIO;
+        error_reportf_err(local_err, "Lost deduplication index during "
+                          "inactivation of node '%s': ",
+                          bdrv_get_device_or_node_name(bs));
+    }
+
     ret = qcow2_cache_flush(bs, s->l2_table_cache);
     if (ret) {
         result = ret;
@@ -2806,6 +3314,13 @@ qcow2_do_close(BlockDriverState *bs, bool close_data_file)
     cache_clean_timer_del(bs);
     qcow2_cache_destroy(s->l2_table_cache);
     qcow2_cache_destroy(s->refcount_block_cache);
+    qcow2_decompress_cache_destroy(s->decompress_cache);
+    s->decompress_cache = NULL;
+    qcow2_compression_dict_free(s->compression_dict);
+    s->compression_dict = NULL;
+    qcow2_dedup_index_free(s->dedup_index);
+    s->dedup_index = NULL;
+    g_clear_pointer(&s->bitmap_digests, g_hash_table_destroy);
 
     qcrypto_block_free(s->crypto);
     s->crypto = NULL;
@@ -3046,6 +3561,36 @@ int qcow2_update_header(BlockDriverState *bs)
         buflen -= ret;
     }
 
+    /* Compression dictionary pointer extension */
+    if (s->compression_dict_offset != 0) {
+        Qcow2CompressionDictHeaderExtension dict_ext = {
+            .offset = cpu_to_be64(s->compression_dict_offset),
+            .length = cpu_to_be32(s->compression_dict_size),
+        };
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_COMPRESSION_DICT,
+                             &dict_ext, sizeof(dict_ext), buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+        buf += ret;
+        buflen -= ret;
+    }
+
+    /* Deduplication index extension */
+    if (s->dedup_table_offset != 0) {
+        Qcow2DedupHeaderExtension dedup_ext = {
+            .table_offset = cpu_to_be64(s->dedup_table_offset),
+            .nb_entries = cpu_to_be32(s->dedup_table_entries),
+        };
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_DEDUP_INDEX,
+                             &dedup_ext, sizeof(dedup_ext), buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+        buf += ret;
+        buflen -= ret;
+    }
+
     /*
      * Feature table.  A mere 8 feature names occupies 392 bytes, and
      * when coupled with the v3 minimum header of 104 bytes plus the
@@ -3081,6 +3626,11 @@ int qcow2_update_header(BlockDriverState *bs)
                 .bit  = QCOW2_INCOMPAT_EXTL2_BITNR,
                 .name = "extended L2 entries",
             },
+            {
+                .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+                .bit  = QCOW2_INCOMPAT_COMPRESSION_DICT_BITNR,
+                .name = "compression dictionary",
+            },
             {
                 .type = QCOW2_FEAT_TYPE_COMPATIBLE,
                 .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
@@ -3096,6 +3646,11 @@ int qcow2_update_header(BlockDriverState *bs)
                 .bit  = QCOW2_AUTOCLEAR_DATA_FILE_RAW_BITNR,
                 .name = "raw external data",
             },
+            {
+                .type = QCOW2_FEAT_TYPE_AUTOCLEAR,
+                .bit  = QCOW2_AUTOCLEAR_DEDUP_INDEX_BITNR,
+                .name = "deduplication index",
+            },
         };
 
         ret = header_ext_add(buf, QCOW2_EXT_MAGIC_FEATURE_TABLE,
@@ -3247,6 +3802,126 @@ qcow2_set_up_encryption(BlockDriverState *bs,
     return ret;
 }
 
+/*
+ * Reads the whole node @ref, which holds a compression dictionary, into
+ * @contents.
+ */
+static int coroutine_fn GRAPH_UNLOCKED
+qcow2_co_read_compression_dict(BlockdevRef *ref, uint8_t **contents,
+                               size_t *size, Error **errp)
+{
+    BlockDriverState *dict_bs;
+    BlockBackend *dict_blk;
+    int64_t len;
+    int ret;
+
+    dict_bs = bdrv_co_open_blockdev_ref(ref, errp);
+    if (dict_bs == NULL) {
+        return -EIO;
+    }
+
+    dict_blk = blk_co_new_with_bs(dict_bs, BLK_PERM_CONSISTENT_READ,
+                                  BLK_PERM_ALL, errp);
+    bdrv_co_unref(dict_bs);
+    if (!dict_blk) {
+        return -EPERM;
+    }
+
+    len = blk_co_getlength(dict_blk);
+    if (len < 0) {
+        ret = len;
+        error_setg_errno(errp, -ret, "Could not get compression dictionary "
+                         "size");
+        goto out;
+    }
+    if (len == 0 || len > QCOW2_MAX_COMPRESSION_DICT_SIZE) {
+        error_setg(errp, "Compression dictionary must be between 1 byte and "
+                   "%" PRId64 " bytes large", QCOW2_MAX_COMPRESSION_DICT_SIZE);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    *contents = g_malloc(len);
+    ret = blk_co_pread(dict_blk, 0, len, *contents, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read compression dictionary");
+        g_free(*contents);
+        *contents = NULL;
+        goto out;
+    }
+    *size = len;
+
+out:
+    blk_co_unref(dict_blk);
+    return ret;
+}
+
+/*
+ * Stores the dictionary @contents in the image and makes all further
+ * compressed writes use it.  Only valid on a freshly created image, since
+ * clusters compressed without the dictionary could not be read back.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+qcow2_set_up_compression_dict(BlockDriverState *bs, const uint8_t *contents,
+                              size_t size, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    g_autofree uint8_t *buf = NULL;
+    Qcow2CompressionDict *dict;
+    int64_t offset;
+    uint64_t buf_size;
+    int ret;
+
+    dict = qcow2_compression_dict_new(s->compression_type, contents, size,
+                                      errp);
+    if (!dict) {
+        return -EINVAL;
+    }
+
+    buf_size = ROUND_UP(size, s->cluster_size);
+    offset = qcow2_alloc_clusters(bs, buf_size);
+    if (offset < 0) {
+        ret = offset;
+        error_setg_errno(errp, -ret, "Could not allocate compression "
+                         "dictionary");
+        goto fail;
+    }
+
+    ret = qcow2_flush_caches(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not flush refcounts");
+        goto fail;
+    }
+
+    buf = g_malloc0(buf_size);
+    memcpy(buf, contents, size);
+    ret = bdrv_co_pwrite(bs->file, offset, buf_size, buf, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write compression dictionary");
+        goto fail;
+    }
+
+    s->compression_dict_offset = offset;
+    s->compression_dict_size = size;
+    s->incompatible_features |= QCOW2_INCOMPAT_COMPRESSION_DICT;
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        s->compression_dict_offset = 0;
+        s->compression_dict_size = 0;
+        s->incompatible_features &= ~QCOW2_INCOMPAT_COMPRESSION_DICT;
+        error_setg_errno(errp, -ret, "Could not update qcow2 header");
+        goto fail;
+    }
+
+    qcow2_compression_dict_free(s->compression_dict);
+    s->compression_dict = dict;
+    return 0;
+
+fail:
+    qcow2_compression_dict_free(dict);
+    return ret;
+}
+
 /**
  * Preallocates metadata structures for data clusters between @offset (in the
  * guest disk) and @new_length (which is thus generally the new guest disk
@@ -3523,6 +4198,8 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
     uint64_t *refcount_table;
     int ret;
     uint8_t compression_type = QCOW2_COMPRESSION_TYPE_ZLIB;
+    g_autofree uint8_t *compression_dict = NULL;
+    size_t compression_dict_size = 0;
 
     assert(create_options->driver == BLOCKDEV_DRIVER_QCOW2);
     qcow2_opts = &create_options->u.qcow2;
@@ -3701,6 +4378,22 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
         compression_type = qcow2_opts->compression_type;
     }
 
+    if (qcow2_opts->compression_dict &&
+        compression_type != QCOW2_COMPRESSION_TYPE_ZSTD) {
+        error_setg(errp, "Compression dictionaries are only supported with "
+                   "compression_type=zstd");
+        ret = -EINVAL;
+        goto out;
+    }
+    if (qcow2_opts->compression_dict) {
+        ret = qcow2_co_read_compression_dict(qcow2_opts->compression_dict,
+                                             &compression_dict,
+                                             &compression_dict_size, errp);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
     /* Create BlockBackend to write to the image */
     blk = blk_co_new_with_bs(bs, BLK_PERM_WRITE | BLK_PERM_RESIZE, BLK_PERM_ALL,
                              errp);
@@ -3861,6 +4554,18 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
         }
     }
 
+    /* Want a compression dictionary? */
+    if (qcow2_opts->compression_dict) {
+        bdrv_graph_co_rdlock();
+        ret = qcow2_set_up_compression_dict(blk_bs(blk), compression_dict,
+                                            compression_dict_size, errp);
+        bdrv_graph_co_rdunlock();
+
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
     blk_co_unref(blk);
     blk = NULL;
 
@@ -3901,6 +4606,7 @@ qcow2_co_create_opts(BlockDriver *drv, const char *filename, QemuOpts *opts,
     Visitor *v;
     BlockDriverState *bs = NULL;
     BlockDriverState *data_bs = NULL;
+    BlockDriverState *dict_bs = NULL;
     const char *val;
     int ret;
 
@@ -3986,6 +4692,19 @@ qcow2_co_create_opts(BlockDriver *drv, const char *filename, QemuOpts *opts,
         qdict_put_str(qdict, "data-file", data_bs->node_name);
     }
 
+    /* Open the compression dictionary (protocol layer) */
+    val = qdict_get_try_str(qdict, BLOCK_OPT_COMPRESSION_DICT);
+    if (val) {
+        dict_bs = bdrv_co_open(val, NULL, NULL, BDRV_O_PROTOCOL, errp);
+        if (dict_bs == NULL) {
+            ret = -EIO;
+            goto finish;
+        }
+
+        qdict_del(qdict, BLOCK_OPT_COMPRESSION_DICT);
+        qdict_put_str(qdict, "compression-dict", dict_bs->node_name);
+    }
+
     /* Set 'driver' and 'node' options */
     qdict_put_str(qdict, "driver", "qcow2");
     qdict_put_str(qdict, "file", bs->node_name);
@@ -4023,6 +4742,7 @@ finish:
     qobject_unref(qdict);
     bdrv_co_unref(bs);
     bdrv_co_unref(data_bs);
+    bdrv_co_unref(dict_bs);
     qapi_free_BlockdevCreateOptions(create_options);
     return ret;
 }
@@ -4349,6 +5069,9 @@ qcow2_co_truncate(BlockDriverState *bs, int64_t offset, bool exact,
             goto fail;
         }
 
+        /* Reserved clusters would keep the image file from being shrunk */
+        qcow2_release_reserved_clusters(bs);
+
         ret = qcow2_cluster_discard(bs, ROUND_UP(offset, s->cluster_size),
                                     old_length - ROUND_UP(offset,
                                                           s->cluster_size),
@@ -4798,7 +5521,8 @@ qcow2_co_pwritev_compressed_part(BlockDriverState *bs,
         }
 
         ret = qcow2_add_task(bs, aio, qcow2_co_pwritev_compressed_task_entry,
-                             0, 0, offset, chunk_size, qiov, qiov_offset, NULL);
+                             0, 0, offset, chunk_size, qiov, qiov_offset, NULL,
+                             0);
         if (ret < 0) {
             break;
         }
@@ -4818,19 +5542,20 @@ qcow2_co_pwritev_compressed_part(BlockDriverState *bs,
     return ret;
 }
 
+/*
+ * Reads and decompresses the compressed cluster described by @l2_entry into
+ * @out_buf, which must be cluster_size bytes large, and adds the result to
+ * the decompressed cluster cache if there is one. @generation is the cache
+ * generation sampled before @l2_entry was looked up.
+ */
 static int coroutine_fn GRAPH_RDLOCK
-qcow2_co_preadv_compressed(BlockDriverState *bs,
-                           uint64_t l2_entry,
-                           uint64_t offset,
-                           uint64_t bytes,
-                           QEMUIOVector *qiov,
-                           size_t qiov_offset)
+qcow2_co_decompress_cluster(BlockDriverState *bs, uint64_t l2_entry,
+                            void *out_buf, uint64_t generation)
 {
     BDRVQcow2State *s = bs->opaque;
-    int ret = 0, csize;
+    int ret, csize;
     uint64_t coffset;
-    uint8_t *buf, *out_buf;
-    int offset_in_cluster = offset_into_cluster(s, offset);
+    uint8_t *buf;
 
     qcow2_parse_compressed_l2_entry(bs, l2_entry, &coffset, &csize);
 
@@ -4839,8 +5564,6 @@ qcow2_co_preadv_compressed(BlockDriverState *bs,
         return -ENOMEM;
     }
 
-    out_buf = qemu_blockalign(bs, s->cluster_size);
-
     BLKDBG_CO_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
     ret = bdrv_co_pread(bs->file, coffset, csize, buf, 0);
     if (ret < 0) {
@@ -4852,12 +5575,146 @@ qcow2_co_preadv_compressed(BlockDriverState *bs,
         goto fail;
     }
 
-    qemu_iovec_from_buf(qiov, qiov_offset, out_buf + offset_in_cluster, bytes);
+    if (s->decompress_cache) {
+        qcow2_decompress_cache_insert(s->decompress_cache, coffset, csize,
+                                      out_buf, generation);
+    }
 
 fail:
-    qemu_vfree(out_buf);
     g_free(buf);
+    return ret;
+}
+
+typedef struct Qcow2DecompressReadahead {
+    BlockDriverState *bs;
+    uint64_t offset;
+    int nb_clusters;
+} Qcow2DecompressReadahead;
+
+static void coroutine_fn qcow2_co_decompress_readahead_entry(void *opaque)
+{
+    Qcow2DecompressReadahead *ra = opaque;
+    BlockDriverState *bs = ra->bs;
+    BDRVQcow2State *s = bs->opaque;
+    uint8_t *out_buf = qemu_blockalign(bs, s->cluster_size);
+    int i;
+
+    bdrv_graph_co_rdlock();
 
+    for (i = 0; i < ra->nb_clusters; i++) {
+        uint64_t offset = ra->offset + ((uint64_t) i << s->cluster_bits);
+        unsigned int bytes = s->cluster_size;
+        QCow2SubclusterType type;
+        uint64_t l2_entry, coffset, generation;
+        int ret, csize;
+
+        if (offset >= bs->total_sectors * BDRV_SECTOR_SIZE) {
+            break;
+        }
+
+        generation = qcow2_decompress_cache_generation(s->decompress_cache);
+        qemu_co_mutex_lock(&s->lock);
+        ret = qcow2_get_host_offset(bs, offset, &bytes, &l2_entry, &type);
+        qemu_co_mutex_unlock(&s->lock);
+        if (ret < 0 || type != QCOW2_SUBCLUSTER_COMPRESSED) {
+            break;
+        }
+
+        qcow2_parse_compressed_l2_entry(bs, l2_entry, &coffset, &csize);
+        if (qcow2_decompress_cache_contains(s->decompress_cache,
+                                            coffset, csize)) {
+            continue;
+        }
+
+        trace_qcow2_decompress_readahead(qemu_coroutine_self(), offset);
+        if (qcow2_co_decompress_cluster(bs, l2_entry, out_buf,
+                                        generation) < 0) {
+            break;
+        }
+    }
+
+    bdrv_graph_co_rdunlock();
+
+    qemu_vfree(out_buf);
+    qatomic_set(&s->decompress_readahead_in_flight, false);
+    bdrv_dec_in_flight(bs);
+    g_free(ra);
+}
+
+/*
+ * Starts decompressing the clusters following @offset in the background if
+ * the guest reads compressed clusters sequentially. At most one read-ahead
+ * coroutine runs at a time.
+ */
+static void coroutine_fn
+qcow2_decompress_readahead(BlockDriverState *bs, uint64_t offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t cluster = offset >> s->cluster_bits;
+    uint64_t last_cluster = s->decompress_last_cluster;
+    Qcow2DecompressReadahead *ra;
+    Coroutine *co;
+
+    /* Racy with requests in other threads, but this is only a heuristic */
+    s->decompress_last_cluster = cluster;
+
+    if (!s->decompress_readahead || cluster != last_cluster + 1) {
+        return;
+    }
+
+    if (qatomic_xchg(&s->decompress_readahead_in_flight, true)) {
+        return;
+    }
+
+    ra = g_new(Qcow2DecompressReadahead, 1);
+    *ra = (Qcow2DecompressReadahead) {
+        .bs = bs,
+        .offset = (cluster + 1) << s->cluster_bits,
+        .nb_clusters = s->decompress_readahead,
+    };
+
+    /* Keeps drain (and therefore close and reopen) waiting for us */
+    bdrv_inc_in_flight(bs);
+    co = qemu_coroutine_create(qcow2_co_decompress_readahead_entry, ra);
+    aio_co_enter(bdrv_get_aio_context(bs), co);
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+qcow2_co_preadv_compressed(BlockDriverState *bs,
+                           uint64_t l2_entry,
+                           uint64_t offset,
+                           uint64_t bytes,
+                           QEMUIOVector *qiov,
+                           size_t qiov_offset,
+                           uint64_t generation)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret, csize;
+    uint64_t coffset;
+    uint8_t *out_buf;
+    int offset_in_cluster = offset_into_cluster(s, offset);
+
+    if (s->decompress_cache) {
+        qcow2_decompress_readahead(bs, offset);
+
+        qcow2_parse_compressed_l2_entry(bs, l2_entry, &coffset, &csize);
+        if (qcow2_decompress_cache_read(s->decompress_cache, coffset, csize,
+                                        offset_in_cluster, bytes,
+                                        qiov, qiov_offset)) {
+            return 0;
+        }
+    }
+
+    out_buf = qemu_blockalign(bs, s->cluster_size);
+
+    ret = qcow2_co_decompress_cluster(bs, l2_entry, out_buf, generation);
+    if (ret >= 0) {
+        qemu_iovec_from_buf(qiov, qiov_offset, out_buf + offset_in_cluster,
+                            bytes);
+        ret = 0;
+    }
+
+    qemu_vfree(out_buf);
     return ret;
 }
 
@@ -4875,6 +5732,10 @@ static int GRAPH_RDLOCK make_completely_empty(BlockDriverState *bs)
         uint32_t reftable_clusters;
     } QEMU_PACKED l1_ofs_rt_ofs_cls;
 
+    /* All refcounts are dropped below, including the reserved clusters */
+    s->alloc_extent_offset = 0;
+    s->alloc_extent_bytes = 0;
+
     ret = qcow2_cache_empty(bs, s->l2_table_cache);
     if (ret < 0) {
         goto fail;
@@ -5024,11 +5885,14 @@ static int GRAPH_RDLOCK qcow2_make_empty(BlockDriverState *bs)
     if (s->qcow_version >= 3 && !s->snapshots && !s->nb_bitmaps &&
         3 + l1_clusters <= s->refcount_block_size &&
         s->crypt_method_header != QCOW_CRYPT_LUKS &&
+        !s->compression_dict_offset &&
+        !s->dedup_index && !s->dedup_table_offset &&
         !has_data_file(bs)) {
         /* The following function only works for qcow2 v3 images (it
          * requires the dirty flag) and only as long as there are no
          * features that reserve extra clusters (such as snapshots,
-         * LUKS header, or persistent bitmaps), because it completely
+         * LUKS header, compression dictionary, deduplication index, or
+         * persistent bitmaps), because it completely
          * empties the image.  Furthermore, the L1 table and three
          * additional clusters (image header, refcount table, one
          * refcount block) have to fit inside one refcount block. It
@@ -5468,6 +6332,12 @@ qcow2_downgrade(BlockDriverState *bs, int target_version,
         return -ENOTSUP;
     }
 
+    if (s->dedup_index || s->dedup_table_offset) {
+        error_setg(errp, "Cannot downgrade an image with a deduplication "
+                   "index");
+        return -ENOTSUP;
+    }
+
     /*
      * If any internal snapshot has a different size than the current
      * image size, or VM state size that exceeds 32 bits, downgrading
@@ -5831,6 +6701,7 @@ qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
         }
 
         helper_cb_info.current_operation = QCOW2_CHANGING_REFCOUNT_ORDER;
+        qcow2_release_reserved_clusters(bs);
         ret = qcow2_change_refcount_order(bs, refcount_order,
                                           &qcow2_amend_helper_cb,
                                           &helper_cb_info, errp);
@@ -6113,6 +6984,12 @@ static QemuOptsList qcow2_create_opts = {
             .help = "Compression method used for image cluster "        \
                     "compression",                                      \
             .def_value_str = "zlib"                                     \
+        },                                                              \
+        {                                                               \
+            .name = BLOCK_OPT_COMPRESSION_DICT,                         \
+            .type = QEMU_OPT_STRING,                                    \
+            .help = "File name of a zstd dictionary to compress "       \
+                    "clusters with",                                    \
         },
         QCOW_COMMON_OPTIONS,
         { /* end of list */ }
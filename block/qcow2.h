@@ -64,6 +64,19 @@
 /* Maximum amount of extra data per snapshot table entry to accept */
 #define QCOW_MAX_SNAPSHOT_EXTRA_DATA 1024
 
+/* Upper limit for the alloc-extent-size option */
+#define QCOW_MAX_ALLOC_EXTENT_SIZE (1 * GiB)
+
+/* Maximum size of a compression dictionary */
+#define QCOW2_MAX_COMPRESSION_DICT_SIZE (1 * MiB)
+
+/* Upper limit for the decompress-readahead option */
+#define QCOW_MAX_DECOMPRESS_READAHEAD 64
+
+/* Deduplication index constraints */
+#define QCOW2_DEDUP_DIGEST_SIZE 32
+#define QCOW2_MAX_DEDUP_INDEX_SIZE (1 * GiB)
+
 /* Bitmap header extension constraints */
 #define QCOW2_MAX_BITMAPS 65535
 #define QCOW2_MAX_BITMAP_DIRECTORY_SIZE (1024 * QCOW2_MAX_BITMAPS)
@@ -150,6 +163,10 @@
 #define QCOW2_OPT_L2_CACHE_ENTRY_SIZE "l2-cache-entry-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
 #define QCOW2_OPT_CACHE_CLEAN_INTERVAL "cache-clean-interval"
+#define QCOW2_OPT_ALLOC_EXTENT_SIZE "alloc-extent-size"
+#define QCOW2_OPT_DECOMPRESS_CACHE_SIZE "decompress-cache-size"
+#define QCOW2_OPT_DECOMPRESS_READAHEAD "decompress-readahead"
+#define QCOW2_OPT_DEDUP_INDEX_SIZE "dedup-index-size"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -231,11 +248,32 @@ typedef struct QCowSnapshot {
 struct Qcow2Cache;
 typedef struct Qcow2Cache Qcow2Cache;
 
+struct Qcow2DecompressCache;
+typedef struct Qcow2DecompressCache Qcow2DecompressCache;
+
+struct Qcow2CompressionDict;
+typedef struct Qcow2CompressionDict Qcow2CompressionDict;
+
+struct Qcow2DedupIndex;
+typedef struct Qcow2DedupIndex Qcow2DedupIndex;
+
 typedef struct Qcow2CryptoHeaderExtension {
     uint64_t offset;
     uint64_t length;
 } QEMU_PACKED Qcow2CryptoHeaderExtension;
 
+typedef struct Qcow2CompressionDictHeaderExtension {
+    uint64_t offset;
+    uint32_t length;
+    uint32_t reserved;
+} QEMU_PACKED Qcow2CompressionDictHeaderExtension;
+
+typedef struct Qcow2DedupHeaderExtension {
+    uint64_t table_offset;
+    uint32_t nb_entries;
+    uint32_t reserved;
+} QEMU_PACKED Qcow2DedupHeaderExtension;
+
 typedef struct Qcow2UnknownHeaderExtension {
     uint32_t magic;
     uint32_t len;
@@ -256,17 +294,21 @@ enum {
     QCOW2_INCOMPAT_DATA_FILE_BITNR  = 2,
     QCOW2_INCOMPAT_COMPRESSION_BITNR = 3,
     QCOW2_INCOMPAT_EXTL2_BITNR      = 4,
+    QCOW2_INCOMPAT_COMPRESSION_DICT_BITNR = 5,
     QCOW2_INCOMPAT_DIRTY            = 1 << QCOW2_INCOMPAT_DIRTY_BITNR,
     QCOW2_INCOMPAT_CORRUPT          = 1 << QCOW2_INCOMPAT_CORRUPT_BITNR,
     QCOW2_INCOMPAT_DATA_FILE        = 1 << QCOW2_INCOMPAT_DATA_FILE_BITNR,
     QCOW2_INCOMPAT_COMPRESSION      = 1 << QCOW2_INCOMPAT_COMPRESSION_BITNR,
     QCOW2_INCOMPAT_EXTL2            = 1 << QCOW2_INCOMPAT_EXTL2_BITNR,
+    QCOW2_INCOMPAT_COMPRESSION_DICT =
+        1 << QCOW2_INCOMPAT_COMPRESSION_DICT_BITNR,
 
     QCOW2_INCOMPAT_MASK             = QCOW2_INCOMPAT_DIRTY
                                     | QCOW2_INCOMPAT_CORRUPT
                                     | QCOW2_INCOMPAT_DATA_FILE
                                     | QCOW2_INCOMPAT_COMPRESSION
-                                    | QCOW2_INCOMPAT_EXTL2,
+                                    | QCOW2_INCOMPAT_EXTL2
+                                    | QCOW2_INCOMPAT_COMPRESSION_DICT,
 };
 
 /* Compatible feature bits */
@@ -281,11 +323,14 @@ enum {
 enum {
     QCOW2_AUTOCLEAR_BITMAPS_BITNR       = 0,
     QCOW2_AUTOCLEAR_DATA_FILE_RAW_BITNR = 1,
+    QCOW2_AUTOCLEAR_DEDUP_INDEX_BITNR   = 2,
     QCOW2_AUTOCLEAR_BITMAPS             = 1 << QCOW2_AUTOCLEAR_BITMAPS_BITNR,
     QCOW2_AUTOCLEAR_DATA_FILE_RAW       = 1 << QCOW2_AUTOCLEAR_DATA_FILE_RAW_BITNR,
+    QCOW2_AUTOCLEAR_DEDUP_INDEX         = 1 << QCOW2_AUTOCLEAR_DEDUP_INDEX_BITNR,
 
     QCOW2_AUTOCLEAR_MASK                = QCOW2_AUTOCLEAR_BITMAPS
-                                        | QCOW2_AUTOCLEAR_DATA_FILE_RAW,
+                                        | QCOW2_AUTOCLEAR_DATA_FILE_RAW
+                                        | QCOW2_AUTOCLEAR_DEDUP_INDEX,
 };
 
 enum qcow2_discard_type {
@@ -345,6 +390,12 @@ typedef struct BDRVQcow2State {
 
     Qcow2Cache *l2_table_cache;
     Qcow2Cache *refcount_block_cache;
+    Qcow2DecompressCache *decompress_cache;
+    /* Number of compressed clusters to decompress ahead of sequential reads */
+    int decompress_readahead;
+    /* Guest cluster index of the last compressed cluster that was read */
+    uint64_t decompress_last_cluster;
+    bool decompress_readahead_in_flight;
     QEMUTimer *cache_clean_timer;
     unsigned cache_clean_interval;
 
@@ -357,6 +408,16 @@ typedef struct BDRVQcow2State {
     uint64_t free_cluster_index;
     uint64_t free_byte_offset;
 
+    /*
+     * Data clusters are reserved in extents of alloc_extent_size bytes so
+     * that refcount blocks are only dirtied once per extent. The unused part
+     * of the current extent (alloc_extent_offset, alloc_extent_bytes) already
+     * has a refcount of 1 but is not referenced by any L2 entry yet.
+     */
+    uint64_t alloc_extent_size;
+    uint64_t alloc_extent_offset;
+    uint64_t alloc_extent_bytes;
+
     CoMutex lock;
 
     Qcow2CryptoHeaderExtension crypto_header; /* QCow2 header extension */
@@ -422,6 +483,37 @@ typedef struct BDRVQcow2State {
      * is to convert the image with the desired compression type set.
      */
     Qcow2CompressionType compression_type;
+
+    /*
+     * Compression dictionary (only with QCOW2_INCOMPAT_COMPRESSION_DICT).
+     * It is stored at compression_dict_offset and never changes once the
+     * image has been created.
+     */
+    uint64_t compression_dict_offset;
+    uint32_t compression_dict_size;
+    Qcow2CompressionDict *compression_dict;
+
+    /*
+     * Deduplication index: maps the digest of full data clusters to their
+     * host offset. Every indexed cluster holds one extra reference for the
+     * index, so the L2 entries pointing to it never have QCOW_OFLAG_COPIED
+     * set and overwrites always allocate a new cluster.
+     *
+     * The index is stored at dedup_table_offset and is only valid on disk
+     * while QCOW2_AUTOCLEAR_DEDUP_INDEX is set. New entries are only added
+     * while dedup_max_entries allows it.
+     */
+    Qcow2DedupIndex *dedup_index;
+    uint64_t dedup_max_entries;
+    uint64_t dedup_table_offset;
+    uint32_t dedup_table_entries;
+
+    /*
+     * Digests of the data clusters of the persistent bitmap tables that were
+     * loaded or stored while the image is open, keyed by table offset. They
+     * let storing a bitmap again rewrite only the clusters that changed.
+     */
+    GHashTable *bitmap_digests;
 } BDRVQcow2State;
 
 typedef struct Qcow2COWRegion {
@@ -496,6 +588,13 @@ typedef struct QCowL2Meta
     QEMUIOVector *data_qiov;
     size_t data_qiov_offset;
 
+    /**
+     * If set, the (single) newly written cluster is added to the
+     * deduplication index under @dedup_digest when it is linked.
+     */
+    bool dedup;
+    uint8_t dedup_digest[QCOW2_DEDUP_DIGEST_SIZE];
+
     /** Pointer to next L2Meta of the same write request */
     struct QCowL2Meta *next;
 
@@ -874,6 +973,11 @@ qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
                         int64_t nb_clusters);
 
 int64_t coroutine_fn GRAPH_RDLOCK qcow2_alloc_bytes(BlockDriverState *bs, int size);
+
+int64_t coroutine_fn GRAPH_RDLOCK
+qcow2_alloc_reserved_clusters(BlockDriverState *bs, uint64_t offset,
+                              uint64_t *nb_clusters);
+void GRAPH_RDLOCK qcow2_release_reserved_clusters(BlockDriverState *bs);
 void GRAPH_RDLOCK qcow2_free_clusters(BlockDriverState *bs,
                                       int64_t offset, int64_t size,
                                       enum qcow2_discard_type type);
@@ -950,6 +1054,10 @@ qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m);
 void coroutine_fn GRAPH_RDLOCK
 qcow2_alloc_cluster_abort(BlockDriverState *bs, QCowL2Meta *m);
 
+int coroutine_fn GRAPH_RDLOCK
+qcow2_dedup_link_cluster(BlockDriverState *bs, uint64_t offset,
+                         uint64_t host_offset);
+
 int GRAPH_RDLOCK
 qcow2_cluster_discard(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
                       enum qcow2_discard_type type, bool full_discard);
@@ -1022,6 +1130,45 @@ void qcow2_cache_put(Qcow2Cache *c, void **table);
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset);
 void qcow2_cache_discard(Qcow2Cache *c, void *table);
 
+/* qcow2-decompress-cache.c functions */
+Qcow2DecompressCache *qcow2_decompress_cache_create(int nb_clusters,
+                                                    int cluster_size);
+void qcow2_decompress_cache_destroy(Qcow2DecompressCache *c);
+bool qcow2_decompress_cache_read(Qcow2DecompressCache *c, uint64_t coffset,
+                                 int csize, int offset_in_cluster,
+                                 uint64_t bytes, QEMUIOVector *qiov,
+                                 size_t qiov_offset);
+bool qcow2_decompress_cache_contains(Qcow2DecompressCache *c,
+                                     uint64_t coffset, int csize);
+uint64_t qcow2_decompress_cache_generation(Qcow2DecompressCache *c);
+void qcow2_decompress_cache_insert(Qcow2DecompressCache *c, uint64_t coffset,
+                                   int csize, const void *buf,
+                                   uint64_t generation);
+void qcow2_decompress_cache_invalidate(Qcow2DecompressCache *c,
+                                       uint64_t offset, uint64_t bytes);
+
+/* qcow2-dedup.c functions */
+Qcow2DedupIndex *qcow2_dedup_index_new(void);
+void qcow2_dedup_index_free(Qcow2DedupIndex *idx);
+uint64_t qcow2_dedup_index_size(Qcow2DedupIndex *idx);
+uint64_t qcow2_dedup_index_lookup(Qcow2DedupIndex *idx, const uint8_t *digest);
+bool qcow2_dedup_index_insert(Qcow2DedupIndex *idx, const uint8_t *digest,
+                              uint64_t offset);
+bool qcow2_dedup_index_remove(Qcow2DedupIndex *idx, uint64_t offset);
+
+int qcow2_dedup_digest(const void *buf, size_t len, uint8_t *digest,
+                       Error **errp);
+
+int coroutine_fn GRAPH_RDLOCK
+qcow2_dedup_load(BlockDriverState *bs, Error **errp);
+int GRAPH_RDLOCK qcow2_dedup_store(BlockDriverState *bs, Error **errp);
+int GRAPH_RDLOCK qcow2_dedup_invalidate(BlockDriverState *bs);
+
+int coroutine_fn GRAPH_RDLOCK
+qcow2_check_dedup_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
+                            void **refcount_table,
+                            int64_t *refcount_table_size);
+
 /* qcow2-bitmap.c functions */
 int coroutine_fn GRAPH_RDLOCK
 qcow2_check_bitmaps_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
@@ -1058,6 +1205,11 @@ bool qcow2_supports_persistent_dirty_bitmap(BlockDriverState *bs);
 uint64_t qcow2_get_persistent_dirty_bitmap_size(BlockDriverState *bs,
                                                 uint32_t cluster_size);
 
+Qcow2CompressionDict *
+qcow2_compression_dict_new(Qcow2CompressionType type, const void *buf,
+                           size_t size, Error **errp);
+void qcow2_compression_dict_free(Qcow2CompressionDict *dict);
+
 ssize_t coroutine_fn
 qcow2_co_compress(BlockDriverState *bs, void *dest, size_t dest_size,
                   const void *src, size_t src_size);
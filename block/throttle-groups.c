@@ -62,7 +62,14 @@ static void timer_cb(ThrottleGroupMember *tgm, ThrottleDirection direction);
  * blk_set_aio_context()). Therefore in this file a thread will
  * access some other ThrottleGroupMember's timers only after verifying that
  * that ThrottleGroupMember has throttled requests in the queue.
+ *
+ * Groups can be nested by giving them a parent group. A request then has to
+ * pass the limits of its own group and of all ancestors, see
+ * throttle_group_co_wait_parent() for how the children of a group share its
+ * capacity.
  */
+typedef struct ThrottleChildWaiter ThrottleChildWaiter;
+
 struct ThrottleGroup {
     Object parent_obj;
 
@@ -70,6 +77,11 @@ struct ThrottleGroup {
     bool is_initialized;
     char *name; /* This is constant during the lifetime of the group */
 
+    /* These are constant after initialization */
+    char *parent_name;
+    ThrottleGroup *parent;
+    uint32_t weight;
+
     QemuMutex lock; /* This lock protects the following four fields */
     ThrottleState ts;
     QLIST_HEAD(, ThrottleGroupMember) head;
@@ -77,6 +89,15 @@ struct ThrottleGroup {
     bool any_timer_armed[THROTTLE_MAX];
     QEMUClockType clock_type;
 
+    /* Requests of child groups waiting for this group's limits, also
+     * protected by lock */
+    QTAILQ_HEAD(, ThrottleChildWaiter) child_waiters[THROTTLE_MAX];
+    uint64_t vtime[THROTTLE_MAX];
+
+    /* Virtual finish time of the last request in the parent group, protected
+     * by parent->lock */
+    uint64_t vfinish[THROTTLE_MAX];
+
     /* This field is protected by the global QEMU mutex */
     QTAILQ_ENTRY(ThrottleGroup) list;
 };
@@ -350,6 +371,173 @@ static void coroutine_mixed_fn schedule_next_request(ThrottleGroupMember *tgm,
     }
 }
 
+#define THROTTLE_WEIGHT_DEFAULT 100
+#define THROTTLE_WEIGHT_MAX     10000
+
+/* A request of a child group waiting in throttle_group_co_wait_parent() */
+struct ThrottleChildWaiter {
+    ThrottleGroup *tg;      /* the parent group */
+    Coroutine *co;
+    uint64_t vstart;        /* virtual start time */
+    bool waiting;           /* the coroutine is yielded, protected by tg->lock */
+    QTAILQ_ENTRY(ThrottleChildWaiter) next;
+};
+
+/* Virtual cost of a request in a group with weight @weight. The size of the
+ * request is taken into account in units of 4 KiB.
+ */
+static uint64_t throttle_child_cost(int64_t bytes, uint32_t weight)
+{
+    uint64_t units = 1 + bytes / 4096;
+
+    return units * THROTTLE_WEIGHT_MAX / weight;
+}
+
+/* Mark @w as woken up and return the coroutine that must be entered, if any.
+ *
+ * This assumes that w->tg->lock is held. The coroutine must be entered only
+ * after releasing the lock.
+ */
+static Coroutine *throttle_child_waiter_wake(ThrottleChildWaiter *w)
+{
+    if (!w->waiting) {
+        return NULL;
+    }
+    w->waiting = false;
+    return w->co;
+}
+
+static void throttle_child_waiter_timer_cb(void *opaque)
+{
+    ThrottleChildWaiter *w = opaque;
+    Coroutine *co;
+
+    qemu_mutex_lock(&w->tg->lock);
+    co = throttle_child_waiter_wake(w);
+    qemu_mutex_unlock(&w->tg->lock);
+
+    if (co) {
+        aio_co_wake(co);
+    }
+}
+
+/* Wait until a request of the child group @child may pass the limits of its
+ * parent group @tg, and do the accounting in @tg.
+ *
+ * Requests of all children queue up in @tg in the order of their virtual
+ * start time (start-time fair queuing). Each request advances the virtual
+ * time of its child by its cost divided by the child's weight, so when the
+ * limits of @tg are exceeded, children with pending requests are served in
+ * proportion to their weights. The virtual start time is never before the
+ * current virtual time of @tg, so a child that has been idle doesn't build up
+ * credit and the capacity it doesn't use goes to its siblings.
+ *
+ * Only the first request in the queue waits for @tg's limits with a timer,
+ * the others wait until they get to the head of the queue.
+ *
+ * @tg:        the parent group
+ * @child:     the child group of @tg that the request comes from
+ * @tgm:       the ThrottleGroupMember that submitted the request
+ * @bytes:     the number of bytes for this I/O
+ * @direction: the ThrottleDirection
+ */
+static void coroutine_fn
+throttle_group_co_wait_parent(ThrottleGroup *tg, ThrottleGroup *child,
+                              ThrottleGroupMember *tgm, int64_t bytes,
+                              ThrottleDirection direction)
+{
+    ThrottleChildWaiter w = {
+        .tg = tg,
+        .co = qemu_coroutine_self(),
+    };
+    ThrottleChildWaiter *iter;
+    Coroutine *next_co = NULL;
+    QEMUTimer timer;
+
+    aio_timer_init(qemu_get_current_aio_context(), &timer, tg->clock_type,
+                   SCALE_NS, throttle_child_waiter_timer_cb, &w);
+
+    qemu_mutex_lock(&tg->lock);
+
+    w.vstart = MAX(child->vfinish[direction], tg->vtime[direction]);
+    child->vfinish[direction] = w.vstart +
+                                throttle_child_cost(bytes, child->weight);
+
+    QTAILQ_FOREACH(iter, &tg->child_waiters[direction], next) {
+        if (iter->vstart > w.vstart) {
+            break;
+        }
+    }
+    if (iter) {
+        QTAILQ_INSERT_BEFORE(iter, &w, next);
+    } else {
+        QTAILQ_INSERT_TAIL(&tg->child_waiters[direction], &w, next);
+    }
+
+    /* If the I/O limits are disabled the member is being drained */
+    while (!qatomic_read(&tgm->io_limits_disabled)) {
+        if (QTAILQ_FIRST(&tg->child_waiters[direction]) == &w) {
+            int64_t now = qemu_clock_get_ns(tg->clock_type);
+            int64_t wait = throttle_compute_delay(&tg->ts, direction, now);
+
+            if (!wait) {
+                break;
+            }
+            timer_mod(&timer, now + wait);
+        }
+
+        w.waiting = true;
+        qemu_mutex_unlock(&tg->lock);
+        qemu_coroutine_yield();
+        qemu_mutex_lock(&tg->lock);
+        timer_del(&timer);
+    }
+
+    QTAILQ_REMOVE(&tg->child_waiters[direction], &w, next);
+    tg->vtime[direction] = MAX(tg->vtime[direction], w.vstart);
+    throttle_account(&tg->ts, direction, bytes);
+
+    /* Let the next request check the limits */
+    iter = QTAILQ_FIRST(&tg->child_waiters[direction]);
+    if (iter) {
+        next_co = throttle_child_waiter_wake(iter);
+    }
+
+    qemu_mutex_unlock(&tg->lock);
+
+    if (next_co) {
+        aio_co_wake(next_co);
+    }
+}
+
+/* Wake up all requests waiting in ancestors of @tg so that they check again
+ * whether their limits are disabled.
+ */
+static void throttle_group_wake_ancestor_waiters(ThrottleGroup *tg)
+{
+    g_autoptr(GPtrArray) cos = g_ptr_array_new();
+    ThrottleChildWaiter *w;
+    ThrottleDirection dir;
+    ThrottleGroup *parent;
+
+    for (parent = tg->parent; parent; parent = parent->parent) {
+        WITH_QEMU_LOCK_GUARD(&parent->lock) {
+            for (dir = THROTTLE_READ; dir < THROTTLE_MAX; dir++) {
+                QTAILQ_FOREACH(w, &parent->child_waiters[dir], next) {
+                    Coroutine *co = throttle_child_waiter_wake(w);
+                    if (co) {
+                        g_ptr_array_add(cos, co);
+                    }
+                }
+            }
+        }
+    }
+
+    for (guint i = 0; i < cos->len; i++) {
+        aio_co_wake(g_ptr_array_index(cos, i));
+    }
+}
+
 /* Check if an I/O request needs to be throttled, wait and set a timer
  * if necessary, and schedule the next request using a round robin
  * algorithm.
@@ -365,6 +553,7 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
     bool must_wait;
     ThrottleGroupMember *token;
     ThrottleGroup *tg = container_of(tgm->throttle_state, ThrottleGroup, ts);
+    ThrottleGroup *child;
 
     assert(bytes >= 0);
     assert(direction < THROTTLE_MAX);
@@ -394,6 +583,12 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
     schedule_next_request(tgm, direction);
 
     qemu_mutex_unlock(&tg->lock);
+
+    /* The request must also pass the limits of all ancestor groups */
+    for (child = tg; child->parent; child = child->parent) {
+        throttle_group_co_wait_parent(child->parent, child, tgm, bytes,
+                                      direction);
+    }
 }
 
 typedef struct {
@@ -451,6 +646,11 @@ void throttle_group_restart_tgm(ThrottleGroupMember *tgm)
     ThrottleDirection dir;
 
     if (tgm->throttle_state) {
+        ThrottleGroup *tg = container_of(tgm->throttle_state, ThrottleGroup,
+                                         ts);
+
+        throttle_group_wake_ancestor_waiters(tg);
+
         for (dir = THROTTLE_READ; dir < THROTTLE_MAX; dir++) {
             QEMUTimer *t = tgm->throttle_timers.timers[dir];
             if (timer_pending(t)) {
@@ -761,9 +961,12 @@ static void throttle_group_obj_init(Object *obj)
         tg->clock_type = QEMU_CLOCK_VIRTUAL;
     }
     tg->is_initialized = false;
+    tg->weight = THROTTLE_WEIGHT_DEFAULT;
     qemu_mutex_init(&tg->lock);
     throttle_init(&tg->ts);
     QLIST_INIT(&tg->head);
+    QTAILQ_INIT(&tg->child_waiters[THROTTLE_READ]);
+    QTAILQ_INIT(&tg->child_waiters[THROTTLE_WRITE]);
 }
 
 /* This function edits throttle_groups and must be called under the global
@@ -791,6 +994,20 @@ static void throttle_group_obj_complete(UserCreatable *obj, Error **errp)
     if (!throttle_is_valid(&cfg, errp)) {
         return;
     }
+
+    /* The parent must already exist, so there can't be any cycles */
+    if (tg->parent_name) {
+        ThrottleGroup *parent = throttle_group_by_name(tg->parent_name);
+
+        if (!parent) {
+            error_setg(errp, "Parent throttle group '%s' not found",
+                       tg->parent_name);
+            return;
+        }
+        object_ref(OBJECT(parent));
+        tg->parent = parent;
+    }
+
     throttle_config(&tg->ts, tg->clock_type, &cfg);
     QTAILQ_INSERT_TAIL(&throttle_groups, tg, list);
     tg->is_initialized = true;
@@ -804,7 +1021,11 @@ static void throttle_group_obj_finalize(Object *obj)
     if (tg->is_initialized) {
         QTAILQ_REMOVE(&throttle_groups, tg, list);
     }
+    if (tg->parent) {
+        object_unref(OBJECT(tg->parent));
+    }
     qemu_mutex_destroy(&tg->lock);
+    g_free(tg->parent_name);
     g_free(tg->name);
 }
 
@@ -929,6 +1150,61 @@ static void throttle_group_get_limits(Object *obj, Visitor *v,
     visit_type_ThrottleLimits(v, name, &argp, errp);
 }
 
+static char *throttle_group_get_parent(Object *obj, Error **errp)
+{
+    ThrottleGroup *tg = THROTTLE_GROUP(obj);
+
+    return g_strdup(tg->parent_name);
+}
+
+static void throttle_group_set_parent(Object *obj, const char *value,
+                                      Error **errp)
+{
+    ThrottleGroup *tg = THROTTLE_GROUP(obj);
+
+    if (tg->is_initialized) {
+        error_setg(errp, "Property cannot be set after initialization");
+        return;
+    }
+
+    g_free(tg->parent_name);
+    tg->parent_name = g_strdup(value);
+}
+
+static void throttle_group_get_weight(Object *obj, Visitor *v,
+                                      const char *name, void *opaque,
+                                      Error **errp)
+{
+    ThrottleGroup *tg = THROTTLE_GROUP(obj);
+    uint32_t value = tg->weight;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void throttle_group_set_weight(Object *obj, Visitor *v,
+                                      const char *name, void *opaque,
+                                      Error **errp)
+{
+    ThrottleGroup *tg = THROTTLE_GROUP(obj);
+    uint32_t value;
+
+    if (tg->is_initialized) {
+        error_setg(errp, "Property cannot be set after initialization");
+        return;
+    }
+
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+    if (value < 1 || value > THROTTLE_WEIGHT_MAX) {
+        error_setg(errp, "%s value must be in the range [1, %u]",
+                   name, THROTTLE_WEIGHT_MAX);
+        return;
+    }
+
+    tg->weight = value;
+}
+
 static bool throttle_group_can_be_deleted(UserCreatable *uc)
 {
     return OBJECT(uc)->ref == 1;
@@ -958,6 +1234,16 @@ static void throttle_group_obj_class_init(ObjectClass *klass, void *class_data)
                               throttle_group_get_limits,
                               throttle_group_set_limits,
                               NULL, NULL);
+
+    /* Nested groups */
+    object_class_property_add_str(klass, "parent",
+                                  throttle_group_get_parent,
+                                  throttle_group_set_parent);
+    object_class_property_add(klass,
+                              "weight", "uint32",
+                              throttle_group_get_weight,
+                              throttle_group_set_weight,
+                              NULL, NULL);
 }
 
 static const TypeInfo throttle_group_info = {
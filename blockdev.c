@@ -2639,7 +2639,7 @@ static BlockJob *do_backup_common(BackupCommon *backup,
 {
     BlockJob *job = NULL;
     BdrvDirtyBitmap *bmap = NULL;
-    BackupPerf perf = { .max_workers = 64 };
+    BackupPerf perf = { .use_reflink = true, .max_workers = 64 };
     int job_flags = JOB_DEFAULT;
 
     if (!backup->has_speed) {
@@ -2665,6 +2665,9 @@ static BlockJob *do_backup_common(BackupCommon *backup,
         if (backup->x_perf->has_use_copy_range) {
             perf.use_copy_range = backup->x_perf->use_copy_range;
         }
+        if (backup->x_perf->has_use_reflink) {
+            perf.use_reflink = backup->x_perf->use_reflink;
+        }
         if (backup->x_perf->has_max_workers) {
             perf.max_workers = backup->x_perf->max_workers;
         }
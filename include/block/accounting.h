@@ -26,6 +26,7 @@
 #define BLOCK_ACCOUNTING_H
 
 #include "qemu/timed-average.h"
+#include "qemu/hdr-histogram.h"
 #include "qemu/thread.h"
 #include "qapi/qapi-types-common.h"
 
@@ -42,10 +43,31 @@ enum BlockAcctType {
     BLOCK_MAX_IOTYPE,
 };
 
+/*
+ * Latency percentiles are kept for reads, writes and flushes, with reads and
+ * writes further broken down by request size. Flushes have no size and are
+ * always accounted in the first size class.
+ */
+#define BLOCK_ACCT_PCT_TYPES        3   /* read, write, flush */
+#define BLOCK_ACCT_SIZE_CLASSES     4   /* <= 4k, <= 64k, <= 512k, larger */
+
+typedef struct BlockAcctLatencyWindow {
+    HdrHistogram hist[BLOCK_ACCT_PCT_TYPES][BLOCK_ACCT_SIZE_CLASSES];
+    int64_t expiration;     /* the end of the current window in ns */
+} BlockAcctLatencyWindow;
+
 struct BlockAcctTimedStats {
     BlockAcctStats *stats;
     TimedAverage latency[BLOCK_MAX_IOTYPE];
     unsigned interval_length; /* in seconds */
+
+    /*
+     * Two windows offset by half a period, like in TimedAverage; percentiles
+     * are always returned from the oldest one.
+     */
+    BlockAcctLatencyWindow *latency_windows;
+    uint64_t latency_window_period; /* in nanoseconds */
+
     QSLIST_ENTRY(BlockAcctTimedStats) entries;
 };
 
@@ -117,6 +139,10 @@ void block_acct_merge_done(BlockAcctStats *stats, enum BlockAcctType type,
 int64_t block_acct_idle_time_ns(BlockAcctStats *stats);
 double block_acct_queue_depth(BlockAcctTimedStats *stats,
                               enum BlockAcctType type);
+uint64_t block_acct_size_class_max(int size_class);
+void block_acct_latency_histogram(BlockAcctTimedStats *stats,
+                                  enum BlockAcctType type, int size_class,
+                                  HdrHistogram *hist);
 int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
                                 uint64List *boundaries);
 void block_latency_histograms_clear(BlockAcctStats *stats);
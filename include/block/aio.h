@@ -236,6 +236,7 @@ struct AioContext {
 
     /* AIO engine parameters */
     int64_t aio_max_batch;  /* maximum number of requests in a batch */
+    int64_t aio_sqpoll_idle; /* io_uring SQ polling idle time in ms, 0: off */
 
     /*
      * List of handlers participating in userspace polling.  Protected by
@@ -710,8 +711,13 @@ void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
  * @ctx: the aio context
  * @max_batch: maximum number of requests in a batch, 0 means that the
  *             engine will use its default
+ * @sqpoll_idle: idle time in milliseconds after which the io_uring submission
+ *               queue polling thread goes to sleep, 0 means that submission
+ *               queue polling is disabled. Only applies to io_uring instances
+ *               set up afterwards.
  */
-void aio_context_set_aio_params(AioContext *ctx, int64_t max_batch);
+void aio_context_set_aio_params(AioContext *ctx, int64_t max_batch,
+                                int64_t sqpoll_idle);
 
 /**
  * aio_context_set_thread_pool_params:
@@ -33,7 +33,7 @@ BlockCopyState *block_copy_state_new(BdrvChild *source, BdrvChild *target,
 
 /* Function should be called prior any actual copy request */
 void block_copy_set_copy_opts(BlockCopyState *s, bool use_copy_range,
-                              bool compress);
+                              bool use_reflink, bool compress);
 void block_copy_set_progress_meter(BlockCopyState *s, ProgressMeter *pm);
 
 void block_copy_state_free(BlockCopyState *s);
@@ -99,6 +99,29 @@ void block_copy_call_cancel(BlockCopyCallState *call_state);
 
 BdrvDirtyBitmap *block_copy_dirty_bitmap(BlockCopyState *s);
 int64_t block_copy_cluster_size(BlockCopyState *s);
+int64_t block_copy_offloaded_bytes(BlockCopyState *s);
+void block_copy_get_tuning(BlockCopyState *s, int *workers, int *chunk_size);
 void block_copy_set_skip_unallocated(BlockCopyState *s, bool skip);
 
+/*
+ * Feedback controller that tunes the copies of block_copy_async(). It is only
+ * public so that it can be unit tested.
+ */
+typedef struct BlockCopyTuneState {
+    int chunk;
+    int workers;
+
+    /* Results of previous epochs */
+    uint64_t prev_throughput;
+    uint64_t base_ns_per_mib;
+    int chunk_step;
+    bool tune_chunk;
+    int epochs;
+} BlockCopyTuneState;
+
+void block_copy_tune_init(BlockCopyTuneState *t);
+void block_copy_tune_step(BlockCopyTuneState *t, uint64_t throughput,
+                          uint64_t ns_per_mib, bool buffered,
+                          int64_t min_chunk, int64_t max_chunk);
+
 #endif /* BLOCK_COPY_H */
@@ -319,6 +319,11 @@ bdrv_can_store_new_dirty_bitmap(BlockDriverState *bs, const char *name,
  *                               recursion.
  *         BDRV_REQ_NO_SERIALISING - do not serialize with other overlapping
  *                                   requests currently in flight.
+ *         BDRV_REQ_NO_FALLBACK - only succeed if the data does not have to be
+ *                                moved at all, e.g. because the target can
+ *                                share the storage of the source (reflink);
+ *                                return -ENOTSUP otherwise.  Only valid in
+ *                                the write flags.
  *
  * Returns: 0 if succeeded; negative error code if failed.
  **/
@@ -32,8 +32,23 @@ typedef struct BlockExportDriver {
     /* True if the export type supports running on an inactive node */
     bool supports_inactive;
 
-    /* Creates and starts a new block export */
-    int (*create)(BlockExport *, BlockExportOptions *, Error **);
+    /*
+     * True if the export type can serve I/O from several AioContexts at
+     * once (given as a list in the 'iothread' option)
+     */
+    bool supports_multithread;
+
+    /*
+     * Creates and starts a new block export.
+     *
+     * If the user passed a set of I/O threads for multi-threading, @multithread
+     * is an array of length @mt_count with the AioContexts to use (the first
+     * one is also exp->ctx).  Otherwise, @multithread is NULL and @mt_count
+     * is 0.  Only drivers with supports_multithread get passed a non-NULL
+     * @multithread.
+     */
+    int (*create)(BlockExport *, BlockExportOptions *,
+                  AioContext *const *multithread, size_t mt_count, Error **);
 
     /*
      * Frees a removed block export. This function is only called after all
@@ -48,6 +63,12 @@ typedef struct BlockExportDriver {
      * shutting down.
      */
     void (*request_shutdown)(BlockExport *);
+
+    /*
+     * Optional. Fills in the driver-specific fields of @info for
+     * query-block-exports.
+     */
+    void (*query_info)(BlockExport *exp, BlockExportInfo *info);
 } BlockExportDriver;
 
 struct BlockExport {
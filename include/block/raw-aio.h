@@ -66,12 +66,27 @@ void laio_attach_aio_context(LinuxAioState *s, AioContext *new_context);
 #endif
 /* io_uring.c - Linux io_uring implementation */
 #ifdef CONFIG_LINUX_IO_URING
-LuringState *luring_init(Error **errp);
+LuringState *luring_init(int64_t sqpoll_idle, Error **errp);
 void luring_cleanup(LuringState *s);
 
-/* luring_co_submit: submit I/O requests in the thread's current AioContext. */
+/*
+ * luring_co_submit: submit I/O requests in the thread's current AioContext.
+ * Fixed buffers are used if @flags contains BDRV_REQ_REGISTERED_BUF and @qiov
+ * lies in memory registered with luring_register_buf().
+ */
 int coroutine_fn luring_co_submit(BlockDriverState *bs, int fd, uint64_t offset,
-                                  QEMUIOVector *qiov, int type);
+                                  QEMUIOVector *qiov, int type,
+                                  BdrvRequestFlags flags);
+
+/*
+ * Registered buffers and files are entered into the fixed buffer and file
+ * tables of all rings. This is best effort: memory and files that cannot be
+ * registered are accessed normally.
+ */
+void luring_register_buf(void *host, size_t size);
+void luring_unregister_buf(void *host, size_t size);
+void luring_register_file(int fd);
+void luring_unregister_file(int fd);
 void luring_detach_aio_context(LuringState *s, AioContext *old_context);
 void luring_attach_aio_context(LuringState *s, AioContext *new_context);
 #endif
@@ -0,0 +1,17 @@
+/*
+ * Persistent translation cache prototypes for use by the rest of the system.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#ifndef EXEC_TB_CACHE_H
+#define EXEC_TB_CACHE_H
+
+/**
+ * tb_cache_exit() - stop saving to the persistent translation cache
+ *
+ * Close the cache file and trace its statistics.  Called before exiting
+ * the process; it is harmless if the cache is not enabled.
+ */
+void tb_cache_exit(void);
+
+#endif /* EXEC_TB_CACHE_H */
@@ -80,6 +80,8 @@ struct TranslationBlock {
 #define CF_NOIRQ         0x00010000 /* Generate an uninterruptible TB */
 #define CF_PCREL         0x00020000 /* Opcodes in TB are PC-relative */
 #define CF_BP_PAGE       0x00040000 /* Breakpoint present in code page */
+#define CF_SUPERBLOCK    0x00080000 /* Hot TB retranslated across jumps */
+#define CF_MIRROR_RAM    0x00100000 /* Access RAM through the tlb mirror */
 #define CF_CLUSTER_MASK  0xff000000 /* Top 8 bits are cluster ID */
 #define CF_CLUSTER_SHIFT 24
 
@@ -154,6 +156,15 @@ static inline uint32_t tb_cflags(const TranslationBlock *tb)
     return qatomic_read(&tb->cflags);
 }
 
+/*
+ * A superblock replaces the TB it was made from, so lookups for the
+ * latter must find it: ignore CF_SUPERBLOCK when comparing TBs.
+ */
+static inline uint32_t tb_lookup_cflags(uint32_t cflags)
+{
+    return cflags & ~CF_SUPERBLOCK;
+}
+
 bool tcg_cflags_has(CPUState *cpu, uint32_t flags);
 void tcg_cflags_set(CPUState *cpu, uint32_t flags);
 
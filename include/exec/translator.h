@@ -61,6 +61,8 @@ typedef enum DisasJumpType {
  * @fake_insn: True if translator_fake_ldb used.
  * @insn_start: The last op emitted by the insn_start hook,
  *              which is expected to be INDEX_op_insn_start.
+ * @pc_end: End of the guest code read so far.  In a superblock, this
+ *          may be past @pc_next.
  *
  * Architecture-agnostic disassembly context.
  */
@@ -74,6 +76,7 @@ struct DisasContextBase {
     bool plugin_enabled;
     bool fake_insn;
     struct TCGOp *insn_start;
+    vaddr pc_end;
     void *host_addr[2];
 
     /*
@@ -112,6 +115,10 @@ struct DisasContextBase {
  *
  * @disas_log:
  *      Print instruction disassembly to log.
+ *
+ * @superblocks:
+ *      The target calls translator_follow_jump(), so that TBs which
+ *      become hot are worth retranslating with CF_SUPERBLOCK.
  */
 typedef struct TranslatorOps {
     void (*init_disas_context)(DisasContextBase *db, CPUState *cpu);
@@ -120,6 +127,7 @@ typedef struct TranslatorOps {
     void (*translate_insn)(DisasContextBase *db, CPUState *cpu);
     void (*tb_stop)(DisasContextBase *db, CPUState *cpu);
     bool (*disas_log)(const DisasContextBase *db, CPUState *cpu, FILE *f);
+    bool superblocks;
 } TranslatorOps;
 
 /**
@@ -158,6 +166,37 @@ void translator_loop(CPUState *cpu, TranslationBlock *tb, int *max_insns,
  */
 bool translator_use_goto_tb(DisasContextBase *db, vaddr dest);
 
+/**
+ * translator_lookup_and_goto_ptr
+ * @db: Disassembly context
+ * @pc: guest virtual PC of the next TB, as cpu_get_tb_cpu_state() would
+ *      compute it
+ *
+ * Like tcg_gen_lookup_and_goto_ptr(), but first probe the jump cache
+ * inline, and only call the lookup helper on a miss.  The caller must
+ * ensure that the CPU state has the same TB flags and cs_base as at the
+ * start of the current TB, which is the case e.g. for near indirect
+ * jumps and returns, since only @pc is computed at run time.
+ */
+void translator_lookup_and_goto_ptr(DisasContextBase *db,
+                                    struct TCGv_i64_d *pc);
+
+/**
+ * translator_follow_jump
+ * @db: Disassembly context
+ * @dest: target pc of an unconditional direct jump
+ *
+ * Return true if translation may continue at @dest within the current
+ * TB, instead of ending the TB with a jump.  The caller must then emit
+ * nothing for the jump but its side effects, and set up the disassembly
+ * context so that the next instruction is read from @dest.
+ *
+ * This only happens in superblocks, i.e. when a TB has been executed
+ * often enough to be retranslated with CF_SUPERBLOCK; the destination
+ * must also be on the page where disassembly started.
+ */
+bool translator_follow_jump(DisasContextBase *db, vaddr dest);
+
 /**
  * translator_io_start
  * @db: Disassembly context
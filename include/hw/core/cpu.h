@@ -288,6 +288,8 @@ typedef struct CPUTLBDesc {
     CPUTLBEntry vtable[CPU_VTLB_SIZE];
     CPUTLBEntryFull vfulltlb[CPU_VTLB_SIZE];
     CPUTLBEntryFull *fulltlb;
+    /* Host address of guest virtual address 0 in the tlb mirror, or 0. */
+    uintptr_t mirror;
 } CPUTLBDesc;
 
 /*
@@ -310,6 +312,11 @@ typedef struct CPUTLBCommon {
     size_t full_flush_count;
     size_t part_flush_count;
     size_t elide_flush_count;
+    /*
+     * Host mappings of the guest RAM in the tlb, if mirror-ram is enabled.
+     * Protected by tlb_c.lock.
+     */
+    struct TLBMirror *mirror;
 } CPUTLBCommon;
 
 /*
@@ -395,6 +402,8 @@ struct qemu_work_item;
 
 #define CPU_UNSET_NUMA_NODE_ID -1
 
+#define CPU_TB_HOT_COUNT_SIZE 512
+
 /**
  * struct CPUState - common state of one CPU core or thread.
  *
@@ -447,6 +456,11 @@ struct qemu_work_item;
  *    ring is enabled.
  * @kvm_fetch_index: Keeps the index that we last fetched from the per-vCPU
  *    dirty ring structure.
+ * @tb_hot_count: Execution counters of TBs, indexed by a hash of their PC;
+ *    see TB_EXIT_HOT.
+ * @tb_lookup_hits: Indirect jumps that found the next TB in @tb_jmp_cache
+ *    inline, without calling the lookup helper.
+ * @tb_lookup_misses: Indirect jumps that tried to, but had to call it.
  *
  * @neg_align: The CPUState is the common part of a concrete ArchCPU
  * which is allocated when an individual CPU instance is created. As
@@ -569,6 +583,11 @@ struct CPUState {
     /* track IOMMUs whose translations we've cached in the TCG TLB */
     GArray *iommu_notifiers;
 
+    /* Updated by TCG code, so that hot TBs can become superblocks */
+    uint16_t tb_hot_count[CPU_TB_HOT_COUNT_SIZE];
+    uint64_t tb_lookup_hits;
+    uint64_t tb_lookup_misses;
+
     /*
      * MUST BE LAST in order to minimize the displacement to CPUArchState.
      */
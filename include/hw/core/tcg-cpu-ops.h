@@ -37,6 +37,16 @@ struct TCGCPUOps {
      */
     void (*translate_code)(CPUState *cpu, TranslationBlock *tb,
                            int *max_insns, vaddr pc, void *host_pc);
+    /**
+     * @translate_code_async: @translate_code may run outside of the vCPU
+     * thread, for -accel tcg,translate-threads=n
+     *
+     * Set this only if @translate_code reads the CPU state through
+     * @tb's pc, cs_base and flags, apart from properties that do not
+     * change after the CPU is realized.  The live state may belong to
+     * another privilege level or address space than @tb.
+     */
+    bool translate_code_async;
     /**
      * @synchronize_from_tb: Synchronize state from a TCG #TranslationBlock
      *
@@ -0,0 +1,47 @@
+/*
+ * Log-linear (HDR-style) histogram
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HDR_HISTOGRAM_H
+#define HDR_HISTOGRAM_H
+
+/*
+ * Each power of two is split into HDR_HISTOGRAM_SUB_BUCKETS linear buckets,
+ * so the value reported for a bucket is never more than 1/16 above the
+ * values that were accounted in it. Values below HDR_HISTOGRAM_SUB_BUCKETS
+ * get a bucket each, values of 2^HDR_HISTOGRAM_MAX_SHIFT and more all end up
+ * in the last bucket and are reported as 2^HDR_HISTOGRAM_MAX_SHIFT - 1.
+ */
+#define HDR_HISTOGRAM_SUB_BITS      4
+#define HDR_HISTOGRAM_SUB_BUCKETS   (1 << HDR_HISTOGRAM_SUB_BITS)
+#define HDR_HISTOGRAM_MAX_SHIFT     40
+#define HDR_HISTOGRAM_NBUCKETS \
+    ((HDR_HISTOGRAM_MAX_SHIFT - HDR_HISTOGRAM_SUB_BITS + 1) * \
+     HDR_HISTOGRAM_SUB_BUCKETS)
+
+typedef struct HdrHistogram {
+    uint64_t count;                             /* number of values */
+    uint32_t buckets[HDR_HISTOGRAM_NBUCKETS];
+} HdrHistogram;
+
+void hdr_histogram_reset(HdrHistogram *h);
+void hdr_histogram_account(HdrHistogram *h, uint64_t value);
+void hdr_histogram_merge(HdrHistogram *dst, const HdrHistogram *src);
+uint64_t hdr_histogram_percentile(const HdrHistogram *h, double percentile);
+
+#endif
@@ -72,6 +72,7 @@ enum plugin_dyn_cb_type {
     PLUGIN_CB_MEM_REGULAR,
     PLUGIN_CB_INLINE_ADD_U64,
     PLUGIN_CB_INLINE_STORE_U64,
+    PLUGIN_CB_MEM_BUFFERED,
 };
 
 struct qemu_plugin_regular_cb {
@@ -87,6 +88,12 @@ struct qemu_plugin_inline_cb {
     enum qemu_plugin_mem_rw rw;
 };
 
+struct qemu_plugin_buffered_cb {
+    struct qemu_plugin_mem_buffer *buf;
+    uint64_t udata;
+    enum qemu_plugin_mem_rw rw;
+};
+
 struct qemu_plugin_conditional_cb {
     union qemu_plugin_cb_sig f;
     TCGHelperInfo *info;
@@ -107,6 +114,7 @@ struct qemu_plugin_dyn_cb {
         struct qemu_plugin_regular_cb regular;
         struct qemu_plugin_conditional_cb cond;
         struct qemu_plugin_inline_cb inline_insn;
+        struct qemu_plugin_buffered_cb buffered;
     };
 };
 
@@ -128,6 +136,25 @@ struct qemu_plugin_scoreboard {
     QLIST_ENTRY(qemu_plugin_scoreboard) entry;
 };
 
+/*
+ * Per-vcpu state of a memory buffer: the generated code appends records
+ * at @next, and calls qemu_plugin_mem_buffer_full() when it reaches @end.
+ */
+struct qemu_plugin_mem_buffer_vcpu {
+    qemu_plugin_mem_record *next;
+    qemu_plugin_mem_record *end;
+    qemu_plugin_mem_record *records;
+};
+
+/* A memory buffer, with a qemu_plugin_mem_buffer_vcpu for each vcpu */
+struct qemu_plugin_mem_buffer {
+    qemu_plugin_vcpu_mem_buf_cb_t cb;
+    void *userdata;
+    size_t n_records;
+    struct qemu_plugin_scoreboard *vcpus;
+    QLIST_ENTRY(qemu_plugin_mem_buffer) entry;
+};
+
 /* Internal context for this TranslationBlock */
 struct qemu_plugin_tb {
     GPtrArray *insns;
@@ -171,6 +198,10 @@ void qemu_plugin_vcpu_mem_cb(CPUState *cpu, uint64_t vaddr,
                              uint64_t value_high,
                              MemOpIdx oi, enum qemu_plugin_mem_rw rw);
 
+/* Called from the generated code when the buffer of @vcpu_index is full */
+void qemu_plugin_mem_buffer_full(uint32_t vcpu_index,
+                                 struct qemu_plugin_mem_buffer *buf);
+
 void qemu_plugin_flush_cb(void);
 
 void qemu_plugin_atexit_cb(void);
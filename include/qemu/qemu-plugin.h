@@ -65,11 +65,15 @@ typedef uint64_t qemu_plugin_id_t;
  *
  * version 4:
  * - added qemu_plugin_read_memory_vaddr
+ *
+ * version 5:
+ * - added qemu_plugin_mem_buffer_new, qemu_plugin_mem_buffer_flush and
+ *   qemu_plugin_register_vcpu_mem_buffered
  */
 
 extern QEMU_PLUGIN_EXPORT int qemu_plugin_version;
 
-#define QEMU_PLUGIN_VERSION 4
+#define QEMU_PLUGIN_VERSION 5
 
 /**
  * struct qemu_info_t - system information for plugins
@@ -701,6 +705,90 @@ void qemu_plugin_register_vcpu_mem_inline_per_vcpu(
     qemu_plugin_u64 entry,
     uint64_t imm);
 
+/**
+ * struct qemu_plugin_mem_record - memory access recorded in a buffer
+ * @vaddr: the virtual address of the access
+ * @udata: the value given to qemu_plugin_register_vcpu_mem_buffered()
+ * @info: handle for the qemu_plugin_mem_* queries
+ *
+ * qemu_plugin_mem_get_value() and qemu_plugin_get_hwaddr() cannot be
+ * used on @info, as the access is over by the time the record is read.
+ */
+typedef struct qemu_plugin_mem_record {
+    uint64_t vaddr;
+    uint64_t udata;
+    qemu_plugin_meminfo_t info;
+} qemu_plugin_mem_record;
+
+/** struct qemu_plugin_mem_buffer - Opaque handle for a memory buffer */
+struct qemu_plugin_mem_buffer;
+
+/**
+ * typedef qemu_plugin_vcpu_mem_buf_cb_t - memory buffer callback type
+ * @vcpu_index: the vCPU that made the accesses
+ * @records: the accesses, in the order they were made
+ * @n: number of records
+ * @userdata: any user data attached to the buffer
+ *
+ * @records is only valid until the callback returns.
+ */
+typedef void (*qemu_plugin_vcpu_mem_buf_cb_t)(
+    unsigned int vcpu_index,
+    const qemu_plugin_mem_record *records,
+    size_t n,
+    void *userdata);
+
+/**
+ * qemu_plugin_mem_buffer_new() - allocate a buffer of memory accesses
+ * @n_records: number of records per vCPU
+ * @cb: callback receiving the records of a vCPU
+ * @userdata: opaque pointer for @cb
+ *
+ * Each vCPU gets its own buffer of @n_records records. Accesses are
+ * appended by the generated code, without a call into the plugin. @cb
+ * is called in the vCPU thread when the buffer of the vCPU is full, when
+ * qemu_plugin_mem_buffer_flush() is called and when the vCPU exits. The
+ * buffers of the vCPUs that are stopped are flushed, from another thread,
+ * before the atexit callbacks; in user mode, that is all of them. @cb is
+ * not called after that, and later accesses are not recorded.
+ *
+ * The buffer lives until QEMU exits.
+ */
+QEMU_PLUGIN_API
+struct qemu_plugin_mem_buffer *
+qemu_plugin_mem_buffer_new(size_t n_records,
+                           qemu_plugin_vcpu_mem_buf_cb_t cb,
+                           void *userdata);
+
+/**
+ * qemu_plugin_mem_buffer_flush() - pass the pending records to the callback
+ * @buf: buffer to flush
+ * @vcpu_index: the vCPU whose records are flushed
+ *
+ * Must be called from a callback running on @vcpu_index, for example a
+ * TB execution callback to receive the accesses of each TB as a batch.
+ */
+QEMU_PLUGIN_API
+void qemu_plugin_mem_buffer_flush(struct qemu_plugin_mem_buffer *buf,
+                                  unsigned int vcpu_index);
+
+/**
+ * qemu_plugin_register_vcpu_mem_buffered() - record memory accesses
+ * @insn: handle for instruction to instrument
+ * @rw: record reads, writes or both
+ * @buf: buffer receiving the records
+ * @udata: value copied in each record, e.g. to identify @insn
+ *
+ * This appends a record to @buf for every memory access generated by
+ * the instruction. It is much cheaper than qemu_plugin_register_vcpu_mem_cb()
+ * for plugins that do not need to see each access as it happens.
+ */
+QEMU_PLUGIN_API
+void qemu_plugin_register_vcpu_mem_buffered(struct qemu_plugin_insn *insn,
+                                            enum qemu_plugin_mem_rw rw,
+                                            struct qemu_plugin_mem_buffer *buf,
+                                            uint64_t udata);
+
 /**
  * qemu_plugin_request_time_control() - request the ability to control time
  *
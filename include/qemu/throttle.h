@@ -156,6 +156,9 @@ bool throttle_schedule_timer(ThrottleState *ts,
                              ThrottleTimers *tt,
                              ThrottleDirection direction);
 
+int64_t throttle_compute_delay(ThrottleState *ts, ThrottleDirection direction,
+                               int64_t now);
+
 void throttle_account(ThrottleState *ts, ThrottleDirection direction,
                       uint64_t size);
 void throttle_limits_to_config(ThrottleLimits *arg, ThrottleConfig *cfg,
@@ -28,5 +28,9 @@ void qemu_vfio_pci_unmap_bar(QEMUVFIOState *s, int index, void *bar,
                              uint64_t offset, uint64_t size);
 int qemu_vfio_pci_init_irq(QEMUVFIOState *s, EventNotifier *e,
                            int irq_type, Error **errp);
+int qemu_vfio_pci_init_irqs(QEMUVFIOState *s, EventNotifier *e,
+                            int irq_type, unsigned *count, Error **errp);
+int qemu_vfio_pci_set_irq(QEMUVFIOState *s, int irq_type, unsigned vector,
+                          EventNotifier *e, Error **errp);
 
 #endif
@@ -16,6 +16,7 @@
 #include "io/channel-file.h"
 #include "io/net-listener.h"
 #include "qapi/error.h"
+#include "qemu/thread.h"
 #include "standard-headers/linux/virtio_blk.h"
 
 /* A kick fd that we monitor on behalf of libvhost-user */
@@ -24,6 +25,8 @@ typedef struct VuFdWatch {
     int fd; /*kick fd*/
     void *pvt;
     vu_watch_cb cb;
+    AioContext *ctx; /* AioContext that the fd handler is installed in */
+    bool enabled; /* protected by VuServer->vq_lock */
     QTAILQ_ENTRY(VuFdWatch) next;
 } VuFdWatch;
 
@@ -31,7 +34,9 @@ typedef struct VuFdWatch {
  * VuServer:
  * A vhost-user server instance with user-defined VuDevIface callbacks.
  * Vhost-user device backends can be implemented using VuServer. VuDevIface
- * callbacks and virtqueue kicks run in the given AioContext.
+ * callbacks and virtqueue kicks run in the given AioContext, unless a
+ * virtqueue has been mapped to a different AioContext with the @queue_ctxs
+ * argument of vhost_user_server_start().
  */
 typedef struct {
     QIONetListener *listener;
@@ -40,11 +45,25 @@ typedef struct {
     int max_queues;
     const VuDevIface *vu_iface;
 
+    /*
+     * Per-virtqueue AioContexts (max_queues entries), or NULL. A NULL entry
+     * means that the virtqueue is processed in ctx.
+     */
+    AioContext **queue_ctxs;
+
+    /*
+     * Serializes access to libvhost-user state between the vhost-user
+     * message loop and virtqueue processing in other AioContexts. Backends
+     * must hold it while pushing completed elements to a virtqueue.
+     */
+    QemuRecMutex vq_lock;
+
     unsigned int in_flight; /* atomic */
+    bool wait_idle; /* protected by vq_lock */
 
     /* Protected by ctx lock */
     bool in_qio_channel_yield;
-    bool wait_idle;
+    bool vq_locked; /* vu_client_trip() holds vq_lock */
     bool quiescing;
     VuDev vu_dev;
     QIOChannel *ioc; /* The I/O channel with the client */
@@ -57,6 +76,7 @@ typedef struct {
 bool vhost_user_server_start(VuServer *server,
                              SocketAddress *unix_socket,
                              AioContext *ctx,
+                             AioContext *const *queue_ctxs,
                              uint16_t max_queues,
                              const VuDevIface *vu_iface,
                              Error **errp);
@@ -74,6 +74,15 @@ void tcg_gen_goto_tb(unsigned idx);
  */
 void tcg_gen_lookup_and_goto_ptr(void);
 
+/**
+ * tcg_gen_goto_ptr() - jump to the code of a TB
+ * @ptr: Host address of the code, e.g. tb->tc.ptr
+ *
+ * For inline versions of tcg_gen_lookup_and_goto_ptr(); the caller
+ * is responsible for checking that the TB matches the current state.
+ */
+void tcg_gen_goto_ptr(TCGv_ptr ptr);
+
 void tcg_gen_plugin_cb(unsigned from);
 void tcg_gen_plugin_mem_cb(TCGv_i64 addr, unsigned meminfo);
 
@@ -513,6 +522,12 @@ static inline void tcg_gen_movi_ptr(TCGv_ptr d, intptr_t s)
     glue(tcg_gen_movi_,PTR)((NAT)d, s);
 }
 
+static inline void tcg_gen_brcond_ptr(TCGCond cond, TCGv_ptr a,
+                                      TCGv_ptr b, TCGLabel *label)
+{
+    glue(tcg_gen_brcond_,PTR)(cond, (NAT)a, (NAT)b, label);
+}
+
 static inline void tcg_gen_brcondi_ptr(TCGCond cond, TCGv_ptr a,
                                        intptr_t b, TCGLabel *label)
 {
@@ -97,6 +97,29 @@ struct TCGRelocation {
     int type;
 };
 
+/*
+ * A reference from the code of the TB being generated to code outside of
+ * it, e.g. a helper or the epilogue.  Backends that define
+ * TCG_TARGET_EXT_RELOCS record these when TCGContext.ext_relocs_enabled
+ * is set, so that the code can later be patched to run at another address.
+ */
+typedef enum TCGExtRelocKind {
+    TCG_EXT_RELOC_PC32,     /* 32-bit displacement from the end of the field */
+    TCG_EXT_RELOC_ABS64,    /* 64-bit absolute address */
+} TCGExtRelocKind;
+
+typedef struct TCGExtReloc TCGExtReloc;
+struct TCGExtReloc {
+    QSIMPLEQ_ENTRY(TCGExtReloc) next;
+    TCGExtRelocKind kind;
+    uint32_t offset;        /* of the field, from the start of the code */
+    const void *target;     /* rx address */
+};
+
+#ifndef TCG_TARGET_EXT_RELOCS
+#define TCG_TARGET_EXT_RELOCS 0
+#endif
+
 typedef struct TCGOp TCGOp;
 typedef struct TCGLabelUse TCGLabelUse;
 struct TCGLabelUse {
@@ -359,6 +382,8 @@ struct TCGContext {
     int page_mask;
     uint8_t page_bits;
     uint8_t tlb_dyn_max_bits;
+    /* Guest loads and stores use CPUTLBDesc.mirror instead of the TLB */
+    bool mirror_ram;
     uint8_t insn_start_words;
     TCGBar guest_mo;
 
@@ -396,7 +421,26 @@ struct TCGContext {
     QSIMPLEQ_HEAD(, TCGLabelQemuLdst) ldst_labels;
     struct TCGLabelPoolData *pool_labels;
 
+    /* References out of the TB being generated, if ext_relocs_enabled */
+    bool ext_relocs_enabled;
+    QSIMPLEQ_HEAD(, TCGExtReloc) ext_relocs;
+
     TCGLabel *exitreq_label;
+    TCGLabel *hot_label;
+
+    /*
+     * Set for the contexts of background translation threads, which
+     * cannot use the softmmu TLB of the vCPU they translate for.
+     */
+    bool gen_async;
+    /*
+     * For gen_async: the code write generation of the page of the TB
+     * when it was requested, see tb_page_write_gen().
+     */
+    unsigned gen_async_write_gen;
+    /* Guest destinations of goto_tb in the TB being generated */
+    uint64_t goto_tb_dest[2];
+    int nb_goto_tb_dest;
 
 #ifdef CONFIG_PLUGIN
     /*
@@ -635,6 +679,41 @@ TranslationBlock *tcg_tb_alloc(TCGContext *s);
 
 void tcg_region_reset_all(void);
 
+/**
+ * tcg_region_can_evict:
+ *
+ * Returns: true if the code buffer has enough regions for
+ * tcg_region_evict() to be useful.
+ */
+bool tcg_region_can_evict(void);
+
+/**
+ * tcg_region_has_free:
+ *
+ * Returns: true if a region is available for the next context that fills
+ * up its current one.
+ */
+bool tcg_region_has_free(void);
+
+/**
+ * tcg_region_evict:
+ * @func: callback
+ * @spare_func: callback
+ * @user_data: opaque value to pass to @func and @spare_func
+ *
+ * Free some of the full regions, preferring the oldest ones that were not
+ * referenced since they were last considered for eviction.  @func is called
+ * for each translation block of an evicted region before it is removed from
+ * the region trees.  @spare_func is called for each translation block of a
+ * region that was referenced and gets a second chance; it should make sure
+ * that the next use of the block calls tcg_tb_mark_referenced() again.
+ * Must be called from a safe-work context.
+ *
+ * Returns: the number of regions that were evicted.
+ */
+size_t tcg_region_evict(GTraverseFunc func, GTraverseFunc spare_func,
+                        gpointer user_data);
+
 size_t tcg_code_size(void);
 size_t tcg_code_capacity(void);
 
@@ -669,6 +748,15 @@ void tcg_tb_remove(TranslationBlock *tb);
  */
 TranslationBlock *tcg_tb_lookup(uintptr_t tc_ptr);
 
+/**
+ * tcg_tb_mark_referenced:
+ * @tb: translation block
+ *
+ * Record that @tb was looked up or chained to, so that the region holding
+ * its code gets a second chance in tcg_region_evict().
+ */
+void tcg_tb_mark_referenced(const TranslationBlock *tb);
+
 /**
  * tcg_tb_foreach:
  * @func: callback
@@ -911,11 +999,9 @@ static inline size_t tcg_current_code_size(TCGContext *s)
  *        TB index (0 or 1). That is, we left the TB via (the equivalent
  *        of) "goto_tb <index>". The main loop uses this to determine
  *        how to link the TB just executed to the next.
- *  2:    we are using instruction counting code generation, and we
- *        did not start executing this TB because the instruction counter
- *        would hit zero midway through it. In this case the pointer
- *        returned is the TB we were about to execute, and the caller must
- *        arrange to execute the remaining count of instructions.
+ *  2:    the execution counter of this TB reached the superblock
+ *        threshold. The pointer returned is the TB we were about to
+ *        execute, and the caller should retranslate it as a superblock.
  *  3:    we stopped because the CPU's exit_request flag was set
  *        (usually meaning that there is an interrupt that needs to be
  *        handled). The pointer returned is the TB we were about to execute
@@ -938,6 +1024,7 @@ static inline size_t tcg_current_code_size(TCGContext *s)
 #define TB_EXIT_IDX0      0
 #define TB_EXIT_IDX1      1
 #define TB_EXIT_IDXMAX    1
+#define TB_EXIT_HOT       2
 #define TB_EXIT_REQUESTED 3
 
 #ifdef CONFIG_TCG_INTERPRETER
@@ -17,6 +17,7 @@
  *  along with this program; if not, see <http://www.gnu.org/licenses/>.
  */
 #include "qemu/osdep.h"
+#include "exec/tb-cache.h"
 #include "tcg/perf.h"
 #include "gdbstub/syscalls.h"
 #include "qemu.h"
@@ -35,4 +36,5 @@ void preexit_cleanup(CPUArchState *env, int code)
         gdb_exit(code);
         qemu_plugin_user_exit();
         perf_exit();
+        tb_cache_exit();
 }
@@ -101,6 +101,16 @@ struct NBDExport {
     bool allocation_depth;
     BdrvDirtyBitmap **export_bitmaps;
     size_t nr_export_bitmaps;
+
+    /*
+     * AioContexts that clients are distributed across if the export was
+     * created with a list of iothreads.  The first entry stands for the
+     * export's own AioContext, which follows the node.  Only accessed in
+     * the main loop.
+     */
+    AioContext **multithread_ctxs;
+    size_t multithread_count;
+    size_t next_ctx;
 };
 
 static QTAILQ_HEAD(, NBDExport) exports = QTAILQ_HEAD_INITIALIZER(exports);
@@ -129,6 +139,7 @@ struct NBDClient {
     QemuMutex lock;
 
     NBDExport *exp;
+    AioContext *ctx; /* If non-NULL, serve requests here, not in the export's */
     QCryptoTLSCreds *tlscreds;
     char *tlsauthz;
     uint32_t handshake_max_secs;
@@ -159,6 +170,12 @@ struct NBDClient {
 
 static void nbd_client_receive_next_request(NBDClient *client);
 
+/* The AioContext in which @client's requests are processed */
+static AioContext *nbd_client_aio_context(NBDClient *client)
+{
+    return client->ctx ?: client->exp->common.ctx;
+}
+
 /* Basic flow for negotiation
 
    Server         Client
@@ -1727,7 +1744,7 @@ static void nbd_drained_end(void *opaque)
     }
 }
 
-/* Runs in export AioContext */
+/* Runs in the client's AioContext */
 static void nbd_wake_read_bh(void *opaque)
 {
     NBDClient *client = opaque;
@@ -1753,7 +1770,7 @@ static bool nbd_drained_poll(void *opaque)
                  * qio_channel_yield().
                  */
                 if (client->recv_coroutine != NULL && client->read_yielding) {
-                    aio_bh_schedule_oneshot(nbd_export_aio_context(client->exp),
+                    aio_bh_schedule_oneshot(nbd_client_aio_context(client),
                                             nbd_wake_read_bh, client);
                 }
 
@@ -1793,6 +1810,7 @@ static const BlockDevOps nbd_block_ops = {
 };
 
 static int nbd_export_create(BlockExport *blk_exp, BlockExportOptions *exp_args,
+                             AioContext *const *multithread, size_t mt_count,
                              Error **errp)
 {
     NBDExport *exp = container_of(blk_exp, NBDExport, common);
@@ -1932,6 +1950,12 @@ static int nbd_export_create(BlockExport *blk_exp, BlockExportOptions *exp_args,
 
     exp->allocation_depth = arg->allocation_depth;
 
+    if (multithread) {
+        exp->multithread_ctxs = g_memdup2(multithread,
+                                          mt_count * sizeof(multithread[0]));
+        exp->multithread_count = mt_count;
+    }
+
     /*
      * We need to inhibit request queuing in the block layer to ensure we can
      * be properly quiesced when entering a drained section, as our coroutines
@@ -1975,6 +1999,26 @@ nbd_export_aio_context(NBDExport *exp)
     return exp->common.ctx;
 }
 
+/*
+ * Pick the AioContext for a newly negotiated client of @exp.  With
+ * multi-threading, clients are assigned to the export's iothreads in
+ * round-robin order; a NULL return means that the client runs in the
+ * export's AioContext.
+ */
+static AioContext *nbd_export_next_client_ctx(NBDExport *exp)
+{
+    size_t i;
+
+    assert(qemu_in_main_thread());
+
+    if (!exp->multithread_count) {
+        return NULL;
+    }
+
+    i = exp->next_ctx++ % exp->multithread_count;
+    return i == 0 ? NULL : exp->multithread_ctxs[i];
+}
+
 static void nbd_export_request_shutdown(BlockExport *blk_exp)
 {
     NBDExport *exp = container_of(blk_exp, NBDExport, common);
@@ -2021,12 +2065,16 @@ static void nbd_export_delete(BlockExport *blk_exp)
     for (i = 0; i < exp->nr_export_bitmaps; i++) {
         bdrv_dirty_bitmap_set_busy(exp->export_bitmaps[i], false);
     }
+
+    g_free(exp->multithread_ctxs);
+    exp->multithread_ctxs = NULL;
 }
 
 const BlockExportDriver blk_exp_nbd = {
     .type               = BLOCK_EXPORT_TYPE_NBD,
     .instance_size      = sizeof(NBDExport),
     .supports_inactive  = true,
+    .supports_multithread = true,
     .create             = nbd_export_create,
     .delete             = nbd_export_delete,
     .request_shutdown   = nbd_export_request_shutdown,
@@ -3207,7 +3255,7 @@ static void nbd_client_receive_next_request(NBDClient *client)
         nbd_client_get(client);
         req = nbd_request_get(client);
         client->recv_coroutine = qemu_coroutine_create(nbd_trip, req);
-        aio_co_schedule(client->exp->common.ctx, client->recv_coroutine);
+        aio_co_schedule(nbd_client_aio_context(client), client->recv_coroutine);
     }
 }
 
@@ -3253,6 +3301,9 @@ static coroutine_fn void nbd_co_client_start(void *opaque)
     }
 
     timer_free(handshake_timer);
+    client->ctx = nbd_export_next_client_ctx(client->exp);
+    trace_nbd_co_client_start_ctx(client->exp->name,
+                                  nbd_client_aio_context(client));
     WITH_QEMU_LOCK_GUARD(&client->lock) {
         nbd_client_receive_next_request(client);
     }
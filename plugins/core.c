@@ -212,6 +212,24 @@ CPUPluginState *qemu_plugin_create_vcpu_state(void)
     return g_new0(CPUPluginState, 1);
 }
 
+/* Allocate the records of the vcpus that do not have any yet */
+static void plugin_mem_buffer_alloc__locked(struct qemu_plugin_mem_buffer *buf)
+{
+    GArray *vcpus = buf->vcpus->data;
+    size_t i;
+
+    for (i = 0; i < vcpus->len; i++) {
+        struct qemu_plugin_mem_buffer_vcpu *v =
+            &g_array_index(vcpus, struct qemu_plugin_mem_buffer_vcpu, i);
+
+        if (!v->records) {
+            v->records = g_new(qemu_plugin_mem_record, buf->n_records);
+            v->next = v->records;
+            v->end = v->records + buf->n_records;
+        }
+    }
+}
+
 static void plugin_grow_scoreboards__locked(CPUState *cpu)
 {
     size_t scoreboard_size = plugin.scoreboard_alloc_size;
@@ -250,9 +268,13 @@ static void plugin_grow_scoreboards__locked(CPUState *cpu)
     /* in case another vcpu is created between unlock and exclusive section. */
     if (scoreboard_size > plugin.scoreboard_alloc_size) {
         struct qemu_plugin_scoreboard *score;
+        struct qemu_plugin_mem_buffer *buf;
         QLIST_FOREACH(score, &plugin.scoreboards, entry) {
             g_array_set_size(score->data, scoreboard_size);
         }
+        QLIST_FOREACH(buf, &plugin.mem_buffers, entry) {
+            plugin_mem_buffer_alloc__locked(buf);
+        }
         plugin.scoreboard_alloc_size = scoreboard_size;
         /* force all tb to be flushed, as scoreboard pointers were changed. */
         tb_flush(cpu);
@@ -285,8 +307,15 @@ void qemu_plugin_vcpu_init_hook(CPUState *cpu)
 
 void qemu_plugin_vcpu_exit_hook(CPUState *cpu)
 {
+    struct qemu_plugin_mem_buffer *buf;
     bool success;
 
+    qemu_rec_mutex_lock(&plugin.lock);
+    QLIST_FOREACH(buf, &plugin.mem_buffers, entry) {
+        plugin_mem_buffer_flush(buf, cpu->cpu_index);
+    }
+    qemu_rec_mutex_unlock(&plugin.lock);
+
     plugin_vcpu_cb__simple(cpu, QEMU_PLUGIN_EV_VCPU_EXIT);
 
     assert(cpu->cpu_index != UNASSIGNED_CPU_INDEX);
@@ -465,6 +494,19 @@ void plugin_register_vcpu_mem_cb(GArray **arr,
     dyn_cb->regular = regular_cb;
 }
 
+void plugin_register_vcpu_mem_buffered(GArray **arr,
+                                       enum qemu_plugin_mem_rw rw,
+                                       struct qemu_plugin_mem_buffer *buf,
+                                       uint64_t udata)
+{
+    struct qemu_plugin_dyn_cb *dyn_cb = plugin_get_dyn_cb(arr);
+    struct qemu_plugin_buffered_cb buffered_cb = { .buf = buf,
+                                                   .udata = udata,
+                                                   .rw = rw };
+    dyn_cb->type = PLUGIN_CB_MEM_BUFFERED;
+    dyn_cb->buffered = buffered_cb;
+}
+
 /*
  * Disable CFI checks.
  * The callback function has been loaded from an external library so we do not
@@ -601,6 +643,23 @@ void exec_inline_op(enum plugin_dyn_cb_type type,
     }
 }
 
+/* Append a record from a helper, as the generated code would have done */
+static void plugin_mem_buffer_append(struct qemu_plugin_buffered_cb *cb,
+                                     unsigned int vcpu_index, uint64_t vaddr,
+                                     qemu_plugin_meminfo_t info)
+{
+    struct qemu_plugin_mem_buffer_vcpu *v =
+        &g_array_index(cb->buf->vcpus->data,
+                       struct qemu_plugin_mem_buffer_vcpu, vcpu_index);
+
+    v->next->vaddr = vaddr;
+    v->next->udata = cb->udata;
+    v->next->info = info;
+    if (++v->next == v->end) {
+        plugin_mem_buffer_flush(cb->buf, vcpu_index);
+    }
+}
+
 void qemu_plugin_vcpu_mem_cb(CPUState *cpu, uint64_t vaddr,
                              uint64_t value_low,
                              uint64_t value_high,
@@ -634,14 +693,56 @@ void qemu_plugin_vcpu_mem_cb(CPUState *cpu, uint64_t vaddr,
                 exec_inline_op(cb->type, &cb->inline_insn, cpu->cpu_index);
             }
             break;
+        case PLUGIN_CB_MEM_BUFFERED:
+            if (rw & cb->buffered.rw) {
+                plugin_mem_buffer_append(&cb->buffered, cpu->cpu_index, vaddr,
+                                         make_plugin_meminfo(oi, rw));
+            }
+            break;
         default:
             g_assert_not_reached();
         }
     }
 }
 
+/*
+ * Hand the pending records of the vcpus to the plugins for the last time.
+ * The records of a vcpu can only be read by another thread while the vcpu
+ * does not run: from an exclusive section in user mode, or once it was
+ * paused in system mode.  The records of vcpus that still run are dropped,
+ * like those they append from now on, so that no buffer callback runs
+ * after the atexit callbacks.  Vcpus that exited flushed their own.
+ */
+static void plugin_mem_buffers_close__locked(void)
+{
+    struct qemu_plugin_mem_buffer *buf;
+    CPUState *cpu;
+
+    if (plugin.mem_buffers_closed) {
+        return;
+    }
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        CPU_FOREACH(cpu) {
+#ifndef CONFIG_USER_ONLY
+            if (!qatomic_read(&cpu->stopped)) {
+                continue;
+            }
+#endif
+            QLIST_FOREACH(buf, &plugin.mem_buffers, entry) {
+                plugin_mem_buffer_flush(buf, cpu->cpu_index);
+            }
+        }
+    }
+    qatomic_set(&plugin.mem_buffers_closed, true);
+}
+
 void qemu_plugin_atexit_cb(void)
 {
+    qemu_rec_mutex_lock(&plugin.lock);
+    plugin_mem_buffers_close__locked();
+    qemu_rec_mutex_unlock(&plugin.lock);
+
     plugin_cb__udata(QEMU_PLUGIN_EV_ATEXIT);
 }
 
@@ -689,6 +790,8 @@ void qemu_plugin_user_exit(void)
     CPU_FOREACH(cpu) {
         qemu_plugin_disable_mem_helpers(cpu);
     }
+    /* While the other threads cannot append records */
+    plugin_mem_buffers_close__locked();
     qemu_rec_mutex_unlock(&plugin.lock);
 
     tb_flush(current_cpu);
@@ -734,6 +837,7 @@ static void __attribute__((__constructor__)) plugin_init(void)
     plugin.cpu_ht = g_hash_table_new(g_int_hash, g_int_equal);
     QLIST_INIT(&plugin.scoreboards);
     plugin.scoreboard_alloc_size = 16; /* avoid frequent reallocation */
+    QLIST_INIT(&plugin.mem_buffers);
     QTAILQ_INIT(&plugin.ctxs);
     qht_init(&plugin.dyn_cb_arr_ht, plugin_dyn_cb_arr_cmp, 16,
              QHT_MODE_AUTO_RESIZE);
@@ -768,3 +872,54 @@ void plugin_scoreboard_free(struct qemu_plugin_scoreboard *score)
     g_array_free(score->data, TRUE);
     g_free(score);
 }
+
+struct qemu_plugin_mem_buffer *
+plugin_mem_buffer_new(size_t n_records, qemu_plugin_vcpu_mem_buf_cb_t cb,
+                      void *userdata)
+{
+    struct qemu_plugin_mem_buffer *buf =
+        g_new0(struct qemu_plugin_mem_buffer, 1);
+
+    g_assert(n_records);
+    buf->cb = cb;
+    buf->userdata = userdata;
+    buf->n_records = n_records;
+    buf->vcpus = plugin_scoreboard_new(
+        sizeof(struct qemu_plugin_mem_buffer_vcpu));
+
+    qemu_rec_mutex_lock(&plugin.lock);
+    plugin_mem_buffer_alloc__locked(buf);
+    QLIST_INSERT_HEAD(&plugin.mem_buffers, buf, entry);
+    qemu_rec_mutex_unlock(&plugin.lock);
+
+    return buf;
+}
+
+/*
+ * Disable CFI checks.
+ * The callback function has been loaded from an external library so we do not
+ * have type information
+ */
+QEMU_DISABLE_CFI
+void plugin_mem_buffer_flush(struct qemu_plugin_mem_buffer *buf,
+                             unsigned int vcpu_index)
+{
+    struct qemu_plugin_mem_buffer_vcpu *v =
+        &g_array_index(buf->vcpus->data,
+                       struct qemu_plugin_mem_buffer_vcpu, vcpu_index);
+    size_t n = v->next - v->records;
+
+    if (n) {
+        /* The records stay untouched until the vcpu executes again. */
+        v->next = v->records;
+        if (!qatomic_read(&plugin.mem_buffers_closed)) {
+            buf->cb(vcpu_index, v->records, n, buf->userdata);
+        }
+    }
+}
+
+void qemu_plugin_mem_buffer_full(uint32_t vcpu_index,
+                                 struct qemu_plugin_mem_buffer *buf)
+{
+    plugin_mem_buffer_flush(buf, vcpu_index);
+}
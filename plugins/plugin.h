@@ -33,6 +33,10 @@ struct qemu_plugin_state {
     GHashTable *cpu_ht;
     QLIST_HEAD(, qemu_plugin_scoreboard) scoreboards;
     size_t scoreboard_alloc_size;
+    /* Memory buffers, whose per-vcpu records follow the scoreboards */
+    QLIST_HEAD(, qemu_plugin_mem_buffer) mem_buffers;
+    /* Set before the atexit callbacks; later records are dropped */
+    bool mem_buffers_closed;
     DECLARE_BITMAP(mask, QEMU_PLUGIN_EV_MAX);
     /*
      * @lock protects the struct as well as ctx->uninstalling.
@@ -108,6 +112,11 @@ void plugin_register_vcpu_mem_cb(GArray **arr,
                                  enum qemu_plugin_mem_rw rw,
                                  void *udata);
 
+void plugin_register_vcpu_mem_buffered(GArray **arr,
+                                       enum qemu_plugin_mem_rw rw,
+                                       struct qemu_plugin_mem_buffer *buf,
+                                       uint64_t udata);
+
 void exec_inline_op(enum plugin_dyn_cb_type type,
                     struct qemu_plugin_inline_cb *cb,
                     int cpu_index);
@@ -118,4 +127,11 @@ struct qemu_plugin_scoreboard *plugin_scoreboard_new(size_t element_size);
 
 void plugin_scoreboard_free(struct qemu_plugin_scoreboard *score);
 
+struct qemu_plugin_mem_buffer *
+plugin_mem_buffer_new(size_t n_records, qemu_plugin_vcpu_mem_buf_cb_t cb,
+                      void *userdata);
+
+void plugin_mem_buffer_flush(struct qemu_plugin_mem_buffer *buf,
+                             unsigned int vcpu_index);
+
 #endif /* PLUGIN_H */
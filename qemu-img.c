@@ -55,6 +55,10 @@
 #include "qemu/throttle.h"
 #include "block/throttle-groups.h"
 
+#ifdef CONFIG_ZSTD
+#include <zdict.h>
+#endif
+
 #define QEMU_IMG_VERSION "qemu-img version " QEMU_FULL_VERSION \
                           "\n" QEMU_COPYRIGHT "\n"
 
@@ -86,6 +90,8 @@ enum {
     OPTION_BITMAPS = 275,
     OPTION_FORCE = 276,
     OPTION_SKIP_BROKEN = 277,
+    OPTION_COMPRESSION_DICT_SIZE = 278,
+    OPTION_STATS = 279,
 };
 
 typedef enum OutputFormat {
@@ -205,8 +211,9 @@ void help(void)
            "Parameters to convert subcommand:\n"
            "  '--bitmaps' copies all top-level persistent bitmaps to destination\n"
            "  '-m' specifies how many coroutines work in parallel during the convert\n"
-           "       process (defaults to 8)\n"
+           "       process (defaults to 8, at most 64)\n"
            "  '-W' allow to write to the target out of order rather than sequential\n"
+           "  '--stats' prints the throughput of the conversion when it completes\n"
            "\n"
            "Parameters to snapshot subcommand:\n"
            "  'snapshot' is the name of the snapshot to create, apply or delete\n"
@@ -1664,9 +1671,22 @@ enum ImgConvertBlockStatus {
     BLK_BACKING_FILE,
 };
 
-#define MAX_COROUTINES 16
+#define MAX_COROUTINES 64
 #define CONVERT_THROTTLE_GROUP "img_convert"
 
+/*
+ * Upper bound for the number of extents remembered from the sizing pass of
+ * convert_do_copy(); beyond that, the copy pass queries the block status
+ * again.
+ */
+#define MAX_CONVERT_EXTENTS (1024 * 1024)
+
+typedef struct ImgConvertExtent {
+    int64_t start;
+    int64_t end;
+    enum ImgConvertBlockStatus status;
+} ImgConvertExtent;
+
 typedef struct ImgConvertState {
     BlockBackend **src;
     int64_t *src_sectors;
@@ -1679,6 +1699,9 @@ typedef struct ImgConvertState {
     int64_t wr_offs;
     enum ImgConvertBlockStatus status;
     int64_t sector_next_status;
+    GArray *extents;
+    bool extents_complete;
+    guint extent_cur;
     BlockBackend *target;
     bool has_zero_init;
     bool compressed;
@@ -1699,6 +1722,12 @@ typedef struct ImgConvertState {
     int64_t wait_sector_num[MAX_COROUTINES];
     CoMutex lock;
     int ret;
+
+    /* For --stats */
+    int64_t block_status_queries;
+    int64_t bytes_read;
+    int64_t bytes_written;
+    int64_t bytes_zeroed;
 } ImgConvertState;
 
 static void convert_select_part(ImgConvertState *s, int64_t sector_num,
@@ -1713,6 +1742,55 @@ static void convert_select_part(ImgConvertState *s, int64_t sector_num,
     }
 }
 
+/*
+ * Remember the block status found at @sector_num so that the copy pass does
+ * not have to query it again.
+ */
+static void convert_record_extent(ImgConvertState *s, int64_t sector_num)
+{
+    ImgConvertExtent e = {
+        .start = sector_num,
+        .end = s->sector_next_status,
+        .status = s->status,
+    };
+
+    if (s->extents_complete || s->extents->len >= MAX_CONVERT_EXTENTS) {
+        return;
+    }
+    g_array_append_val(s->extents, e);
+}
+
+/*
+ * Look up the block status at @sector_num in the extents recorded during
+ * the sizing pass. Returns false if it has to be queried instead.
+ */
+static bool convert_lookup_extent(ImgConvertState *s, int64_t sector_num)
+{
+    ImgConvertExtent *e;
+
+    if (!s->extents_complete) {
+        return false;
+    }
+
+    while (s->extent_cur < s->extents->len &&
+           g_array_index(s->extents, ImgConvertExtent,
+                         s->extent_cur).end <= sector_num) {
+        s->extent_cur++;
+    }
+    if (s->extent_cur == s->extents->len) {
+        return false;
+    }
+
+    e = &g_array_index(s->extents, ImgConvertExtent, s->extent_cur);
+    if (e->start > sector_num) {
+        return false;
+    }
+
+    s->status = e->status;
+    s->sector_next_status = e->end;
+    return true;
+}
+
 static int coroutine_mixed_fn GRAPH_RDLOCK
 convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
 {
@@ -1735,7 +1813,8 @@ convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
         }
     }
 
-    if (s->sector_next_status <= sector_num) {
+    if (s->sector_next_status <= sector_num &&
+        !convert_lookup_extent(s, sector_num)) {
         uint64_t offset = (sector_num - src_cur_offset) * BDRV_SECTOR_SIZE;
         int64_t count;
         int tail;
@@ -1753,6 +1832,7 @@ convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
 
             ret = bdrv_block_status_above(src_bs, base, offset, count, &count,
                                           NULL, NULL);
+            s->block_status_queries++;
 
             if (ret < 0) {
                 if (s->salvage) {
@@ -1798,6 +1878,7 @@ convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
         }
 
         s->sector_next_status = sector_num + n;
+        convert_record_extent(s, sector_num);
     }
 
     n = MIN(n, s->sector_next_status - sector_num);
@@ -1865,6 +1946,7 @@ static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
             }
         }
 
+        s->bytes_read += n << BDRV_SECTOR_BITS;
         sector_num += n;
         nb_sectors -= n;
         buf += n * BDRV_SECTOR_SIZE;
@@ -1911,6 +1993,7 @@ static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
                 if (ret < 0) {
                     return ret;
                 }
+                s->bytes_written += n << BDRV_SECTOR_BITS;
                 break;
             }
             /* fall-through */
@@ -1927,6 +2010,7 @@ static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
             if (ret < 0) {
                 return ret;
             }
+            s->bytes_zeroed += n << BDRV_SECTOR_BITS;
             break;
         }
 
@@ -1963,6 +2047,7 @@ static int coroutine_fn convert_co_copy_range(ImgConvertState *s, int64_t sector
             return ret;
         }
 
+        s->bytes_written += n << BDRV_SECTOR_BITS;
         sector_num += n;
         nb_sectors -= n;
     }
@@ -2115,6 +2200,7 @@ static int convert_do_copy(ImgConvertState *s)
         s->buf_sectors = s->cluster_sectors;
     }
 
+    s->extents = g_array_new(false, false, sizeof(ImgConvertExtent));
     while (sector_num < s->total_sectors) {
         bdrv_graph_rdlock_main_loop();
         n = convert_iteration_sectors(s, sector_num);
@@ -2129,8 +2215,10 @@ static int convert_do_copy(ImgConvertState *s)
         sector_num += n;
     }
 
-    /* Do the copy */
+    /* Do the copy, reusing the block status gathered above */
     s->sector_next_status = 0;
+    s->extents_complete = true;
+    s->extent_cur = 0;
     s->ret = -EINPROGRESS;
 
     qemu_co_mutex_init(&s->lock);
@@ -2155,6 +2243,30 @@ static int convert_do_copy(ImgConvertState *s)
     return s->ret;
 }
 
+static void convert_print_stats(ImgConvertState *s, int64_t elapsed_ns)
+{
+    double seconds = MAX(elapsed_ns, 1) / (double) NANOSECONDS_PER_SECOND;
+    uint64_t size = s->total_sectors * BDRV_SECTOR_SIZE;
+    g_autofree char *size_str = size_to_str(size);
+    g_autofree char *rate_str = size_to_str(size / seconds);
+    g_autofree char *read_str = size_to_str(s->bytes_read);
+    g_autofree char *read_rate_str = size_to_str(s->bytes_read / seconds);
+    g_autofree char *written_str = size_to_str(s->bytes_written);
+    g_autofree char *written_rate_str =
+        size_to_str(s->bytes_written / seconds);
+    g_autofree char *zeroed_str = size_to_str(s->bytes_zeroed);
+
+    printf("Converted %s in %3.3f seconds (%s/s)\n",
+           size_str, seconds, rate_str);
+    printf("  read:    %s (%s/s)\n", read_str, read_rate_str);
+    printf("  written: %s (%s/s)\n", written_str, written_rate_str);
+    printf("  zeroed:  %s\n", zeroed_str);
+    printf("  block status queries: %" PRId64 ", extents: %u\n",
+           s->block_status_queries, s->extents->len);
+    printf("  coroutines: %ld, %s writes\n", s->num_coroutines,
+           s->wr_in_order ? "in-order" : "out-of-order");
+}
+
 /* Check that bitmaps can be copied, or output an error */
 static int convert_check_bitmaps(BlockDriverState *src, bool skip_broken)
 {
@@ -2231,6 +2343,104 @@ static void set_rate_limit(BlockBackend *blk, int64_t rate_limit)
     blk_set_io_limits(blk, &cfg);
 }
 
+#ifdef CONFIG_ZSTD
+/* Upper bound for the amount of source data sampled for dictionary training */
+#define CONVERT_DICT_MAX_SAMPLE_BYTES (128 * MiB)
+
+/*
+ * Trains a zstd dictionary of at most @dict_size bytes from chunks of
+ * @chunk_size bytes spread evenly over all source images, and writes it to a
+ * temporary file whose name is returned in @filename.
+ *
+ * If no dictionary can be trained from the source data, warns and leaves
+ * @filename NULL, so that the image is compressed without a dictionary.
+ */
+static int convert_train_compression_dict(ImgConvertState *s,
+                                          size_t dict_size, size_t chunk_size,
+                                          char **filename)
+{
+    g_autofree uint8_t *samples = NULL;
+    g_autofree size_t *sample_sizes = NULL;
+    g_autofree uint8_t *dict = NULL;
+    g_autoptr(GError) gerr = NULL;
+    uint64_t budget, total_bytes, stride;
+    unsigned nb_samples = 0, max_samples;
+    size_t ret;
+    int bs_i, fd;
+
+    total_bytes = s->total_sectors * BDRV_SECTOR_SIZE;
+    budget = MIN(MIN((uint64_t)dict_size * 100, CONVERT_DICT_MAX_SAMPLE_BYTES),
+                 ROUND_UP(total_bytes, chunk_size));
+    max_samples = budget / chunk_size;
+    if (max_samples == 0) {
+        warn_report("Source images are too small to train a compression "
+                    "dictionary, compressing without one");
+        return 0;
+    }
+    stride = MAX(total_bytes / max_samples, chunk_size);
+
+    samples = g_malloc((size_t)max_samples * chunk_size);
+    sample_sizes = g_new(size_t, max_samples);
+
+    for (bs_i = 0; bs_i < s->src_num && nb_samples < max_samples; bs_i++) {
+        int64_t src_bytes = s->src_sectors[bs_i] * BDRV_SECTOR_SIZE;
+        int64_t offset;
+
+        for (offset = 0; offset < src_bytes && nb_samples < max_samples;
+             offset += stride)
+        {
+            uint8_t *buf = samples + (size_t)nb_samples * chunk_size;
+            int64_t bytes = MIN(chunk_size, src_bytes - offset);
+
+            if (blk_pread(s->src[bs_i], offset, bytes, buf, 0) < 0) {
+                error_report("Could not read source image for compression "
+                             "dictionary training");
+                return -EIO;
+            }
+            /* Zero chunks compress well anyway and would skew the result */
+            if (buffer_is_zero(buf, bytes)) {
+                continue;
+            }
+            sample_sizes[nb_samples++] = bytes;
+        }
+    }
+
+    if (nb_samples == 0) {
+        warn_report("Source images contain no data to train a compression "
+                    "dictionary, compressing without one");
+        return 0;
+    }
+
+    dict = g_malloc(dict_size);
+    ret = ZDICT_trainFromBuffer(dict, dict_size, samples, sample_sizes,
+                                nb_samples);
+    if (ZDICT_isError(ret)) {
+        warn_report("Could not train compression dictionary, compressing "
+                    "without one: %s", ZDICT_getErrorName(ret));
+        return 0;
+    }
+
+    fd = g_file_open_tmp("qemu-img-dict-XXXXXX", filename, &gerr);
+    if (fd < 0) {
+        error_report("Could not create compression dictionary file: %s",
+                     gerr->message);
+        return -EIO;
+    }
+    if (qemu_write_full(fd, dict, ret) != ret) {
+        error_report("Could not write compression dictionary file: %s",
+                     strerror(errno));
+        close(fd);
+        unlink(*filename);
+        g_free(*filename);
+        *filename = NULL;
+        return -EIO;
+    }
+    close(fd);
+
+    return 0;
+}
+#endif
+
 static int img_convert(int argc, char **argv)
 {
     int c, bs_i, flags, src_flags = BDRV_O_NO_SHARE;
@@ -2254,6 +2464,10 @@ static int img_convert(int argc, char **argv)
     bool bitmaps = false;
     bool skip_broken = false;
     int64_t rate_limit = 0;
+    int64_t compression_dict_size = 0;
+    char *compression_dict_file = NULL;
+    bool stats = false;
+    int64_t start_time;
 
     ImgConvertState s = (ImgConvertState) {
         /* Need at least 4k of zeros for sparse detection */
@@ -2275,6 +2489,9 @@ static int img_convert(int argc, char **argv)
             {"target-is-zero", no_argument, 0, OPTION_TARGET_IS_ZERO},
             {"bitmaps", no_argument, 0, OPTION_BITMAPS},
             {"skip-broken-bitmaps", no_argument, 0, OPTION_SKIP_BROKEN},
+            {"compression-dict-size", required_argument, 0,
+             OPTION_COMPRESSION_DICT_SIZE},
+            {"stats", no_argument, 0, OPTION_STATS},
             {0, 0, 0, 0}
         };
         c = getopt_long(argc, argv, ":hf:O:B:CcF:o:l:S:pt:T:qnm:WUr:",
@@ -2409,6 +2626,16 @@ static int img_convert(int argc, char **argv)
         case OPTION_SKIP_BROKEN:
             skip_broken = true;
             break;
+        case OPTION_COMPRESSION_DICT_SIZE:
+            compression_dict_size = cvtnum_full("compression dictionary size",
+                                                optarg, 1, 1 * MiB);
+            if (compression_dict_size < 0) {
+                goto fail_getopt;
+            }
+            break;
+        case OPTION_STATS:
+            stats = true;
+            break;
         }
     }
 
@@ -2451,6 +2678,12 @@ static int img_convert(int argc, char **argv)
         goto fail_getopt;
     }
 
+    if (compression_dict_size && (!s.compressed || skip_create)) {
+        error_report("--compression-dict-size requires use of -c and "
+                     "cannot be used with -n");
+        goto fail_getopt;
+    }
+
     s.src_num = argc - optind - 1;
     out_filename = s.src_num >= 1 ? argv[argc - 1] : NULL;
 
@@ -2645,6 +2878,42 @@ static int img_convert(int argc, char **argv)
         }
     }
 
+    /* Train a compression dictionary from the source data */
+    if (compression_dict_size) {
+        const char *compression_type =
+            qemu_opt_get(opts, BLOCK_OPT_COMPRESSION_TYPE);
+
+        if (!compression_type || strcmp(compression_type, "zstd")) {
+            error_report("--compression-dict-size requires "
+                         "-o compression_type=zstd");
+            ret = -1;
+            goto out;
+        }
+        if (qemu_opt_get(opts, BLOCK_OPT_COMPRESSION_DICT)) {
+            error_report("--compression-dict-size and -o "
+                         BLOCK_OPT_COMPRESSION_DICT " are mutually exclusive");
+            ret = -1;
+            goto out;
+        }
+#ifdef CONFIG_ZSTD
+        ret = convert_train_compression_dict(
+            &s, compression_dict_size,
+            qemu_opt_get_size(opts, BLOCK_OPT_CLUSTER_SIZE, 64 * KiB),
+            &compression_dict_file);
+        if (ret < 0) {
+            goto out;
+        }
+        if (compression_dict_file) {
+            qemu_opt_set(opts, BLOCK_OPT_COMPRESSION_DICT,
+                         compression_dict_file, &error_abort);
+        }
+#else
+        error_report("Compression dictionaries require zstd support");
+        ret = -1;
+        goto out;
+#endif
+    }
+
     /* Determine if bitmaps need copying */
     if (bitmaps) {
         if (s.src_num > 1) {
@@ -2783,7 +3052,11 @@ static int img_convert(int argc, char **argv)
         set_rate_limit(s.target, rate_limit);
     }
 
+    start_time = get_clock();
     ret = convert_do_copy(&s);
+    if (stats && ret == 0) {
+        convert_print_stats(&s, get_clock() - start_time);
+    }
 
     /* Now copy the bitmaps */
     if (bitmaps && ret == 0) {
@@ -2807,6 +3080,13 @@ out:
     }
     g_free(s.src_sectors);
     g_free(s.src_alignment);
+    if (s.extents) {
+        g_array_free(s.extents, true);
+    }
+    if (compression_dict_file) {
+        unlink(compression_dict_file);
+        g_free(compression_dict_file);
+    }
 fail_getopt:
     qemu_opts_del(sn_opts);
     g_free(options);
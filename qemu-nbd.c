@@ -26,6 +26,7 @@
 #include "qemu/cutils.h"
 #include "system/block-backend.h"
 #include "system/runstate.h" /* for qemu_system_killed() prototype */
+#include "system/iothread.h"
 #include "block/block_int.h"
 #include "block/nbd.h"
 #include "qemu/main-loop.h"
@@ -71,6 +72,7 @@
 #define QEMU_NBD_OPT_SELINUX_LABEL   266
 #define QEMU_NBD_OPT_TLSHOSTNAME     267
 #define QEMU_NBD_OPT_HANDSHAKE_LIMIT 268
+#define QEMU_NBD_OPT_IOTHREADS       269
 
 #define MBR_SIZE 512
 
@@ -82,6 +84,7 @@ static QIONetListener *server;
 static QCryptoTLSCreds *tlscreds;
 static const char *tlsauthz;
 static int handshake_limit = NBD_DEFAULT_HANDSHAKE_MAX_SECS;
+static int nr_iothreads;
 
 static void usage(const char *name)
 {
@@ -104,6 +107,7 @@ static void usage(const char *name)
 "  -x, --export-name=NAME    expose export by name (default is empty string)\n"
 "  -D, --description=TEXT    export a human-readable description\n"
 "      --handshake-limit=N   limit client's handshake to N seconds (default 10)\n"
+"      --iothreads=NUM       distribute clients across NUM I/O threads\n"
 "\n"
 "Exposing part of the image:\n"
 "  -o, --offset=OFFSET       offset into the image\n"
@@ -573,6 +577,7 @@ int main(int argc, char **argv)
         { "description", required_argument, NULL, 'D' },
         { "handshake-limit", required_argument, NULL,
           QEMU_NBD_OPT_HANDSHAKE_LIMIT },
+        { "iothreads", required_argument, NULL, QEMU_NBD_OPT_IOTHREADS },
         { "tls-creds", required_argument, NULL, QEMU_NBD_OPT_TLSCREDS },
         { "tls-hostname", required_argument, NULL, QEMU_NBD_OPT_TLSHOSTNAME },
         { "tls-authz", required_argument, NULL, QEMU_NBD_OPT_TLSAUTHZ },
@@ -826,6 +831,13 @@ int main(int argc, char **argv)
                 exit(EXIT_FAILURE);
             }
             break;
+        case QEMU_NBD_OPT_IOTHREADS:
+            if (qemu_strtoi(optarg, NULL, 0, &nr_iothreads) < 0 ||
+                nr_iothreads < 0) {
+                error_report("Invalid number of iothreads '%s'", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
         }
     }
 
@@ -836,7 +848,8 @@ int main(int argc, char **argv)
         }
         if (export_name || export_description || dev_offset ||
             opts.device || disconnect || fmt || sn_id_or_name || bitmaps ||
-            alloc_depth || seen_aio || seen_discard || seen_cache) {
+            alloc_depth || seen_aio || seen_discard || seen_cache ||
+            nr_iothreads) {
             error_report("List mode is incompatible with per-device settings");
             exit(EXIT_FAILURE);
         }
@@ -1183,6 +1196,28 @@ int main(int argc, char **argv)
             .allocation_depth     = alloc_depth,
         },
     };
+
+    if (nr_iothreads) {
+        strList *iothread_ids = NULL;
+        int i;
+
+        /* Our own BlockBackend must not pin the node to the main loop */
+        blk_set_allow_aio_context_change(blk, true);
+
+        for (i = nr_iothreads - 1; i >= 0; i--) {
+            char *id = g_strdup_printf("qemu-nbd-iothread%d", i);
+
+            iothread_create(id, &error_fatal);
+            QAPI_LIST_PREPEND(iothread_ids, id);
+        }
+
+        export_opts->iothread = g_new(BlockExportIothreads, 1);
+        *export_opts->iothread = (BlockExportIothreads) {
+            .type    = QTYPE_QLIST,
+            .u.multi = iothread_ids,
+        };
+    }
+
     blk_exp_add(export_opts, &error_fatal);
     qapi_free_BlockExportOptions(export_opts);
 
@@ -197,9 +197,13 @@ DEF("accel", HAS_ARG, QEMU_OPTION_accel,
     "                igd-passthru=on|off (enable Xen integrated Intel graphics passthrough, default=off)\n"
     "                kernel-irqchip=on|off|split controls accelerated irqchip support (default=on)\n"
     "                kvm-shadow-mem=size of KVM shadow MMU in bytes\n"
+    "                mirror-ram=on|off (access shared guest RAM through host mappings in TCG)\n"
     "                one-insn-per-tb=on|off (one guest instruction per TCG translation block)\n"
     "                split-wx=on|off (enable TCG split w^x mapping)\n"
+    "                superblock-threshold=n (retranslate TCG translation blocks across jumps after n executions)\n"
     "                tb-size=n (TCG translation block cache size)\n"
+    "                tb-cache=file (keep TCG translated code in file across runs)\n"
+    "                translate-threads=n (translate TCG code ahead on n threads)\n"
     "                dirty-ring-size=n (KVM dirty ring GFN count, default 0)\n"
     "                eager-split-size=n (KVM Eager Page Split chunk size, default 0, disabled. ARM only)\n"
     "                notify-vmexit=run|internal-error|disable,notify-window=n (enable notify VM exit and set notify window, x86 only)\n"
@@ -228,6 +232,23 @@ SRST
     ``kvm-shadow-mem=size``
         Defines the size of the KVM shadow MMU.
 
+    ``mirror-ram=on|off``
+        Experimental.  Makes the TCG accelerator map the guest RAM that
+        the softmmu TLB holds at its guest virtual addresses in a host
+        address range reserved for each vCPU, so that guest loads and
+        stores do not probe the TLB.  Accesses to anything else, such as
+        I/O, pages with watchpoints and pages tracked for dirty logging,
+        fault and are retried through the TLB, which is much slower than
+        the TLB alone; workloads doing a lot of I/O should leave this off.
+        Only RAM that is backed by a shared file, such as
+        ``-object memory-backend-memfd,share=on``, is mapped; the option
+        is ignored with a warning if the machine's RAM is not.  Only
+        supported on 64-bit x86 and Arm Linux hosts, for guests with
+        32-bit virtual addresses; the option is ignored otherwise.  Each
+        vCPU keeps up to 8192 mappings, which may require raising
+        ``vm.max_map_count`` on the host for guests with many vCPUs.  The
+        default is off.
+
     ``one-insn-per-tb=on|off``
         Makes the TCG accelerator put only one guest instruction into
         each translation block. This slows down emulation a lot, but
@@ -240,9 +261,33 @@ SRST
         such a case this will default on. On other operating systems, this
         will default off, but one may enable this for testing or debugging.
 
+    ``superblock-threshold=n``
+        Makes the TCG accelerator count how many times each translation
+        block runs, and retranslate it after ``n`` runs into a larger
+        block that continues past unconditional jumps, so that it is
+        optimized as a whole.  The default is 0, which disables the
+        counting.  Only some guest architectures (currently x86) follow
+        jumps; for the others, this option has no effect.
+
     ``tb-size=n``
         Controls the size (in MiB) of the TCG translation block cache.
 
+    ``tb-cache=file``
+        Saves the code generated by TCG to ``file``, and reuses it in later
+        runs of the same QEMU binary with the same CPU model and features
+        when the guest code has not changed.  The file is recreated when
+        this is not the case.  The cache is disabled if ``file`` is a
+        symbolic link, is not owned by the user or is writable by others.
+        Only supported on x86-64 hosts.
+
+    ``translate-threads=n``
+        Starts ``n`` threads that translate guest code ahead of the vCPUs,
+        following the direct jumps out of the code that the vCPUs
+        translate, so that they spend less time translating code that they
+        enter for the first time.  Requires ``thread=multi``, and is not
+        available in user mode.  Only x86 guests support it so far; it has
+        no effect with other guests.  The default is 0.
+
     ``thread=single|multi``
         Controls number of TCG threads. When the TCG is multi-threaded
         there will be one thread per vCPU therefore taking advantage of
@@ -6069,7 +6114,7 @@ SRST
 
             CN=laptop.example.com,O=Example Home,L=London,ST=London,C=GB
 
-    ``-object iothread,id=id,poll-max-ns=poll-max-ns,poll-grow=poll-grow,poll-shrink=poll-shrink,aio-max-batch=aio-max-batch``
+    ``-object iothread,id=id,poll-max-ns=poll-max-ns,poll-grow=poll-grow,poll-shrink=poll-shrink,aio-max-batch=aio-max-batch,aio-sqpoll-idle=aio-sqpoll-idle``
         Creates a dedicated event loop thread that devices can be
         assigned to. This is known as an IOThread. By default device
         emulation happens in vCPU threads or the main event loop thread.
@@ -6109,6 +6154,13 @@ SRST
         in a batch for the AIO engine, 0 means that the engine will use
         its default.
 
+        The ``aio-sqpoll-idle`` parameter enables submission queue
+        polling for the io_uring AIO engine: a kernel thread picks up
+        new requests without system calls and goes to sleep after this
+        many milliseconds without requests. 0 (the default) disables
+        submission queue polling. Changes only take effect for io_uring
+        instances that have not been set up yet.
+
         The IOThread parameters can be modified at run-time using the
         ``qom-set`` command (where ``iothread1`` is the IOThread's
         ``id``):
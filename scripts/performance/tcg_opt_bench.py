@@ -0,0 +1,160 @@
+#!/usr/bin/env python3
+
+#  Compare the size of the generated host code and the execution time of
+#  a set of guest binaries, for one or two QEMU linux-user executables.
+#  Typically used to measure the effect of a change to tcg/optimize.c,
+#  with a build from before the change as baseline, or to compare a
+#  build using the TCG interpreter (TCI) with a native one.  For TCI, the
+#  code size is the size of the bytecode.
+#
+#  Syntax:
+#  tcg_opt_bench.py [-h] [-n RUNS] [-b <baseline qemu executable>] \
+#                   -q <qemu executable> <guest command> [<guest command> ...]
+#
+#  [-h] - Print the script arguments help message.
+#  [-n] - Number of timed runs of each guest command, the fastest is kept.
+#  [-b] - QEMU executable to compare against.
+#
+#  Each guest command is a target executable with its options, quoted as
+#  a single argument.
+#
+#  Example of usage:
+#  tcg_opt_bench.py -n 5 -b ./qemu-x86_64.orig -q ./qemu-x86_64 \
+#                   "coulomb_double-x86_64" "sha512-x86_64 -n 100"
+#
+#  This program is free software: you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation, either version 2 of the License, or
+#  (at your option) any later version.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+import argparse
+import os
+import re
+import shlex
+import subprocess
+import sys
+import tempfile
+import time
+
+
+def code_size(qemu, guest):
+    """
+    Run the guest command with out_asm logging and sum the size of the
+    host code of all the translation blocks.
+
+    Parameters:
+    qemu (str): QEMU executable
+    guest (list): target executable and its options
+
+    Returns:
+    (int, int): number of translation blocks, bytes of host code
+    """
+    with tempfile.TemporaryDirectory() as tmpdirname:
+        log_path = os.path.join(tmpdirname, "out_asm.log")
+        run = subprocess.run([qemu, "-d", "out_asm", "-D", log_path] + guest,
+                             stdout=subprocess.DEVNULL,
+                             stderr=subprocess.PIPE)
+        if run.returncode:
+            sys.exit(run.stderr.decode("utf-8"))
+
+        nb_tbs = 0
+        size = 0
+        pattern = re.compile(r"^OUT: \[size=(\d+)\]")
+        with open(log_path, "r", errors="replace") as log:
+            for line in log:
+                match = pattern.match(line)
+                if match:
+                    nb_tbs += 1
+                    size += int(match.group(1))
+    return nb_tbs, size
+
+
+def run_time(qemu, guest, runs):
+    """
+    Run the guest command without logging and measure its wall time.
+
+    Parameters:
+    qemu (str): QEMU executable
+    guest (list): target executable and its options
+    runs (int): number of runs
+
+    Returns:
+    (float): fastest run, in seconds
+    """
+    best = None
+    for _ in range(runs):
+        start = time.perf_counter()
+        run = subprocess.run([qemu] + guest,
+                             stdout=subprocess.DEVNULL,
+                             stderr=subprocess.PIPE)
+        elapsed = time.perf_counter() - start
+        if run.returncode:
+            sys.exit(run.stderr.decode("utf-8"))
+        if best is None or elapsed < best:
+            best = elapsed
+    return best
+
+
+def measure(qemu, guest, runs):
+    nb_tbs, size = code_size(qemu, guest)
+    return {"tbs": nb_tbs, "size": size, "time": run_time(qemu, guest, runs)}
+
+
+def delta(new, old):
+    if not old:
+        return ""
+    return "{:+.2f}%".format((new - old) / old * 100)
+
+
+def main():
+    # Parse the command line arguments
+    parser = argparse.ArgumentParser(
+        usage='tcg_opt_bench.py [-h] [-n RUNS] '
+        '[-b <baseline qemu executable>] -q <qemu executable> '
+        '<guest command> [<guest command> ...]')
+
+    parser.add_argument('-n', dest='runs', type=int, default=3,
+                        help='Number of timed runs of each guest command.')
+    parser.add_argument('-b', dest='baseline', type=str,
+                        help='QEMU executable to compare against.')
+    parser.add_argument('-q', dest='qemu', type=str, required=True,
+                        help='QEMU executable to measure.')
+    parser.add_argument('guests', type=str, nargs='+',
+                        help=argparse.SUPPRESS)
+
+    args = parser.parse_args()
+    if args.runs < 1:
+        sys.exit("The number of runs must be at least 1.")
+
+    print('{:<24}{:>10}{:>14}{:>10}{:>12}{:>10}'.
+          format("Guest", "TBs", "Code bytes", "", "Time (s)", ""))
+
+    for guest_line in args.guests:
+        guest = shlex.split(guest_line)
+        name = os.path.basename(guest[0])
+        new = measure(args.qemu, guest, args.runs)
+
+        if args.baseline:
+            old = measure(args.baseline, guest, args.runs)
+            print('{:<24}{:>10}{:>14}{:>10}{:>12.3f}{:>10}'.
+                  format(name + " (base)", old["tbs"],
+                         format(old["size"], ","), "", old["time"], ""))
+        else:
+            old = {"tbs": 0, "size": 0, "time": 0}
+
+        print('{:<24}{:>10}{:>14}{:>10}{:>12.3f}{:>10}'.
+              format(name, new["tbs"], format(new["size"], ","),
+                     delta(new["size"], old["size"]),
+                     new["time"], delta(new["time"], old["time"])))
+
+
+if __name__ == "__main__":
+    main()
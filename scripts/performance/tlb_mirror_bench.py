@@ -0,0 +1,131 @@
+#!/usr/bin/env python3
+
+#  Compare the execution time of a set of system-mode guest kernels with
+#  -accel tcg,mirror-ram=off and -accel tcg,mirror-ram=on, which maps
+#  guest RAM in host memory so that loads and stores do not probe the
+#  softmmu TLB.  Typically used with TLB-miss heavy guests, such as the
+#  tlb-miss test of tests/tcg/i386.  Guest RAM is backed by memfd in both
+#  runs, as mirror-ram requires.
+#
+#  Syntax:
+#  tlb_mirror_bench.py [-h] [-n RUNS] [-m MEM] -q <qemu executable> \
+#                      [-a <qemu options>] <kernel> [<kernel> ...]
+#
+#  [-h] - Print the script arguments help message.
+#  [-n] - Number of timed runs of each kernel, the fastest is kept.
+#  [-m] - Size of guest RAM, as for -m.
+#  [-a] - Other QEMU options, such as the devices that the kernels need.
+#
+#  Example of usage:
+#  tlb_mirror_bench.py -n 5 -q ./qemu-system-i386 \
+#      -a "-device isa-debugcon,chardev=output -chardev null,id=output \
+#          -device isa-debug-exit,iobase=0xf4,iosize=0x4" \
+#      tests/tcg/i386-softmmu/tlb-miss
+#
+#  This program is free software: you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation, either version 2 of the License, or
+#  (at your option) any later version.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with this program. If not, see <https://www.gnu.org/licenses/>.
+
+import argparse
+import os
+import shlex
+import subprocess
+import sys
+import time
+
+
+def qemu_command(qemu, mem, extra, mirror, kernel):
+    """
+    Build the QEMU command line for one run.
+
+    Parameters:
+    qemu (str): QEMU executable
+    mem (str): size of guest RAM
+    extra (list): other QEMU options
+    mirror (bool): value of mirror-ram
+    kernel (str): guest kernel
+
+    Returns:
+    (list): command line
+    """
+    return [qemu, "-display", "none", "-monitor", "none",
+            "-accel", "tcg,mirror-ram=" + ("on" if mirror else "off"),
+            "-m", mem,
+            "-object", "memory-backend-memfd,id=ram,size={},share=on"
+            .format(mem),
+            "-machine", "memory-backend=ram"] + extra + ["-kernel", kernel]
+
+
+def run_time(command, runs):
+    """
+    Run the command and measure its wall time.  The guests report their
+    result with isa-debug-exit, which makes QEMU exit with 1 on success.
+
+    Parameters:
+    command (list): command line
+    runs (int): number of runs
+
+    Returns:
+    (float): fastest run, in seconds
+    """
+    best = None
+    for _ in range(runs):
+        start = time.perf_counter()
+        run = subprocess.run(command,
+                             stdout=subprocess.DEVNULL,
+                             stderr=subprocess.PIPE)
+        elapsed = time.perf_counter() - start
+        if run.returncode not in (0, 1):
+            sys.exit(run.stderr.decode("utf-8"))
+        if best is None or elapsed < best:
+            best = elapsed
+    return best
+
+
+def main():
+    # Parse the command line arguments
+    parser = argparse.ArgumentParser(
+        usage='tlb_mirror_bench.py [-h] [-n RUNS] [-m MEM] '
+        '-q <qemu executable> [-a <qemu options>] '
+        '<kernel> [<kernel> ...]')
+
+    parser.add_argument('-n', dest='runs', type=int, default=3,
+                        help='Number of timed runs of each kernel.')
+    parser.add_argument('-m', dest='mem', type=str, default="128M",
+                        help='Size of guest RAM.')
+    parser.add_argument('-q', dest='qemu', type=str, required=True,
+                        help='QEMU executable to measure.')
+    parser.add_argument('-a', dest='args', type=str, default="",
+                        help='Other QEMU options.')
+    parser.add_argument('kernels', type=str, nargs='+',
+                        help=argparse.SUPPRESS)
+
+    args = parser.parse_args()
+    if args.runs < 1:
+        sys.exit("The number of runs must be at least 1.")
+    extra = shlex.split(args.args)
+
+    print('{:<24}{:>16}{:>16}{:>10}'.
+          format("Kernel", "TLB (s)", "Mirror (s)", ""))
+
+    for kernel in args.kernels:
+        tlb = run_time(qemu_command(args.qemu, args.mem, extra,
+                                    False, kernel), args.runs)
+        mirror = run_time(qemu_command(args.qemu, args.mem, extra,
+                                       True, kernel), args.runs)
+        print('{:<24}{:>16.3f}{:>16.3f}{:>10}'.
+              format(os.path.basename(kernel), tlb, mirror,
+                     "{:+.2f}%".format((mirror - tlb) / tlb * 100)))
+
+
+if __name__ == "__main__":
+    main()
@@ -8470,6 +8470,18 @@ int x86_mmu_index_pl(CPUX86State *env, unsigned pl)
     return mmu_index_base + mmu_index_32;
 }
 
+/* Like x86_cpu_mmu_index(), from the flags of cpu_get_tb_cpu_state() */
+int x86_mmu_index_tb_flags(uint32_t flags)
+{
+    int mmu_index_32 = (flags & HF_CS64_MASK) ? 0 : 1;
+    int mmu_index_base =
+        (flags & HF_CPL_MASK) == 3 ? MMU_USER64_IDX :
+        !(flags & HF_SMAP_MASK) ? MMU_KNOSMAP64_IDX :
+        (flags & AC_MASK) ? MMU_KNOSMAP64_IDX : MMU_KSMAP64_IDX;
+
+    return mmu_index_base + mmu_index_32;
+}
+
 static int x86_cpu_mmu_index(CPUState *cs, bool ifetch)
 {
     CPUX86State *env = cpu_env(cs);
@@ -175,6 +175,13 @@ typedef struct DisasContext {
  */
 #define DISAS_EOB_RECHECK_TF   DISAS_TARGET_4
 
+/*
+ * EIP has already been updated by a near jump, which changes neither
+ * CS nor the TB flags.  Like DISAS_JUMP, but the jump cache can be
+ * probed inline.
+ */
+#define DISAS_JUMP_NEAR        DISAS_TARGET_5
+
 /* The environment in which user-only runs is constrained. */
 #ifdef CONFIG_USER_ONLY
 #define PE(S)     true
@@ -2231,6 +2238,19 @@ static void gen_bnd_jmp(DisasContext *s)
     }
 }
 
+/* Look up the TB at CS:EIP, with the TB flags of the current TB. */
+static void gen_lookup_and_goto_ptr_near(DisasContext *s)
+{
+    TCGv_i64 pc = tcg_temp_new_i64();
+
+    tcg_gen_extu_tl_i64(pc, cpu_eip);
+    if (!CODE64(s)) {
+        tcg_gen_addi_i64(pc, pc, s->cs_base);
+        tcg_gen_ext32u_i64(pc, pc);
+    }
+    translator_lookup_and_goto_ptr(&s->base, pc);
+}
+
 /*
  * Generate an end of block, including common tasks such as generating
  * single step traps, resetting the RF flag, and handling the interrupt
@@ -2260,10 +2280,19 @@ gen_eob(DisasContext *s, int mode)
         tcg_gen_exit_tb(NULL, 0);
     } else if ((s->flags & HF_TF_MASK) && mode != DISAS_EOB_INHIBIT_IRQ) {
         gen_helper_single_step(tcg_env);
-    } else if (mode == DISAS_JUMP &&
+    } else if ((mode == DISAS_JUMP || mode == DISAS_JUMP_NEAR) &&
                /* give irqs a chance to happen */
                !inhibit_reset) {
-        tcg_gen_lookup_and_goto_ptr();
+        /*
+         * Resetting RF and the BND registers changes the flags; the
+         * latter is done at runtime by gen_bnd_jmp().
+         */
+        if (mode == DISAS_JUMP_NEAR && s->flags == s->base.tb->flags &&
+            !(s->flags & (HF_RF_MASK | HF_MPX_IU_MASK))) {
+            gen_lookup_and_goto_ptr_near(s);
+        } else {
+            tcg_gen_lookup_and_goto_ptr();
+        }
     } else {
         tcg_gen_exit_tb(NULL, 0);
     }
@@ -2322,7 +2351,7 @@ static void gen_jmp_rel(DisasContext *s, MemOp ot, int diff, int tb_num)
             tcg_gen_movi_tl(cpu_eip, new_eip);
         }
         if (s->jmp_opt) {
-            gen_eob(s, DISAS_JUMP);   /* jump to another page */
+            gen_eob(s, DISAS_JUMP_NEAR);   /* jump to another page */
         } else {
             gen_eob(s, DISAS_EOB_ONLY);  /* exit to main loop */
         }
@@ -2336,6 +2365,24 @@ static void gen_jmp_rel_csize(DisasContext *s, int diff, int tb_num)
     gen_jmp_rel(s, CODE32(s) ? MO_32 : MO_16, diff, tb_num);
 }
 
+/*
+ * Unconditional jump to eip+diff, truncating the result to OT.  In a
+ * superblock, keep translating at the destination if EIP does not wrap.
+ */
+static void gen_jmp_rel_follow(DisasContext *s, MemOp ot, int diff)
+{
+    target_ulong mask = CODE64(s) ? -1 : ot == MO_16 ? 0xffff : 0xffffffff;
+    target_ulong new_pc = s->pc + diff;
+    target_ulong new_eip = new_pc - s->cs_base;
+
+    if (s->jmp_opt && (new_eip & mask) == new_eip &&
+        translator_follow_jump(&s->base, new_pc)) {
+        s->pc = new_pc;
+        return;
+    }
+    gen_jmp_rel(s, ot, diff, 0);
+}
+
 static inline void gen_ldq_env_A0(DisasContext *s, int offset)
 {
     tcg_gen_qemu_ld_i64(s->tmp1_i64, s->A0, s->mem_index, MO_LEUQ);
@@ -3728,7 +3775,7 @@ static void i386_tr_init_disas_context(DisasContextBase *dcbase, CPUState *cpu)
     dc->cc_op = CC_OP_DYNAMIC;
     dc->cc_op_dirty = false;
     /* select memory access functions */
-    dc->mem_index = cpu_mmu_index(cpu, false);
+    dc->mem_index = x86_mmu_index_tb_flags(flags);
     dc->cpuid_features = env->features[FEAT_1_EDX];
     dc->cpuid_ext_features = env->features[FEAT_1_ECX];
     dc->cpuid_ext2_features = env->features[FEAT_8000_0001_EDX];
@@ -3860,6 +3907,7 @@ static void i386_tr_tb_stop(DisasContextBase *dcbase, CPUState *cpu)
     case DISAS_EOB_ONLY:
     case DISAS_EOB_RECHECK_TF:
     case DISAS_JUMP:
+    case DISAS_JUMP_NEAR:
         gen_eob(dc, dc->base.is_jmp);
         break;
     default:
@@ -3873,6 +3921,7 @@ static const TranslatorOps i386_tr_ops = {
     .insn_start         = i386_tr_insn_start,
     .translate_insn     = i386_tr_translate_insn,
     .tb_stop            = i386_tr_tb_stop,
+    .superblocks        = true,
 };
 
 void x86_translate_code(CPUState *cpu, TranslationBlock *tb,
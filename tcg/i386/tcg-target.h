@@ -30,6 +30,7 @@
 #ifdef __x86_64__
 # define TCG_TARGET_NB_REGS   32
 # define MAX_CODE_GEN_BUFFER_SIZE  (2 * GiB)
+# define TCG_TARGET_EXT_RELOCS  1
 #else
 # define TCG_TARGET_NB_REGS   24
 # define MAX_CODE_GEN_BUFFER_SIZE  UINT32_MAX
@@ -54,8 +54,34 @@ typedef struct TempOptInfo {
     uint64_t val;
     uint64_t z_mask;  /* mask bit is 0 if and only if value bit is 0 */
     uint64_t s_mask;  /* mask bit is 1 if value bit matches msb */
+    uint32_t gen;     /* incremented each time the temp is redefined */
 } TempOptInfo;
 
+/*
+ * An operation whose result is still available in OUT, as long as
+ * neither OUT nor the inputs have been redefined since.
+ */
+#define CSE_ENTRIES   64
+#define CSE_MAX_ARGS  5
+
+typedef struct CSEEntry {
+    TCGOpcode opc;
+    TCGType type;
+    uint32_t epoch;
+    uint32_t out_gen;
+    TCGTemp *out;
+    TCGArg args[CSE_MAX_ARGS];
+    uint32_t gen[CSE_MAX_ARGS];
+} CSEEntry;
+
+/* A store to env that nothing has read yet. */
+#define MAX_PENDING_ST  8
+
+typedef struct PendingStore {
+    TCGOp *op;
+    intptr_t start, last;
+} PendingStore;
+
 typedef struct OptContext {
     TCGContext *tcg;
     TCGOp *prev_mb;
@@ -64,6 +90,14 @@ typedef struct OptContext {
     IntervalTreeRoot mem_copy;
     QSIMPLEQ_HEAD(, MemCopyInfo) mem_free;
 
+    /* Common subexpressions, within the extended basic block. */
+    uint32_t cse_epoch;
+    CSEEntry cse[CSE_ENTRIES];
+
+    /* Stores to env that may yet be overwritten. */
+    int nb_pending_st;
+    PendingStore pending_st[MAX_PENDING_ST];
+
     /* In flight values from optimization. */
     TCGType type;
 } OptContext;
@@ -138,6 +172,7 @@ static void init_ts_info(OptContext *ctx, TCGTemp *ts)
     if (ti == NULL) {
         ti = tcg_malloc(sizeof(TempOptInfo));
         ts->state_ptr = ti;
+        ti->gen = 0;
     }
 
     ti->next_copy = ts;
@@ -239,6 +274,7 @@ static void reset_ts(OptContext *ctx, TCGTemp *ts)
     ti->is_const = false;
     ti->z_mask = -1;
     ti->s_mask = 0;
+    ti->gen++;
 
     if (!QSIMPLEQ_EMPTY(&ti->mem_copy)) {
         if (ts == nts) {
@@ -322,6 +358,81 @@ static TCGTemp *find_mem_copy_for(OptContext *ctx, TCGType type, intptr_t s)
     return NULL;
 }
 
+/*
+ * Return true if a global lives in env between @start and @last.
+ * The register allocator loads globals without an op in the stream.
+ */
+static bool env_global_in(OptContext *ctx, intptr_t start, intptr_t last)
+{
+    TCGContext *s = ctx->tcg;
+    TCGTemp *env = tcgv_ptr_temp(tcg_env);
+
+    for (int i = 0; i < s->nb_globals; i++) {
+        TCGTemp *ts = &s->temps[i];
+        intptr_t ofs;
+
+        if (ts->kind != TEMP_GLOBAL) {
+            continue;
+        }
+        /* We don't know where the base points. */
+        if (ts->indirect_reg) {
+            return true;
+        }
+        ofs = ts->mem_offset;
+        if (ts->mem_base == env &&
+            ofs <= last && start <= ofs + tcg_type_size(ts->type) - 1) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Record a store to env, removing the earlier ones that it overwrites. */
+static void record_pending_st(OptContext *ctx, TCGOp *op,
+                              intptr_t start, intptr_t last)
+{
+    int i, j;
+
+    for (i = j = 0; i < ctx->nb_pending_st; i++) {
+        PendingStore *p = &ctx->pending_st[i];
+
+        if (start <= p->start && p->last <= last &&
+            !env_global_in(ctx, p->start, p->last)) {
+            tcg_op_remove(ctx->tcg, p->op);
+        } else {
+            ctx->pending_st[j++] = *p;
+        }
+    }
+
+    if (j == MAX_PENDING_ST) {
+        memmove(&ctx->pending_st[0], &ctx->pending_st[1],
+                (MAX_PENDING_ST - 1) * sizeof(PendingStore));
+        j--;
+    }
+    ctx->pending_st[j++] = (PendingStore){ op, start, last };
+    ctx->nb_pending_st = j;
+}
+
+/* Forget the stores that a load between @start and @last may read. */
+static void read_pending_st(OptContext *ctx, intptr_t start, intptr_t last)
+{
+    int i, j;
+
+    for (i = j = 0; i < ctx->nb_pending_st; i++) {
+        PendingStore *p = &ctx->pending_st[i];
+
+        if (p->last < start || last < p->start) {
+            ctx->pending_st[j++] = *p;
+        }
+    }
+    ctx->nb_pending_st = j;
+}
+
+static void read_pending_st_all(OptContext *ctx)
+{
+    ctx->nb_pending_st = 0;
+}
+
 static TCGArg arg_new_constant(OptContext *ctx, uint64_t val)
 {
     TCGType type = ctx->type;
@@ -944,6 +1055,8 @@ static void finish_bb(OptContext *ctx)
 {
     /* We only optimize memory barriers across basic blocks. */
     ctx->prev_mb = NULL;
+    /* The stores may be read on the other path. */
+    read_pending_st_all(ctx);
 }
 
 static void finish_ebb(OptContext *ctx)
@@ -952,6 +1065,7 @@ static void finish_ebb(OptContext *ctx)
     /* We only optimize across extended basic blocks. */
     memset(&ctx->temps_used, 0, sizeof(ctx->temps_used));
     remove_mem_copy_all(ctx);
+    ctx->cse_epoch++;
 }
 
 static bool finish_folding(OptContext *ctx, TCGOp *op)
@@ -1618,6 +1732,9 @@ static bool fold_call(OptContext *ctx, TCGOp *op)
         reset_temp(ctx, op->args[i]);
     }
 
+    /* The helper may read env, or raise an exception. */
+    read_pending_st_all(ctx);
+
     /* Stop optimizing MB across calls. */
     ctx->prev_mb = NULL;
     return true;
@@ -2704,30 +2821,44 @@ static bool fold_sub2(OptContext *ctx, TCGOp *op)
 static bool fold_tcg_ld(OptContext *ctx, TCGOp *op)
 {
     uint64_t z_mask = -1, s_mask = 0;
+    intptr_t ofs = op->args[2];
+    intptr_t lm1;
 
     /* We can't do any folding with a load, but we can record bits. */
     switch (op->opc) {
     CASE_OP_32_64(ld8s):
         s_mask = INT8_MIN;
+        lm1 = 0;
         break;
     CASE_OP_32_64(ld8u):
         z_mask = MAKE_64BIT_MASK(0, 8);
+        lm1 = 0;
         break;
     CASE_OP_32_64(ld16s):
         s_mask = INT16_MIN;
+        lm1 = 1;
         break;
     CASE_OP_32_64(ld16u):
         z_mask = MAKE_64BIT_MASK(0, 16);
+        lm1 = 1;
         break;
     case INDEX_op_ld32s_i64:
         s_mask = INT32_MIN;
+        lm1 = 3;
         break;
     case INDEX_op_ld32u_i64:
         z_mask = MAKE_64BIT_MASK(0, 32);
+        lm1 = 3;
         break;
     default:
         g_assert_not_reached();
     }
+
+    if (op->args[1] == tcgv_ptr_arg(tcg_env)) {
+        read_pending_st(ctx, ofs, ofs + lm1);
+    } else {
+        read_pending_st_all(ctx);
+    }
     return fold_masks_zs(ctx, op, z_mask, s_mask);
 }
 
@@ -2738,11 +2869,14 @@ static bool fold_tcg_ld_memcopy(OptContext *ctx, TCGOp *op)
     TCGType type;
 
     if (op->args[1] != tcgv_ptr_arg(tcg_env)) {
+        read_pending_st_all(ctx);
         return finish_folding(ctx, op);
     }
 
     type = ctx->type;
     ofs = op->args[2];
+    read_pending_st(ctx, ofs, ofs + tcg_type_size(type) - 1);
+
     dst = arg_temp(op->args[0]);
     src = find_mem_copy_for(ctx, type, ofs);
     if (src && src->base_type == type) {
@@ -2785,6 +2919,7 @@ static bool fold_tcg_st(OptContext *ctx, TCGOp *op)
         g_assert_not_reached();
     }
     remove_mem_copy_in(ctx, ofs, ofs + lm1);
+    record_pending_st(ctx, op, ofs, ofs + lm1);
     return true;
 }
 
@@ -2817,6 +2952,7 @@ static bool fold_tcg_st_memcopy(OptContext *ctx, TCGOp *op)
     last = ofs + tcg_type_size(type) - 1;
     remove_mem_copy_in(ctx, ofs, last);
     record_mem_copy(ctx, type, src, ofs, last);
+    record_pending_st(ctx, op, ofs, last);
     return true;
 }
 
@@ -2839,12 +2975,96 @@ static bool fold_xor(OptContext *ctx, TCGOp *op)
     return fold_masks_zs(ctx, op, z_mask, s_mask);
 }
 
+static bool cse_candidate(TCGOpcode opc, const TCGOpDef *def)
+{
+    if (def->nb_oargs != 1 ||
+        def->nb_iargs + def->nb_cargs > CSE_MAX_ARGS ||
+        (def->flags & (TCG_OPF_BB_END | TCG_OPF_CALL_CLOBBER |
+                       TCG_OPF_SIDE_EFFECTS | TCG_OPF_NOT_PRESENT |
+                       TCG_OPF_VECTOR))) {
+        return false;
+    }
+
+    /* Loads depend on memory, not only on their operands. */
+    switch (opc) {
+    CASE_OP_32_64(ld8s):
+    CASE_OP_32_64(ld8u):
+    CASE_OP_32_64(ld16s):
+    CASE_OP_32_64(ld16u):
+    case INDEX_op_ld32s_i64:
+    case INDEX_op_ld32u_i64:
+    case INDEX_op_ld_i32:
+    case INDEX_op_ld_i64:
+        return false;
+    default:
+        return true;
+    }
+}
+
+static CSEEntry *cse_slot(OptContext *ctx, const CSEEntry *key, int nb_args)
+{
+    uint64_t h = key->opc | (uint64_t)key->type << 16;
+
+    for (int i = 0; i < nb_args; i++) {
+        h = (h ^ key->args[i]) * 0x9e3779b97f4a7c15ull;
+    }
+    return &ctx->cse[(h >> 32) % CSE_ENTRIES];
+}
+
+/*
+ * Replace @op with a copy of the result of an identical operation
+ * earlier in the extended basic block, if its output and inputs
+ * have not been redefined since.  Otherwise fill in @key for
+ * cse_record().
+ */
+static bool fold_cse(OptContext *ctx, TCGOp *op, CSEEntry *key)
+{
+    const TCGOpDef *def = &tcg_op_defs[op->opc];
+    int nb_iargs = def->nb_iargs;
+    int nb_args = nb_iargs + def->nb_cargs;
+    CSEEntry *e;
+    int i;
+
+    memset(key, 0, sizeof(*key));
+    key->opc = op->opc;
+    key->type = ctx->type;
+    key->out = arg_temp(op->args[0]);
+    for (i = 0; i < nb_args; i++) {
+        key->args[i] = op->args[1 + i];
+    }
+    for (i = 0; i < nb_iargs; i++) {
+        key->gen[i] = arg_info(op->args[1 + i])->gen;
+    }
+
+    e = cse_slot(ctx, key, nb_args);
+    if (e->epoch != ctx->cse_epoch ||
+        e->opc != key->opc ||
+        e->type != key->type ||
+        memcmp(e->args, key->args, sizeof(e->args)) ||
+        memcmp(e->gen, key->gen, sizeof(e->gen)) ||
+        ts_info(e->out)->gen != e->out_gen) {
+        return false;
+    }
+    return tcg_opt_gen_mov(ctx, op, op->args[0], temp_arg(e->out));
+}
+
+/* Record the result of the operation in @key, once folded. */
+static void cse_record(OptContext *ctx, const CSEEntry *key)
+{
+    const TCGOpDef *def = &tcg_op_defs[key->opc];
+    CSEEntry *e = cse_slot(ctx, key, def->nb_iargs + def->nb_cargs);
+
+    *e = *key;
+    e->epoch = ctx->cse_epoch;
+    e->out_gen = ts_info(key->out)->gen;
+}
+
 /* Propagate constants and copies, fold constant expressions. */
 void tcg_optimize(TCGContext *s)
 {
     int nb_temps, i;
     TCGOp *op, *op_next;
-    OptContext ctx = { .tcg = s };
+    OptContext ctx = { .tcg = s, .cse_epoch = 1 };
 
     QSIMPLEQ_INIT(&ctx.mem_free);
 
@@ -2862,6 +3082,7 @@ void tcg_optimize(TCGContext *s)
         TCGOpcode opc = op->opc;
         const TCGOpDef *def;
         bool done = false;
+        CSEEntry cse_key, *cse = NULL;
 
         /* Calls are special. */
         if (opc == INDEX_op_call) {
@@ -2876,6 +3097,19 @@ void tcg_optimize(TCGContext *s)
         /* Pre-compute the type of the operation. */
         ctx.type = TCGOP_TYPE(op);
 
+        /* Ops that may read env, or raise an exception, besides loads. */
+        if (opc == INDEX_op_dupm_vec ||
+            (def->flags & (TCG_OPF_CALL_CLOBBER | TCG_OPF_SIDE_EFFECTS))) {
+            read_pending_st_all(&ctx);
+        }
+
+        if (cse_candidate(opc, def)) {
+            if (fold_cse(&ctx, op, &cse_key)) {
+                continue;
+            }
+            cse = &cse_key;
+        }
+
         /*
          * Process each opcode.
          * Sorted alphabetically by opcode as much as possible.
@@ -3086,5 +3320,9 @@ void tcg_optimize(TCGContext *s)
             break;
         }
         tcg_debug_assert(done);
+
+        if (cse) {
+            cse_record(&ctx, cse);
+        }
     }
 }
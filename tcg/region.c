@@ -28,6 +28,7 @@
 #include "qemu/mprotect.h"
 #include "qemu/memalign.h"
 #include "qemu/cacheinfo.h"
+#include "qemu/bitmap.h"
 #include "qemu/qtree.h"
 #include "qapi/error.h"
 #include "tcg/tcg.h"
@@ -57,6 +58,9 @@ struct tcg_region_tree {
  * dynamically allocate from as demand dictates. Given appropriate region
  * sizing, this minimizes flushes even when some TCG threads generate a lot
  * more code than others.
+ *
+ * When no region is free, full regions can be evicted individually instead
+ * of flushing the whole buffer; see tcg_region_evict().
  */
 struct tcg_region_state {
     QemuMutex lock;
@@ -70,10 +74,21 @@ struct tcg_region_state {
     size_t total_size; /* size of entire buffer, >= n * stride */
 
     /* fields protected by the lock */
-    size_t current; /* current region index */
+    unsigned long *free; /* regions not assigned to any context */
+    uint64_t *filled; /* generation at which a region became full, or 0 */
+    size_t *used; /* size accounted in agg_size_full for each full region */
+    uint64_t generation;
     size_t agg_size_full; /* aggregate size of full regions */
+
+    /* set without the lock when a TB of the region is looked up */
+    uint8_t *referenced;
 };
 
+/* Below this number of regions, eviction would not keep enough code around */
+#define TCG_REGION_EVICT_MIN 4
+/* Evict at most 1/TCG_REGION_EVICT_DIV of the regions at once */
+#define TCG_REGION_EVICT_DIV 4
+
 static struct tcg_region_state region;
 
 /*
@@ -191,10 +206,9 @@ static void tcg_region_trees_init(void)
     }
 }
 
-static struct tcg_region_tree *tc_ptr_to_region_tree(const void *p)
+/* Returns region.n if @p does not point into the code_gen_buffer */
+static size_t tc_ptr_to_region_idx(const void *p)
 {
-    size_t region_idx;
-
     /*
      * Like tcg_splitwx_to_rw, with no assert.  The pc may come from
      * a signal handler over which the caller has no control.
@@ -202,20 +216,28 @@ static struct tcg_region_tree *tc_ptr_to_region_tree(const void *p)
     if (!in_code_gen_buffer(p)) {
         p -= tcg_splitwx_diff;
         if (!in_code_gen_buffer(p)) {
-            return NULL;
+            return region.n;
         }
     }
 
     if (p < region.start_aligned) {
-        region_idx = 0;
+        return 0;
     } else {
         ptrdiff_t offset = p - region.start_aligned;
 
         if (offset > region.stride * (region.n - 1)) {
-            region_idx = region.n - 1;
-        } else {
-            region_idx = offset / region.stride;
+            return region.n - 1;
         }
+        return offset / region.stride;
+    }
+}
+
+static struct tcg_region_tree *tc_ptr_to_region_tree(const void *p)
+{
+    size_t region_idx = tc_ptr_to_region_idx(p);
+
+    if (region_idx == region.n) {
+        return NULL;
     }
     return region_trees + region_idx * tree_size;
 }
@@ -261,6 +283,16 @@ TranslationBlock *tcg_tb_lookup(uintptr_t tc_ptr)
     return tb;
 }
 
+void tcg_tb_mark_referenced(const TranslationBlock *tb)
+{
+    size_t region_idx = tc_ptr_to_region_idx(tb->tc.ptr);
+
+    if (region_idx < region.n &&
+        !qatomic_read(&region.referenced[region_idx])) {
+        qatomic_set(&region.referenced[region_idx], 1);
+    }
+}
+
 static void tcg_region_tree_lock_all(void)
 {
     size_t i;
@@ -311,6 +343,13 @@ size_t tcg_nb_tbs(void)
     return nb_tbs;
 }
 
+static void tcg_region_tree_reset__locked(struct tcg_region_tree *rt)
+{
+    /* Increment the refcount first so that destroy acts as a reset */
+    q_tree_ref(rt->tree);
+    q_tree_destroy(rt->tree);
+}
+
 static void tcg_region_tree_reset_all(void)
 {
     size_t i;
@@ -319,9 +358,7 @@ static void tcg_region_tree_reset_all(void)
     for (i = 0; i < region.n; i++) {
         struct tcg_region_tree *rt = region_trees + i * tree_size;
 
-        /* Increment the refcount first so that destroy acts as a reset */
-        q_tree_ref(rt->tree);
-        q_tree_destroy(rt->tree);
+        tcg_region_tree_reset__locked(rt);
     }
     tcg_region_tree_unlock_all();
 }
@@ -359,11 +396,13 @@ static void tcg_region_assign(TCGContext *s, size_t curr_region)
 
 static bool tcg_region_alloc__locked(TCGContext *s)
 {
-    if (region.current == region.n) {
+    size_t curr_region = find_first_bit(region.free, region.n);
+
+    if (curr_region == region.n) {
         return true;
     }
-    tcg_region_assign(s, region.current);
-    region.current++;
+    clear_bit(curr_region, region.free);
+    tcg_region_assign(s, curr_region);
     return false;
 }
 
@@ -374,12 +413,15 @@ static bool tcg_region_alloc__locked(TCGContext *s)
 bool tcg_region_alloc(TCGContext *s)
 {
     bool err;
-    /* read the region size now; alloc__locked will overwrite it on success */
+    /* read the region now; alloc__locked will overwrite it on success */
+    size_t full_region = tc_ptr_to_region_idx(s->code_gen_buffer);
     size_t size_full = s->code_gen_buffer_size;
 
     qemu_mutex_lock(&region.lock);
     err = tcg_region_alloc__locked(s);
     if (!err) {
+        region.filled[full_region] = ++region.generation;
+        region.used[full_region] = size_full - TCG_HIGHWATER;
         region.agg_size_full += size_full - TCG_HIGHWATER;
     }
     qemu_mutex_unlock(&region.lock);
@@ -410,7 +452,10 @@ void tcg_region_reset_all(void)
     unsigned int i;
 
     qemu_mutex_lock(&region.lock);
-    region.current = 0;
+    bitmap_set(region.free, 0, region.n);
+    memset(region.filled, 0, region.n * sizeof(*region.filled));
+    memset(region.used, 0, region.n * sizeof(*region.used));
+    memset(region.referenced, 0, region.n);
     region.agg_size_full = 0;
 
     for (i = 0; i < n_ctxs; i++) {
@@ -422,6 +467,93 @@ void tcg_region_reset_all(void)
     tcg_region_tree_reset_all();
 }
 
+bool tcg_region_can_evict(void)
+{
+    /* no need for synchronization; region.n is set at init time */
+    return region.n >= TCG_REGION_EVICT_MIN;
+}
+
+bool tcg_region_has_free(void)
+{
+    bool ret;
+
+    qemu_mutex_lock(&region.lock);
+    ret = find_first_bit(region.free, region.n) < region.n;
+    qemu_mutex_unlock(&region.lock);
+    return ret;
+}
+
+static int tcg_region_filled_cmp(const void *ap, const void *bp)
+{
+    uint64_t a = region.filled[*(const size_t *)ap];
+    uint64_t b = region.filled[*(const size_t *)bp];
+
+    return a < b ? -1 : a > b;
+}
+
+/* Call from a safe-work context */
+size_t tcg_region_evict(GTraverseFunc func, GTraverseFunc spare_func,
+                        gpointer user_data)
+{
+    size_t target = MAX(1, region.n / TCG_REGION_EVICT_DIV);
+    g_autofree size_t *cand = g_new(size_t, region.n);
+    g_autofree size_t *victims = g_new(size_t, target);
+    size_t i, nb_cand = 0, nb_victims = 0;
+
+    qemu_mutex_lock(&region.lock);
+
+    for (i = 0; i < region.n; i++) {
+        if (region.filled[i]) {
+            cand[nb_cand++] = i;
+        }
+    }
+    qsort(cand, nb_cand, sizeof(*cand), tcg_region_filled_cmp);
+
+    /*
+     * Oldest first, but give a second chance to regions whose TBs were
+     * looked up since they were last considered: they probably hold hot
+     * code that would just be translated again.
+     */
+    for (i = 0; i < nb_cand && nb_victims < target; i++) {
+        if (qatomic_xchg(&region.referenced[cand[i]], 0)) {
+            struct tcg_region_tree *rt = region_trees + cand[i] * tree_size;
+
+            region.filled[cand[i]] = ++region.generation;
+            qemu_mutex_lock(&rt->lock);
+            q_tree_foreach(rt->tree, spare_func, user_data);
+            qemu_mutex_unlock(&rt->lock);
+            continue;
+        }
+        victims[nb_victims++] = cand[i];
+        cand[i] = region.n;
+    }
+    /* If everything is hot, fall back to plain FIFO */
+    for (i = 0; i < nb_cand && nb_victims < target; i++) {
+        if (cand[i] != region.n) {
+            victims[nb_victims++] = cand[i];
+        }
+    }
+
+    for (i = 0; i < nb_victims; i++) {
+        size_t r = victims[i];
+        struct tcg_region_tree *rt = region_trees + r * tree_size;
+
+        qemu_mutex_lock(&rt->lock);
+        q_tree_foreach(rt->tree, func, user_data);
+        tcg_region_tree_reset__locked(rt);
+        qemu_mutex_unlock(&rt->lock);
+
+        region.agg_size_full -= region.used[r];
+        region.used[r] = 0;
+        region.filled[r] = 0;
+        qatomic_set(&region.referenced[r], 0);
+        set_bit(r, region.free);
+    }
+
+    qemu_mutex_unlock(&region.lock);
+    return nb_victims;
+}
+
 static size_t tcg_n_regions(size_t tb_size, unsigned max_cpus)
 {
 #ifdef CONFIG_USER_ONLY
@@ -435,9 +567,13 @@ static size_t tcg_n_regions(size_t tb_size, unsigned max_cpus)
      * being of reasonable size. If that's not possible we make do by evenly
      * dividing the code_gen_buffer among the vCPUs.
      */
-    /* Use a single region if all we have is one vCPU thread */
+    /*
+     * A single vCPU thread only ever fills one region at a time, but a
+     * few regions of >= 8 MB let the oldest code be evicted without
+     * flushing everything.
+     */
     if (max_cpus == 1 || !qemu_tcg_mttcg_enabled()) {
-        return 1;
+        return MAX(1, MIN(tb_size / (8 * MiB), 16));
     }
 
     /*
@@ -808,6 +944,11 @@ void tcg_region_init(size_t tb_size, int splitwx, unsigned max_cpus)
 
     /* init the region struct */
     qemu_mutex_init(&region.lock);
+    region.free = bitmap_new(region.n);
+    bitmap_set(region.free, 0, region.n);
+    region.filled = g_new0(uint64_t, region.n);
+    region.used = g_new0(size_t, region.n);
+    region.referenced = g_new0(uint8_t, region.n);
 
     /*
      * Set guard pages in the rw buffer, as that's the one into which
@@ -3325,8 +3325,8 @@ void tcg_gen_exit_tb(const TranslationBlock *tb, unsigned idx)
         tcg_debug_assert(tcg_ctx->goto_tb_issue_mask & (1 << idx));
 #endif
     } else {
-        /* This is an exit via the exitreq label.  */
-        tcg_debug_assert(idx == TB_EXIT_REQUESTED);
+        /* This is an exit via the exitreq or hot label.  */
+        tcg_debug_assert(idx == TB_EXIT_REQUESTED || idx == TB_EXIT_HOT);
     }
 
     tcg_gen_op1i(INDEX_op_exit_tb, 0, val);
@@ -3362,3 +3362,11 @@ void tcg_gen_lookup_and_goto_ptr(void)
     tcg_gen_op1i(INDEX_op_goto_ptr, TCG_TYPE_PTR, tcgv_ptr_arg(ptr));
     tcg_temp_free_ptr(ptr);
 }
+
+void tcg_gen_goto_ptr(TCGv_ptr ptr)
+{
+    tcg_debug_assert(!(tcg_ctx->gen_tb->cflags & CF_NO_GOTO_PTR));
+
+    plugin_gen_disable_mem_helpers();
+    tcg_gen_op1i(INDEX_op_goto_ptr, TCG_TYPE_PTR, tcgv_ptr_arg(ptr));
+}
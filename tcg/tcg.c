@@ -426,6 +426,13 @@ tlb_mask_table_ofs(TCGContext *s, int which)
             sizeof(CPUNegativeOffsetState));
 }
 
+static int __attribute__((unused))
+tlb_mirror_ofs(TCGContext *s, int which)
+{
+    return (offsetof(CPUNegativeOffsetState, tlb.d[which].mirror) -
+            sizeof(CPUNegativeOffsetState));
+}
+
 /* Signal overflow, starting over with fewer guest insns. */
 static G_NORETURN
 void tcg_raise_tb_overflow(TCGContext *s)
@@ -760,6 +767,31 @@ static void new_pool_l8(TCGContext *s, int rtype, tcg_insn_unit *label,
     new_pool_insert(s, n);
 }
 
+/*
+ * Record a reference at @where to @target, outside of the TB being
+ * generated.  References within the TB move along with it.
+ */
+__attribute__((unused))
+static void tcg_out_ext_reloc(TCGContext *s, tcg_insn_unit *where,
+                              TCGExtRelocKind kind, const void *target)
+{
+    TCGExtReloc *r;
+
+    if (!s->ext_relocs_enabled) {
+        return;
+    }
+    if (target >= tcg_splitwx_to_rx(s->gen_tb) &&
+        target <= tcg_splitwx_to_rx(s->code_ptr)) {
+        return;
+    }
+
+    r = tcg_malloc(sizeof(*r));
+    r->kind = kind;
+    r->offset = tcg_ptr_byte_diff(where, s->code_buf);
+    r->target = target;
+    QSIMPLEQ_INSERT_TAIL(&s->ext_relocs, r, next);
+}
+
 /*
  * Generate TB finalization at the end of block
  */
@@ -6403,6 +6435,7 @@ int tcg_gen_code(TCGContext *s, TranslationBlock *tb, uint64_t pc_start)
 
     QSIMPLEQ_INIT(&s->ldst_labels);
     s->pool_labels = NULL;
+    QSIMPLEQ_INIT(&s->ext_relocs);
 
     start_words = s->insn_start_words;
     s->gen_insn_data =
@@ -126,6 +126,18 @@ static void tci_args_rrs(uint32_t insn, TCGReg *r0, TCGReg *r1, int32_t *i2)
     *i2 = sextract32(insn, 16, 16);
 }
 
+/* The label is in a second word, which is consumed. */
+static void tci_args_rrcl(uint32_t insn, const uint32_t **tb_ptr,
+                          TCGReg *r0, TCGReg *r1, TCGCond *c2, void **l3)
+{
+    uint32_t label = *(*tb_ptr)++;
+
+    *r0 = extract32(insn, 8, 4);
+    *r1 = extract32(insn, 12, 4);
+    *c2 = extract32(insn, 16, 4);
+    *l3 = sextract32(label, 12, 20) + (void *)*tb_ptr;
+}
+
 static void tci_args_rrbb(uint32_t insn, TCGReg *r0, TCGReg *r1,
                           uint8_t *i2, uint8_t *i3)
 {
@@ -343,6 +355,20 @@ static void tci_qemu_st(CPUArchState *env, uint64_t taddr, uint64_t val,
 # define CASE_64(x)
 #endif
 
+/*
+ * Fetch the next instruction and jump directly to its handler, if it
+ * has an entry in the dispatch table of tcg_qemu_tb_exec, or to the
+ * switch otherwise.  Ending each frequent handler with its own indirect
+ * jump, rather than going back to a single one at the top of the loop,
+ * lets the host predict the next opcode from the current one.
+ */
+#define tci_next()                              \
+    do {                                        \
+        insn = *tb_ptr++;                       \
+        opc = extract32(insn, 0, 8);            \
+        goto *dispatch[opc];                    \
+    } while (0)
+
 /* Interpret pseudo code in tb. */
 /*
  * Disable CFI checks.
@@ -352,6 +378,62 @@ static void tci_qemu_st(CPUArchState *env, uint64_t taddr, uint64_t val,
 uintptr_t QEMU_DISABLE_CFI tcg_qemu_tb_exec(CPUArchState *env,
                                             const void *v_tb_ptr)
 {
+    static const void * const dispatch[256] = {
+        [0 ... 255] = &&do_switch,
+        [INDEX_op_br] = &&do_br,
+        [INDEX_op_setcond_i32] = &&do_setcond_i32,
+        [INDEX_op_brcond_i32] = &&do_brcond_i32,
+        [INDEX_op_mov_i32] = &&do_mov,
+        [INDEX_op_tci_movi] = &&do_tci_movi,
+        [INDEX_op_tci_movl] = &&do_tci_movl,
+        [INDEX_op_tci_addi] = &&do_tci_addi,
+        [INDEX_op_ld8u_i32] = &&do_ld8u,
+        [INDEX_op_ld_i32] = &&do_ld32u,
+        [INDEX_op_st8_i32] = &&do_st8,
+        [INDEX_op_st_i32] = &&do_st32,
+        [INDEX_op_add_i32] = &&do_add,
+        [INDEX_op_sub_i32] = &&do_sub,
+        [INDEX_op_and_i32] = &&do_and,
+        [INDEX_op_or_i32] = &&do_or,
+        [INDEX_op_xor_i32] = &&do_xor,
+        [INDEX_op_shl_i32] = &&do_shl_i32,
+        [INDEX_op_shr_i32] = &&do_shr_i32,
+        [INDEX_op_sar_i32] = &&do_sar_i32,
+        [INDEX_op_deposit_i32] = &&do_deposit_i32,
+        [INDEX_op_extract_i32] = &&do_extract_i32,
+#if TCG_TARGET_REG_BITS == 64
+        [INDEX_op_setcond_i64] = &&do_setcond_i64,
+        [INDEX_op_brcond_i64] = &&do_brcond_i64,
+        [INDEX_op_mov_i64] = &&do_mov,
+        [INDEX_op_ld8u_i64] = &&do_ld8u,
+        [INDEX_op_ld32u_i64] = &&do_ld32u,
+        [INDEX_op_ld_i64] = &&do_ld_i64,
+        [INDEX_op_st8_i64] = &&do_st8,
+        [INDEX_op_st32_i64] = &&do_st32,
+        [INDEX_op_st_i64] = &&do_st_i64,
+        [INDEX_op_add_i64] = &&do_add,
+        [INDEX_op_sub_i64] = &&do_sub,
+        [INDEX_op_and_i64] = &&do_and,
+        [INDEX_op_or_i64] = &&do_or,
+        [INDEX_op_xor_i64] = &&do_xor,
+        [INDEX_op_shl_i64] = &&do_shl_i64,
+        [INDEX_op_shr_i64] = &&do_shr_i64,
+        [INDEX_op_sar_i64] = &&do_sar_i64,
+        [INDEX_op_deposit_i64] = &&do_deposit_i64,
+        [INDEX_op_extract_i64] = &&do_extract_i64,
+        [INDEX_op_ext32s_i64] = &&do_ext32s,
+        [INDEX_op_ext_i32_i64] = &&do_ext32s,
+        [INDEX_op_ext32u_i64] = &&do_ext32u,
+        [INDEX_op_extu_i32_i64] = &&do_ext32u,
+#endif
+        [INDEX_op_exit_tb] = &&do_exit_tb,
+        [INDEX_op_goto_tb] = &&do_goto_tb,
+        [INDEX_op_goto_ptr] = &&do_goto_ptr,
+        [INDEX_op_qemu_ld_i32] = &&do_qemu_ld_i32,
+        [INDEX_op_qemu_ld_i64] = &&do_qemu_ld_i64,
+        [INDEX_op_qemu_st_i32] = &&do_qemu_st_i32,
+        [INDEX_op_qemu_st_i64] = &&do_qemu_st_i64,
+    };
     const uint32_t *tb_ptr = v_tb_ptr;
     tcg_target_ulong regs[TCG_TARGET_NB_REGS];
     uint64_t stack[(TCG_STATIC_CALL_ARGS_SIZE + TCG_STATIC_FRAME_SIZE)
@@ -375,9 +457,9 @@ uintptr_t QEMU_DISABLE_CFI tcg_qemu_tb_exec(CPUArchState *env,
         int32_t ofs;
         void *ptr;
 
-        insn = *tb_ptr++;
-        opc = extract32(insn, 0, 8);
+        tci_next();
 
+    do_switch:
         switch (opc) {
         case INDEX_op_call:
             {
@@ -433,13 +515,15 @@ uintptr_t QEMU_DISABLE_CFI tcg_qemu_tb_exec(CPUArchState *env,
             break;
 
         case INDEX_op_br:
+        do_br:
             tci_args_l(insn, tb_ptr, &ptr);
             tb_ptr = ptr;
-            continue;
+            tci_next();
         case INDEX_op_setcond_i32:
+        do_setcond_i32:
             tci_args_rrrc(insn, &r0, &r1, &r2, &condition);
             regs[r0] = tci_compare32(regs[r1], regs[r2], condition);
-            break;
+            tci_next();
         case INDEX_op_movcond_i32:
             tci_args_rrrrrc(insn, &r0, &r1, &r2, &r3, &r4, &condition);
             tmp32 = tci_compare32(regs[r1], regs[r2], condition);
@@ -454,9 +538,10 @@ uintptr_t QEMU_DISABLE_CFI tcg_qemu_tb_exec(CPUArchState *env,
             break;
 #elif TCG_TARGET_REG_BITS == 64
         case INDEX_op_setcond_i64:
+        do_setcond_i64:
             tci_args_rrrc(insn, &r0, &r1, &r2, &condition);
             regs[r0] = tci_compare64(regs[r1], regs[r2], condition);
-            break;
+            tci_next();
         case INDEX_op_movcond_i64:
             tci_args_rrrrrc(insn, &r0, &r1, &r2, &r3, &r4, &condition);
             tmp32 = tci_compare64(regs[r1], regs[r2], condition);
@@ -464,25 +549,34 @@ uintptr_t QEMU_DISABLE_CFI tcg_qemu_tb_exec(CPUArchState *env,
             break;
 #endif
         CASE_32_64(mov)
+        do_mov:
             tci_args_rr(insn, &r0, &r1);
             regs[r0] = regs[r1];
-            break;
+            tci_next();
         case INDEX_op_tci_movi:
+        do_tci_movi:
             tci_args_ri(insn, &r0, &t1);
             regs[r0] = t1;
-            break;
+            tci_next();
         case INDEX_op_tci_movl:
+        do_tci_movl:
             tci_args_rl(insn, tb_ptr, &r0, &ptr);
             regs[r0] = *(tcg_target_ulong *)ptr;
-            break;
+            tci_next();
+        case INDEX_op_tci_addi:
+        do_tci_addi:
+            tci_args_rrs(insn, &r0, &r1, &ofs);
+            regs[r0] = regs[r1] + ofs;
+            tci_next();
 
             /* Load/store operations (32 bit). */
 
         CASE_32_64(ld8u)
+        do_ld8u:
             tci_args_rrs(insn, &r0, &r1, &ofs);
             ptr = (void *)(regs[r1] + ofs);
             regs[r0] = *(uint8_t *)ptr;
-            break;
+            tci_next();
         CASE_32_64(ld8s)
             tci_args_rrs(insn, &r0, &r1, &ofs);
             ptr = (void *)(regs[r1] + ofs);
@@ -500,15 +594,17 @@ uintptr_t QEMU_DISABLE_CFI tcg_qemu_tb_exec(CPUArchState *env,
             break;
         case INDEX_op_ld_i32:
         CASE_64(ld32u)
+        do_ld32u:
             tci_args_rrs(insn, &r0, &r1, &ofs);
             ptr = (void *)(regs[r1] + ofs);
             regs[r0] = *(uint32_t *)ptr;
-            break;
+            tci_next();
         CASE_32_64(st8)
+        do_st8:
             tci_args_rrs(insn, &r0, &r1, &ofs);
             ptr = (void *)(regs[r1] + ofs);
             *(uint8_t *)ptr = regs[r0];
-            break;
+            tci_next();
         CASE_32_64(st16)
             tci_args_rrs(insn, &r0, &r1, &ofs);
             ptr = (void *)(regs[r1] + ofs);
@@ -516,37 +612,43 @@ uintptr_t QEMU_DISABLE_CFI tcg_qemu_tb_exec(CPUArchState *env,
             break;
         case INDEX_op_st_i32:
         CASE_64(st32)
+        do_st32:
             tci_args_rrs(insn, &r0, &r1, &ofs);
             ptr = (void *)(regs[r1] + ofs);
             *(uint32_t *)ptr = regs[r0];
-            break;
+            tci_next();
 
             /* Arithmetic operations (mixed 32/64 bit). */
 
         CASE_32_64(add)
+        do_add:
             tci_args_rrr(insn, &r0, &r1, &r2);
             regs[r0] = regs[r1] + regs[r2];
-            break;
+            tci_next();
         CASE_32_64(sub)
+        do_sub:
             tci_args_rrr(insn, &r0, &r1, &r2);
             regs[r0] = regs[r1] - regs[r2];
-            break;
+            tci_next();
         CASE_32_64(mul)
             tci_args_rrr(insn, &r0, &r1, &r2);
             regs[r0] = regs[r1] * regs[r2];
             break;
         CASE_32_64(and)
+        do_and:
             tci_args_rrr(insn, &r0, &r1, &r2);
             regs[r0] = regs[r1] & regs[r2];
-            break;
+            tci_next();
         CASE_32_64(or)
+        do_or:
             tci_args_rrr(insn, &r0, &r1, &r2);
             regs[r0] = regs[r1] | regs[r2];
-            break;
+            tci_next();
         CASE_32_64(xor)
+        do_xor:
             tci_args_rrr(insn, &r0, &r1, &r2);
             regs[r0] = regs[r1] ^ regs[r2];
-            break;
+            tci_next();
 #if TCG_TARGET_HAS_andc_i32 || TCG_TARGET_HAS_andc_i64
         CASE_32_64(andc)
             tci_args_rrr(insn, &r0, &r1, &r2);
@@ -620,17 +722,20 @@ uintptr_t QEMU_DISABLE_CFI tcg_qemu_tb_exec(CPUArchState *env,
             /* Shift/rotate operations (32 bit). */
 
         case INDEX_op_shl_i32:
+        do_shl_i32:
             tci_args_rrr(insn, &r0, &r1, &r2);
             regs[r0] = (uint32_t)regs[r1] << (regs[r2] & 31);
-            break;
+            tci_next();
         case INDEX_op_shr_i32:
+        do_shr_i32:
             tci_args_rrr(insn, &r0, &r1, &r2);
             regs[r0] = (uint32_t)regs[r1] >> (regs[r2] & 31);
-            break;
+            tci_next();
         case INDEX_op_sar_i32:
+        do_sar_i32:
             tci_args_rrr(insn, &r0, &r1, &r2);
             regs[r0] = (int32_t)regs[r1] >> (regs[r2] & 31);
-            break;
+            tci_next();
 #if TCG_TARGET_HAS_rot_i32
         case INDEX_op_rotl_i32:
             tci_args_rrr(insn, &r0, &r1, &r2);
@@ -642,23 +747,26 @@ uintptr_t QEMU_DISABLE_CFI tcg_qemu_tb_exec(CPUArchState *env,
             break;
 #endif
         case INDEX_op_deposit_i32:
+        do_deposit_i32:
             tci_args_rrrbb(insn, &r0, &r1, &r2, &pos, &len);
             regs[r0] = deposit32(regs[r1], pos, len, regs[r2]);
-            break;
+            tci_next();
         case INDEX_op_extract_i32:
+        do_extract_i32:
             tci_args_rrbb(insn, &r0, &r1, &pos, &len);
             regs[r0] = extract32(regs[r1], pos, len);
-            break;
+            tci_next();
         case INDEX_op_sextract_i32:
             tci_args_rrbb(insn, &r0, &r1, &pos, &len);
             regs[r0] = sextract32(regs[r1], pos, len);
             break;
         case INDEX_op_brcond_i32:
-            tci_args_rl(insn, tb_ptr, &r0, &ptr);
-            if ((uint32_t)regs[r0]) {
+        do_brcond_i32:
+            tci_args_rrcl(insn, &tb_ptr, &r0, &r1, &condition, &ptr);
+            if (tci_compare32(regs[r0], regs[r1], condition)) {
                 tb_ptr = ptr;
             }
-            break;
+            tci_next();
 #if TCG_TARGET_REG_BITS == 32 || TCG_TARGET_HAS_add2_i32
         case INDEX_op_add2_i32:
             tci_args_rrrrrr(insn, &r0, &r1, &r2, &r3, &r4, &r5);
@@ -745,15 +853,17 @@ uintptr_t QEMU_DISABLE_CFI tcg_qemu_tb_exec(CPUArchState *env,
             regs[r0] = *(int32_t *)ptr;
             break;
         case INDEX_op_ld_i64:
+        do_ld_i64:
             tci_args_rrs(insn, &r0, &r1, &ofs);
             ptr = (void *)(regs[r1] + ofs);
             regs[r0] = *(uint64_t *)ptr;
-            break;
+            tci_next();
         case INDEX_op_st_i64:
+        do_st_i64:
             tci_args_rrs(insn, &r0, &r1, &ofs);
             ptr = (void *)(regs[r1] + ofs);
             *(uint64_t *)ptr = regs[r0];
-            break;
+            tci_next();
 
             /* Arithmetic operations (64 bit). */
 
@@ -825,17 +935,20 @@ uintptr_t QEMU_DISABLE_CFI tcg_qemu_tb_exec(CPUArchState *env,
             /* Shift/rotate operations (64 bit). */
 
         case INDEX_op_shl_i64:
+        do_shl_i64:
             tci_args_rrr(insn, &r0, &r1, &r2);
             regs[r0] = regs[r1] << (regs[r2] & 63);
-            break;
+            tci_next();
         case INDEX_op_shr_i64:
+        do_shr_i64:
             tci_args_rrr(insn, &r0, &r1, &r2);
             regs[r0] = regs[r1] >> (regs[r2] & 63);
-            break;
+            tci_next();
         case INDEX_op_sar_i64:
+        do_sar_i64:
             tci_args_rrr(insn, &r0, &r1, &r2);
             regs[r0] = (int64_t)regs[r1] >> (regs[r2] & 63);
-            break;
+            tci_next();
 #if TCG_TARGET_HAS_rot_i64
         case INDEX_op_rotl_i64:
             tci_args_rrr(insn, &r0, &r1, &r2);
@@ -847,33 +960,38 @@ uintptr_t QEMU_DISABLE_CFI tcg_qemu_tb_exec(CPUArchState *env,
             break;
 #endif
         case INDEX_op_deposit_i64:
+        do_deposit_i64:
             tci_args_rrrbb(insn, &r0, &r1, &r2, &pos, &len);
             regs[r0] = deposit64(regs[r1], pos, len, regs[r2]);
-            break;
+            tci_next();
         case INDEX_op_extract_i64:
+        do_extract_i64:
             tci_args_rrbb(insn, &r0, &r1, &pos, &len);
             regs[r0] = extract64(regs[r1], pos, len);
-            break;
+            tci_next();
         case INDEX_op_sextract_i64:
             tci_args_rrbb(insn, &r0, &r1, &pos, &len);
             regs[r0] = sextract64(regs[r1], pos, len);
             break;
         case INDEX_op_brcond_i64:
-            tci_args_rl(insn, tb_ptr, &r0, &ptr);
-            if (regs[r0]) {
+        do_brcond_i64:
+            tci_args_rrcl(insn, &tb_ptr, &r0, &r1, &condition, &ptr);
+            if (tci_compare64(regs[r0], regs[r1], condition)) {
                 tb_ptr = ptr;
             }
-            break;
+            tci_next();
         case INDEX_op_ext32s_i64:
         case INDEX_op_ext_i32_i64:
+        do_ext32s:
             tci_args_rr(insn, &r0, &r1);
             regs[r0] = (int32_t)regs[r1];
-            break;
+            tci_next();
         case INDEX_op_ext32u_i64:
         case INDEX_op_extu_i32_i64:
+        do_ext32u:
             tci_args_rr(insn, &r0, &r1);
             regs[r0] = (uint32_t)regs[r1];
-            break;
+            tci_next();
 #if TCG_TARGET_HAS_bswap64_i64
         case INDEX_op_bswap64_i64:
             tci_args_rr(insn, &r0, &r1);
@@ -885,30 +1003,35 @@ uintptr_t QEMU_DISABLE_CFI tcg_qemu_tb_exec(CPUArchState *env,
             /* QEMU specific operations. */
 
         case INDEX_op_exit_tb:
+        do_exit_tb:
             tci_args_l(insn, tb_ptr, &ptr);
             return (uintptr_t)ptr;
 
         case INDEX_op_goto_tb:
+        do_goto_tb:
             tci_args_l(insn, tb_ptr, &ptr);
             tb_ptr = *(void **)ptr;
-            break;
+            tci_next();
 
         case INDEX_op_goto_ptr:
+        do_goto_ptr:
             tci_args_r(insn, &r0);
             ptr = (void *)regs[r0];
             if (!ptr) {
                 return 0;
             }
             tb_ptr = ptr;
-            break;
+            tci_next();
 
         case INDEX_op_qemu_ld_i32:
+        do_qemu_ld_i32:
             tci_args_rrm(insn, &r0, &r1, &oi);
             taddr = regs[r1];
             regs[r0] = tci_qemu_ld(env, taddr, oi, tb_ptr);
-            break;
+            tci_next();
 
         case INDEX_op_qemu_ld_i64:
+        do_qemu_ld_i64:
             if (TCG_TARGET_REG_BITS == 64) {
                 tci_args_rrm(insn, &r0, &r1, &oi);
                 taddr = regs[r1];
@@ -923,15 +1046,17 @@ uintptr_t QEMU_DISABLE_CFI tcg_qemu_tb_exec(CPUArchState *env,
             } else {
                 regs[r0] = tmp64;
             }
-            break;
+            tci_next();
 
         case INDEX_op_qemu_st_i32:
+        do_qemu_st_i32:
             tci_args_rrm(insn, &r0, &r1, &oi);
             taddr = regs[r1];
             tci_qemu_st(env, taddr, regs[r0], oi, tb_ptr);
-            break;
+            tci_next();
 
         case INDEX_op_qemu_st_i64:
+        do_qemu_st_i64:
             if (TCG_TARGET_REG_BITS == 64) {
                 tci_args_rrm(insn, &r0, &r1, &oi);
                 tmp64 = regs[r0];
@@ -943,7 +1068,7 @@ uintptr_t QEMU_DISABLE_CFI tcg_qemu_tb_exec(CPUArchState *env,
                 oi = regs[r3];
             }
             tci_qemu_st(env, taddr, tmp64, oi, tb_ptr);
-            break;
+            tci_next();
 
         case INDEX_op_mb:
             /* Ensure ordering for all kinds */
@@ -1042,9 +1167,9 @@ int print_insn_tci(bfd_vma addr, disassemble_info *info)
 
     case INDEX_op_brcond_i32:
     case INDEX_op_brcond_i64:
-        tci_args_rl(insn, tb_ptr, &r0, &ptr);
-        info->fprintf_func(info->stream, "%-12s  %s, 0, ne, %p",
-                           op_name, str_r(r0), ptr);
+        tci_args_rrcl(insn, &tb_ptr, &r0, &r1, &c, &ptr);
+        info->fprintf_func(info->stream, "%-12s  %s, %s, %s, %p",
+                           op_name, str_r(r0), str_r(r1), str_c(c), ptr);
         break;
 
     case INDEX_op_setcond_i32:
@@ -1085,6 +1210,7 @@ int print_insn_tci(bfd_vma addr, disassemble_info *info)
     case INDEX_op_st32_i64:
     case INDEX_op_st_i32:
     case INDEX_op_st_i64:
+    case INDEX_op_tci_addi:
         tci_args_rrs(insn, &r0, &r1, &s2);
         info->fprintf_func(info->stream, "%-12s  %s, %s, %d",
                            op_name, str_r(r0), str_r(r1), s2);
@@ -1243,5 +1369,5 @@ int print_insn_tci(bfd_vma addr, disassemble_info *info)
         break;
     }
 
-    return sizeof(insn);
+    return (uintptr_t)tb_ptr - addr;
 }
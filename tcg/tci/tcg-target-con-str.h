@@ -9,3 +9,9 @@
  * REGS(letter, register_mask)
  */
 REGS('r', MAKE_64BIT_MASK(0, TCG_TARGET_NB_REGS))
+
+/*
+ * Define constraint letters for constants:
+ * CONST(letter, TCG_CT_CONST_* bit set)
+ */
+CONST('I', TCG_CT_CONST_S16)
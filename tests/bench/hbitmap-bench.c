@@ -0,0 +1,103 @@
+/*
+ * QEMU HBitmap merge and serialization speed benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "qemu/hbitmap.h"
+
+typedef struct HBitmapBenchOpts {
+    uint64_t size;      /* bits */
+    unsigned stride;    /* one dirty bit every @stride bits */
+} HBitmapBenchOpts;
+
+static HBitmap *bench_bitmap_new(const HBitmapBenchOpts *opts)
+{
+    HBitmap *hb = hbitmap_alloc(opts->size, 0);
+    uint64_t i;
+
+    if (opts->stride == 1) {
+        hbitmap_set(hb, 0, opts->size);
+        return hb;
+    }
+    for (i = 0; i < opts->size; i += opts->stride) {
+        hbitmap_set(hb, i, 1);
+    }
+    return hb;
+}
+
+static void test_merge_speed(const void *opaque)
+{
+    const HBitmapBenchOpts *opts = opaque;
+    HBitmap *src = bench_bitmap_new(opts);
+    HBitmap *dst = hbitmap_alloc(opts->size, 0);
+    unsigned n = 0;
+
+    g_test_timer_start();
+    do {
+        hbitmap_merge(dst, src, dst);
+        n++;
+    } while (g_test_timer_elapsed() < 0.5);
+
+    g_test_message("merge: %" PRIu64 " Mbit, 1/%u dirty: %.0f us/merge",
+                   opts->size / MiB, opts->stride,
+                   g_test_timer_last() * 1000000 / n);
+
+    hbitmap_free(src);
+    hbitmap_free(dst);
+}
+
+static void test_serialize_speed(const void *opaque)
+{
+    const HBitmapBenchOpts *opts = opaque;
+    HBitmap *hb = bench_bitmap_new(opts);
+    uint64_t len = hbitmap_serialization_size(hb, 0, opts->size);
+    uint8_t *buf = g_malloc(len);
+    double total = 0.0;
+
+    g_test_timer_start();
+    do {
+        hbitmap_serialize_part(hb, buf, 0, opts->size);
+        total += len;
+    } while (g_test_timer_elapsed() < 0.5);
+
+    g_test_message("serialize: %" PRIu64 " Mbit, 1/%u dirty: %.0f MB/sec",
+                   opts->size / MiB, opts->stride,
+                   total / MiB / g_test_timer_last());
+
+    g_free(buf);
+    hbitmap_free(hb);
+}
+
+int main(int argc, char **argv)
+{
+    /* 16 Mbit is a 1 TiB disk with the default 64 KiB granularity */
+    static const uint64_t sizes[] = { 16 * MiB, 256 * MiB };
+    static const unsigned strides[] = { 1, 4099, 1048573 };
+    size_t i, j;
+
+    g_test_init(&argc, &argv, NULL);
+
+    for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+        for (j = 0; j < ARRAY_SIZE(strides); j++) {
+            HBitmapBenchOpts *opts = g_new(HBitmapBenchOpts, 1);
+            g_autofree char *merge_path = NULL, *serialize_path = NULL;
+
+            opts->size = sizes[i];
+            opts->stride = strides[j];
+
+            merge_path = g_strdup_printf("/hbitmap/merge/%" PRIu64 "M/%u",
+                                         sizes[i] / MiB, strides[j]);
+            serialize_path = g_strdup_printf("/hbitmap/serialize/%" PRIu64
+                                             "M/%u", sizes[i] / MiB,
+                                             strides[j]);
+            g_test_add_data_func(merge_path, opts, test_merge_speed);
+            g_test_add_data_func(serialize_path, opts, test_serialize_speed);
+        }
+    }
+
+    return g_test_run();
+}
@@ -20,6 +20,9 @@
 #include "libqos/qgraph.h"
 #include "libqos/vhost-user-blk.h"
 #include "libqos/libqos-pc.h"
+#include "libqmp.h"
+#include "qobject/qdict.h"
+#include "qobject/qlist.h"
 
 #define TEST_IMAGE_SIZE         (64 * 1024 * 1024)
 #define QVIRTIO_BLK_TIMEOUT_US  (30 * 1000 * 1000)
@@ -27,6 +30,7 @@
 
 typedef struct {
     pid_t pid;
+    int qmp_fd;
 } QemuStorageDaemonState;
 
 typedef struct QVirtioBlkReq {
@@ -764,6 +768,169 @@ static void multiqueue(void *obj, void *data, QGuestAllocator *t_alloc)
     qpci_unplug_acpi_device_test(qts, "drv1", PCI_SLOT_HP);
 }
 
+/* Submits a one sector request on @vq and waits for it to complete */
+static void queue_rw(QVirtioDevice *dev, QGuestAllocator *alloc,
+                     QVirtQueue *vq, uint32_t type, uint64_t sector,
+                     char *data)
+{
+    QVirtioBlkReq req;
+    uint64_t req_addr;
+    uint32_t free_head;
+    QTestState *qts = global_qtest;
+
+    req.type = type;
+    req.ioprio = 1;
+    req.sector = sector;
+    req.data = g_malloc0(512);
+    if (type == VIRTIO_BLK_T_OUT) {
+        strcpy(req.data, data);
+    }
+
+    req_addr = virtio_blk_request(alloc, dev, &req, 512);
+
+    g_free(req.data);
+
+    free_head = qvirtqueue_add(qts, vq, req_addr, 16, false, true);
+    qvirtqueue_add(qts, vq, req_addr + 16, 512, type == VIRTIO_BLK_T_IN,
+                   true);
+    qvirtqueue_add(qts, vq, req_addr + 528, 1, true, false);
+
+    qvirtqueue_kick(qts, dev, vq, free_head);
+
+    qvirtio_wait_used_elem(qts, dev, vq, free_head, NULL,
+                           QVIRTIO_BLK_TIMEOUT_US);
+    g_assert_cmpint(readb(req_addr + 528), ==, 0);
+
+    if (type == VIRTIO_BLK_T_IN) {
+        qtest_memread(qts, req_addr + 16, data, 512);
+    }
+
+    guest_free(alloc, req_addr);
+}
+
+/* Returns the per-virtqueue counters of export @id */
+static QList *qsd_query_queues(QemuStorageDaemonState *qsd, const char *id)
+{
+    QDict *rsp;
+    QList *exports, *queues = NULL;
+    QListEntry *e;
+
+    rsp = qmp_fd(qsd->qmp_fd, "{'execute': 'query-block-exports'}");
+    g_assert(!qmp_rsp_is_err(rsp));
+    exports = qdict_get_qlist(rsp, "return");
+
+    QLIST_FOREACH_ENTRY(exports, e) {
+        QDict *exp = qobject_to(QDict, qlist_entry_obj(e));
+
+        if (!strcmp(qdict_get_str(exp, "id"), id)) {
+            queues = qdict_get_qlist(exp, "queues");
+            qobject_ref(queues);
+        }
+    }
+    qobject_unref(rsp);
+
+    g_assert_nonnull(queues);
+    return queues;
+}
+
+/*
+ * Submit requests on every virtqueue of a device whose export spreads its
+ * virtqueues over several iothreads, and check the per-virtqueue counters
+ * reported by the storage daemon.
+ */
+static void multiqueue_iothreads(void *obj, void *data,
+                                 QGuestAllocator *t_alloc)
+{
+    QVirtioPCIDevice *pdev1 = obj;
+    QemuStorageDaemonState *qsd = data;
+    QVirtioPCIDevice *pdev4;
+    QVirtioDevice *dev4;
+    QVirtQueue *vq[4];
+    QTestState *qts = pdev1->pdev->bus->qts;
+    QList *queues;
+    QListEntry *e;
+    QDict *rsp;
+    uint64_t features;
+    char buf[512];
+    int i;
+
+    if (pdev1->pdev->bus->not_hotpluggable) {
+        g_test_skip("bus pci.0 does not support hotplug");
+        return;
+    }
+
+    rsp = qmp_fd_receive(qsd->qmp_fd); /* greeting */
+    qobject_unref(rsp);
+    rsp = qmp_fd(qsd->qmp_fd, "{'execute': 'qmp_capabilities'}");
+    g_assert(!qmp_rsp_is_err(rsp));
+    qobject_unref(rsp);
+
+    qtest_qmp_device_add(qts, "vhost-user-blk-pci", "drv1",
+                         "{'addr': %s, 'chardev': 'char2', 'num-queues': 4}",
+                         stringify(PCI_SLOT_HP) ".0");
+
+    pdev4 = virtio_pci_new(pdev1->pdev->bus,
+                           &(QPCIAddress) {
+                               .devfn = QPCI_DEVFN(PCI_SLOT_HP, 0)
+                           });
+    g_assert_nonnull(pdev4);
+    qos_object_start_hw(&pdev4->obj);
+
+    dev4 = &pdev4->vdev;
+    features = qvirtio_get_features(dev4);
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                            (1u << VIRTIO_RING_F_INDIRECT_DESC) |
+                            (1u << VIRTIO_RING_F_EVENT_IDX) |
+                            (1u << VIRTIO_F_NOTIFY_ON_EMPTY) |
+                            (1u << VIRTIO_BLK_F_SCSI));
+    qvirtio_set_features(dev4, features);
+
+    for (i = 0; i < ARRAY_SIZE(vq); i++) {
+        vq[i] = qvirtqueue_setup(dev4, t_alloc, i);
+    }
+    qvirtio_set_driver_ok(dev4);
+
+    /* Each virtqueue writes its own sector and reads back the next one's */
+    for (i = 0; i < ARRAY_SIZE(vq); i++) {
+        snprintf(buf, sizeof(buf), "TEST%d", i);
+        queue_rw(dev4, t_alloc, vq[i], VIRTIO_BLK_T_OUT, i, buf);
+    }
+    for (i = 0; i < ARRAY_SIZE(vq); i++) {
+        char expected[16];
+
+        snprintf(expected, sizeof(expected), "TEST%d",
+                 (int)((i + 1) % ARRAY_SIZE(vq)));
+        queue_rw(dev4, t_alloc, vq[i], VIRTIO_BLK_T_IN,
+                 (i + 1) % ARRAY_SIZE(vq), buf);
+        g_assert_cmpstr(buf, ==, expected);
+    }
+
+    queues = qsd_query_queues(qsd, "disk1");
+    g_assert_cmpint(qlist_size(queues), ==, ARRAY_SIZE(vq));
+    i = 0;
+    QLIST_FOREACH_ENTRY(queues, e) {
+        QDict *q = qobject_to(QDict, qlist_entry_obj(e));
+
+        g_assert_cmpint(qdict_get_int(q, "index"), ==, i);
+        g_assert_cmpint(qdict_get_int(q, "rd-operations"), ==, 1);
+        g_assert_cmpint(qdict_get_int(q, "wr-operations"), ==, 1);
+        g_assert_cmpint(qdict_get_int(q, "rd-bytes"), ==, 512);
+        g_assert_cmpint(qdict_get_int(q, "wr-bytes"), ==, 512);
+        g_assert_cmpint(qdict_get_int(q, "failed-operations"), ==, 0);
+        i++;
+    }
+    qobject_unref(queues);
+
+    for (i = 0; i < ARRAY_SIZE(vq); i++) {
+        qvirtqueue_cleanup(dev4->bus, vq[i], t_alloc);
+    }
+    qvirtio_pci_device_disable(pdev4);
+    qos_object_destroy(&pdev4->obj);
+
+    /* unplug secondary disk */
+    qpci_unplug_acpi_device_test(qts, "drv1", PCI_SLOT_HP);
+}
+
 /*
  * Check that setting the vring addr on a non-existent virtqueue does
  * not crash.
@@ -874,6 +1041,7 @@ static void quit_storage_daemon(void *data)
     /* Before quitting storage-daemon, quit qemu to avoid dubious messages */
     qtest_kill_qemu(global_qtest);
 
+    close(qsd->qmp_fd);
     kill(qsd->pid, SIGTERM);
     pid = waitpid(qsd->pid, &wstatus, 0);
     g_assert_cmpint(pid, ==, qsd->pid);
@@ -892,18 +1060,38 @@ static void quit_storage_daemon(void *data)
     g_free(data);
 }
 
-static void start_vhost_user_blk(GString *cmd_line, int vus_instances,
-                                 int num_queues)
+/*
+ * Starts qemu-storage-daemon with @vus_instances vhost-user-blk exports. If
+ * @num_iothreads is not 0, the virtqueues of each export are spread over that
+ * many iothreads.
+ */
+static QemuStorageDaemonState *start_vhost_user_blk(GString *cmd_line,
+                                                    int vus_instances,
+                                                    int num_queues,
+                                                    int num_iothreads)
 {
     const char *vhost_user_blk_bin = qtest_qemu_storage_daemon_binary();
-    int i;
+    int i, ret;
+    int qmp_fds[2];
     gchar *img_path;
     GString *storage_daemon_command = g_string_new(NULL);
+    GString *export_iothreads = g_string_new(NULL);
     QemuStorageDaemonState *qsd;
 
+    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, qmp_fds);
+    g_assert_cmpint(ret, !=, -1);
+
     g_string_append_printf(storage_daemon_command,
-                           "exec %s ",
-                           vhost_user_blk_bin);
+                           "exec %s "
+                           "--chardev socket,id=qmp,fd=%d --monitor qmp ",
+                           vhost_user_blk_bin, qmp_fds[1]);
+
+    for (i = 0; i < num_iothreads; i++) {
+        g_string_append_printf(storage_daemon_command,
+                               "--object iothread,id=iothread%d ", i);
+        g_string_append_printf(export_iothreads, ",iothread.%d=iothread%d",
+                               i, i);
+    }
 
     g_string_append_printf(cmd_line,
             " -object memory-backend-shm,id=mem,size=256M "
@@ -918,8 +1106,8 @@ static void start_vhost_user_blk(GString *cmd_line, int vus_instances,
         g_string_append_printf(storage_daemon_command,
             "--blockdev driver=file,node-name=disk%d,filename=%s "
             "--export type=vhost-user-blk,id=disk%d,addr.type=fd,addr.str=%d,"
-            "node-name=disk%i,writable=on,num-queues=%d ",
-            i, img_path, i, fd, i, num_queues);
+            "node-name=disk%i,writable=on,num-queues=%d%s ",
+            i, img_path, i, fd, i, num_queues, export_iothreads->str);
 
         g_string_append_printf(cmd_line, "-chardev socket,id=char%d,path=%s ",
                                i + 1, sock_path);
@@ -942,18 +1130,22 @@ static void start_vhost_user_blk(GString *cmd_line, int vus_instances,
         exit(1);
     }
     g_string_free(storage_daemon_command, true);
+    g_string_free(export_iothreads, true);
+    close(qmp_fds[1]);
 
     qsd = g_new(QemuStorageDaemonState, 1);
     qsd->pid = pid;
+    qsd->qmp_fd = qmp_fds[0];
 
     /* Make sure qemu-storage-daemon is stopped */
     qtest_add_abrt_handler(quit_storage_daemon, qsd);
     g_test_queue_destroy(quit_storage_daemon, qsd);
+    return qsd;
 }
 
 static void *vhost_user_blk_test_setup(GString *cmd_line, void *arg)
 {
-    start_vhost_user_blk(cmd_line, 1, 1);
+    start_vhost_user_blk(cmd_line, 1, 1, 0);
     return arg;
 }
 
@@ -967,16 +1159,21 @@ static void *vhost_user_blk_test_setup(GString *cmd_line, void *arg)
 static void *vhost_user_blk_hotplug_test_setup(GString *cmd_line, void *arg)
 {
     /* "-chardev socket,id=char2" is used for pci_hotplug*/
-    start_vhost_user_blk(cmd_line, 2, 1);
+    start_vhost_user_blk(cmd_line, 2, 1, 0);
     return arg;
 }
 
 static void *vhost_user_blk_multiqueue_test_setup(GString *cmd_line, void *arg)
 {
-    start_vhost_user_blk(cmd_line, 2, 8);
+    start_vhost_user_blk(cmd_line, 2, 8, 0);
     return arg;
 }
 
+static void *vhost_user_blk_iothreads_test_setup(GString *cmd_line, void *arg)
+{
+    return start_vhost_user_blk(cmd_line, 2, 4, 3);
+}
+
 static void register_vhost_user_blk_test(void)
 {
     QOSGraphTestOptions opts = {
@@ -1009,6 +1206,10 @@ static void register_vhost_user_blk_test(void)
 
     opts.before = vhost_user_blk_multiqueue_test_setup;
     qos_add_test("multiqueue", "vhost-user-blk-pci", multiqueue, &opts);
+
+    opts.before = vhost_user_blk_iothreads_test_setup;
+    qos_add_test("multiqueue-iothreads", "vhost-user-blk-pci",
+                 multiqueue_iothreads, &opts);
 }
 
 libqos_init(register_vhost_user_blk_test);
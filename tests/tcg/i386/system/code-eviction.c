@@ -0,0 +1,95 @@
+/*
+ * Code buffer eviction test
+ *
+ * Runs many copies of a small function, so that their translations do
+ * not fit in a small code buffer (-accel tcg,tb-size=32) and the oldest
+ * regions are evicted.  Every copy returns a value derived from its own
+ * address, and the copies are run again after some of them have been
+ * modified, so evicted TBs must be translated again from the current
+ * code and must not be found through stale page lists.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include <stdint.h>
+#include <minilib.h>
+
+#define CODE_SIZE    (8 * 1024 * 1024)
+#define STRIDE       32
+#define NB_COPIES    (CODE_SIZE / STRIDE)
+#define MUL          0x9e3779b9u
+#define XOR          0x5a5a5a5au
+
+/*
+ * uint32_t copy(void): returns (address of label 1) * MUL ^ imm, where imm
+ * is initially XOR.  The call ends the first TB, the ret the second one.
+ */
+asm(".pushsection .text\n"
+    "code_template:\n"
+    "    call 1f\n"
+    "1:  pop %eax\n"
+    "    imul $0x9e3779b9, %eax, %eax\n"
+    "    .byte 0x35\n"
+    "code_template_imm:\n"
+    "    .long 0x5a5a5a5a\n"
+    "    ret\n"
+    "code_template_end:\n"
+    ".popsection");
+
+extern uint8_t code_template[], code_template_imm[], code_template_end[];
+
+static uint8_t code[CODE_SIZE] __attribute__((aligned(4096)));
+
+static uint32_t expected(uint32_t i, uint32_t imm)
+{
+    uint32_t label = (uint32_t)(uintptr_t)&code[i * STRIDE] + 5;
+
+    return label * MUL ^ imm;
+}
+
+static int run_all(int pass, uint32_t odd_imm)
+{
+    uint32_t i;
+
+    for (i = 0; i < NB_COPIES; i++) {
+        uint32_t (*f)(void) = (uint32_t (*)(void))&code[i * STRIDE];
+        uint32_t want = expected(i, i & 1 ? odd_imm : XOR);
+        uint32_t got = f();
+
+        if (got != want) {
+            ml_printf("FAIL: pass %d, copy %d returned %x, expected %x\n",
+                      pass, i, got, want);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int main(void)
+{
+    uint32_t template_size = code_template_end - code_template;
+    uint32_t imm_offset = code_template_imm - code_template;
+    uint32_t i, j;
+
+    for (i = 0; i < NB_COPIES; i++) {
+        for (j = 0; j < template_size; j++) {
+            code[i * STRIDE + j] = code_template[j];
+        }
+    }
+
+    /* Fill the code buffer, then run the evicted copies again */
+    if (run_all(1, XOR) || run_all(2, XOR)) {
+        return 1;
+    }
+
+    /* Modify the odd copies, whether their TBs were evicted or not */
+    for (i = 1; i < NB_COPIES; i += 2) {
+        *(uint32_t *)&code[i * STRIDE + imm_offset] = ~XOR;
+    }
+    if (run_all(3, ~XOR)) {
+        return 1;
+    }
+
+    ml_printf("PASS: %d copies\n", NB_COPIES);
+    return 0;
+}
@@ -0,0 +1,96 @@
+/*
+ * Superblock test
+ *
+ * Runs a small function, whose code continues past an unconditional jump
+ * and a call, often enough for it to be retranslated as a superblock
+ * (-accel tcg,superblock-threshold=16).  The immediates on both sides of
+ * the jump are modified while the function is hot, so the superblock must
+ * be invalidated like any other TB when any of the code it covers is
+ * written.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include <stdint.h>
+#include <minilib.h>
+
+#define NB_CALLS    4096
+#define PATCH_EVERY 64
+
+/*
+ * uint32_t func(void): returns (A + B) ^ C.  B follows a jump, and C is
+ * in a function that is called.
+ */
+asm(".pushsection .text\n"
+    "code_template:\n"
+    "    .byte 0xb8\n"                  /* mov $A, %eax */
+    "code_template_a:\n"
+    "    .long 0\n"
+    "    jmp 1f\n"
+    "    .fill 8, 1, 0xcc\n"
+    "1:  .byte 0x05\n"                  /* add $B, %eax */
+    "code_template_b:\n"
+    "    .long 0\n"
+    "    call 2f\n"
+    "    ret\n"
+    "2:  .byte 0x35\n"                  /* xor $C, %eax */
+    "code_template_c:\n"
+    "    .long 0\n"
+    "    ret\n"
+    "code_template_end:\n"
+    ".popsection");
+
+extern uint8_t code_template[], code_template_end[];
+extern uint8_t code_template_a[], code_template_b[], code_template_c[];
+
+static uint8_t code[4096] __attribute__((aligned(4096)));
+
+static void patch(uint8_t *field, uint32_t value)
+{
+    *(uint32_t *)&code[field - code_template] = value;
+}
+
+int main(void)
+{
+    uint32_t (*func)(void) = (uint32_t (*)(void))code;
+    uint32_t template_size = code_template_end - code_template;
+    uint32_t a = 0, b = 0, c = 0;
+    uint32_t i;
+
+    for (i = 0; i < template_size; i++) {
+        code[i] = code_template[i];
+    }
+
+    for (i = 0; i < NB_CALLS; i++) {
+        uint32_t want, got;
+
+        /* Let the function become hot again between modifications */
+        if (i % PATCH_EVERY == 0) {
+            switch (i / PATCH_EVERY % 3) {
+            case 0:
+                a = i * 0x9e3779b9u;
+                patch(code_template_a, a);
+                break;
+            case 1:
+                b = i * 0x85ebca6bu;
+                patch(code_template_b, b);
+                break;
+            case 2:
+                c = i * 0xc2b2ae35u;
+                patch(code_template_c, c);
+                break;
+            }
+        }
+
+        want = (a + b) ^ c;
+        got = func();
+        if (got != want) {
+            ml_printf("FAIL: call %d returned %x, expected %x\n",
+                      i, got, want);
+            return 1;
+        }
+    }
+
+    ml_printf("PASS: %d calls\n", NB_CALLS);
+    return 0;
+}
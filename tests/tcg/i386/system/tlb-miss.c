@@ -0,0 +1,184 @@
+/*
+ * TLB miss benchmark
+ *
+ * Random loads and stores over a buffer that is much larger than the
+ * softmmu TLB, to compare -accel tcg,mirror-ram=off and on (see
+ * scripts/performance/tlb_mirror_bench.py).  Paging is enabled, and every
+ * store writes a new value that the loads check, so that the test also
+ * checks the mirror:
+ *
+ *  - a window page is mapped in turn to pages of the buffer, and the TLB
+ *    flushed with invlpg or a CR3 reload, so that stale mappings of the
+ *    window would be read or written;
+ *  - the window is also mapped to a page of code, which is modified
+ *    through it and run, for writes to clean pages and code invalidation;
+ *  - a few reads of the BIOS, which is not mirrored, go through the
+ *    fallback.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include <stdint.h>
+#include <minilib.h>
+
+#define BUF_SIZE        (32 * 1024 * 1024)
+#define NB_WORDS        (BUF_SIZE / sizeof(uint32_t))
+#define NB_ACCESSES     (4 * 1024 * 1024)
+#define BIOS_RESET      0xffff0
+
+#define PAGE_SIZE       4096
+#define WORDS_PER_PAGE  (PAGE_SIZE / sizeof(uint32_t))
+#define PTE_PRESENT     0x1
+#define PTE_WRITE       0x2
+#define IDENTITY_SIZE   (64 * 1024 * 1024)
+#define WINDOW          0x8000000   /* outside of the identity mapping */
+#define REMAP_EVERY     0xffff      /* mask of the access count */
+
+static uint32_t buf[NB_WORDS];
+static uint8_t gen[NB_WORDS];      /* stores to each word */
+
+static uint32_t page_dir[1024] __attribute__((aligned(PAGE_SIZE)));
+static uint32_t page_tables[IDENTITY_SIZE / PAGE_SIZE]
+    __attribute__((aligned(PAGE_SIZE)));
+static uint32_t window_table[1024] __attribute__((aligned(PAGE_SIZE)));
+static uint8_t code[PAGE_SIZE] __attribute__((aligned(PAGE_SIZE)));
+
+static uint32_t pattern(uint32_t i)
+{
+    return i * 0x9e3779b9u;
+}
+
+static uint32_t expected(uint32_t i)
+{
+    return pattern(i) + gen[i] * 0x01000193u;
+}
+
+static void store(volatile uint32_t *p, uint32_t i)
+{
+    gen[i]++;
+    *p = expected(i);
+}
+
+static void setup_paging(void)
+{
+    uint32_t i;
+
+    for (i = 0; i < IDENTITY_SIZE / PAGE_SIZE; i++) {
+        page_tables[i] = i * PAGE_SIZE | PTE_WRITE | PTE_PRESENT;
+    }
+    for (i = 0; i < IDENTITY_SIZE >> 22; i++) {
+        page_dir[i] = (uint32_t)(uintptr_t)&page_tables[i * 1024] |
+                      PTE_WRITE | PTE_PRESENT;
+    }
+    page_dir[WINDOW >> 22] = (uint32_t)(uintptr_t)window_table |
+                             PTE_WRITE | PTE_PRESENT;
+
+    asm volatile("mov %0, %%cr3\n"
+                 "mov %%cr0, %%eax\n"
+                 "or $0x80000000, %%eax\n"  /* PG */
+                 "mov %%eax, %%cr0"
+                 : : "r"(page_dir) : "eax", "memory");
+}
+
+/* Map the window to @page, and flush it from the TLB one way or another */
+static volatile uint32_t *map_window(void *page, uint32_t n)
+{
+    window_table[0] = (uint32_t)(uintptr_t)page | PTE_WRITE | PTE_PRESENT;
+    if (n & (REMAP_EVERY + 1)) {
+        asm volatile("invlpg (%0)" : : "r"(WINDOW) : "memory");
+    } else {
+        asm volatile("mov %%cr3, %%eax\n"
+                     "mov %%eax, %%cr3" : : : "eax", "memory");
+    }
+    return (volatile uint32_t *)WINDOW;
+}
+
+/* mov $imm32, %eax; ret */
+static uint32_t run_code(void)
+{
+    return ((uint32_t (*)(void))code)();
+}
+
+/* Read and write a few words of the page of word @i through the window */
+static int check_window(uint32_t i, uint32_t n)
+{
+    uint32_t base = i & ~(WORDS_PER_PAGE - 1);
+    volatile uint32_t *w = map_window(&buf[base], n);
+    uint32_t j, k;
+
+    for (k = 0; k < 8; k++) {
+        j = (i + k * 131) & (WORDS_PER_PAGE - 1);
+        if (w[j] != expected(base + j)) {
+            ml_printf("FAIL: word %d is %x through the window, expected %x\n",
+                      base + j, w[j], expected(base + j));
+            return 1;
+        }
+        store(&w[j], base + j);
+        if (buf[base + j] != expected(base + j)) {
+            ml_printf("FAIL: word %d is %x after a store through the window, "
+                      "expected %x\n", base + j, buf[base + j],
+                      expected(base + j));
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Modify the code through the window, and then run it */
+static int check_code(uint32_t n)
+{
+    volatile uint8_t *w = (volatile uint8_t *)map_window(code, n);
+    uint32_t got;
+
+    *(volatile uint32_t *)(w + 1) = n;
+    got = run_code();
+    if (got != n) {
+        ml_printf("FAIL: code returned %x after it was modified to return %x\n",
+                  got, n);
+        return 1;
+    }
+    return 0;
+}
+
+int main(void)
+{
+    volatile uint8_t *bios = (volatile uint8_t *)BIOS_RESET;
+    uint32_t x = 0x12345678;
+    uint32_t i, n;
+    uint8_t b;
+
+    setup_paging();
+
+    for (i = 0; i < NB_WORDS; i++) {
+        buf[i] = expected(i);
+    }
+    code[0] = 0xb8;
+    code[5] = 0xc3;
+
+    b = *bios;
+    for (n = 0; n < NB_ACCESSES; n++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        i = x & (NB_WORDS - 1);
+        if (buf[i] != expected(i)) {
+            ml_printf("FAIL: word %d is %x, expected %x\n",
+                      i, buf[i], expected(i));
+            return 1;
+        }
+        store(&buf[i ^ 1], i ^ 1);
+
+        if ((n & REMAP_EVERY) == 0) {
+            if (check_window(i, n) || check_code(n)) {
+                return 1;
+            }
+            if (*bios != b) {
+                ml_printf("FAIL: BIOS byte changed from %x to %x\n", b, *bios);
+                return 1;
+            }
+        }
+    }
+
+    ml_printf("PASS: %d random accesses\n", NB_ACCESSES);
+    return 0;
+}
@@ -0,0 +1,255 @@
+/*
+ * User and kernel mode test
+ *
+ * Runs the same code in ring 3 and in ring 0.  The code branches over a
+ * load from a page that only the kernel may access, so that the load is
+ * translated ahead of time, e.g. by -accel tcg,translate-threads=n, while
+ * the vCPU returns to the kernel.  The load must fault in user mode and
+ * succeed in kernel mode however it was translated.
+ *
+ * Then the kernel modifies code that is translated ahead in the same way,
+ * and runs it at once: it must see the new code.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include <stdint.h>
+#include <minilib.h>
+
+#define CODE_SIZE   (32 * 1024)
+#define STRIDE      32
+#define NB_COPIES   (CODE_SIZE / STRIDE)
+
+#define KERNEL_CS   0x08
+#define KERNEL_DS   0x10
+#define TSS_SEL     0x28
+
+#define SECRET_ADDR 0x800000    /* first page of the third 4MiB page */
+#define SECRET      0x5ec7e700u
+#define FAULT       0xffffffffu
+
+/*
+ * Copied NB_COPIES times.  With ECX == 0, return to the kernel at once,
+ * otherwise load from EBX first.  Either way, return the value of EAX.
+ */
+asm(".pushsection .text\n"
+    "code_template:\n"
+    "    test %ecx, %ecx\n"
+    "    jnz 1f\n"
+    "    int $0x80\n"
+    "1:  mov (%ebx), %eax\n"
+    "    int $0x80\n"
+    "code_template_end:\n"
+    ".popsection");
+
+/*
+ * uint32_t enter_code(void *code, uint32_t ecx, const void *ebx, int user)
+ *
+ * Jump to @code in ring 0 or ring 3.  Returns the value that the code
+ * passes to int $0x80 in EAX, or FAULT if it raised an exception.
+ */
+asm(".pushsection .text\n"
+    "enter_code:\n"
+    "    push %ebp\n"
+    "    push %ebx\n"
+    "    push %esi\n"
+    "    push %edi\n"
+    "    mov %esp, kernel_esp\n"
+    "    mov 20(%esp), %edx\n"
+    "    mov 24(%esp), %ecx\n"
+    "    mov 28(%esp), %ebx\n"
+    "    xor %eax, %eax\n"
+    "    cmpl $0, 32(%esp)\n"
+    "    jne 1f\n"
+    "    jmp *%edx\n"
+    "1:  mov $0x23, %eax\n"
+    "    mov %eax, %ds\n"
+    "    mov %eax, %es\n"
+    "    push $0x23\n"
+    "    push $user_stack + 4096\n"
+    "    pushf\n"
+    "    push $0x1b\n"
+    "    push %edx\n"
+    "    iret\n"
+    "trap_fault:\n"
+    "    mov $0xffffffff, %eax\n"
+    "trap_syscall:\n"
+    "    mov $0x10, %edx\n"
+    "    mov %edx, %ds\n"
+    "    mov %edx, %es\n"
+    "    mov %edx, %fs\n"
+    "    mov %edx, %gs\n"
+    "    mov kernel_esp, %esp\n"
+    "    pop %edi\n"
+    "    pop %esi\n"
+    "    pop %ebx\n"
+    "    pop %ebp\n"
+    "    ret\n"
+    ".popsection");
+
+/*
+ * Copied NB_COPIES times too.  With ECX == 0, return at once, otherwise
+ * return the immediate at smc_template_imm, which is modified in between.
+ */
+asm(".pushsection .text\n"
+    "smc_template:\n"
+    "    test %ecx, %ecx\n"
+    "    jnz 1f\n"
+    "    int $0x80\n"
+    "1:  .byte 0xb8\n"                  /* mov $imm, %eax */
+    "smc_template_imm:\n"
+    "    .long 0\n"
+    "    int $0x80\n"
+    "smc_template_end:\n"
+    ".popsection");
+
+extern uint8_t code_template[], code_template_end[];
+extern uint8_t smc_template[], smc_template_imm[], smc_template_end[];
+extern uint8_t trap_fault[], trap_syscall[];
+uint32_t enter_code(void *code, uint32_t ecx, const void *ebx, int user);
+
+uint32_t kernel_esp;
+uint8_t user_stack[4096] __attribute__((aligned(16)));
+
+static uint8_t trap_stack[4096] __attribute__((aligned(16)));
+static uint8_t code[CODE_SIZE] __attribute__((aligned(4096)));
+static uint8_t smc_code[CODE_SIZE] __attribute__((aligned(4096)));
+static uint32_t page_dir[1024] __attribute__((aligned(4096)));
+static uint32_t tss[26];
+static uint64_t gdt[6];
+static uint64_t idt[256];
+
+static struct {
+    uint16_t limit;
+    uint32_t base;
+} __attribute__((packed)) gdtr, idtr;
+
+static uint64_t segment(uint32_t base, uint32_t limit, uint8_t access,
+                        uint8_t flags)
+{
+    return (limit & 0xffff) | (uint64_t)(base & 0xffffff) << 16 |
+           (uint64_t)access << 40 | (uint64_t)((limit >> 16) & 0xf) << 48 |
+           (uint64_t)flags << 52 | (uint64_t)(base >> 24) << 56;
+}
+
+static uint64_t gate(void *handler, uint8_t access)
+{
+    uint32_t offset = (uint32_t)(uintptr_t)handler;
+
+    return (offset & 0xffff) | (uint64_t)KERNEL_CS << 16 |
+           (uint64_t)access << 40 | (uint64_t)(offset >> 16) << 48;
+}
+
+static void setup(void)
+{
+    int i;
+
+    /* Same code and data segments as boot.S, plus ring 3 and a TSS */
+    gdt[1] = segment(0, 0xfffff, 0x9b, 0xc);
+    gdt[2] = segment(0, 0xfffff, 0x93, 0xc);
+    gdt[3] = segment(0, 0xfffff, 0xfb, 0xc);
+    gdt[4] = segment(0, 0xfffff, 0xf3, 0xc);
+    gdt[5] = segment((uint32_t)(uintptr_t)tss, sizeof(tss) - 1, 0x89, 0);
+    tss[1] = (uint32_t)(uintptr_t)(trap_stack + sizeof(trap_stack));
+    tss[2] = KERNEL_DS;
+    tss[25] = sizeof(tss) << 16;    /* no I/O permission bitmap */
+    gdtr.limit = sizeof(gdt) - 1;
+    gdtr.base = (uint32_t)(uintptr_t)gdt;
+    asm volatile("lgdt %0\n"
+                 "ltr %w1" : : "m"(gdtr), "r"(TSS_SEL));
+
+    for (i = 0; i < 32; i++) {
+        idt[i] = gate(trap_fault, 0x8e);
+    }
+    idt[0x80] = gate(trap_syscall, 0xee);
+    idtr.limit = sizeof(idt) - 1;
+    idtr.base = (uint32_t)(uintptr_t)idt;
+    asm volatile("lidt %0" : : "m"(idtr));
+
+    /* 4MiB pages: the first one for everybody, the third for the kernel */
+    page_dir[0] = 0x000000 | 0x87;
+    page_dir[SECRET_ADDR >> 22] = SECRET_ADDR | 0x83;
+    asm volatile("mov %%cr4, %%eax\n"
+                 "or $0x10, %%eax\n"        /* PSE */
+                 "mov %%eax, %%cr4\n"
+                 "mov %0, %%cr3\n"
+                 "mov %%cr0, %%eax\n"
+                 "or $0x80000000, %%eax\n"  /* PG */
+                 "mov %%eax, %%cr0"
+                 : : "r"(page_dir) : "eax", "memory");
+}
+
+static int check_smc(void)
+{
+    uint32_t template_size = smc_template_end - smc_template;
+    uint32_t imm = smc_template_imm - smc_template;
+    uint32_t i, j;
+
+    for (i = 0; i < NB_COPIES; i++) {
+        for (j = 0; j < template_size; j++) {
+            smc_code[i * STRIDE + j] = smc_template[j];
+        }
+    }
+
+    for (i = 0; i < NB_COPIES; i++) {
+        uint8_t *f = &smc_code[i * STRIDE];
+        uint32_t want = i * 0x9e3779b9u, got;
+
+        /* Translate the first TB, which requests the second one */
+        enter_code(f, 0, f, 0);
+        *(volatile uint32_t *)&f[imm] = want;
+        got = enter_code(f, 1, f, 0);
+        if (got != want) {
+            ml_printf("FAIL: copy %d returned %x after it was modified "
+                      "to return %x\n", i, got, want);
+            return 1;
+        }
+    }
+
+    ml_printf("PASS: %d copies\n", NB_COPIES);
+    return 0;
+}
+
+int main(void)
+{
+    volatile uint32_t *secret = (volatile uint32_t *)SECRET_ADDR;
+    const void *addr = (const void *)SECRET_ADDR;
+    uint32_t template_size = code_template_end - code_template;
+    uint32_t i, j;
+
+    setup();
+
+    for (i = 0; i < NB_COPIES; i++) {
+        for (j = 0; j < template_size; j++) {
+            code[i * STRIDE + j] = code_template[j];
+        }
+    }
+
+    for (i = 0; i < NB_COPIES; i++) {
+        void *f = &code[i * STRIDE];
+        uint32_t got;
+
+        *secret = SECRET + i;
+
+        /* Translate both paths in each mode, then take the load */
+        if (enter_code(f, 0, addr, 1) == FAULT ||
+            enter_code(f, 0, addr, 0) == FAULT) {
+            ml_printf("FAIL: copy %d faulted without loading\n", i);
+            return 1;
+        }
+        got = enter_code(f, 1, addr, 1);
+        if (got != FAULT) {
+            ml_printf("FAIL: copy %d loaded %x from the kernel in user mode\n",
+                      i, got);
+            return 1;
+        }
+        got = enter_code(f, 1, addr, 0);
+        if (got != SECRET + i) {
+            ml_printf("FAIL: copy %d loaded %x in kernel mode, expected %x\n",
+                      i, got, SECRET + i);
+            return 1;
+        }
+    }
+
+    return check_smc();
+}
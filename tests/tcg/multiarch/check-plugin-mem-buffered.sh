@@ -0,0 +1,37 @@
+#!/usr/bin/env bash
+
+# This script runs a given executable with the mem plugin counting the
+# memory accesses inline, with a callback per access and with buffered
+# records, and checks that the three totals are the same.
+
+set -euo pipefail
+
+die()
+{
+    echo "$@" 1>&2
+    exit 1
+}
+
+[ $# -eq 3 ] || die "usage: qemu_bin plugin exe"
+
+qemu_bin=$1; shift
+plugin=$1; shift
+exe=$1; shift
+
+count()
+{
+    log=$exe.$1.pout
+    $qemu_bin -plugin "$plugin,$1=true" -d plugin -D "$log" "$exe" \
+        > /dev/null || die "running $exe with $1 counting failed"
+    sed -n 's/^mem accesses: //p' "$log"
+}
+
+inline=$(count inline)
+callback=$(count callback)
+buffered=$(count buffered)
+
+[ -n "$inline" ] || die "no count of memory accesses"
+[ "$callback" = "$inline" ] ||
+    die "callback counted $callback accesses, inline $inline"
+[ "$buffered" = "$inline" ] ||
+    die "buffered counted $buffered accesses, inline $inline"
@@ -60,7 +60,8 @@ static struct qemu_plugin_scoreboard *counts;
 static qemu_plugin_u64 mem_count;
 static qemu_plugin_u64 io_count;
 static bool do_inline, do_callback, do_print_accesses, do_region_summary;
-static bool do_haddr;
+static bool do_haddr, do_buffered;
+static struct qemu_plugin_mem_buffer *mem_buffer;
 static enum qemu_plugin_mem_rw rw = QEMU_PLUGIN_MEM_RW;
 
 
@@ -80,7 +81,7 @@ static void plugin_exit(qemu_plugin_id_t id, void *p)
 {
     g_autoptr(GString) out = g_string_new("");
 
-    if (do_inline || do_callback) {
+    if (do_inline || do_callback || do_buffered) {
         g_string_printf(out, "mem accesses: %" PRIu64 "\n",
                         qemu_plugin_u64_sum(mem_count));
     }
@@ -253,6 +254,13 @@ static void vcpu_mem(unsigned int cpu_index, qemu_plugin_meminfo_t meminfo,
     }
 }
 
+static void vcpu_mem_batch(unsigned int cpu_index,
+                           const qemu_plugin_mem_record *records, size_t n,
+                           void *udata)
+{
+    qemu_plugin_u64_add(mem_count, cpu_index, n);
+}
+
 static void print_access(unsigned int cpu_index, qemu_plugin_meminfo_t meminfo,
                          uint64_t vaddr, void *udata)
 {
@@ -305,6 +313,9 @@ static void vcpu_tb_trans(qemu_plugin_id_t id, struct qemu_plugin_tb *tb)
                 QEMU_PLUGIN_INLINE_ADD_U64,
                 mem_count, 1);
         }
+        if (do_buffered) {
+            qemu_plugin_register_vcpu_mem_buffered(insn, rw, mem_buffer, 0);
+        }
         if (do_callback || do_region_summary) {
             qemu_plugin_register_vcpu_mem_cb(insn, vcpu_mem,
                                              QEMU_PLUGIN_CB_NO_REGS,
@@ -358,6 +369,11 @@ QEMU_PLUGIN_EXPORT int qemu_plugin_install(qemu_plugin_id_t id,
                 fprintf(stderr, "boolean argument parsing failed: %s\n", opt);
                 return -1;
             }
+        } else if (g_strcmp0(tokens[0], "buffered") == 0) {
+            if (!qemu_plugin_bool_parse(tokens[0], tokens[1], &do_buffered)) {
+                fprintf(stderr, "boolean argument parsing failed: %s\n", opt);
+                return -1;
+            }
         } else if (g_strcmp0(tokens[0], "print-accesses") == 0) {
             if (!qemu_plugin_bool_parse(tokens[0], tokens[1],
                                         &do_print_accesses)) {
@@ -376,9 +392,9 @@ QEMU_PLUGIN_EXPORT int qemu_plugin_install(qemu_plugin_id_t id,
         }
     }
 
-    if (do_inline && do_callback) {
-        fprintf(stderr,
-                "can't enable inline and callback counting at the same time\n");
+    if (do_inline + do_callback + do_buffered > 1) {
+        fprintf(stderr, "can't enable more than one of inline, callback "
+                "and buffered counting at the same time\n");
         return -1;
     }
 
@@ -399,6 +415,10 @@ QEMU_PLUGIN_EXPORT int qemu_plugin_install(qemu_plugin_id_t id,
     mem_count = qemu_plugin_scoreboard_u64_in_struct(
         counts, CPUCount, mem_count);
     io_count = qemu_plugin_scoreboard_u64_in_struct(counts, CPUCount, io_count);
+    if (do_buffered) {
+        /* Keep it small, so that the buffers are often found full */
+        mem_buffer = qemu_plugin_mem_buffer_new(64, vcpu_mem_batch, NULL);
+    }
     qemu_plugin_register_vcpu_tb_trans_cb(id, vcpu_tb_trans);
     qemu_plugin_register_atexit_cb(id, plugin_exit, NULL);
     return 0;
@@ -0,0 +1,307 @@
+/*
+ * Check and time the AVX/AVX2 shuffles, blends and unpacks that are
+ * expanded inline by TCG.
+ *
+ * Each instruction is run on random inputs and compared with a C model,
+ * then executed in a loop to print the time per instruction.  The number
+ * of loop iterations can be given on the command line; it is kept small
+ * by default so that the test stays quick under "make check-tcg".
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+typedef union {
+    uint64_t q[4];
+    uint32_t l[8];
+    uint16_t w[16];
+    uint8_t b[32];
+} V;
+
+typedef struct {
+    const char *name;
+    void (*run)(const V *a, const V *b, const V *c, V *d);
+    void (*ref)(const V *a, const V *b, const V *c, V *d);
+    void (*bench)(long n);
+} Test;
+
+/*
+ * The inputs are in ymm1, ymm2 and ymm3 (the mask of the variable
+ * blends), the result in ymm0, which starts out as all ones so that
+ * the clearing of the high half by the 128-bit VEX forms, and its
+ * preservation by the legacy SSE forms, are checked.  The second input
+ * is also in "mem", for the forms with a memory operand; legacy SSE
+ * needs it to be aligned.
+ */
+static V mem __attribute__((aligned(32)));
+
+#define TEST(NAME, TEXT, REF)                                           \
+static void run_##NAME(const V *a, const V *b, const V *c, V *d)        \
+{                                                                       \
+    mem = *b;                                                           \
+    asm("vmovdqu %1, %%ymm1\n\t"                                        \
+        "vmovdqu %2, %%ymm2\n\t"                                        \
+        "vmovdqu %3, %%ymm3\n\t"                                        \
+        "vpcmpeqd %%ymm0, %%ymm0, %%ymm0\n\t"                           \
+        TEXT "\n\t"                                                     \
+        "vmovdqu %%ymm0, %0"                                            \
+        : "=m"(*d) : "m"(*a), "m"(*b), "m"(*c), "m"(mem)                \
+        : "xmm0", "xmm1", "xmm2", "xmm3");                              \
+}                                                                       \
+static void bench_##NAME(long n)                                        \
+{                                                                       \
+    asm volatile("1:\n\t"                                               \
+                 TEXT "\n\t" TEXT "\n\t" TEXT "\n\t" TEXT "\n\t"        \
+                 TEXT "\n\t" TEXT "\n\t" TEXT "\n\t" TEXT "\n\t"        \
+                 "dec %0\n\t"                                           \
+                 "jnz 1b"                                               \
+                 : "+r"(n) : : "xmm0", "xmm1", "xmm2", "xmm3");         \
+}                                                                       \
+static void ref_##NAME(const V *a, const V *b, const V *c, V *d)        \
+{                                                                       \
+    REF;                                                                \
+}
+
+/* Models; len is the vector length in bytes. */
+
+static void pshufd(V *d, const V *a, int imm, int len)
+{
+    for (int i = 0; i < len / 4; i++) {
+        d->l[i] = a->l[(i & ~3) | ((imm >> ((i & 3) * 2)) & 3)];
+    }
+}
+
+static void pshufw(V *d, const V *a, int imm, int len, int hi)
+{
+    for (int i = 0; i < len / 2; i++) {
+        if (!!(i & 4) == hi) {
+            d->w[i] = a->w[(i & ~3) | ((imm >> ((i & 3) * 2)) & 3)];
+        } else {
+            d->w[i] = a->w[i];
+        }
+    }
+}
+
+static void shufps(V *d, const V *a, const V *b, int imm, int len)
+{
+    for (int i = 0; i < len / 4; i++) {
+        const V *s = i & 2 ? b : a;
+        d->l[i] = s->l[(i & ~3) | ((imm >> ((i & 3) * 2)) & 3)];
+    }
+}
+
+static void shufpd(V *d, const V *a, const V *b, int imm, int len)
+{
+    for (int i = 0; i < len / 8; i++) {
+        const V *s = i & 1 ? b : a;
+        d->q[i] = s->q[(i & ~1) | ((imm >> i) & 1)];
+    }
+}
+
+static void permq(V *d, const V *a, int imm)
+{
+    for (int i = 0; i < 4; i++) {
+        d->q[i] = a->q[(imm >> (i * 2)) & 3];
+    }
+}
+
+static void permilpd(V *d, const V *a, int imm, int len)
+{
+    for (int i = 0; i < len / 8; i++) {
+        d->q[i] = a->q[(i & ~1) | ((imm >> i) & 1)];
+    }
+}
+
+static void blend(V *d, const V *a, const V *b, int imm, int len, int esz)
+{
+    for (int i = 0; i < len / esz; i++) {
+        const V *s = (imm >> (i & 7)) & 1 ? b : a;
+        memcpy(&d->b[i * esz], &s->b[i * esz], esz);
+    }
+}
+
+static void blendv(V *d, const V *a, const V *b, const V *c, int len, int esz)
+{
+    for (int i = 0; i < len / esz; i++) {
+        const V *s = c->b[i * esz + esz - 1] & 0x80 ? b : a;
+        memcpy(&d->b[i * esz], &s->b[i * esz], esz);
+    }
+}
+
+/* The legacy SSE forms leave the high half of ymm0 alone. */
+static void sse_high(V *d)
+{
+    memset(&d->b[16], 0xff, 16);
+}
+
+static void unpck(V *d, const V *a, const V *b, int len, int esz, int hi)
+{
+    int lane = 16 / esz;
+
+    for (int i = 0; i < len / esz; i++) {
+        const V *s = i & 1 ? b : a;
+        int j = (i & -lane) + (hi ? lane / 2 : 0) + (i & (lane - 1)) / 2;
+        memcpy(&d->b[i * esz], &s->b[j * esz], esz);
+    }
+}
+
+TEST(vpshufd_x, "vpshufd $0x1b, %%xmm1, %%xmm0", pshufd(d, a, 0x1b, 16))
+TEST(vpshufd_y, "vpshufd $0x4e, %%ymm1, %%ymm0", pshufd(d, a, 0x4e, 32))
+TEST(vpshuflw_y, "vpshuflw $0xb1, %%ymm1, %%ymm0", pshufw(d, a, 0xb1, 32, 0))
+TEST(vpshufhw_y, "vpshufhw $0x39, %%ymm1, %%ymm0", pshufw(d, a, 0x39, 32, 1))
+TEST(vshufps_y, "vshufps $0x8d, %%ymm2, %%ymm1, %%ymm0",
+     shufps(d, a, b, 0x8d, 32))
+TEST(vshufpd_y, "vshufpd $0x6, %%ymm2, %%ymm1, %%ymm0",
+     shufpd(d, a, b, 6, 32))
+TEST(vpermq, "vpermq $0x93, %%ymm1, %%ymm0", permq(d, a, 0x93))
+TEST(vpermilps_y, "vpermilps $0xe1, %%ymm1, %%ymm0", pshufd(d, a, 0xe1, 32))
+TEST(vpermilpd_y, "vpermilpd $0x9, %%ymm1, %%ymm0", permilpd(d, a, 9, 32))
+TEST(vblendps_y, "vblendps $0xa6, %%ymm2, %%ymm1, %%ymm0",
+     blend(d, a, b, 0xa6, 32, 4))
+TEST(vblendpd_x, "vblendpd $0x2, %%xmm2, %%xmm1, %%xmm0",
+     blend(d, a, b, 2, 16, 8))
+TEST(vpblendw_y, "vpblendw $0x5c, %%ymm2, %%ymm1, %%ymm0",
+     blend(d, a, b, 0x5c, 32, 2))
+TEST(vpblendd_y, "vpblendd $0x3c, %%ymm2, %%ymm1, %%ymm0",
+     blend(d, a, b, 0x3c, 32, 4))
+TEST(vpblendvb_y, "vpblendvb %%ymm3, %%ymm2, %%ymm1, %%ymm0",
+     blendv(d, a, b, c, 32, 1))
+TEST(vblendvps_y, "vblendvps %%ymm3, %%ymm2, %%ymm1, %%ymm0",
+     blendv(d, a, b, c, 32, 4))
+TEST(vblendvpd_x, "vblendvpd %%xmm3, %%xmm2, %%xmm1, %%xmm0",
+     blendv(d, a, b, c, 16, 8))
+TEST(vpunpcklqdq_y, "vpunpcklqdq %%ymm2, %%ymm1, %%ymm0",
+     unpck(d, a, b, 32, 8, 0))
+TEST(vpunpckhqdq_x, "vpunpckhqdq %%xmm2, %%xmm1, %%xmm0",
+     unpck(d, a, b, 16, 8, 1))
+TEST(vunpcklps_y, "vunpcklps %%ymm2, %%ymm1, %%ymm0",
+     unpck(d, a, b, 32, 4, 0))
+TEST(vunpckhps_y, "vunpckhps %%ymm2, %%ymm1, %%ymm0",
+     unpck(d, a, b, 32, 4, 1))
+TEST(vunpckhpd_y, "vunpckhpd %%ymm2, %%ymm1, %%ymm0",
+     unpck(d, a, b, 32, 8, 1))
+/* Destination overlapping the sources. */
+TEST(vshufps_ovl, "vmovdqa %%ymm1, %%ymm0\n\t"
+                  "vshufps $0x1e, %%ymm0, %%ymm0, %%ymm0",
+     shufps(d, a, a, 0x1e, 32))
+/* Memory operands. */
+TEST(vpshufd_ym, "vpshufd $0x4e, mem(%%rip), %%ymm0", pshufd(d, b, 0x4e, 32))
+TEST(vblendps_ym, "vblendps $0xa6, mem(%%rip), %%ymm1, %%ymm0",
+     blend(d, a, b, 0xa6, 32, 4))
+TEST(vpblendvb_ym, "vpblendvb %%ymm3, mem(%%rip), %%ymm1, %%ymm0",
+     blendv(d, a, b, c, 32, 1))
+TEST(vunpckhps_ym, "vunpckhps mem(%%rip), %%ymm1, %%ymm0",
+     unpck(d, a, b, 32, 4, 1))
+
+/* Legacy SSE; the variable blends take their mask in xmm0. */
+TEST(pshufd, "pshufd $0x1b, %%xmm1, %%xmm0",
+     pshufd(d, a, 0x1b, 16); sse_high(d))
+TEST(pshufd_m, "pshufd $0x39, mem(%%rip), %%xmm0",
+     pshufd(d, b, 0x39, 16); sse_high(d))
+TEST(shufps, "movaps %%xmm1, %%xmm0\n\t"
+             "shufps $0x8d, %%xmm2, %%xmm0",
+     shufps(d, a, b, 0x8d, 16); sse_high(d))
+TEST(blendps_m, "movaps %%xmm1, %%xmm0\n\t"
+                "blendps $0x6, mem(%%rip), %%xmm0",
+     blend(d, a, b, 6, 16, 4); sse_high(d))
+TEST(pblendw, "movdqa %%xmm1, %%xmm0\n\t"
+              "pblendw $0x5c, %%xmm2, %%xmm0",
+     blend(d, a, b, 0x5c, 16, 2); sse_high(d))
+TEST(blendvps, "movaps %%xmm3, %%xmm0\n\t"
+               "blendvps %%xmm0, %%xmm2, %%xmm1\n\t"
+               "movaps %%xmm1, %%xmm0",
+     blendv(d, a, b, c, 16, 4); sse_high(d))
+TEST(blendvpd_m, "movapd %%xmm3, %%xmm0\n\t"
+                 "blendvpd %%xmm0, mem(%%rip), %%xmm1\n\t"
+                 "movapd %%xmm1, %%xmm0",
+     blendv(d, a, b, c, 16, 8); sse_high(d))
+TEST(pblendvb, "movdqa %%xmm3, %%xmm0\n\t"
+               "pblendvb %%xmm0, %%xmm2, %%xmm1\n\t"
+               "movdqa %%xmm1, %%xmm0",
+     blendv(d, a, b, c, 16, 1); sse_high(d))
+TEST(pblendvb_m, "movdqa %%xmm3, %%xmm0\n\t"
+                 "pblendvb %%xmm0, mem(%%rip), %%xmm1\n\t"
+                 "movdqa %%xmm1, %%xmm0",
+     blendv(d, a, b, c, 16, 1); sse_high(d))
+TEST(punpckhqdq_m, "movdqa %%xmm1, %%xmm0\n\t"
+                   "punpckhqdq mem(%%rip), %%xmm0",
+     unpck(d, a, b, 16, 8, 1); sse_high(d))
+TEST(unpcklps, "movaps %%xmm1, %%xmm0\n\t"
+               "unpcklps %%xmm2, %%xmm0",
+     unpck(d, a, b, 16, 4, 0); sse_high(d))
+
+#define T(NAME) { #NAME, run_##NAME, ref_##NAME, bench_##NAME }
+
+static const Test tests[] = {
+    T(vpshufd_x), T(vpshufd_y), T(vpshuflw_y), T(vpshufhw_y),
+    T(vshufps_y), T(vshufpd_y), T(vpermq), T(vpermilps_y), T(vpermilpd_y),
+    T(vblendps_y), T(vblendpd_x), T(vpblendw_y), T(vpblendd_y),
+    T(vpblendvb_y), T(vblendvps_y), T(vblendvpd_x),
+    T(vpunpcklqdq_y), T(vpunpckhqdq_x), T(vunpcklps_y), T(vunpckhps_y),
+    T(vunpckhpd_y), T(vshufps_ovl),
+    T(vpshufd_ym), T(vblendps_ym), T(vpblendvb_ym), T(vunpckhps_ym),
+    T(pshufd), T(pshufd_m), T(shufps), T(blendps_m), T(pblendw),
+    T(blendvps), T(blendvpd_m), T(pblendvb), T(pblendvb_m),
+    T(punpckhqdq_m), T(unpcklps),
+};
+
+static uint64_t rand64(void)
+{
+    static uint64_t x = 0x9e3779b97f4a7c15ull;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return x;
+}
+
+int main(int argc, char **argv)
+{
+    long iters = argc > 1 ? atol(argv[1]) : 10000;
+    int failed = 0;
+
+    for (int i = 0; i < ARRAY_SIZE(tests); i++) {
+        const Test *t = &tests[i];
+        struct timespec start, end;
+        double ns;
+
+        for (int n = 0; n < 16; n++) {
+            V a, b, c, got, want;
+
+            for (int j = 0; j < 4; j++) {
+                a.q[j] = rand64();
+                b.q[j] = rand64();
+                c.q[j] = rand64();
+            }
+            memset(&want, 0, sizeof(want));
+            t->run(&a, &b, &c, &got);
+            t->ref(&a, &b, &c, &want);
+            if (memcmp(&got, &want, sizeof(V))) {
+                printf("FAIL %s\n", t->name);
+                for (int j = 3; j >= 0; j--) {
+                    printf("  %016" PRIx64 " %016" PRIx64 "\n",
+                           got.q[j], want.q[j]);
+                }
+                failed = 1;
+                break;
+            }
+        }
+
+        if (iters > 0) {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            t->bench(iters);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            ns = (end.tv_sec - start.tv_sec) * 1e9 +
+                 (end.tv_nsec - start.tv_nsec);
+            printf("%-16s %8.2f ns/insn\n", t->name, ns / (iters * 8));
+        }
+    }
+    return failed;
+}
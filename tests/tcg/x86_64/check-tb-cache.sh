@@ -0,0 +1,89 @@
+#!/usr/bin/env bash
+
+# This script runs a given executable several times with -tb-cache, and
+# checks that the cache is reused, that it is discarded when the CPU
+# features change, and that a corrupted or unsafe cache file does not
+# change the output of the program.
+
+set -euo pipefail
+
+die()
+{
+    echo "$@" 1>&2
+    exit 1
+}
+
+[ $# -eq 2 ] || die "usage: qemu_bin exe"
+
+qemu_bin=$1; shift
+exe=$1; shift
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cache=$dir/tb-cache
+
+# Run @exe with the cache and CPU model @1, and check its output
+run()
+{
+    rm -f "$dir/log"
+    $qemu_bin -cpu "$1" -tb-cache "$cache" -d 'trace:tb_cache_*' \
+        -D "$dir/log" "$exe" > "$dir/out" 2> "$dir/err" ||
+        die "running $exe with -cpu $1 failed"
+    cmp -s "$dir/out" "$dir/ref" ||
+        die "output of $exe with -cpu $1 differs"
+}
+
+# Print the statistic @1 (hits, misses, stale or saved) of the last run
+cache_stat()
+{
+    sed -n "s/.*tb_cache_stats.* $1 \([0-9]*\).*/\1/p" "$dir/log" | tail -n 1
+}
+
+reset()
+{
+    grep -q tb_cache_reset "$dir/log"
+}
+
+$qemu_bin -cpu max "$exe" > "$dir/ref" || die "running $exe failed"
+
+# The first run fills the cache, the second one reuses it
+run max
+if grep -q "not supported on this host" "$dir/err"; then
+    echo "skipping, tb-cache is not supported on this host"
+    exit 0
+fi
+reset || die "a new cache was not created"
+[ "$(cache_stat saved)" -gt 0 ] || die "nothing was saved"
+run max
+reset && die "the cache was discarded although nothing changed"
+hits=$(cache_stat hits)
+[ "$hits" -gt 0 ] || die "the cache was not reused"
+
+# Same CPU model with different features
+run max,-avx2
+reset || die "the cache was not discarded when the CPU features changed"
+[ "$(cache_stat hits)" -eq 0 ] || die "code was reused for other CPU features"
+run max
+reset || die "the cache was not discarded when the CPU features changed"
+run max
+
+# Overwrite some of the records; the output must not change
+size=$(stat -c %s "$cache")
+dd if=/dev/urandom of="$cache" bs=1 seek=$((size / 2)) \
+    count=$((size / 4)) conv=notrunc 2> /dev/null
+run max
+reset && die "the cache was discarded although only records were corrupted"
+[ "$(cache_stat hits)" -lt "$hits" ] || die "corrupted records were used"
+
+# Files that others can write must not be used
+chmod go+w "$cache"
+run max
+grep -q "disabling the cache" "$dir/err" ||
+    die "a cache file writable by others was used"
+chmod go-w "$cache"
+
+mv "$cache" "$cache.real"
+ln -s "$cache.real" "$cache"
+run max
+grep -q "disabling the cache" "$dir/err" ||
+    die "a symbolic link to the cache file was followed"
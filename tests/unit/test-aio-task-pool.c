@@ -0,0 +1,89 @@
+/*
+ * Test the aio task pool
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "block/aio.h"
+#include "block/aio_task.h"
+#include "qemu/coroutine.h"
+#include "qemu/main-loop.h"
+
+static int running;
+static int max_running;
+
+static int coroutine_fn sleep_task(AioTask *task)
+{
+    running++;
+    max_running = MAX(max_running, running);
+    qemu_co_sleep_ns(QEMU_CLOCK_REALTIME, 1000000);
+    running--;
+    return 0;
+}
+
+static void coroutine_fn start_tasks(AioTaskPool *pool, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        AioTask *task = g_new0(AioTask, 1);
+
+        task->func = sleep_task;
+        aio_task_pool_start_task(pool, task);
+    }
+}
+
+static void coroutine_fn test_set_max_busy_tasks_co(void *opaque)
+{
+    bool *done = opaque;
+    AioTaskPool *pool = aio_task_pool_new(4);
+
+    start_tasks(pool, 8);
+    g_assert_cmpint(max_running, ==, 4);
+
+    /*
+     * Lowering the limit leaves the running tasks alone, new ones wait until
+     * fewer tasks than the new limit run
+     */
+    aio_task_pool_set_max_busy_tasks(pool, 2);
+    g_assert_cmpint(running, >, 2);
+    max_running = 0;
+    start_tasks(pool, 8);
+    g_assert_cmpint(max_running, ==, 2);
+
+    /* Raising it lets more tasks run right away */
+    aio_task_pool_set_max_busy_tasks(pool, 6);
+    max_running = 0;
+    start_tasks(pool, 12);
+    g_assert_cmpint(max_running, ==, 6);
+
+    aio_task_pool_wait_all(pool);
+    g_assert_cmpint(running, ==, 0);
+    g_assert_cmpint(aio_task_pool_status(pool), ==, 0);
+    aio_task_pool_free(pool);
+
+    *done = true;
+}
+
+static void test_set_max_busy_tasks(void)
+{
+    bool done = false;
+    Coroutine *co = qemu_coroutine_create(test_set_max_busy_tasks_co, &done);
+
+    qemu_coroutine_enter(co);
+    while (!done) {
+        aio_poll(qemu_get_aio_context(), true);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    qemu_init_main_loop(&error_abort);
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/aio-task-pool/set-max-busy-tasks",
+                    test_set_max_busy_tasks);
+    return g_test_run();
+}
@@ -0,0 +1,152 @@
+/*
+ * Test the feedback controller of block-copy
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "block/block-copy.h"
+
+#define MIN_CHUNK   (64 * KiB)
+#define MAX_CHUNK   (16 * MiB)
+
+static void step(BlockCopyTuneState *t, uint64_t throughput,
+                 uint64_t ns_per_mib, bool buffered)
+{
+    block_copy_tune_step(t, throughput, ns_per_mib, buffered,
+                         MIN_CHUNK, MAX_CHUNK);
+}
+
+/* Runs a chunk epoch and the following workers epoch */
+static void step2(BlockCopyTuneState *t, uint64_t throughput)
+{
+    g_assert_true(t->tune_chunk);
+    step(t, throughput, 1000, true);
+    step(t, throughput, 1000, true);
+}
+
+static void test_workers(void)
+{
+    BlockCopyTuneState t;
+    int i, workers;
+
+    block_copy_tune_init(&t);
+    workers = t.workers;
+
+    /* Without buffered copies every epoch tunes the workers */
+    step(&t, 100, 1000, false);
+    g_assert_cmpint(t.workers, ==, workers + 1);
+    step(&t, 100, 1000, false);
+    g_assert_cmpint(t.workers, ==, workers + 2);
+
+    /* They keep growing up to a limit while the latency doesn't */
+    for (i = 0; i < 100; i++) {
+        step(&t, 100, 1000, false);
+    }
+    workers = t.workers;
+    step(&t, 100, 1000, false);
+    g_assert_cmpint(t.workers, ==, workers);
+    g_assert_cmpint(t.chunk, ==, 1 * MiB);
+
+    /* Twice the lowest latency is fine, more halves the number */
+    step(&t, 100, 2000, false);
+    g_assert_cmpint(t.workers, ==, workers);
+    step(&t, 100, 2001, false);
+    g_assert_cmpint(t.workers, ==, workers / 2);
+    step(&t, 100, 3000, false);
+    g_assert_cmpint(t.workers, ==, workers / 4);
+
+    /* Throughput that drops by more than 5% stops the growth */
+    step(&t, 100, 1000, false);
+    g_assert_cmpint(t.workers, ==, workers / 4 + 1);
+    step(&t, 96, 1000, false);
+    g_assert_cmpint(t.workers, ==, workers / 4 + 2);
+    step(&t, 91, 1000, false);
+    g_assert_cmpint(t.workers, ==, workers / 4 + 2);
+
+    /* There is always one */
+    for (i = 0; i < 10; i++) {
+        step(&t, 100, 1000000, false);
+    }
+    g_assert_cmpint(t.workers, ==, 1);
+}
+
+static void test_chunk(void)
+{
+    BlockCopyTuneState t;
+    int workers;
+
+    block_copy_tune_init(&t);
+    workers = t.workers;
+    g_assert_cmpint(t.chunk, ==, 1 * MiB);
+
+    /* The chunk size doubles while the throughput doesn't drop */
+    step2(&t, 100);
+    g_assert_cmpint(t.chunk, ==, 2 * MiB);
+    g_assert_cmpint(t.workers, ==, workers + 1);
+    step2(&t, 100);
+    g_assert_cmpint(t.chunk, ==, 4 * MiB);
+
+    /* It turns around when it does */
+    step2(&t, 90);
+    g_assert_cmpint(t.chunk, ==, 2 * MiB);
+    step2(&t, 90);
+    g_assert_cmpint(t.chunk, ==, 1 * MiB);
+    step2(&t, 80);
+    g_assert_cmpint(t.chunk, ==, 2 * MiB);
+    step2(&t, 80);
+    g_assert_cmpint(t.chunk, ==, 4 * MiB);
+
+    /* And at the limits */
+    step2(&t, 80);
+    step2(&t, 80);
+    g_assert_cmpint(t.chunk, ==, MAX_CHUNK);
+    step2(&t, 80);
+    g_assert_cmpint(t.chunk, ==, MAX_CHUNK);
+    step2(&t, 80);
+    g_assert_cmpint(t.chunk, ==, MAX_CHUNK / 2);
+
+    while (t.chunk > MIN_CHUNK) {
+        step2(&t, 80);
+    }
+    step2(&t, 80);
+    g_assert_cmpint(t.chunk, ==, MIN_CHUNK);
+    step2(&t, 80);
+    g_assert_cmpint(t.chunk, ==, 2 * MIN_CHUNK);
+}
+
+static void test_chunk_relearns_latency(void)
+{
+    BlockCopyTuneState t;
+    int workers;
+
+    block_copy_tune_init(&t);
+    workers = t.workers;
+
+    /*
+     * Larger requests take longer per byte, which must not be taken for
+     * queueing after the chunk size changed
+     */
+    step(&t, 100, 1000, true);
+    g_assert_cmpint(t.chunk, ==, 2 * MiB);
+    step(&t, 100, 5000, true);
+    g_assert_cmpint(t.workers, ==, workers + 1);
+
+    /* But it is if the chunk size stayed the same */
+    block_copy_tune_step(&t, 100, 5000, true, 2 * MiB, 2 * MiB);
+    g_assert_cmpint(t.chunk, ==, 2 * MiB);
+    block_copy_tune_step(&t, 100, 10001, true, 2 * MiB, 2 * MiB);
+    g_assert_cmpint(t.workers, ==, (workers + 1) / 2);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/block-copy/tune/workers", test_workers);
+    g_test_add_func("/block-copy/tune/chunk", test_chunk);
+    g_test_add_func("/block-copy/tune/chunk-relearns-latency",
+                    test_chunk_relearns_latency);
+    return g_test_run();
+}
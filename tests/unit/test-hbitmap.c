@@ -1042,6 +1042,74 @@ static void test_hbitmap_next_dirty_area_after_truncate(TestHBitmapData *data,
     test_hbitmap_next_dirty_area_check(data, 0, INT64_MAX);
 }
 
+static void hbitmap_test_merge_ranges(TestHBitmapData *data, HBitmap *b,
+                                      const uint64_t (*ranges)[2], int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        uint64_t first = ranges[i][0], count = ranges[i][1];
+
+        hbitmap_set(b, first, count);
+        while (count-- != 0) {
+            data->bits[first >> LOG_BITS_PER_LONG] |=
+                1UL << (first & (BITS_PER_LONG - 1));
+            first++;
+        }
+    }
+}
+
+static void test_hbitmap_merge_sparse(TestHBitmapData *data,
+                                      const void *unused)
+{
+    static const uint64_t ranges[][2] = {
+        { 0, 1 }, { L1 - 1, 2 }, { L2 + 3, L1 }, { L3 - 1, 1 },
+        { L3 + L2 * 5, L2 + 7 }, { L3 * 2 - L1, L1 },
+    };
+    HBitmap *b;
+
+    hbitmap_test_init(data, L3 * 2, 0);
+    b = hbitmap_alloc(L3 * 2, 0);
+
+    hbitmap_test_set(data, 5, 10);
+    hbitmap_test_set(data, L2 + 1, L1 * 3);
+    hbitmap_test_merge_ranges(data, b, ranges, ARRAY_SIZE(ranges));
+
+    hbitmap_merge(data->hb, b, data->hb);
+    hbitmap_test_check(data, 0);
+
+    /* Merging again must not change anything, including the count */
+    hbitmap_merge(b, data->hb, data->hb);
+    hbitmap_test_check(data, 0);
+
+    hbitmap_free(b);
+}
+
+static void test_hbitmap_merge_result(TestHBitmapData *data,
+                                      const void *unused)
+{
+    static const uint64_t ranges[][2] = {
+        { L1 * 3, 1 }, { L2 * 7, L2 }, { L3 + 1, L1 + 1 },
+    };
+    HBitmap *a, *b;
+
+    hbitmap_test_init(data, L3 * 2, 0);
+    a = hbitmap_alloc(L3 * 2, 0);
+    b = hbitmap_alloc(L3 * 2, 0);
+
+    /* Stale contents of the result must not leak into the merge */
+    hbitmap_set(data->hb, 0, L3 * 2);
+    hbitmap_set(a, L2 + 9, 3);
+    data->bits[(L2 + 9) >> LOG_BITS_PER_LONG] |= 7UL << ((L2 + 9) & (L1 - 1));
+    hbitmap_test_merge_ranges(data, b, ranges, ARRAY_SIZE(ranges));
+
+    hbitmap_merge(a, b, data->hb);
+    hbitmap_test_check(data, 0);
+
+    hbitmap_free(a);
+    hbitmap_free(b);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -1094,6 +1162,9 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/serialize/zeroes",
                      test_hbitmap_serialize_zeroes);
 
+    hbitmap_test_add("/hbitmap/merge/sparse", test_hbitmap_merge_sparse);
+    hbitmap_test_add("/hbitmap/merge/result", test_hbitmap_merge_result);
+
     hbitmap_test_add("/hbitmap/iter/iter_and_reset",
                      test_hbitmap_iter_and_reset);
 
@@ -0,0 +1,121 @@
+/*
+ * Log-linear histogram tests
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/hdr-histogram.h"
+
+static void test_empty(void)
+{
+    HdrHistogram *h = g_new0(HdrHistogram, 1);
+
+    g_assert_cmpuint(hdr_histogram_percentile(h, 50), ==, 0);
+    g_assert_cmpuint(hdr_histogram_percentile(h, 99.9), ==, 0);
+
+    g_free(h);
+}
+
+static void test_small_values(void)
+{
+    HdrHistogram *h = g_new0(HdrHistogram, 1);
+    int i;
+
+    /* Values below 16 have a bucket each and are reported exactly */
+    for (i = 1; i <= 10; i++) {
+        hdr_histogram_account(h, i);
+    }
+
+    g_assert_cmpuint(h->count, ==, 10);
+    g_assert_cmpuint(hdr_histogram_percentile(h, 0), ==, 1);
+    g_assert_cmpuint(hdr_histogram_percentile(h, 50), ==, 5);
+    g_assert_cmpuint(hdr_histogram_percentile(h, 51), ==, 6);
+    g_assert_cmpuint(hdr_histogram_percentile(h, 100), ==, 10);
+
+    g_free(h);
+}
+
+static void test_relative_error(void)
+{
+    HdrHistogram *h = g_new0(HdrHistogram, 1);
+    uint64_t value, result;
+
+    for (value = 1; value < (1ULL << 40); value = value * 3 + 7) {
+        hdr_histogram_reset(h);
+        hdr_histogram_account(h, value);
+
+        result = hdr_histogram_percentile(h, 50);
+        g_assert_cmpuint(result, >=, value);
+        g_assert_cmpuint(result - value, <=, value / 16);
+    }
+
+    g_free(h);
+}
+
+static void test_overflow(void)
+{
+    HdrHistogram *h = g_new0(HdrHistogram, 1);
+
+    hdr_histogram_account(h, UINT64_MAX);
+    g_assert_cmpuint(h->buckets[HDR_HISTOGRAM_NBUCKETS - 1], ==, 1);
+    g_assert_cmpuint(hdr_histogram_percentile(h, 50), ==,
+                     (1ULL << HDR_HISTOGRAM_MAX_SHIFT) - 1);
+
+    g_free(h);
+}
+
+static void test_percentiles(void)
+{
+    HdrHistogram *a = g_new0(HdrHistogram, 1);
+    HdrHistogram *b = g_new0(HdrHistogram, 1);
+    uint64_t result;
+    int i;
+
+    /* 990 fast requests, 9 slow ones and a single very slow one */
+    for (i = 0; i < 990; i++) {
+        hdr_histogram_account(a, 100000);
+    }
+    for (i = 0; i < 9; i++) {
+        hdr_histogram_account(b, 5000000);
+    }
+    hdr_histogram_account(b, 80000000);
+
+    hdr_histogram_merge(a, b);
+    g_assert_cmpuint(a->count, ==, 1000);
+
+    result = hdr_histogram_percentile(a, 50);
+    g_assert_cmpuint(result, >=, 100000);
+    g_assert_cmpuint(result, <=, 100000 + 100000 / 16);
+
+    result = hdr_histogram_percentile(a, 99);
+    g_assert_cmpuint(result, >=, 100000);
+    g_assert_cmpuint(result, <=, 100000 + 100000 / 16);
+
+    result = hdr_histogram_percentile(a, 99.5);
+    g_assert_cmpuint(result, >=, 5000000);
+    g_assert_cmpuint(result, <=, 5000000 + 5000000 / 16);
+
+    result = hdr_histogram_percentile(a, 99.9);
+    g_assert_cmpuint(result, >=, 5000000);
+    g_assert_cmpuint(result, <=, 5000000 + 5000000 / 16);
+
+    result = hdr_histogram_percentile(a, 100);
+    g_assert_cmpuint(result, >=, 80000000);
+    g_assert_cmpuint(result, <=, 80000000 + 80000000 / 16);
+
+    g_free(a);
+    g_free(b);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/hdr-histogram/empty", test_empty);
+    g_test_add_func("/hdr-histogram/small_values", test_small_values);
+    g_test_add_func("/hdr-histogram/relative_error", test_relative_error);
+    g_test_add_func("/hdr-histogram/overflow", test_overflow);
+    g_test_add_func("/hdr-histogram/percentiles", test_percentiles);
+    return g_test_run();
+}
@@ -734,6 +734,35 @@ static void test_accounting(void)
                                 (64.0 / 13)));
 }
 
+static void test_compute_delay(void)
+{
+    int64_t now;
+
+    throttle_init(&ts);
+    throttle_config_init(&cfg);
+    cfg.buckets[THROTTLE_OPS_TOTAL].avg = 10;
+    throttle_config(&ts, QEMU_CLOCK_VIRTUAL, &cfg);
+    now = ts.previous_leak;
+
+    /* empty bucket */
+    g_assert_cmpint(throttle_compute_delay(&ts, THROTTLE_READ, now), ==, 0);
+
+    /* the bucket holds one operation, the second one must wait 100 ms */
+    throttle_account(&ts, THROTTLE_READ, 512);
+    throttle_account(&ts, THROTTLE_WRITE, 512);
+    g_assert_cmpint(throttle_compute_delay(&ts, THROTTLE_READ, now), ==,
+                    NANOSECONDS_PER_SECOND / 10);
+
+    /* half of it has leaked after 50 ms */
+    now += NANOSECONDS_PER_SECOND / 20;
+    g_assert_cmpint(throttle_compute_delay(&ts, THROTTLE_WRITE, now), ==,
+                    NANOSECONDS_PER_SECOND / 20);
+
+    /* and nothing is left after 100 ms */
+    now += NANOSECONDS_PER_SECOND / 20;
+    g_assert_cmpint(throttle_compute_delay(&ts, THROTTLE_READ, now), ==, 0);
+}
+
 static void test_groups(void)
 {
     ThrottleConfig cfg1, cfg2;
@@ -829,6 +858,7 @@ int main(int argc, char **argv)
                     test_iops_size_is_missing_limit);
     g_test_add_func("/throttle/config_functions",   test_config_functions);
     g_test_add_func("/throttle/accounting",         test_accounting);
+    g_test_add_func("/throttle/compute_delay",      test_compute_delay);
     g_test_add_func("/throttle/groups",             test_groups);
     return g_test_run();
 }
@@ -469,7 +469,7 @@ LuringState *aio_setup_linux_io_uring(AioContext *ctx, Error **errp)
         return ctx->linux_io_uring;
     }
 
-    ctx->linux_io_uring = luring_init(errp);
+    ctx->linux_io_uring = luring_init(ctx->aio_sqpoll_idle, errp);
     if (!ctx->linux_io_uring) {
         return NULL;
     }
@@ -615,6 +615,7 @@ AioContext *aio_context_new(Error **errp)
     ctx->poll_shrink = 0;
 
     ctx->aio_max_batch = 0;
+    ctx->aio_sqpoll_idle = 0;
 
     ctx->thread_pool_min = 0;
     ctx->thread_pool_max = THREAD_POOL_MAX_THREADS_DEFAULT;
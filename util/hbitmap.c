@@ -892,6 +892,46 @@ static void hbitmap_sparse_merge(HBitmap *dst, const HBitmap *src)
     }
 }
 
+/**
+ * hbitmap_level_merge: performs dst = dst | src
+ * requires equal granularities.
+ * Only the words of the last level that are nonzero in src are visited; they
+ * are found through the 2nd-last level of src, so the cost is proportional to
+ * the size of the upper levels plus the number of dirty words in src.
+ */
+static void hbitmap_level_merge(HBitmap *dst, const HBitmap *src)
+{
+    const int last = HBITMAP_LEVELS - 1;
+    unsigned long *dst_words = dst->levels[last];
+    const unsigned long *src_words = src->levels[last];
+    const unsigned long *src_up = src->levels[last - 1];
+    uint64_t i;
+    int lev;
+
+    assert(dst->granularity == src->granularity);
+    assert(dst->size == src->size);
+
+    /* The upper levels are at least BITS_PER_LONG times smaller */
+    for (lev = last - 1; lev >= 0; lev--) {
+        for (i = 0; i < dst->sizes[lev]; i++) {
+            dst->levels[lev][i] |= src->levels[lev][i];
+        }
+    }
+
+    for (i = 0; i < src->sizes[last - 1]; i++) {
+        unsigned long cur = src_up[i];
+
+        while (cur) {
+            uint64_t pos = (i << BITS_PER_LEVEL) + ctzl(cur);
+            unsigned long added = src_words[pos] & ~dst_words[pos];
+
+            cur &= cur - 1;
+            dst_words[pos] |= added;
+            dst->count += ctpopl(added);
+        }
+    }
+}
+
 /**
  * Given HBitmaps A and B, let R := A (BITOR) B.
  * Bitmaps A and B will not be modified,
@@ -900,9 +940,6 @@ static void hbitmap_sparse_merge(HBitmap *dst, const HBitmap *src)
  */
 void hbitmap_merge(const HBitmap *a, const HBitmap *b, HBitmap *result)
 {
-    int i;
-    uint64_t j;
-
     assert(a->orig_size == result->orig_size);
     assert(b->orig_size == result->orig_size);
 
@@ -916,32 +953,29 @@ void hbitmap_merge(const HBitmap *a, const HBitmap *b, HBitmap *result)
         return;
     }
 
-    if (a->granularity != b->granularity) {
-        if ((a != result) && (b != result)) {
-            hbitmap_reset_all(result);
-        }
-        if (a != result) {
-            hbitmap_sparse_merge(result, a);
-        }
-        if (b != result) {
-            hbitmap_sparse_merge(result, b);
-        }
-        return;
+    if ((a != result) && (b != result)) {
+        hbitmap_reset_all(result);
     }
 
-    /* This merge is O(size), as BITS_PER_LONG and HBITMAP_LEVELS are constant.
-     * It may be possible to improve running times for sparsely populated maps
-     * by using hbitmap_iter_next, but this is suboptimal for dense maps.
+    /*
+     * Both merges are O(dirty words + size / BITS_PER_LONG^2) when the
+     * granularities match, so mostly-clean bitmaps (the common case for
+     * incremental backup) no longer pay for a pass over the whole last level.
      */
-    assert(a->size == b->size);
-    for (i = HBITMAP_LEVELS - 1; i >= 0; i--) {
-        for (j = 0; j < a->sizes[i]; j++) {
-            result->levels[i][j] = a->levels[i][j] | b->levels[i][j];
+    if (a != result) {
+        if (a->granularity == result->granularity) {
+            hbitmap_level_merge(result, a);
+        } else {
+            hbitmap_sparse_merge(result, a);
+        }
+    }
+    if (b != result) {
+        if (b->granularity == result->granularity) {
+            hbitmap_level_merge(result, b);
+        } else {
+            hbitmap_sparse_merge(result, b);
         }
     }
-
-    /* Recompute the dirty count */
-    result->count = hb_count_between(result, 0, result->size - 1);
 }
 
 char *hbitmap_sha256(const HBitmap *bitmap, Error **errp)
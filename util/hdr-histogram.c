@@ -0,0 +1,138 @@
+/*
+ * Log-linear (HDR-style) histogram
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include <math.h>
+#include "qemu/host-utils.h"
+#include "qemu/hdr-histogram.h"
+
+/* This module records values in a fixed set of buckets whose width grows
+ * with the magnitude of the values, so that percentiles can be computed
+ * with a bounded relative error and accounting a value is O(1).
+ *
+ * Bucket layout, with SUB_BITS = 4:
+ *
+ *        values            bucket index
+ *        [0, 16)           value
+ *        [16, 32)          16 + (value - 16)
+ *        [32, 64)          32 + (value - 32) / 2
+ *        [64, 128)         48 + (value - 64) / 4
+ *        ...
+ */
+
+static unsigned bucket_index(uint64_t value)
+{
+    unsigned shift;
+
+    if (value < HDR_HISTOGRAM_SUB_BUCKETS) {
+        return value;
+    }
+
+    shift = 63 - clz64(value);
+    if (shift >= HDR_HISTOGRAM_MAX_SHIFT) {
+        return HDR_HISTOGRAM_NBUCKETS - 1;
+    }
+
+    return (shift - HDR_HISTOGRAM_SUB_BITS + 1) * HDR_HISTOGRAM_SUB_BUCKETS +
+           ((value >> (shift - HDR_HISTOGRAM_SUB_BITS)) &
+            (HDR_HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+/* Return the largest value that is accounted in bucket @index */
+static uint64_t bucket_max(unsigned index)
+{
+    unsigned group = index / HDR_HISTOGRAM_SUB_BUCKETS;
+    unsigned sub = index % HDR_HISTOGRAM_SUB_BUCKETS;
+
+    if (group == 0) {
+        return index;
+    }
+
+    return ((uint64_t) (HDR_HISTOGRAM_SUB_BUCKETS + sub + 1) << (group - 1))
+           - 1;
+}
+
+/* Reset a histogram
+ *
+ * @h: the histogram
+ */
+void hdr_histogram_reset(HdrHistogram *h)
+{
+    memset(h, 0, sizeof(*h));
+}
+
+/* Account a value
+ *
+ * @h:     the histogram
+ * @value: the value to account
+ */
+void hdr_histogram_account(HdrHistogram *h, uint64_t value)
+{
+    h->buckets[bucket_index(value)]++;
+    h->count++;
+}
+
+/* Add all values accounted in @src to @dst
+ *
+ * @dst: the destination histogram
+ * @src: the source histogram
+ */
+void hdr_histogram_merge(HdrHistogram *dst, const HdrHistogram *src)
+{
+    unsigned i;
+
+    if (!src->count) {
+        return;
+    }
+
+    for (i = 0; i < HDR_HISTOGRAM_NBUCKETS; i++) {
+        dst->buckets[i] += src->buckets[i];
+    }
+    dst->count += src->count;
+}
+
+/* Get a percentile
+ *
+ * @h:          the histogram
+ * @percentile: the percentile, between 0 and 100
+ * @ret:        an upper bound for the smallest value so that @percentile
+ *              percent of all accounted values are smaller or equal, or 0
+ *              if the histogram is empty
+ */
+uint64_t hdr_histogram_percentile(const HdrHistogram *h, double percentile)
+{
+    uint64_t target, seen = 0;
+    unsigned i;
+
+    if (!h->count) {
+        return 0;
+    }
+
+    target = MAX(1, (uint64_t) ceil(h->count * percentile / 100));
+    target = MIN(target, h->count);
+
+    for (i = 0; i < HDR_HISTOGRAM_NBUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= target) {
+            return bucket_max(i);
+        }
+    }
+
+    g_assert_not_reached();
+}
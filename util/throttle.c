@@ -462,6 +462,25 @@ bool throttle_schedule_timer(ThrottleState *ts,
     return true;
 }
 
+/* Compute how long an operation must be delayed without arming a timer
+ *
+ * This is meant for callers that wait in some other way than with
+ * ThrottleTimers.
+ *
+ * @direction: throttle direction
+ * @now:       the current clock timestamp
+ * @ret:       the time to wait in ns or 0 if the operation can go through
+ */
+int64_t throttle_compute_delay(ThrottleState *ts, ThrottleDirection direction,
+                               int64_t now)
+{
+    int64_t next_timestamp;
+
+    assert(direction < THROTTLE_MAX);
+    throttle_compute_timer(ts, direction, now, &next_timestamp);
+    return next_timestamp - now;
+}
+
 /* do the accounting for this operation
  *
  * @direction: throttle direction
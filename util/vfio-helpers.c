@@ -193,13 +193,50 @@ void qemu_vfio_pci_unmap_bar(QEMUVFIOState *s, int index, void *bar,
 /**
  * Initialize device IRQ with @irq_type and register an event notifier.
  */
-int qemu_vfio_pci_init_irq(QEMUVFIOState *s, EventNotifier *e,
-                           int irq_type, Error **errp)
+static int qemu_vfio_pci_set_irq_fds(QEMUVFIOState *s, int irq_type,
+                                     unsigned start, unsigned count,
+                                     const int *fds, Error **errp)
 {
     int r;
     struct vfio_irq_set *irq_set;
     size_t irq_set_size;
+
+    irq_set_size = sizeof(*irq_set) + count * sizeof(int);
+    irq_set = g_malloc0(irq_set_size);
+
+    *irq_set = (struct vfio_irq_set) {
+        .argsz = irq_set_size,
+        .flags = VFIO_IRQ_SET_DATA_EVENTFD | VFIO_IRQ_SET_ACTION_TRIGGER,
+        .index = irq_type,
+        .start = start,
+        .count = count,
+    };
+
+    memcpy(&irq_set->data, fds, count * sizeof(int));
+    r = ioctl(s->device, VFIO_DEVICE_SET_IRQS, irq_set);
+    g_free(irq_set);
+    if (r) {
+        error_setg_errno(errp, errno, "Failed to setup device interrupt");
+        return -errno;
+    }
+    return 0;
+}
+
+/*
+ * Enable up to *@count interrupt vectors of type @irq_type and connect the
+ * first one to @e.  The other vectors are enabled without a notifier, use
+ * qemu_vfio_pci_set_irq() to connect them.  On success *@count is updated to
+ * the number of vectors that were actually enabled, which is at least 1.
+ */
+int qemu_vfio_pci_init_irqs(QEMUVFIOState *s, EventNotifier *e,
+                            int irq_type, unsigned *count, Error **errp)
+{
     struct vfio_irq_info irq_info = { .argsz = sizeof(irq_info) };
+    g_autofree int *fds = NULL;
+    unsigned i;
+    int r;
+
+    assert(*count > 0);
 
     irq_info.index = irq_type;
     if (ioctl(s->device, VFIO_DEVICE_GET_IRQ_INFO, &irq_info)) {
@@ -210,29 +247,48 @@ int qemu_vfio_pci_init_irq(QEMUVFIOState *s, EventNotifier *e,
         error_setg(errp, "Device interrupt doesn't support eventfd");
         return -EINVAL;
     }
-
-    irq_set_size = sizeof(*irq_set) + sizeof(int);
-    irq_set = g_malloc0(irq_set_size);
+    if (!irq_info.count) {
+        error_setg(errp, "Device has no interrupt of the requested type");
+        return -EINVAL;
+    }
 
     /* Get to a known IRQ state */
-    *irq_set = (struct vfio_irq_set) {
-        .argsz = irq_set_size,
-        .flags = VFIO_IRQ_SET_DATA_EVENTFD | VFIO_IRQ_SET_ACTION_TRIGGER,
-        .index = irq_info.index,
-        .start = 0,
-        .count = 1,
-    };
+    *count = MIN(*count, irq_info.count);
+    fds = g_new(int, *count);
+    fds[0] = event_notifier_get_fd(e);
+    for (i = 1; i < *count; i++) {
+        fds[i] = -1;
+    }
 
-    *(int *)&irq_set->data = event_notifier_get_fd(e);
-    r = ioctl(s->device, VFIO_DEVICE_SET_IRQS, irq_set);
-    g_free(irq_set);
+    r = qemu_vfio_pci_set_irq_fds(s, irq_type, 0, *count, fds, errp);
     if (r) {
-        error_setg_errno(errp, errno, "Failed to setup device interrupt");
-        return -errno;
+        return r;
     }
+    trace_qemu_vfio_pci_init_irqs(s, irq_type, *count, irq_info.count);
     return 0;
 }
 
+int qemu_vfio_pci_init_irq(QEMUVFIOState *s, EventNotifier *e,
+                           int irq_type, Error **errp)
+{
+    unsigned count = 1;
+
+    return qemu_vfio_pci_init_irqs(s, e, irq_type, &count, errp);
+}
+
+/*
+ * Connect vector @vector, enabled by qemu_vfio_pci_init_irqs(), to @e, or
+ * disconnect it if @e is NULL.
+ */
+int qemu_vfio_pci_set_irq(QEMUVFIOState *s, int irq_type, unsigned vector,
+                          EventNotifier *e, Error **errp)
+{
+    int fd = e ? event_notifier_get_fd(e) : -1;
+
+    trace_qemu_vfio_pci_set_irq(s, irq_type, vector, fd);
+    return qemu_vfio_pci_set_irq_fds(s, irq_type, vector, 1, &fd, errp);
+}
+
 static int qemu_vfio_pci_read_config(QEMUVFIOState *s, void *buf,
                                      int size, int ofs)
 {
@@ -9,6 +9,7 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/error-report.h"
+#include "qemu/lockable.h"
 #include "qemu/main-loop.h"
 #include "qemu/vhost-user-server.h"
 #include "block/aio-wait.h"
@@ -27,7 +28,12 @@
  * protocol messages over the UNIX domain socket.
  *
  * When virtqueues are set up libvhost-user calls set_watch() to monitor kick
- * fds. These fds are also handled in the VuServer->ctx AioContext.
+ * fds. These fds are also handled in the VuServer->ctx AioContext, unless the
+ * virtqueue has been mapped to another AioContext in VuServer->queue_ctxs.
+ * In that case virtqueue processing runs in a different thread than
+ * vu_client_trip(). VuServer->vq_lock is held while a vhost-user message is
+ * processed and while kick fds are handled, so libvhost-user never sees
+ * concurrent calls.
  *
  * Both vu_client_trip() and kick fd monitoring can be stopped by shutting down
  * the socket connection. Shutting down the socket connection causes
@@ -96,6 +102,7 @@ void vhost_user_server_inc_in_flight(VuServer *server)
 void vhost_user_server_dec_in_flight(VuServer *server)
 {
     if (qatomic_fetch_dec(&server->in_flight) == 1) {
+        QEMU_LOCK_GUARD(&server->vq_lock);
         if (server->wait_idle) {
             aio_co_wake(server->co_trip);
         }
@@ -107,6 +114,22 @@ bool vhost_user_server_has_in_flight(VuServer *server)
     return qatomic_load_acquire(&server->in_flight) > 0;
 }
 
+static void vu_client_trip_lock_vqs(VuServer *server)
+{
+    if (!server->vq_locked) {
+        qemu_rec_mutex_lock(&server->vq_lock);
+        server->vq_locked = true;
+    }
+}
+
+static void vu_client_trip_unlock_vqs(VuServer *server)
+{
+    if (server->vq_locked) {
+        server->vq_locked = false;
+        qemu_rec_mutex_unlock(&server->vq_lock);
+    }
+}
+
 static bool coroutine_fn
 vu_message_read(VuDev *vu_dev, int conn_fd, VhostUserMsg *vmsg)
 {
@@ -120,6 +143,9 @@ vu_message_read(VuDev *vu_dev, int conn_fd, VhostUserMsg *vmsg)
     VuServer *server = container_of(vu_dev, VuServer, vu_dev);
     QIOChannel *ioc = server->ioc;
 
+    /* Never yield with vq_lock held */
+    vu_client_trip_unlock_vqs(server);
+
     vmsg->fd_num = 0;
     if (!ioc) {
         error_report_err(local_err);
@@ -199,6 +225,8 @@ vu_message_read(VuDev *vu_dev, int conn_fd, VhostUserMsg *vmsg)
         }
     }
 
+    /* Released by vu_client_trip() once the message has been processed */
+    vu_client_trip_lock_vqs(server);
     return true;
 
 fail:
@@ -207,6 +235,25 @@ fail:
     return false;
 }
 
+/*
+ * Stop monitoring all kick fds. A kick handler that is already running in
+ * another thread sees !enabled once it gets vq_lock and returns without doing
+ * anything.
+ */
+static void vu_fd_watches_detach(VuServer *server)
+{
+    VuFdWatch *vu_fd_watch;
+
+    QEMU_LOCK_GUARD(&server->vq_lock);
+    QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
+        if (vu_fd_watch->enabled) {
+            aio_set_fd_handler(vu_fd_watch->ctx, vu_fd_watch->fd,
+                               NULL, NULL, NULL, NULL, vu_fd_watch);
+            vu_fd_watch->enabled = false;
+        }
+    }
+}
+
 static coroutine_fn void vu_client_trip(void *opaque)
 {
     VuServer *server = opaque;
@@ -219,20 +266,30 @@ static coroutine_fn void vu_client_trip(void *opaque)
             return;
         }
         /* vu_dispatch() returns false if server->ctx went away */
-        if (!vu_dispatch(vu_dev) && server->ctx) {
+        bool ok = vu_dispatch(vu_dev);
+
+        vu_client_trip_unlock_vqs(server);
+        if (!ok && server->ctx) {
             break;
         }
     }
 
+    /* Kicks may still arrive in other threads, stop processing them */
+    vu_fd_watches_detach(server);
+
+    qemu_rec_mutex_lock(&server->vq_lock);
     if (vhost_user_server_has_in_flight(server)) {
         /* Wait for requests to complete before we can unmap the memory */
         server->wait_idle = true;
+        qemu_rec_mutex_unlock(&server->vq_lock);
         qemu_coroutine_yield();
+        qemu_rec_mutex_lock(&server->vq_lock);
         server->wait_idle = false;
     }
     assert(!vhost_user_server_has_in_flight(server));
 
     vu_deinit(vu_dev);
+    qemu_rec_mutex_unlock(&server->vq_lock);
 
     /* vu_deinit() should have called remove_watch() */
     assert(QTAILQ_EMPTY(&server->vu_fd_watches));
@@ -261,17 +318,35 @@ static void kick_handler(void *opaque)
 {
     VuFdWatch *vu_fd_watch = opaque;
     VuDev *vu_dev = vu_fd_watch->vu_dev;
+    VuServer *server = container_of(vu_dev, VuServer, vu_dev);
 
-    vu_fd_watch->cb(vu_dev, 0, vu_fd_watch->pvt);
+    qemu_rec_mutex_lock(&server->vq_lock);
+    if (vu_fd_watch->enabled) {
+        vu_fd_watch->cb(vu_dev, 0, vu_fd_watch->pvt);
+    }
+    qemu_rec_mutex_unlock(&server->vq_lock);
 
     /* Stop vu_client_trip() if an error occurred in vu_fd_watch->cb() */
     if (vu_dev->broken) {
-        VuServer *server = container_of(vu_dev, VuServer, vu_dev);
-
         qio_channel_shutdown(server->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
     }
 }
 
+/*
+ * libvhost-user only watches virtqueue kick fds, passing the virtqueue index
+ * as @pvt, so this returns the AioContext that the virtqueue is mapped to.
+ */
+static AioContext *vu_fd_watch_ctx(VuServer *server, VuFdWatch *vu_fd_watch)
+{
+    uintptr_t qidx = (uintptr_t)vu_fd_watch->pvt;
+
+    if (server->queue_ctxs && qidx < server->max_queues &&
+        server->queue_ctxs[qidx]) {
+        return server->queue_ctxs[qidx];
+    }
+    return server->ctx;
+}
+
 static VuFdWatch *find_vu_fd_watch(VuServer *server, int fd)
 {
 
@@ -303,11 +378,13 @@ set_watch(VuDev *vu_dev, int fd, int vu_evt,
 
         vu_fd_watch->fd = fd;
         vu_fd_watch->cb = cb;
-        qemu_socket_set_nonblock(fd);
-        aio_set_fd_handler(server->ctx, fd, kick_handler,
-                           NULL, NULL, NULL, vu_fd_watch);
         vu_fd_watch->vu_dev = vu_dev;
         vu_fd_watch->pvt = pvt;
+        vu_fd_watch->ctx = vu_fd_watch_ctx(server, vu_fd_watch);
+        vu_fd_watch->enabled = true;
+        qemu_socket_set_nonblock(fd);
+        aio_set_fd_handler(vu_fd_watch->ctx, fd, kick_handler,
+                           NULL, NULL, NULL, vu_fd_watch);
     }
 }
 
@@ -325,10 +402,18 @@ static void remove_watch(VuDev *vu_dev, int fd)
     if (!vu_fd_watch) {
         return;
     }
-    aio_set_fd_handler(server->ctx, fd, NULL, NULL, NULL, NULL, NULL);
+    if (vu_fd_watch->enabled) {
+        aio_set_fd_handler(vu_fd_watch->ctx, fd, NULL, NULL, NULL, NULL, NULL);
+    }
 
     QTAILQ_REMOVE(&server->vu_fd_watches, vu_fd_watch, next);
-    g_free(vu_fd_watch);
+
+    if (vu_fd_watch->ctx != qemu_get_current_aio_context()) {
+        /* kick_handler() may still be about to run in the other thread */
+        aio_bh_schedule_oneshot(vu_fd_watch->ctx, g_free, vu_fd_watch);
+    } else {
+        g_free(vu_fd_watch);
+    }
 }
 
 
@@ -382,12 +467,7 @@ void vhost_user_server_stop(VuServer *server)
     server->restart_listener_bh = NULL;
 
     if (server->sioc) {
-        VuFdWatch *vu_fd_watch;
-
-        QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
-            aio_set_fd_handler(server->ctx, vu_fd_watch->fd,
-                               NULL, NULL, NULL, NULL, vu_fd_watch);
-        }
+        vu_fd_watches_detach(server);
 
         qio_channel_shutdown(server->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
 
@@ -398,6 +478,9 @@ void vhost_user_server_stop(VuServer *server)
         qio_net_listener_disconnect(server->listener);
         object_unref(OBJECT(server->listener));
     }
+
+    g_free(server->queue_ctxs);
+    server->queue_ctxs = NULL;
 }
 
 /*
@@ -423,9 +506,13 @@ void vhost_user_server_attach_aio_context(VuServer *server, AioContext *ctx)
         return;
     }
 
-    QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
-        aio_set_fd_handler(ctx, vu_fd_watch->fd, kick_handler, NULL,
-                           NULL, NULL, vu_fd_watch);
+    WITH_QEMU_LOCK_GUARD(&server->vq_lock) {
+        QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
+            vu_fd_watch->ctx = vu_fd_watch_ctx(server, vu_fd_watch);
+            vu_fd_watch->enabled = true;
+            aio_set_fd_handler(vu_fd_watch->ctx, vu_fd_watch->fd,
+                               kick_handler, NULL, NULL, NULL, vu_fd_watch);
+        }
     }
 
     if (server->co_trip) {
@@ -453,12 +540,7 @@ void vhost_user_server_attach_aio_context(VuServer *server, AioContext *ctx)
 void vhost_user_server_detach_aio_context(VuServer *server)
 {
     if (server->sioc) {
-        VuFdWatch *vu_fd_watch;
-
-        QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
-            aio_set_fd_handler(server->ctx, vu_fd_watch->fd,
-                               NULL, NULL, NULL, NULL, vu_fd_watch);
-        }
+        vu_fd_watches_detach(server);
     }
 
     server->ctx = NULL;
@@ -474,6 +556,7 @@ void vhost_user_server_detach_aio_context(VuServer *server)
 bool vhost_user_server_start(VuServer *server,
                              SocketAddress *socket_addr,
                              AioContext *ctx,
+                             AioContext *const *queue_ctxs,
                              uint16_t max_queues,
                              const VuDevIface *vu_iface,
                              Error **errp)
@@ -505,6 +588,12 @@ bool vhost_user_server_start(VuServer *server,
         .ctx                   = ctx,
     };
 
+    if (queue_ctxs) {
+        server->queue_ctxs = g_memdup2(queue_ctxs,
+                                       max_queues * sizeof(queue_ctxs[0]));
+    }
+    qemu_rec_mutex_init(&server->vq_lock);
+
     qio_net_listener_set_name(server->listener, "vhost-user-backend-listener");
 
     qio_net_listener_set_client_func(server->listener,